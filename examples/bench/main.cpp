@@ -0,0 +1,668 @@
+#include "ggml/ggml.h"
+
+#include "gpt-2/gpt-2.h"
+#include "whisper/whisper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// micro-benchmarks of the kernels at the shapes of the example models and of full model steps
+//
+// every case is a graph that is computed repeatedly with a thread pool of each of the requested sizes
+// the FLOPs and bytes of a case are the estimates of the ggml profiler for one computation of its graph
+// the kernels of another instruction set are measured by running again with GGML_CPU_ISA set (see ggml_cpu_isa())
+
+struct bench_params {
+    std::vector<int> n_threads;
+
+    int32_t n_runs   = 10;
+    int32_t n_warmup = 2;
+
+    std::string filter;         // only the cases whose name contains this
+    std::string format = "csv"; // csv or json
+    std::string fname_out;      // default: stdout
+    std::string whisper_model;  // the whisper_encode case needs a model
+
+    bool list = false;
+};
+
+struct bench_case {
+    std::string name;
+    std::string shape;
+
+    size_t mem_size; // for the weights, the inputs and the results of the graph
+
+    // builds the graph in ctx
+    std::function<void (struct ggml_context * ctx, struct ggml_cgraph & gf)> build;
+
+    // used instead of a graph for the steps that are computed by a library
+    std::function<bool (int n_threads)> run;
+};
+
+struct bench_result {
+    std::string name;
+    std::string shape;
+
+    int n_threads;
+    int n_runs;
+
+    int64_t flops;
+    int64_t bytes;
+
+    double t_mean_ms;
+    double t_min_ms;
+    double t_p50_ms;
+    double t_p90_ms;
+    double t_p99_ms;
+    double t_max_ms;
+
+    double speedup; // p50 of the first thread count over the p50 of this one
+};
+
+//
+// CLI
+//
+
+static std::vector<int> bench_default_threads() {
+    const int n_max = std::max(1, (int) std::thread::hardware_concurrency());
+
+    std::vector<int> res;
+    for (int n = 1; n < n_max; n *= 2) {
+        res.push_back(n);
+    }
+    res.push_back(n_max);
+
+    return res;
+}
+
+void bench_print_usage(int argc, char ** argv, const bench_params & params);
+
+bool bench_params_parse(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-t" || arg == "--threads") {
+            params.n_threads.clear();
+
+            std::string list = argv[++i];
+            for (size_t pos = 0; pos < list.size(); ) {
+                size_t end = list.find(',', pos);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                params.n_threads.push_back(std::stoi(list.substr(pos, end - pos)));
+                pos = end + 1;
+            }
+        } else if (arg == "-r" || arg == "--runs") {
+            params.n_runs = std::stoi(argv[++i]);
+        } else if (arg == "-w" || arg == "--warmup") {
+            params.n_warmup = std::stoi(argv[++i]);
+        } else if (arg == "-f" || arg == "--filter") {
+            params.filter = argv[++i];
+        } else if (arg == "--format") {
+            params.format = argv[++i];
+            if (params.format != "csv" && params.format != "json") {
+                fprintf(stderr, "error: unknown format '%s'\n", params.format.c_str());
+                bench_print_usage(argc, argv, params);
+                exit(0);
+            }
+        } else if (arg == "-o" || arg == "--output") {
+            params.fname_out = argv[++i];
+        } else if (arg == "--whisper") {
+            params.whisper_model = argv[++i];
+        } else if (arg == "-l" || arg == "--list") {
+            params.list = true;
+        } else if (arg == "-h" || arg == "--help") {
+            bench_print_usage(argc, argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    if (params.n_threads.empty() || params.n_runs < 1 || params.n_warmup < 0) {
+        fprintf(stderr, "error: invalid arguments\n");
+        bench_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    return true;
+}
+
+void bench_print_usage(int argc, char ** argv, const bench_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -t N,..., --threads N,...\n");
+    fprintf(stderr, "                        thread counts to measure (default: powers of 2 up to the hardware threads)\n");
+    fprintf(stderr, "  -r N, --runs N        measured runs per case and thread count (default: %d)\n", params.n_runs);
+    fprintf(stderr, "  -w N, --warmup N      runs before the measured ones (default: %d)\n", params.n_warmup);
+    fprintf(stderr, "  -f STR, --filter STR  only run the cases whose name contains STR\n");
+    fprintf(stderr, "  --format FMT          output format: csv or json (default: %s)\n", params.format.c_str());
+    fprintf(stderr, "  -o FNAME, --output FNAME\n");
+    fprintf(stderr, "                        output file (default: stdout)\n");
+    fprintf(stderr, "  --whisper FNAME       whisper model for the whisper_encode case (default: skip the case)\n");
+    fprintf(stderr, "  -l, --list            list the cases and exit\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "set GGML_CPU_ISA to measure the kernels of another instruction set\n");
+    fprintf(stderr, "\n");
+}
+
+//
+// cases
+//
+
+static std::mt19937 g_rng(0);
+
+static void bench_set_random(struct ggml_tensor * t) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    const int n = ggml_nelements(t);
+
+    switch (t->type) {
+        case GGML_TYPE_F32:
+            for (int i = 0; i < n; i++) {
+                ((float *) t->data)[i] = dist(g_rng);
+            }
+            break;
+        case GGML_TYPE_F16:
+            for (int i = 0; i < n; i++) {
+                ((ggml_fp16_t *) t->data)[i] = ggml_fp32_to_fp16(dist(g_rng));
+            }
+            break;
+        default:
+            fprintf(stderr, "%s: unsupported type\n", __func__);
+            exit(1);
+    }
+}
+
+static struct ggml_tensor * bench_new_tensor(struct ggml_context * ctx, enum ggml_type type, int ne0, int ne1 = 1, int ne2 = 1) {
+    struct ggml_tensor * t = ggml_new_tensor_3d(ctx, type, ne0, ne1, ne2);
+    bench_set_random(t);
+    return t;
+}
+
+static size_t bench_mib(size_t n) {
+    return n*1024*1024;
+}
+
+static const char * bench_type_name(enum ggml_type type) {
+    return type == GGML_TYPE_F16 ? "f16" : "f32";
+}
+
+// a row of m dot products of length k, as computed by mul_mat with a single column
+static bench_case bench_vec_dot(enum ggml_type type, int k, int m) {
+    char shape[128];
+    snprintf(shape, sizeof(shape), "k=%d m=%d", k, m);
+
+    return {
+        std::string("vec_dot_") + bench_type_name(type), shape,
+        (size_t) k*m*ggml_type_size(type) + bench_mib(4),
+        [=](struct ggml_context * ctx, struct ggml_cgraph & gf) {
+            ggml_build_forward_expand(&gf, ggml_mul_mat(ctx, bench_new_tensor(ctx, type, k, m), bench_new_tensor(ctx, GGML_TYPE_F32, k, 1)));
+        },
+        nullptr,
+    };
+}
+
+// [k, m] x [k, n] -> [m, n]
+static bench_case bench_mul_mat(const char * model, enum ggml_type type, int k, int m, int n) {
+    char shape[128];
+    snprintf(shape, sizeof(shape), "%s k=%d m=%d n=%d", model, k, m, n);
+
+    return {
+        std::string("mul_mat_") + bench_type_name(type) + "_f32", shape,
+        (size_t) k*m*ggml_type_size(type) + (size_t) (k + m)*n*sizeof(float)*2 + bench_mib(4),
+        [=](struct ggml_context * ctx, struct ggml_cgraph & gf) {
+            ggml_build_forward_expand(&gf, ggml_mul_mat(ctx, bench_new_tensor(ctx, type, k, m), bench_new_tensor(ctx, GGML_TYPE_F32, k, n)));
+        },
+        nullptr,
+    };
+}
+
+// the attention of the whisper encoder: n_head heads of d for n positions
+static bench_case bench_flash_attn(int d, int n, int n_head) {
+    char shape[128];
+    snprintf(shape, sizeof(shape), "d=%d n=%d heads=%d", d, n, n_head);
+
+    return {
+        "flash_attn", shape,
+        (size_t) 4*d*n*n_head*sizeof(float) + bench_mib(16),
+        [=](struct ggml_context * ctx, struct ggml_cgraph & gf) {
+            struct ggml_tensor * q = bench_new_tensor(ctx, GGML_TYPE_F16, d, n, n_head);
+            struct ggml_tensor * k = bench_new_tensor(ctx, GGML_TYPE_F16, d, n, n_head);
+            struct ggml_tensor * v = bench_new_tensor(ctx, GGML_TYPE_F16, n, d, n_head);
+
+            ggml_build_forward_expand(&gf, ggml_flash_attn(ctx, q, k, v, false));
+        },
+        nullptr,
+    };
+}
+
+static bench_case bench_soft_max(int nc, int nr) {
+    char shape[128];
+    snprintf(shape, sizeof(shape), "nc=%d nr=%d", nc, nr);
+
+    return {
+        "soft_max", shape,
+        (size_t) 2*nc*nr*sizeof(float) + bench_mib(4),
+        [=](struct ggml_context * ctx, struct ggml_cgraph & gf) {
+            ggml_build_forward_expand(&gf, ggml_soft_max(ctx, bench_new_tensor(ctx, GGML_TYPE_F32, nc, nr)));
+        },
+        nullptr,
+    };
+}
+
+// the convolutions of the whisper encoder: the kernel is [3, c_in, c_out] and the input [n, c_in]
+static bench_case bench_conv_1d(int s0, int n, int c_in, int c_out) {
+    char shape[128];
+    snprintf(shape, sizeof(shape), "n=%d c_in=%d c_out=%d s0=%d", n, c_in, c_out, s0);
+
+    return {
+        "conv_1d", shape,
+        (size_t) (3*c_in*c_out + 4*n*(c_in + c_out) + (n/s0)*3*c_in)*sizeof(float) + bench_mib(16),
+        [=](struct ggml_context * ctx, struct ggml_cgraph & gf) {
+            struct ggml_tensor * w = bench_new_tensor(ctx, GGML_TYPE_F16, 3, c_in, c_out);
+            struct ggml_tensor * x = bench_new_tensor(ctx, GGML_TYPE_F32, n, c_in);
+
+            ggml_build_forward_expand(&gf, ggml_conv_1d(ctx, w, x, s0, 1));
+        },
+        nullptr,
+    };
+}
+
+static void bench_gpt2_free(gpt2_model * model) {
+    if (model->ctx) {
+        ggml_free(model->ctx);
+    }
+    delete model;
+}
+
+static void bench_threadpool_free(struct ggml_threadpool ** pool) {
+    if (*pool) {
+        ggml_threadpool_free(*pool);
+    }
+    delete pool;
+}
+
+// gpt2_eval of the gpt-2 example for GPT-2 117M with random f16 weights: N new tokens after n_past tokens
+// the model is created by the first run and shared by the cases, so that they measure the graph of the example
+static bench_case bench_gpt2_eval(const std::shared_ptr<gpt2_model> & model, int N, int n_past) {
+    std::shared_ptr<struct ggml_threadpool *> pool(new struct ggml_threadpool * (nullptr), bench_threadpool_free);
+
+    char shape[128];
+    snprintf(shape, sizeof(shape), "gpt-2 117M N=%d n_past=%d", N, n_past);
+
+    return {
+        "gpt2_eval", shape,
+        0,
+        nullptr,
+        [model, pool, N, n_past](int n_threads) {
+            if (model->ctx == nullptr) {
+                if (!gpt2_model_init(*model, GGML_TYPE_F16, GGML_TYPE_F16, 1, false)) {
+                    return false;
+                }
+
+                for (const auto & it : model->tensors) {
+                    bench_set_random(it.second);
+                }
+            }
+
+            if (*pool == nullptr || ggml_threadpool_n_threads(*pool) != n_threads) {
+                if (*pool) {
+                    ggml_threadpool_free(*pool);
+                }
+                *pool = ggml_threadpool_new(n_threads);
+            }
+
+            std::vector<gpt_vocab::id> tokens(N);
+            for (int i = 0; i < N; i++) {
+                tokens[i] = (i*7919) % model->hparams.n_vocab;
+            }
+
+            std::vector<float> logits;
+            size_t mem_per_token = 0;
+
+            return gpt2_eval(*model, *pool, n_past, tokens, logits, mem_per_token);
+        },
+    };
+}
+
+static void bench_whisper_free(struct whisper_context ** wctx) {
+    whisper_free(*wctx);
+    delete wctx;
+}
+
+// the context is loaded by the first run and kept by the case
+static bench_case bench_whisper_encode(const std::string & fname_model) {
+    std::shared_ptr<struct whisper_context *> wctx(new struct whisper_context * (nullptr), bench_whisper_free);
+
+    return {
+        "whisper_encode", "30 s of audio",
+        0,
+        nullptr,
+        [fname_model, wctx](int n_threads) {
+            if (*wctx == nullptr) {
+                *wctx = whisper_init(fname_model.c_str());
+                if (*wctx == nullptr) {
+                    return false;
+                }
+
+                // 30 s of noise
+                std::vector<float> pcmf32(WHISPER_SAMPLE_RATE*WHISPER_CHUNK_SIZE);
+                std::uniform_real_distribution<float> dist(-0.1f, 0.1f);
+                for (auto & v : pcmf32) {
+                    v = dist(g_rng);
+                }
+
+                if (whisper_pcm_to_mel(*wctx, pcmf32.data(), pcmf32.size(), 1) != 0) {
+                    return false;
+                }
+            }
+
+            return whisper_encode(*wctx, 0, n_threads) == 0;
+        },
+    };
+}
+
+static std::vector<bench_case> bench_cases(const bench_params & params) {
+    std::vector<bench_case> cases;
+
+    // the dot products of the decoding steps
+    for (auto type : { GGML_TYPE_F16, GGML_TYPE_F32 }) {
+        cases.push_back(bench_vec_dot(type,  768, 3072));
+        cases.push_back(bench_vec_dot(type, 4096, 4096));
+    }
+
+    // the projections of the models: gpt-2 117M, gpt-j 6B (one token) and whisper base (encoder)
+    for (auto type : { GGML_TYPE_F16, GGML_TYPE_F32 }) {
+        cases.push_back(bench_mul_mat("gpt-2",    type,  768,  2304,    1));
+        cases.push_back(bench_mul_mat("gpt-2",    type,  768,  2304,    8));
+        cases.push_back(bench_mul_mat("gpt-2",    type,  768,  3072,    8));
+        cases.push_back(bench_mul_mat("gpt-2",    type, 3072,   768,    8));
+        cases.push_back(bench_mul_mat("gpt-2",    type,  768, 50257,    1));
+        cases.push_back(bench_mul_mat("gpt-j",    type, 4096,  4096,    1));
+        cases.push_back(bench_mul_mat("gpt-j",    type, 4096, 16384,    1));
+        cases.push_back(bench_mul_mat("whisper",  type,  512,   512, 1500));
+        cases.push_back(bench_mul_mat("whisper",  type,  512,  2048, 1500));
+        cases.push_back(bench_mul_mat("whisper",  type, 2048,   512, 1500));
+    }
+
+    cases.push_back(bench_flash_attn(64, 1500, 8));
+
+    // the attention of a gpt-2 decoding step and of the whisper encoder
+    cases.push_back(bench_soft_max( 256,   12));
+    cases.push_back(bench_soft_max(1500, 1500*8));
+
+    cases.push_back(bench_conv_1d(1, 3000,  80, 512));
+    cases.push_back(bench_conv_1d(2, 3000, 512, 512));
+
+    {
+        std::shared_ptr<gpt2_model> model(new gpt2_model, bench_gpt2_free);
+
+        cases.push_back(bench_gpt2_eval(model, 1, 128));
+        cases.push_back(bench_gpt2_eval(model, 32, 0));
+    }
+
+    if (!params.whisper_model.empty()) {
+        cases.push_back(bench_whisper_encode(params.whisper_model));
+    }
+
+    return cases;
+}
+
+//
+// measurement
+//
+
+static double bench_percentile(const std::vector<double> & sorted, double p) {
+    const int i = (int) std::lround(p*(sorted.size() - 1));
+    return sorted[std::min(std::max(i, 0), (int) sorted.size() - 1)];
+}
+
+// times of n_runs computations after n_warmup ones, in ms
+static bool bench_measure(const std::function<bool ()> & compute, int n_runs, int n_warmup, std::vector<double> & times) {
+    for (int i = 0; i < n_warmup; i++) {
+        if (!compute()) {
+            return false;
+        }
+    }
+
+    times.clear();
+    for (int i = 0; i < n_runs; i++) {
+        const int64_t t_start = ggml_time_ns();
+
+        if (!compute()) {
+            return false;
+        }
+
+        times.push_back(1e-6*(ggml_time_ns() - t_start));
+    }
+
+    std::sort(times.begin(), times.end());
+
+    return true;
+}
+
+// the estimates of the profiler for one computation
+static void bench_count(const std::function<bool ()> & compute, int64_t & flops, int64_t & bytes) {
+    struct ggml_profiler * prof = ggml_profiler_new();
+
+    ggml_profiler_set_active(prof);
+    compute();
+    ggml_profiler_set_active(nullptr);
+
+    flops = 0;
+    bytes = 0;
+
+    for (int op = 0; op < GGML_OP_COUNT; op++) {
+        const struct ggml_profiler_op_stats stats = ggml_profiler_get_op_stats(prof, (enum ggml_op) op);
+
+        flops += stats.flops;
+        bytes += stats.bytes;
+    }
+
+    ggml_profiler_free(prof);
+}
+
+static bool bench_run_case(const bench_case & bc, const bench_params & params, std::vector<bench_result> & results) {
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph gf = {};
+
+    if (bc.build) {
+        struct ggml_init_params ip = {
+            .mem_size   = bc.mem_size,
+            .mem_buffer = NULL,
+        };
+
+        ctx = ggml_init(ip);
+        if (ctx == nullptr) {
+            return false;
+        }
+
+        gf = *ggml_new_graph(ctx);
+
+        bc.build(ctx, gf);
+    }
+
+    bool ok = true;
+
+    double t_first_p50_ms = 0.0;
+
+    for (size_t it = 0; it < params.n_threads.size() && ok; it++) {
+        const int n_threads = params.n_threads[it];
+
+        struct ggml_threadpool * pool = bc.build ? ggml_threadpool_new(n_threads) : nullptr;
+
+        const std::function<bool ()> compute = [&]() {
+            if (bc.run) {
+                return bc.run(n_threads);
+            }
+
+            ggml_graph_compute_with_pool(ctx, &gf, pool);
+            return true;
+        };
+
+        bench_result res = {};
+
+        res.name      = bc.name;
+        res.shape     = bc.shape;
+        res.n_threads = n_threads;
+        res.n_runs    = params.n_runs;
+
+        std::vector<double> times;
+
+        ok = bench_measure(compute, params.n_runs, params.n_warmup, times);
+
+        if (ok) {
+            bench_count(compute, res.flops, res.bytes);
+
+            double sum = 0.0;
+            for (auto t : times) {
+                sum += t;
+            }
+
+            res.t_mean_ms = sum/times.size();
+            res.t_min_ms  = times.front();
+            res.t_p50_ms  = bench_percentile(times, 0.50);
+            res.t_p90_ms  = bench_percentile(times, 0.90);
+            res.t_p99_ms  = bench_percentile(times, 0.99);
+            res.t_max_ms  = times.back();
+
+            if (it == 0) {
+                t_first_p50_ms = res.t_p50_ms;
+            }
+
+            res.speedup = t_first_p50_ms/res.t_p50_ms;
+
+            fprintf(stderr, "%-16s %-36s t = %3d: p50 = %10.3f ms, %8.2f GFLOP/s, %8.2f GB/s, x%.2f\n",
+                    res.name.c_str(), res.shape.c_str(), n_threads, res.t_p50_ms,
+                    1e-6*res.flops/res.t_p50_ms, 1e-6*res.bytes/res.t_p50_ms, res.speedup);
+
+            results.push_back(res);
+        }
+
+        if (pool) {
+            ggml_threadpool_free(pool);
+        }
+    }
+
+    if (ctx) {
+        ggml_free(ctx);
+    }
+
+    return ok;
+}
+
+//
+// output
+//
+
+static void bench_write_csv(FILE * fout, const std::vector<bench_result> & results) {
+    fprintf(fout, "name,shape,isa,n_threads,n_runs,flops,bytes,mean_ms,min_ms,p50_ms,p90_ms,p99_ms,max_ms,gflops,gbs,speedup\n");
+
+    for (const auto & res : results) {
+        fprintf(fout, "%s,%s,%s,%d,%d,%lld,%lld,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.3f,%.3f,%.3f\n",
+                res.name.c_str(), res.shape.c_str(), ggml_cpu_isa(), res.n_threads, res.n_runs,
+                (long long) res.flops, (long long) res.bytes,
+                res.t_mean_ms, res.t_min_ms, res.t_p50_ms, res.t_p90_ms, res.t_p99_ms, res.t_max_ms,
+                1e-6*res.flops/res.t_p50_ms, 1e-6*res.bytes/res.t_p50_ms, res.speedup);
+    }
+}
+
+static void bench_write_json(FILE * fout, const std::vector<bench_result> & results) {
+    fprintf(fout, "{\n");
+    fprintf(fout, "  \"isa\": \"%s\",\n", ggml_cpu_isa());
+    fprintf(fout, "  \"hardware_threads\": %d,\n", (int) std::thread::hardware_concurrency());
+    fprintf(fout, "  \"results\": [");
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto & res = results[i];
+
+        fprintf(fout, "%s\n    {\"name\": \"%s\", \"shape\": \"%s\", \"n_threads\": %d, \"n_runs\": %d, "
+                "\"flops\": %lld, \"bytes\": %lld, "
+                "\"mean_ms\": %.4f, \"min_ms\": %.4f, \"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f, "
+                "\"gflops\": %.3f, \"gbs\": %.3f, \"speedup\": %.3f}",
+                i == 0 ? "" : ",",
+                res.name.c_str(), res.shape.c_str(), res.n_threads, res.n_runs,
+                (long long) res.flops, (long long) res.bytes,
+                res.t_mean_ms, res.t_min_ms, res.t_p50_ms, res.t_p90_ms, res.t_p99_ms, res.t_max_ms,
+                1e-6*res.flops/res.t_p50_ms, 1e-6*res.bytes/res.t_p50_ms, res.speedup);
+    }
+
+    fprintf(fout, "\n  ]\n}\n");
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    // the kernels of the host CPU are selected by the first ggml_init()
+    {
+        struct ggml_init_params ip = {
+            .mem_size   = 1024,
+            .mem_buffer = NULL,
+        };
+
+        ggml_free(ggml_init(ip));
+    }
+
+    bench_params params;
+    params.n_threads = bench_default_threads();
+
+    if (bench_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    const std::vector<bench_case> cases = bench_cases(params);
+
+    if (params.list) {
+        for (const auto & bc : cases) {
+            printf("%-16s %s\n", bc.name.c_str(), bc.shape.c_str());
+        }
+        return 0;
+    }
+
+    fprintf(stderr, "%s: isa = %s, runs = %d, warmup = %d\n", __func__, ggml_cpu_isa(), params.n_runs, params.n_warmup);
+
+    std::vector<bench_result> results;
+
+    for (const auto & bc : cases) {
+        if (!params.filter.empty() && bc.name.find(params.filter) == std::string::npos) {
+            continue;
+        }
+
+        if (!bench_run_case(bc, params, results)) {
+            fprintf(stderr, "%s: failed to run '%s' (%s)\n", __func__, bc.name.c_str(), bc.shape.c_str());
+            return 1;
+        }
+    }
+
+    FILE * fout = params.fname_out.empty() ? stdout : fopen(params.fname_out.c_str(), "w");
+    if (fout == nullptr) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.fname_out.c_str());
+        return 1;
+    }
+
+    if (params.format == "json") {
+        bench_write_json(fout, results);
+    } else {
+        bench_write_csv(fout, results);
+    }
+
+    if (fout != stdout) {
+        fclose(fout);
+    }
+
+    return 0;
+}
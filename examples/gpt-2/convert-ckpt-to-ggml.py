@@ -8,6 +8,7 @@
 #   - Name length (int)
 #   - Dimensions (int[n_dims])
 #   - Name (char[name_length])
+#   - Padding (zero bytes up to the next multiple of 32 bytes from the beginning of the file)
 #   - Data (float[n_dims])
 #
 # By default, the bigger matrices are converted to 16-bit floats.
@@ -69,7 +70,7 @@ list_vars = tf.train.list_variables(dir_model)
 
 fout = open(fname_out, "wb")
 
-fout.write(struct.pack("i", 0x67676d6c)) # magic: ggml in hex
+fout.write(struct.pack("i", 0x67676a74)) # magic: ggjt in hex - ggml with aligned tensor data
 fout.write(struct.pack("i", hparams["n_vocab"]))
 fout.write(struct.pack("i", hparams["n_ctx"]))
 fout.write(struct.pack("i", hparams["n_embd"]))
@@ -118,6 +119,9 @@ for name, shape in list_vars:
         fout.write(struct.pack("i", data.shape[n_dims - 1 - i]))
     fout.write(str);
 
+    # pad the data to a multiple of 32 bytes from the beginning of the file, so it can be used from a memory mapping
+    fout.write(b"\0" * (-fout.tell() % 32))
+
     # data
     data.tofile(fout)
 
@@ -0,0 +1,999 @@
+#include "gpt-2.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+
+// the key + value memory of each layer holds the keys and values of each head in contiguous rows:
+//
+//   keys:   [n_embd/n_head, n_seq*n_ctx, n_head]
+//   values: [n_seq*n_ctx, n_embd/n_head, n_head] - transposed, so that they multiply the attention weights directly
+//
+// each sequence owns a slot of n_ctx consecutive positions - position i of sequence s is at s*n_ctx + i
+//
+// the keys can be block-quantized, since each token writes whole rows of them. each token writes a column of the
+// values, so they are kept in f16 when the keys are quantized
+ggml_type gpt2_kv_type_k(ggml_type kv_type) {
+    return kv_type;
+}
+
+ggml_type gpt2_kv_type_v(ggml_type kv_type) {
+    return ggml_is_quantized(kv_type) ? GGML_TYPE_F16 : kv_type;
+}
+
+// offset of the key of position i of the first head of layer il
+size_t gpt2_offs_k(const gpt2_model & model, int il, int i) {
+    const auto & hparams = model.hparams;
+
+    const size_t nb_k = ggml_type_size(model.memory_k->type)*(hparams.n_embd/hparams.n_head)/ggml_blck_size(model.memory_k->type);
+
+    return nb_k*((size_t) il*model.n_seq*hparams.n_ctx*hparams.n_head + i);
+}
+
+// offset of the values of position i of the first head of layer il
+size_t gpt2_offs_v(const gpt2_model & model, int il, int i) {
+    const auto & hparams = model.hparams;
+
+    return ggml_type_size(model.memory_v->type)*((size_t) il*model.n_seq*hparams.n_ctx*hparams.n_embd + i);
+}
+
+// the keys of layer il for the positions [i0, i0 + n)
+// [n_embd/n_head, n, n_head]
+struct ggml_tensor * gpt2_view_k(struct ggml_context * ctx0, const gpt2_model & model, int il, int i0, int n) {
+    const auto & hparams = model.hparams;
+
+    const size_t nb_k = ggml_type_size(model.memory_k->type)*(hparams.n_embd/hparams.n_head)/ggml_blck_size(model.memory_k->type);
+
+    return ggml_view_3d(ctx0, model.memory_k,
+            hparams.n_embd/hparams.n_head, n, hparams.n_head,
+            nb_k, nb_k*model.n_seq*hparams.n_ctx,
+            gpt2_offs_k(model, il, i0));
+}
+
+// the values of layer il for the positions [i0, i0 + n)
+// [n, n_embd/n_head, n_head]
+struct ggml_tensor * gpt2_view_v(struct ggml_context * ctx0, const gpt2_model & model, int il, int i0, int n) {
+    const auto & hparams = model.hparams;
+
+    const size_t nb_v = ggml_type_size(model.memory_v->type);
+
+    return ggml_view_3d(ctx0, model.memory_v,
+            n, hparams.n_embd/hparams.n_head, hparams.n_head,
+            nb_v*model.n_seq*hparams.n_ctx, nb_v*model.n_seq*hparams.n_ctx*(hparams.n_embd/hparams.n_head),
+            gpt2_offs_v(model, il, i0));
+}
+
+// read a tensor stored as f32 or f16 in the model file and quantize it into the given tensor
+// if transpose is true, the tensor holds the transpose of the data in the file
+void gpt2_read_quantized(std::ifstream & fin, int32_t ftype, struct ggml_tensor * tensor, bool transpose) {
+    const int n0 = transpose ? tensor->ne[1] : tensor->ne[0]; // row length in the file
+    const int n1 = transpose ? tensor->ne[0] : tensor->ne[1];
+    const int n  = n0*n1;
+
+    std::vector<float> data(n);
+
+    if (ftype == 0) {
+        fin.read(reinterpret_cast<char *>(data.data()), n*sizeof(float));
+    } else {
+        std::vector<ggml_fp16_t> tmp(n);
+        fin.read(reinterpret_cast<char *>(tmp.data()), n*sizeof(ggml_fp16_t));
+
+        for (int i = 0; i < n; ++i) {
+            data[i] = ggml_fp16_to_fp32(tmp[i]);
+        }
+    }
+
+    if (transpose) {
+        std::vector<float> tmp(n);
+        for (int i1 = 0; i1 < n1; ++i1) {
+            for (int i0 = 0; i0 < n0; ++i0) {
+                tmp[i0*n1 + i1] = data[i1*n0 + i0];
+            }
+        }
+        data.swap(tmp);
+    }
+
+    ggml_quantize(tensor->type, data.data(), tensor->data, n);
+}
+
+// create the tensors of a model with the hparams in model.hparams, and its key + value memory
+//
+//   - wtype:    the type of the 2D weights - the attention and fc weights are transposed when it is quantized
+//               (see gpt2_mul_mat_t)
+//   - kv_type:  the type of the key + value memory (see gpt2_kv_type_k/v)
+//   - n_seq:    the number of sequences that the key + value memory holds (see gpt2_eval_batch)
+//   - no_alloc: only create the tensor objects of the weights, their data is set by the caller
+//
+bool gpt2_model_init(gpt2_model & model, ggml_type wtype, ggml_type kv_type, int n_seq, bool no_alloc) {
+    const bool quantized = ggml_is_quantized(wtype);
+
+    // the keys of a head are quantized in whole blocks
+    {
+        const auto & hparams = model.hparams;
+
+        if (ggml_is_quantized(kv_type) && (hparams.n_embd/hparams.n_head) % ggml_blck_size(kv_type) != 0) {
+            fprintf(stderr, "%s: the head size %d is not a multiple of %d, using f16 keys\n",
+                    __func__, hparams.n_embd/hparams.n_head, ggml_blck_size(kv_type));
+            kv_type = GGML_TYPE_F16;
+        }
+    }
+
+    auto & ctx = model.ctx;
+
+    size_t ctx_size = 0;
+
+    {
+        const auto & hparams = model.hparams;
+
+        const int n_embd  = hparams.n_embd;
+        const int n_layer = hparams.n_layer;
+        const int n_ctx   = hparams.n_ctx;
+        const int n_vocab = hparams.n_vocab;
+
+        ctx_size += n_embd*ggml_type_size(GGML_TYPE_F32); // ln_f_g
+        ctx_size += n_embd*ggml_type_size(GGML_TYPE_F32); // ln_f_b
+
+        ctx_size += n_vocab*n_embd*ggml_type_sizef(wtype);         // wte
+        ctx_size +=   n_ctx*n_embd*ggml_type_size(GGML_TYPE_F32); // wpe
+
+        ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_1_g
+        ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_1_b
+
+        ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_2_g
+        ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_2_b
+
+        ctx_size += n_layer*(3*n_embd*n_embd*ggml_type_sizef(wtype));         // c_attn_attn_w
+        ctx_size += n_layer*(       3*n_embd*ggml_type_size(GGML_TYPE_F32)); // c_attn_attn_b
+
+        ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype));           // c_attn_proj_w
+        ctx_size += n_layer*(       n_embd*ggml_type_size(GGML_TYPE_F32));   // c_attn_proj_b
+
+        ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_sizef(wtype));         // c_mlp_fc_w
+        ctx_size += n_layer*(       4*n_embd*ggml_type_size(GGML_TYPE_F32)); // c_mlp_fc_b
+
+        ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_sizef(wtype));         // c_mlp_proj_w
+        ctx_size += n_layer*(         n_embd*ggml_type_size(GGML_TYPE_F32)); // c_mlp_proj_b
+
+        // the context only holds the tensor objects of the weights
+        if (no_alloc) {
+            ctx_size = 0;
+        }
+
+        ctx_size += n_seq*n_ctx*n_layer*n_embd*ggml_type_sizef(gpt2_kv_type_k(kv_type)); // memory_k
+        ctx_size += n_seq*n_ctx*n_layer*n_embd*ggml_type_sizef(gpt2_kv_type_v(kv_type)); // memory_v
+
+        ctx_size += (6 + 12*n_layer)*256; // object overhead
+    }
+
+    // create the ggml context
+    {
+        struct ggml_init_params params = {
+            .mem_size   = ctx_size,
+            .mem_buffer = NULL,
+            .no_alloc   = no_alloc,
+        };
+
+        model.ctx = ggml_init(params);
+        if (!model.ctx) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            return false;
+        }
+    }
+
+    // prepare memory for the weights
+    {
+        const auto & hparams = model.hparams;
+
+        const int n_embd  = hparams.n_embd;
+        const int n_layer = hparams.n_layer;
+        const int n_ctx   = hparams.n_ctx;
+        const int n_vocab = hparams.n_vocab;
+
+        model.layers.resize(n_layer);
+
+        model.ln_f_g = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+        model.ln_f_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+
+        model.wte = ggml_new_tensor_2d(ctx, wtype,         n_embd, n_vocab);
+        model.wpe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_ctx);
+
+        // map by name
+        model.tensors["model/ln_f/g"] = model.ln_f_g;
+        model.tensors["model/ln_f/b"] = model.ln_f_b;
+
+        model.tensors["model/wte"] = model.wte;
+        model.tensors["model/wpe"] = model.wpe;
+
+        for (int i = 0; i < n_layer; ++i) {
+            auto & layer = model.layers[i];
+
+            layer.ln_1_g             = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
+            layer.ln_1_b             = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
+
+            layer.ln_2_g             = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
+            layer.ln_2_b             = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
+
+            layer.c_attn_attn_w      = quantized ? ggml_new_tensor_2d(ctx, wtype, n_embd, 3*n_embd)
+                                                 : ggml_new_tensor_2d(ctx, wtype, 3*n_embd, n_embd);
+            layer.c_attn_attn_b      = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 3*n_embd);
+
+            layer.c_attn_proj_w      = ggml_new_tensor_2d(ctx, wtype,           n_embd, n_embd);
+            layer.c_attn_proj_b      = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
+
+            layer.c_mlp_fc_w         = quantized ? ggml_new_tensor_2d(ctx, wtype, n_embd, 4*n_embd)
+                                                 : ggml_new_tensor_2d(ctx, wtype, 4*n_embd, n_embd);
+            layer.c_mlp_fc_b         = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_embd);
+
+            layer.c_mlp_proj_w_trans = ggml_new_tensor_2d(ctx, wtype,         4*n_embd, n_embd);
+            layer.c_mlp_proj_b       = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
+
+            // map by name
+            model.tensors["model/h" + std::to_string(i) + "/ln_1/g"]        = layer.ln_1_g;
+            model.tensors["model/h" + std::to_string(i) + "/ln_1/b"]        = layer.ln_1_b;
+
+            model.tensors["model/h" + std::to_string(i) + "/ln_2/g"]        = layer.ln_2_g;
+            model.tensors["model/h" + std::to_string(i) + "/ln_2/b"]        = layer.ln_2_b;
+
+            model.tensors["model/h" + std::to_string(i) + "/attn/c_attn/w"] = layer.c_attn_attn_w;
+            model.tensors["model/h" + std::to_string(i) + "/attn/c_attn/b"] = layer.c_attn_attn_b;
+
+            model.tensors["model/h" + std::to_string(i) + "/attn/c_proj/w"] = layer.c_attn_proj_w;
+            model.tensors["model/h" + std::to_string(i) + "/attn/c_proj/b"] = layer.c_attn_proj_b;
+
+            model.tensors["model/h" + std::to_string(i) + "/mlp/c_fc/w"]    = layer.c_mlp_fc_w;
+            model.tensors["model/h" + std::to_string(i) + "/mlp/c_fc/b"]    = layer.c_mlp_fc_b;
+
+            model.tensors["model/h" + std::to_string(i) + "/mlp/c_proj/w"]  = layer.c_mlp_proj_w_trans;
+            model.tensors["model/h" + std::to_string(i) + "/mlp/c_proj/b"]  = layer.c_mlp_proj_b;
+        }
+    }
+
+    // key + value memory
+    {
+        const auto & hparams = model.hparams;
+
+        const int n_embd  = hparams.n_embd;
+        const int n_layer = hparams.n_layer;
+        const int n_ctx   = hparams.n_ctx;
+
+        const int n_mem      = n_layer*n_seq*n_ctx;
+        const int n_elements = n_embd*n_mem;
+
+        // the memory is written during inference, so it always lives in the context
+        ggml_set_no_alloc(ctx, false);
+
+        model.n_seq = n_seq;
+
+        model.memory_k = ggml_new_tensor_1d(ctx, gpt2_kv_type_k(kv_type), n_elements);
+        model.memory_v = ggml_new_tensor_1d(ctx, gpt2_kv_type_v(kv_type), n_elements);
+
+        // the graphs attend to a few masked positions past the context (see gpt2_graph), so they must be finite
+        ggml_set_zero(model.memory_k);
+        ggml_set_zero(model.memory_v);
+    }
+
+    return true;
+}
+
+// load the model's weights from a file
+//
+//   - qtype:    quantize the 2D weights to this type at load time (GGML_TYPE_COUNT - keep the type in the model file)
+//   - kv_type:  the type of the key + value memory (see gpt2_kv_type_k/v)
+//   - n_seq:    the number of sequences that the key + value memory holds (see gpt2_eval_batch)
+//   - use_mmap: use the weights in place from a memory mapping of the file, if it has the aligned format
+//
+bool gpt2_model_load(const std::string & fname, gpt2_model & model, gpt_vocab & vocab, ggml_type qtype, ggml_type kv_type, int n_seq, bool use_mmap) {
+    printf("%s: loading model from '%s'\n", __func__, fname.c_str());
+
+    auto fin = std::ifstream(fname, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    // verify magic
+    uint32_t magic;
+    {
+        fin.read((char *) &magic, sizeof(magic));
+        if (magic != GGML_FILE_MAGIC && magic != GGML_FILE_MAGIC_ALIGNED) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname.c_str());
+            return false;
+        }
+    }
+
+    // load hparams
+    {
+        auto & hparams = model.hparams;
+
+        fin.read((char *) &hparams.n_vocab, sizeof(hparams.n_vocab));
+        fin.read((char *) &hparams.n_ctx,   sizeof(hparams.n_ctx));
+        fin.read((char *) &hparams.n_embd,  sizeof(hparams.n_embd));
+        fin.read((char *) &hparams.n_head,  sizeof(hparams.n_head));
+        fin.read((char *) &hparams.n_layer, sizeof(hparams.n_layer));
+        fin.read((char *) &hparams.f16,     sizeof(hparams.f16));
+
+        printf("%s: n_vocab = %d\n", __func__, hparams.n_vocab);
+        printf("%s: n_ctx   = %d\n", __func__, hparams.n_ctx);
+        printf("%s: n_embd  = %d\n", __func__, hparams.n_embd);
+        printf("%s: n_head  = %d\n", __func__, hparams.n_head);
+        printf("%s: n_layer = %d\n", __func__, hparams.n_layer);
+        printf("%s: f16     = %d\n", __func__, hparams.f16);
+    }
+
+    // load vocab
+    {
+        int32_t n_vocab = 0;
+        fin.read((char *) &n_vocab, sizeof(n_vocab));
+
+        if (n_vocab != model.hparams.n_vocab) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad vocab size %d != %d)\n",
+                    __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
+            return false;
+        }
+
+        std::string word;
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len;
+            fin.read((char *) &len, sizeof(len));
+
+            word.resize(len);
+            fin.read((char *) word.data(), len);
+
+            vocab.token_to_id[word] = i;
+            vocab.id_to_token[i] = word;
+        }
+    }
+
+    // for the big tensors, we have the option to store the data in 16-bit floats
+    // in order to save memory and also to speed up the computation
+    // they can also be quantized at load time
+    const ggml_type wtype = qtype != GGML_TYPE_COUNT ? qtype : model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
+    // the attention and fc weights are stored transposed in the model file
+    // when quantized, they are transposed back at load time (see gpt2_mul_mat_t)
+    const bool quantized = ggml_is_quantized(wtype);
+    std::set<struct ggml_tensor *> transposed;
+
+    // the weights that don't have to be converted at load time can point straight into the mapped file
+    if (use_mmap && magic == GGML_FILE_MAGIC_ALIGNED && !quantized) {
+        if (!gpt_mmap_open(fname, model.mm)) {
+            fprintf(stderr, "%s: failed to mmap '%s' - reading the weights instead\n", __func__, fname.c_str());
+        }
+    }
+
+    const bool mapped = model.mm.addr != nullptr;
+
+    if (!gpt2_model_init(model, wtype, kv_type, n_seq, mapped)) {
+        return false;
+    }
+
+    {
+        const int n_mem = model.hparams.n_layer*model.n_seq*model.hparams.n_ctx;
+
+        const size_t memory_size = ggml_nbytes(model.memory_k) + ggml_nbytes(model.memory_v);
+
+        printf("%s: ggml ctx size = %6.2f MB\n", __func__, ggml_used_mem(model.ctx)/(1024.0*1024.0));
+        printf("%s: memory size = %8.2f MB, n_mem = %d\n", __func__, memory_size/1024.0/1024.0, n_mem);
+    }
+
+    // the quantized weights are transposed back at load time
+    if (quantized) {
+        for (const auto & layer : model.layers) {
+            transposed.insert(layer.c_attn_attn_w);
+            transposed.insert(layer.c_attn_proj_w);
+            transposed.insert(layer.c_mlp_fc_w);
+        }
+    }
+
+    // load weights
+    {
+        size_t total_size = 0;
+
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ftype;
+
+            fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+            fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+            fin.read(reinterpret_cast<char *>(&ftype),  sizeof(ftype));
+
+            if (fin.eof()) {
+                break;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[2] = { 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+                nelements *= ne[i];
+            }
+
+            std::string name(length, 0);
+            fin.read(&name[0], length);
+
+            // in the aligned format, the data starts at the next multiple of GGML_FILE_ALIGN
+            if (magic == GGML_FILE_MAGIC_ALIGNED) {
+                const size_t offset = fin.tellg();
+                fin.seekg((GGML_FILE_ALIGN - offset % GGML_FILE_ALIGN) % GGML_FILE_ALIGN, std::ios::cur);
+            }
+
+            if (model.tensors.find(name.data()) == model.tensors.end()) {
+                fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                return false;
+            }
+
+            auto tensor = model.tensors[name.data()];
+            if (ggml_nelements(tensor) != nelements) {
+                fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                return false;
+            }
+
+            const bool transpose = transposed.count(tensor) > 0;
+
+            const int ne0 = transpose ? tensor->ne[1] : tensor->ne[0];
+            const int ne1 = transpose ? tensor->ne[0] : tensor->ne[1];
+
+            if (ne0 != ne[0] || ne1 != ne[1]) {
+                fprintf(stderr, "%s: tensor '%s' has wrong shape in model file: got [%d, %d], expected [%d, %d]\n",
+                        __func__, name.data(), ne0, ne1, ne[0], ne[1]);
+                return false;
+            }
+
+            if (ggml_is_quantized(tensor->type)) {
+                if (ftype != 0 && ftype != 1) {
+                    fprintf(stderr, "%s: tensor '%s' has unsupported type %d in model file\n", __func__, name.data(), ftype);
+                    return false;
+                }
+
+                gpt2_read_quantized(fin, ftype, tensor, transpose);
+            } else {
+                const size_t bpe = (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
+
+                if (nelements*bpe != ggml_nbytes(tensor)) {
+                    fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                            __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                    return false;
+                }
+
+                if (mapped) {
+                    const size_t offset = fin.tellg();
+                    if (offset + ggml_nbytes(tensor) > model.mm.size) {
+                        fprintf(stderr, "%s: tensor '%s' is out of bounds of the model file\n", __func__, name.data());
+                        return false;
+                    }
+
+                    tensor->data = (char *) model.mm.addr + offset;
+                    fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+                } else {
+                    fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+                }
+            }
+
+            //printf("%24s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
+            total_size += ggml_nbytes(tensor);
+        }
+
+        // the mapped weights that are not in the file have no data at all
+        if (mapped) {
+            for (const auto & it : model.tensors) {
+                if (it.second->data == nullptr) {
+                    fprintf(stderr, "%s: tensor '%s' is missing from the model file\n", __func__, it.first.c_str());
+                    return false;
+                }
+            }
+        }
+
+        printf("%s: model size  = %8.2f MB%s\n", __func__, total_size/1024.0/1024.0, mapped ? " (mmap)" : "");
+    }
+
+    fin.close();
+
+    model.id = gpt_model_id(model.tensors, &model.hparams, sizeof(model.hparams), qtype);
+
+    return true;
+}
+
+// multiply by a weight matrix that is stored transposed in the model file
+// quantized weights have been transposed back at load time, the f16 ones are multiplied transposed by the blocked
+// gemm of ggml_mul_mat() for batches of tokens
+struct ggml_tensor * gpt2_mul_mat_t(struct ggml_context * ctx0, struct ggml_tensor * w, struct ggml_tensor * cur) {
+    if (ggml_is_quantized(w->type)) {
+        return ggml_mul_mat(ctx0, w, cur);
+    }
+
+    return ggml_mul_mat(ctx0, ggml_transpose(ctx0, w), cur);
+}
+
+// the number of keys / values that a graph attends to is rounded up to a multiple of this, so that the graph
+// can be computed again for the following tokens - the positions past n_past + N are masked
+#define GPT2_KV_BLOCK 32
+
+// a graph of the transformer for a batch of tokens that is built once and computed again for the following
+// evaluations with the same number of tokens per sequence, by rebinding its inputs, as long as the contexts fit in
+// the n_kv keys / values
+//
+// the tokens attend to the n_kv keys / values from the first slot of the batch on - with a single sequence, the
+// attention skips the positions past n_past + N, otherwise it is masked to the positions of the token's own sequence
+struct gpt2_graph {
+    std::vector<uint8_t> buf_meta; // tensor objects of the graph
+    std::vector<uint8_t> buf;      // data of the intermediate tensors, placed by ggml_graph_alloc()
+
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph    gf  = {};
+
+    std::vector<int> n_tokens; // number of tokens of each sequence of the batch
+
+    int N    = 0;
+    int n_kv = 0;
+
+    // inputs
+    struct ggml_tensor * embd;
+    struct ggml_tensor * position;
+    struct ggml_tensor * mask; // [n_kv, N], 0 or -INFINITY - only with several sequences
+
+    std::vector<struct ggml_tensor *> k;      // views of the memory where the new keys / values are stored, per layer and sequence
+    std::vector<struct ggml_tensor *> v;
+    std::vector<struct ggml_tensor *> K;      // views of the memory that the tokens attend to, per layer
+    std::vector<struct ggml_tensor *> V;
+    std::vector<struct ggml_tensor *> n_past; // n_past parameters of the attention - only with a single sequence
+
+    // output
+    struct ggml_tensor * logits;
+};
+
+// build the graph of the transformer for a batch of tokens that attend to n_kv keys / values and plan its memory
+//
+//   - model:    the model
+//   - pool:     the worker threads that will compute the graph
+//   - n_tokens: the number of tokens of each sequence of the batch
+//   - n_kv:     the number of keys / values in the memory that the tokens attend to
+//   - graph:    the graph, replacing the previous one
+//
+bool gpt2_build_graph(
+        const gpt2_model & model,
+        struct ggml_threadpool * pool,
+        const std::vector<int> & n_tokens,
+        const int n_kv,
+              gpt2_graph & graph) {
+    const auto & hparams = model.hparams;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_head  = hparams.n_head;
+
+    const int n_batch = n_tokens.size();
+
+    int N = 0;
+    for (int n : n_tokens) {
+        N += n;
+    }
+
+    if (graph.ctx) {
+        ggml_free(graph.ctx);
+    }
+
+    // the context only holds the tensor objects of the graph (and a few scalars)
+    // the data of the intermediate tensors is placed in graph.buf by ggml_graph_alloc()
+    graph.buf_meta.resize(2*GGML_DEFAULT_GRAPH_SIZE*(ggml_tensor_overhead() + 16) + ggml_graph_overhead(GGML_DEFAULT_GRAPH_SIZE, false));
+
+    struct ggml_init_params params = {
+        .mem_size   = graph.buf_meta.size(),
+        .mem_buffer = graph.buf_meta.data(),
+        .no_alloc   = true,
+    };
+
+    graph.ctx      = ggml_init(params);
+    graph.gf       = *ggml_new_graph(graph.ctx);
+    graph.n_tokens = n_tokens;
+    graph.N        = N;
+    graph.n_kv     = n_kv;
+
+    graph.k.resize(n_layer*n_batch);
+    graph.v.resize(n_layer*n_batch);
+    graph.K.resize(n_layer);
+    graph.V.resize(n_layer);
+    graph.n_past.resize(n_layer);
+
+    struct ggml_context * ctx0 = graph.ctx;
+    struct ggml_cgraph  & gf   = graph.gf;
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+
+    graph.embd     = embd;
+    graph.position = position;
+    graph.mask     = n_batch > 1 ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, N) : nullptr;
+
+    // wte + wpe
+    struct ggml_tensor * inpL =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.wte, embd),
+                ggml_get_rows(ctx0, model.wpe, position));
+
+    for (int il = 0; il < n_layer; ++il) {
+        struct ggml_tensor * cur;
+
+        // norm
+        {
+            // [ 768, N]
+            cur = ggml_norm(ctx0, inpL);
+
+            // cur = ln_1_g*cur + ln_1_b
+            // [ 768, N]
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        model.layers[il].ln_1_g),
+                    model.layers[il].ln_1_b);
+        }
+
+        // attn
+        // [2304, 768] - model.layers[il].c_attn_attn_w
+        // [2304,   1] - model.layers[il].c_attn_attn_b
+        // [ 768,   N] - cur (in)
+        // [2304,   N] - cur (out)
+        //
+        // cur = attn_w*cur + attn_b
+        // [2304, N]
+        {
+            cur = gpt2_mul_mat_t(ctx0,
+                    model.layers[il].c_attn_attn_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    model.layers[il].c_attn_attn_b);
+        }
+
+        // self-attention
+        {
+            // store key and value to memory, in the slot of each sequence
+            // the views are moved to the slot and n_past of the sequence when the graph is computed (see gpt2_eval_batch)
+            for (int ib = 0, i0 = 0; ib < n_batch; i0 += n_tokens[ib], ++ib) {
+                const int n = n_tokens[ib];
+
+                if (n == 0) {
+                    continue;
+                }
+
+                // Kcur = cur[:, i0:i0 + n].view(n_embd/n_head, n_head, n).permute(0, 2, 1, 3)
+                // [64, n, 12]
+                struct ggml_tensor * Kcur =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, cur, n_embd/n_head, n_head, n, (n_embd/n_head)*sizeof(float), cur->nb[1], i0*cur->nb[1] + 1*sizeof(float)*n_embd),
+                            0, 2, 1, 3);
+
+                // Vcur = cur[:, i0:i0 + n].view(n_embd/n_head, n_head, n).permute(1, 2, 0, 3)
+                // [n, 64, 12]
+                struct ggml_tensor * Vcur =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, cur, n_embd/n_head, n_head, n, (n_embd/n_head)*sizeof(float), cur->nb[1], i0*cur->nb[1] + 2*sizeof(float)*n_embd),
+                            1, 2, 0, 3);
+
+                struct ggml_tensor * k = gpt2_view_k(ctx0, model, il, 0, n);
+                struct ggml_tensor * v = gpt2_view_v(ctx0, model, il, 0, n);
+
+                graph.k[il*n_batch + ib] = k;
+                graph.v[il*n_batch + ib] = v;
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+            }
+
+            // Q = cur[0:n_embd, :].view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+            // [64, N, 12]
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_view_3d(ctx0, cur, n_embd/n_head, n_head, N, (n_embd/n_head)*sizeof(float), cur->nb[1], 0),
+                        0, 2, 1, 3);
+
+            // K = Kmem[il, i_kv:i_kv + n_kv]
+            // [64, n_kv, 12]
+            struct ggml_tensor * K = gpt2_view_k(ctx0, model, il, 0, n_kv);
+
+            graph.K[il] = K;
+
+            // V_trans = Vmem[il, i_kv:i_kv + n_kv]
+            // [n_kv, 64, 12]
+            struct ggml_tensor * V_trans = gpt2_view_v(ctx0, model, il, 0, n_kv);
+
+            graph.V[il] = V_trans;
+
+            // KQV = transpose(V) * soft_max(mask_past(K * Q / sqrt(n_embd/n_head)))
+            // [64, N, 12]
+            // the keys / values are streamed in tiles, so the [n_kv, N, 12] weights are never stored
+            // with a single sequence, the positions past n_past + N are skipped - n_past is set when the graph is computed
+            // with several sequences, the mask also hides the positions of the other sequences from each token
+            struct ggml_tensor * KQV = ggml_flash_attn_kv(ctx0, Q, K, V_trans, graph.mask, 0, 1.0f/sqrt(float(n_embd)/n_head));
+
+            graph.n_past[il] = graph.mask ? nullptr : KQV->opt[1];
+
+            // KQV_merged = KQV.permute(0, 2, 1, 3)
+            // [64, 12, N]
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+            // cur = KQV_merged.contiguous().view(n_embd, N)
+            // [768, N]
+            cur = ggml_cpy(ctx0,
+                    KQV_merged,
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+        }
+
+        // projection
+        // [ 768, 768] - model.layers[il].c_attn_proj_w
+        // [ 768,   1] - model.layers[il].c_attn_proj_b
+        // [ 768,   N] - cur (in)
+        // [ 768,   N] - cur (out)
+        //
+        // cur = proj_w*cur + proj_b
+        // [768, N]
+        {
+            cur = gpt2_mul_mat_t(ctx0,
+                    model.layers[il].c_attn_proj_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    model.layers[il].c_attn_proj_b);
+        }
+
+        // add the input
+        cur = ggml_add(ctx0, cur, inpL);
+
+        struct ggml_tensor * inpFF = cur;
+
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF);
+
+                // cur = ln_2_g*cur + ln_2_b
+                // [ 768, N]
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            cur,
+                            model.layers[il].ln_2_g),
+                        model.layers[il].ln_2_b);
+            }
+
+            // fully connected
+            // [3072, 768] - model.layers[il].c_mlp_fc_w
+            // [3072,   1] - model.layers[il].c_mlp_fc_b
+            // [ 768,   N] - cur (in)
+            // [3072,   N] - cur (out)
+            //
+            // cur = fc_w*cur + fc_b
+            // [3072, N]
+            cur = gpt2_mul_mat_t(ctx0,
+                    model.layers[il].c_mlp_fc_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    model.layers[il].c_mlp_fc_b);
+
+            // GELU activation
+            // [3072, N]
+            cur = ggml_gelu(ctx0, cur);
+
+            // projection
+            // [ 768, 3072] - model.layers[il].c_mlp_proj_w
+            // [ 768,    1] - model.layers[il].c_mlp_proj_b
+            // [3072,    N] - cur (in)
+            // [ 768,    N] - cur (out)
+            //
+            // cur = proj_w*cur + proj_b
+            // [768, N]
+            cur = ggml_mul_mat(ctx0,
+                    model.layers[il].c_mlp_proj_w_trans,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    model.layers[il].c_mlp_proj_b);
+        }
+
+        // input for next layer
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
+
+    // norm
+    {
+        // [ 768, N]
+        inpL = ggml_norm(ctx0, inpL);
+
+        // inpL = ln_f_g*inpL + ln_f_b
+        // [ 768, N]
+        inpL = ggml_add(ctx0,
+                ggml_mul(ctx0,
+                    inpL,
+                    model.ln_f_g),
+                model.ln_f_b);
+    }
+
+    // inpL = WTE * inpL
+    // [ 768, 50257] - model.wte
+    // [ 768, N]     - inpL
+    inpL = ggml_mul_mat(ctx0, model.wte, inpL);
+
+    // the softmax is left to the sampler, which only needs it for the top tokens
+    ggml_build_forward_expand(&gf, inpL);
+
+    graph.logits = inpL;
+
+    // merge the layer norms, the bias + GELU and the scaled masked soft max into single nodes
+    ggml_graph_fuse(&gf);
+
+    // the work buffer is planned for the number of threads of the pool
+    gf.n_threads = ggml_threadpool_n_threads(pool);
+
+    // place the intermediate tensors, growing the buffer when the graph needs more memory
+    {
+        const size_t buf_size = ggml_graph_alloc(ctx0, &gf, NULL, 0);
+
+        if (buf_size > graph.buf.size()) {
+            //printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, graph.buf.size(), buf_size);
+            graph.buf.resize(buf_size);
+        }
+
+        ggml_graph_alloc(ctx0, &gf, graph.buf.data(), graph.buf.size());
+    }
+
+    return true;
+}
+
+// evaluate the transformer on a batch of tokens from independent sequences in one graph
+//
+// the sequences share the weights, so the matrix multiplications process the tokens of all of them at once
+// each sequence attends only to its own slot of the key + value memory
+//
+//   - model:     the model
+//   - pool:      the worker threads to use for the computation
+//   - batch:     the new tokens of each sequence - a sequence appears at most once
+//   - embd_w:    the predicted logits of the token that follows each sequence, n_vocab per sequence
+//
+bool gpt2_eval_batch(
+        const gpt2_model & model,
+        struct ggml_threadpool * pool,
+        const std::vector<gpt2_seq_tokens> & batch,
+              std::vector<float>           & embd_w,
+              size_t                       & mem_per_token) {
+    const auto & hparams = model.hparams;
+
+    const int n_layer = hparams.n_layer;
+    const int n_ctx   = hparams.n_ctx;
+    const int n_vocab = hparams.n_vocab;
+
+    const int n_batch = batch.size();
+
+    // the positions of the memory that the batch attends to, from the slot of its first sequence
+    int i_kv = model.n_seq*n_ctx;
+    int n_kv = 0;
+
+    std::vector<int> n_tokens(n_batch);
+
+    for (int ib = 0; ib < n_batch; ++ib) {
+        const auto & st = batch[ib];
+
+        if (st.seq < 0 || st.seq >= model.n_seq || st.n_past + (int) st.tokens.size() > n_ctx) {
+            fprintf(stderr, "%s: sequence %d does not fit in the key + value memory\n", __func__, st.seq);
+            return false;
+        }
+
+        n_tokens[ib] = st.tokens.size();
+
+        i_kv = std::min(i_kv, st.seq*n_ctx);
+    }
+
+    for (const auto & st : batch) {
+        n_kv = std::max(n_kv, st.seq*n_ctx + st.n_past + (int) st.tokens.size() - i_kv);
+    }
+
+    static gpt2_graph graph;
+
+    // build a new graph when the tokens change, the contexts no longer fit in the previous one or the work buffer was
+    // planned for another number of threads
+    if (graph.ctx == nullptr || graph.n_tokens != n_tokens || n_kv > graph.n_kv || i_kv + graph.n_kv > model.n_seq*n_ctx ||
+        graph.gf.n_threads != ggml_threadpool_n_threads(pool)) {
+        n_kv = std::min(model.n_seq*n_ctx - i_kv, ((n_kv + GPT2_KV_BLOCK - 1)/GPT2_KV_BLOCK)*GPT2_KV_BLOCK);
+
+        if (!gpt2_build_graph(model, pool, n_tokens, n_kv, graph)) {
+            fprintf(stderr, "%s: failed to build the graph\n", __func__);
+            return false;
+        }
+
+        if (mem_per_token == 0) {
+            mem_per_token = graph.buf.size()/graph.N;
+        }
+    }
+
+    // rebind the inputs of the graph
+    for (int ib = 0, i0 = 0; ib < n_batch; i0 += n_tokens[ib], ++ib) {
+        const auto & st = batch[ib];
+
+        for (int i = 0; i < n_tokens[ib]; ++i) {
+            ((int32_t *) graph.embd->data)[i0 + i]     = st.tokens[i];
+            ((int32_t *) graph.position->data)[i0 + i] = st.n_past + i;
+        }
+
+        for (int il = 0; il < n_layer; ++il) {
+            if (graph.k[il*n_batch + ib] == nullptr) {
+                continue;
+            }
+
+            graph.k[il*n_batch + ib]->view_offs = gpt2_offs_k(model, il, st.seq*n_ctx + st.n_past);
+            graph.v[il*n_batch + ib]->view_offs = gpt2_offs_v(model, il, st.seq*n_ctx + st.n_past);
+        }
+    }
+
+    for (int il = 0; il < n_layer; ++il) {
+        graph.K[il]->view_offs = gpt2_offs_k(model, il, i_kv);
+        graph.V[il]->view_offs = gpt2_offs_v(model, il, i_kv);
+
+        if (graph.n_past[il]) {
+            ggml_set_i32_1d(graph.n_past[il], 0, batch[0].n_past);
+        }
+    }
+
+    // token i of a sequence sees the positions [0, n_past + i] of its slot
+    if (graph.mask) {
+        float * mask = (float *) graph.mask->data;
+
+        for (int ib = 0, i0 = 0; ib < n_batch; i0 += n_tokens[ib], ++ib) {
+            const int j0 = batch[ib].seq*n_ctx - i_kv;
+
+            for (int i = 0; i < n_tokens[ib]; ++i) {
+                float * row = mask + (size_t) (i0 + i)*graph.n_kv;
+
+                for (int j = 0; j < graph.n_kv; ++j) {
+                    row[j] = j >= j0 && j <= j0 + batch[ib].n_past + i ? 0.0f : -INFINITY;
+                }
+            }
+        }
+    }
+
+    ggml_graph_update_views(&graph.gf);
+
+    // run the computation
+    ggml_graph_compute_with_pool(graph.ctx, &graph.gf, pool);
+
+    //ggml_graph_print   (&graph.gf);
+    //ggml_graph_dump_dot(&graph.gf, NULL, "gpt-2.dot");
+
+    // return result for just the last token of each sequence
+    embd_w.resize(n_batch*n_vocab);
+
+    for (int ib = 0, i0 = 0; ib < n_batch; i0 += n_tokens[ib], ++ib) {
+        if (n_tokens[ib] > 0) {
+            memcpy(embd_w.data() + ib*n_vocab, (float *) ggml_get_data(graph.logits) + (n_vocab*(i0 + n_tokens[ib] - 1)), sizeof(float)*n_vocab);
+        }
+    }
+
+    return true;
+}
+
+// evaluate the transformer
+//
+//   - model:     the model
+//   - pool:      the worker threads to use for the computation
+//   - n_past:    the context size so far
+//   - embd_inp:  the embeddings of the tokens in the context
+//   - embd_w:    the predicted logits of the next token
+//
+bool gpt2_eval(
+        const gpt2_model & model,
+        struct ggml_threadpool * pool,
+        const int n_past,
+        const std::vector<gpt_vocab::id> & embd_inp,
+              std::vector<float>         & embd_w,
+              size_t                     & mem_per_token) {
+    return gpt2_eval_batch(model, pool, { { 0, n_past, embd_inp } }, embd_w, mem_per_token);
+}
+
@@ -0,0 +1,115 @@
+// GPT-2 model: loading, graph and evaluation
+//
+// shared by the gpt-2 example and ggml-bench, so that the benchmark measures the same graph as the example
+
+#pragma once
+
+#include "ggml/ggml.h"
+
+#include "utils.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// default hparams (GPT-2 117M)
+struct gpt2_hparams {
+    int32_t n_vocab = 50257;
+    int32_t n_ctx   = 1024;
+    int32_t n_embd  = 768;
+    int32_t n_head  = 12;
+    int32_t n_layer = 12;
+    int32_t f16     = 1;
+};
+
+struct gpt2_layer {
+    // normalization
+    struct ggml_tensor * ln_1_g;
+    struct ggml_tensor * ln_1_b;
+
+    struct ggml_tensor * ln_2_g;
+    struct ggml_tensor * ln_2_b;
+
+    // attention
+    struct ggml_tensor * c_attn_attn_w;
+    struct ggml_tensor * c_attn_attn_b;
+
+    struct ggml_tensor * c_attn_proj_w;
+    struct ggml_tensor * c_attn_proj_b;
+
+    // mlp
+    struct ggml_tensor * c_mlp_fc_w;
+    struct ggml_tensor * c_mlp_fc_b;
+
+    struct ggml_tensor * c_mlp_proj_w_trans; // transposed for efficiency
+    struct ggml_tensor * c_mlp_proj_b;
+};
+
+struct gpt2_model {
+    gpt2_hparams hparams;
+
+    // normalization
+    struct ggml_tensor * ln_f_g;
+    struct ggml_tensor * ln_f_b;
+
+    struct ggml_tensor * wte; // position embedding
+    struct ggml_tensor * wpe; //    token embedding
+
+    std::vector<gpt2_layer> layers;
+
+    // key + value memory, stored per head so that the attention reads it without permutes (see gpt2_view_k/v)
+    // it holds n_seq independent sequences of up to n_ctx tokens
+    struct ggml_tensor * memory_k;
+    struct ggml_tensor * memory_v;
+
+    int n_seq = 1;
+
+    //
+    struct ggml_context * ctx = nullptr;
+    std::map<std::string, struct ggml_tensor *> tensors;
+
+    // the model file, if the weights are used in place from a memory mapping of it
+    gpt_mmap mm;
+
+    // identifies the weights in the key + value memory snapshots (see gpt_model_id)
+    uint64_t id = 0;
+};
+
+// the tokens of one sequence in a batch (see gpt2_eval_batch)
+struct gpt2_seq_tokens {
+    int seq;    // the slot of the sequence in the key + value memory
+    int n_past; // the number of tokens of the sequence that are already in the memory
+
+    std::vector<gpt_vocab::id> tokens;
+};
+
+// the types of the keys and values in the key + value memory for the requested type
+ggml_type gpt2_kv_type_k(ggml_type kv_type);
+ggml_type gpt2_kv_type_v(ggml_type kv_type);
+
+// offsets of the keys / values of position i of the first head of layer il in the key + value memory
+size_t gpt2_offs_k(const gpt2_model & model, int il, int i);
+size_t gpt2_offs_v(const gpt2_model & model, int il, int i);
+
+// create the tensors of a model with the hparams in model.hparams, and its key + value memory
+bool gpt2_model_init(gpt2_model & model, ggml_type wtype, ggml_type kv_type, int n_seq, bool no_alloc);
+
+// load the model's weights from a file
+bool gpt2_model_load(const std::string & fname, gpt2_model & model, gpt_vocab & vocab, ggml_type qtype, ggml_type kv_type, int n_seq, bool use_mmap);
+
+// evaluate the transformer on a batch of tokens from independent sequences in one graph
+bool gpt2_eval_batch(
+        const gpt2_model & model,
+        struct ggml_threadpool * pool,
+        const std::vector<gpt2_seq_tokens> & batch,
+              std::vector<float>           & embd_w,
+              size_t                       & mem_per_token);
+
+// evaluate the transformer on the tokens of a single sequence
+bool gpt2_eval(
+        const gpt2_model & model,
+        struct ggml_threadpool * pool,
+        const int n_past,
+        const std::vector<gpt_vocab::id> & embd_inp,
+              std::vector<float>         & embd_w,
+              size_t                     & mem_per_token);
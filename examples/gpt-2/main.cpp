@@ -1,658 +1,261 @@
 #include "ggml/ggml.h"
 
+#include "gpt-2.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
-#include <fstream>
 #include <map>
 #include <string>
 #include <vector>
 
-// default hparams (GPT-2 117M)
-struct gpt2_hparams {
-    int32_t n_vocab = 50257;
-    int32_t n_ctx   = 1024;
-    int32_t n_embd  = 768;
-    int32_t n_head  = 12;
-    int32_t n_layer = 12;
-    int32_t f16     = 1;
-};
-
-struct gpt2_layer {
-    // normalization
-    struct ggml_tensor * ln_1_g;
-    struct ggml_tensor * ln_1_b;
-
-    struct ggml_tensor * ln_2_g;
-    struct ggml_tensor * ln_2_b;
-
-    // attention
-    struct ggml_tensor * c_attn_attn_w;
-    struct ggml_tensor * c_attn_attn_b;
-
-    struct ggml_tensor * c_attn_proj_w;
-    struct ggml_tensor * c_attn_proj_b;
-
-    // mlp
-    struct ggml_tensor * c_mlp_fc_w;
-    struct ggml_tensor * c_mlp_fc_b;
-
-    struct ggml_tensor * c_mlp_proj_w_trans; // transposed for efficiency
-    struct ggml_tensor * c_mlp_proj_b;
-};
+// a snapshot of n positions of the key + value memory holds, for each layer and head, the keys of the n positions, then
+// for each layer, head and dimension, the values of the n positions
+size_t gpt2_kv_size(const gpt2_model & model, int n) {
+    const auto & hparams = model.hparams;
 
-struct gpt2_model {
-    gpt2_hparams hparams;
+    const size_t nb_k = ggml_type_size(model.memory_k->type)*(hparams.n_embd/hparams.n_head)/ggml_blck_size(model.memory_k->type);
+    const size_t nb_v = ggml_type_size(model.memory_v->type);
 
-    // normalization
-    struct ggml_tensor * ln_f_g;
-    struct ggml_tensor * ln_f_b;
+    return (size_t) n*hparams.n_layer*(hparams.n_head*nb_k + hparams.n_embd*nb_v);
+}
 
-    struct ggml_tensor * wte; // position embedding
-    struct ggml_tensor * wpe; //    token embedding
+// copy or restore the first n positions of the slot of sequence seq, from / to a snapshot of n_snap positions
+static void gpt2_kv_copy(const gpt2_model & model, int seq, uint8_t * snap, int n_snap, int n, bool save) {
+    const auto & hparams = model.hparams;
 
-    std::vector<gpt2_layer> layers;
+    const int n_layer = hparams.n_layer;
+    const int n_embd  = hparams.n_embd;
+    const int n_head  = hparams.n_head;
+    const int n_ctx   = hparams.n_ctx;
 
-    // key + value memory
-    struct ggml_tensor * memory_k;
-    struct ggml_tensor * memory_v;
+    const size_t nb_k = ggml_type_size(model.memory_k->type)*(n_embd/n_head)/ggml_blck_size(model.memory_k->type);
+    const size_t nb_v = ggml_type_size(model.memory_v->type);
 
-    //
-    struct ggml_context * ctx;
-    std::map<std::string, struct ggml_tensor *> tensors;
-};
+    // distance between the rows of consecutive heads / dimensions in the memory
+    const size_t nb_slot_k = nb_k*model.n_seq*n_ctx;
+    const size_t nb_slot_v = nb_v*model.n_seq*n_ctx;
 
-// load the model's weights from a file
-bool gpt2_model_load(const std::string & fname, gpt2_model & model, gpt_vocab & vocab) {
-    printf("%s: loading model from '%s'\n", __func__, fname.c_str());
+    uint8_t * mem_k = (uint8_t *) model.memory_k->data;
+    uint8_t * mem_v = (uint8_t *) model.memory_v->data;
 
-    auto fin = std::ifstream(fname, std::ios::binary);
-    if (!fin) {
-        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
-        return false;
-    }
+    for (int il = 0; il < n_layer; ++il) {
+        for (int h = 0; h < n_head; ++h) {
+            uint8_t * src = mem_k + gpt2_offs_k(model, il, seq*n_ctx) + h*nb_slot_k;
+            uint8_t * dst = snap + (size_t) (il*n_head + h)*n_snap*nb_k;
 
-    // verify magic
-    {
-        uint32_t magic;
-        fin.read((char *) &magic, sizeof(magic));
-        if (magic != 0x67676d6c) {
-            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname.c_str());
-            return false;
+            save ? memcpy(dst, src, n*nb_k) : memcpy(src, dst, n*nb_k);
         }
     }
 
-    // load hparams
-    {
-        auto & hparams = model.hparams;
-
-        fin.read((char *) &hparams.n_vocab, sizeof(hparams.n_vocab));
-        fin.read((char *) &hparams.n_ctx,   sizeof(hparams.n_ctx));
-        fin.read((char *) &hparams.n_embd,  sizeof(hparams.n_embd));
-        fin.read((char *) &hparams.n_head,  sizeof(hparams.n_head));
-        fin.read((char *) &hparams.n_layer, sizeof(hparams.n_layer));
-        fin.read((char *) &hparams.f16,     sizeof(hparams.f16));
-
-        printf("%s: n_vocab = %d\n", __func__, hparams.n_vocab);
-        printf("%s: n_ctx   = %d\n", __func__, hparams.n_ctx);
-        printf("%s: n_embd  = %d\n", __func__, hparams.n_embd);
-        printf("%s: n_head  = %d\n", __func__, hparams.n_head);
-        printf("%s: n_layer = %d\n", __func__, hparams.n_layer);
-        printf("%s: f16     = %d\n", __func__, hparams.f16);
-    }
-
-    // load vocab
-    {
-        int32_t n_vocab = 0;
-        fin.read((char *) &n_vocab, sizeof(n_vocab));
-
-        if (n_vocab != model.hparams.n_vocab) {
-            fprintf(stderr, "%s: invalid model file '%s' (bad vocab size %d != %d)\n",
-                    __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
-            return false;
-        }
-
-        std::string word;
-        for (int i = 0; i < n_vocab; i++) {
-            uint32_t len;
-            fin.read((char *) &len, sizeof(len));
+    snap += (size_t) n_snap*n_layer*n_head*nb_k;
 
-            word.resize(len);
-            fin.read((char *) word.data(), len);
+    for (int il = 0; il < n_layer; ++il) {
+        for (int j = 0; j < n_embd; ++j) {
+            uint8_t * src = mem_v + gpt2_offs_v(model, il, seq*n_ctx) + j*nb_slot_v;
+            uint8_t * dst = snap + (size_t) (il*n_embd + j)*n_snap*nb_v;
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            save ? memcpy(dst, src, n*nb_v) : memcpy(src, dst, n*nb_v);
         }
     }
+}
 
-    // for the big tensors, we have the option to store the data in 16-bit floats
-    // in order to save memory and also to speed up the computation
-    const ggml_type wtype = model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
-
-    auto & ctx = model.ctx;
-
-    size_t ctx_size = 0;
-
-    {
-        const auto & hparams = model.hparams;
-
-        const int n_embd  = hparams.n_embd;
-        const int n_layer = hparams.n_layer;
-        const int n_ctx   = hparams.n_ctx;
-        const int n_vocab = hparams.n_vocab;
-
-        ctx_size += n_embd*ggml_type_size(GGML_TYPE_F32); // ln_f_g
-        ctx_size += n_embd*ggml_type_size(GGML_TYPE_F32); // ln_f_b
-
-        ctx_size += n_vocab*n_embd*ggml_type_size(wtype);         // wte
-        ctx_size +=   n_ctx*n_embd*ggml_type_size(GGML_TYPE_F32); // wpe
-
-        ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_1_g
-        ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_1_b
-
-        ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_2_g
-        ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_2_b
-
-        ctx_size += n_layer*(3*n_embd*n_embd*ggml_type_size(wtype));         // c_attn_attn_w
-        ctx_size += n_layer*(       3*n_embd*ggml_type_size(GGML_TYPE_F32)); // c_attn_attn_b
+// the description of the snapshots of the key + value memory of the model
+static gpt_kv_desc gpt2_kv_desc(const gpt2_model & model) {
+    gpt_kv_desc desc;
 
-        ctx_size += n_layer*(n_embd*n_embd*ggml_type_size(wtype));           // c_attn_proj_w
-        ctx_size += n_layer*(       n_embd*ggml_type_size(GGML_TYPE_F32));   // c_attn_proj_b
+    desc.n_layer  = model.hparams.n_layer;
+    desc.n_head   = model.hparams.n_head;
+    desc.n_embd   = model.hparams.n_embd;
+    desc.n_ctx    = model.hparams.n_ctx;
+    desc.type_k   = model.memory_k->type;
+    desc.type_v   = model.memory_v->type;
+    desc.model_id = model.id;
 
-        ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_size(wtype));         // c_mlp_fc_w
-        ctx_size += n_layer*(       4*n_embd*ggml_type_size(GGML_TYPE_F32)); // c_mlp_fc_b
+    return desc;
+}
 
-        ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_size(wtype));         // c_mlp_proj_w
-        ctx_size += n_layer*(         n_embd*ggml_type_size(GGML_TYPE_F32)); // c_mlp_proj_b
+// save the key + value memory of sequence seq, after the evaluation of the given tokens
+void gpt2_kv_save(const gpt2_model & model, int seq, const std::vector<gpt_vocab::id> & tokens, gpt_kv_snapshot & snap) {
+    const int n = tokens.size();
 
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_size(GGML_TYPE_F32); // memory_k
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_size(GGML_TYPE_F32); // memory_v
+    snap = {};
+    snap.desc   = gpt2_kv_desc(model);
+    snap.tokens = tokens;
+    snap.size   = gpt2_kv_size(model, n);
+    snap.buf.resize(snap.size);
 
-        ctx_size += (6 + 12*n_layer)*256; // object overhead
+    gpt2_kv_copy(model, seq, snap.buf.data(), n, n, true);
+}
 
-        printf("%s: ggml ctx size = %6.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
-    }
+// restore the first n positions of a snapshot into the slot of sequence seq
+bool gpt2_kv_load(const gpt2_model & model, int seq, const gpt_kv_snapshot & snap, int n) {
+    const int n_snap = snap.tokens.size();
 
-    // create the ggml context
-    {
-        struct ggml_init_params params = {
-            .mem_size   = ctx_size,
-            .mem_buffer = NULL,
-        };
-
-        model.ctx = ggml_init(params);
-        if (!model.ctx) {
-            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
-            return false;
-        }
+    if (seq < 0 || seq >= model.n_seq || n < 0 || n > n_snap || n_snap > model.hparams.n_ctx) {
+        fprintf(stderr, "%s: invalid restore of %d positions into sequence %d\n", __func__, n, seq);
+        return false;
     }
 
-    // prepare memory for the weights
-    {
-        const auto & hparams = model.hparams;
-
-        const int n_embd  = hparams.n_embd;
-        const int n_layer = hparams.n_layer;
-        const int n_ctx   = hparams.n_ctx;
-        const int n_vocab = hparams.n_vocab;
-
-        model.layers.resize(n_layer);
-
-        model.ln_f_g = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
-        model.ln_f_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
-
-        model.wte = ggml_new_tensor_2d(ctx, wtype,         n_embd, n_vocab);
-        model.wpe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_ctx);
-
-        // map by name
-        model.tensors["model/ln_f/g"] = model.ln_f_g;
-        model.tensors["model/ln_f/b"] = model.ln_f_b;
-
-        model.tensors["model/wte"] = model.wte;
-        model.tensors["model/wpe"] = model.wpe;
-
-        for (int i = 0; i < n_layer; ++i) {
-            auto & layer = model.layers[i];
-
-            layer.ln_1_g             = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
-            layer.ln_1_b             = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
-
-            layer.ln_2_g             = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
-            layer.ln_2_b             = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
-
-            layer.c_attn_attn_w      = ggml_new_tensor_2d(ctx, wtype,         3*n_embd, n_embd);
-            layer.c_attn_attn_b      = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 3*n_embd);
-
-            layer.c_attn_proj_w      = ggml_new_tensor_2d(ctx, wtype,           n_embd, n_embd);
-            layer.c_attn_proj_b      = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
-
-            layer.c_mlp_fc_w         = ggml_new_tensor_2d(ctx, wtype,         4*n_embd, n_embd);
-            layer.c_mlp_fc_b         = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_embd);
-
-            layer.c_mlp_proj_w_trans = ggml_new_tensor_2d(ctx, wtype,         4*n_embd, n_embd);
-            layer.c_mlp_proj_b       = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
-
-            // map by name
-            model.tensors["model/h" + std::to_string(i) + "/ln_1/g"]        = layer.ln_1_g;
-            model.tensors["model/h" + std::to_string(i) + "/ln_1/b"]        = layer.ln_1_b;
-
-            model.tensors["model/h" + std::to_string(i) + "/ln_2/g"]        = layer.ln_2_g;
-            model.tensors["model/h" + std::to_string(i) + "/ln_2/b"]        = layer.ln_2_b;
-
-            model.tensors["model/h" + std::to_string(i) + "/attn/c_attn/w"] = layer.c_attn_attn_w;
-            model.tensors["model/h" + std::to_string(i) + "/attn/c_attn/b"] = layer.c_attn_attn_b;
-
-            model.tensors["model/h" + std::to_string(i) + "/attn/c_proj/w"] = layer.c_attn_proj_w;
-            model.tensors["model/h" + std::to_string(i) + "/attn/c_proj/b"] = layer.c_attn_proj_b;
-
-            model.tensors["model/h" + std::to_string(i) + "/mlp/c_fc/w"]    = layer.c_mlp_fc_w;
-            model.tensors["model/h" + std::to_string(i) + "/mlp/c_fc/b"]    = layer.c_mlp_fc_b;
-
-            model.tensors["model/h" + std::to_string(i) + "/mlp/c_proj/w"]  = layer.c_mlp_proj_w_trans;
-            model.tensors["model/h" + std::to_string(i) + "/mlp/c_proj/b"]  = layer.c_mlp_proj_b;
-        }
+    if (!gpt_kv_desc_match(snap.desc, gpt2_kv_desc(model))) {
+        fprintf(stderr, "%s: the snapshot was saved from another model or key + value memory type\n", __func__);
+        return false;
     }
 
-    // key + value memory
-    {
-        const auto & hparams = model.hparams;
-
-        const int n_embd  = hparams.n_embd;
-        const int n_layer = hparams.n_layer;
-        const int n_ctx   = hparams.n_ctx;
-
-        const int n_mem      = n_layer*n_ctx;
-        const int n_elements = n_embd*n_mem;
-
-        model.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
-        model.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
-
-        const size_t memory_size = ggml_nbytes(model.memory_k) + ggml_nbytes(model.memory_v);
-
-        printf("%s: memory size = %8.2f MB, n_mem = %d\n", __func__, memory_size/1024.0/1024.0, n_mem);
+    if (snap.size != gpt2_kv_size(model, n_snap)) {
+        fprintf(stderr, "%s: the snapshot does not match the key + value memory of the model\n", __func__);
+        return false;
     }
 
-    // load weights
-    {
-        size_t total_size = 0;
-
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ftype;
-
-            fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-            fin.read(reinterpret_cast<char *>(&length), sizeof(length));
-            fin.read(reinterpret_cast<char *>(&ftype),  sizeof(ftype));
-
-            if (fin.eof()) {
-                break;
-            }
-
-            int32_t nelements = 1;
-            int32_t ne[2] = { 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
-                nelements *= ne[i];
-            }
-
-            std::string name(length, 0);
-            fin.read(&name[0], length);
+    gpt2_kv_copy(model, seq, (uint8_t *) gpt_kv_data(snap), n_snap, n, false);
 
-            if (model.tensors.find(name.data()) == model.tensors.end()) {
-                fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
-            }
-
-            auto tensor = model.tensors[name.data()];
-            if (ggml_nelements(tensor) != nelements) {
-                fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                return false;
-            }
-
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1]) {
-                fprintf(stderr, "%s: tensor '%s' has wrong shape in model file: got [%d, %d], expected [%d, %d]\n",
-                        __func__, name.data(), tensor->ne[0], tensor->ne[1], ne[0], ne[1]);
-                return false;
-            }
-
-            const size_t bpe = (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
+    return true;
+}
 
-            if (nelements*bpe != ggml_nbytes(tensor)) {
-                fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
-            }
+// restore the longest prefix of tokens found in the cache into the slot of sequence seq and return its length
+// the last token is always left to evaluate, since its logits are needed to predict the next one
+int gpt2_prefix_cache_restore(const gpt2_model & model, int seq, gpt_prefix_cache & cache, const std::vector<gpt_vocab::id> & tokens) {
+    int n_match = 0;
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+    const gpt_kv_snapshot * snap = gpt_prefix_cache_find(cache, tokens, n_match);
 
-            //printf("%24s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
-            total_size += ggml_nbytes(tensor);
-        }
+    n_match = std::min(n_match, (int) tokens.size() - 1);
 
-        printf("%s: model size  = %8.2f MB\n", __func__, total_size/1024.0/1024.0);
+    if (snap == nullptr || n_match <= 0 || !gpt2_kv_load(model, seq, *snap, n_match)) {
+        return 0;
     }
 
-    fin.close();
-
-    return true;
+    return n_match;
 }
 
-// evaluate the transformer
+// generate n_seq continuations of the prompt, with the tokens of all the sequences evaluated in the same batches
 //
-//   - model:     the model
-//   - n_threads: number of threads to use
-//   - n_past:    the context size so far
-//   - embd_inp:  the embeddings of the tokens in the context
-//   - embd_w:    the predicted probabilities of the next token
+//   - n_prefix: the number of tokens of the prompt already in the slot of each sequence
+//   - n_eval:   the number of tokens evaluated for all the sequences
 //
-bool gpt2_eval(
+bool gpt2_generate_parallel(
         const gpt2_model & model,
-        const int n_threads,
-        const int n_past,
+        const gpt_vocab & vocab,
+        struct ggml_threadpool * pool,
+        const gpt_params & params,
         const std::vector<gpt_vocab::id> & embd_inp,
-              std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
-    const int N = embd_inp.size();
+              int            n_prefix,
+              std::mt19937 & rng,
+              size_t       & mem_per_token,
+              int64_t      & t_sample_us,
+              int64_t      & t_predict_us,
+              int          & n_eval) {
+    const int n_seq   = params.n_seq;
+    const int n_vocab = model.hparams.n_vocab;
+
+    std::vector<gpt2_seq_tokens> batch(n_seq);
+    for (int s = 0; s < n_seq; ++s) {
+        batch[s].seq    = s;
+        batch[s].n_past = n_prefix;
+    }
 
-    const auto & hparams = model.hparams;
+    std::vector<std::string> text(n_seq);
 
-    const int n_embd  = hparams.n_embd;
-    const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
-    const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
+    std::vector<float> embd_w;
+
+    gpt_sampler sampler;
+    sampler.top_k = params.top_k;
+    sampler.top_p = params.top_p;
+    sampler.temp  = params.temp;
 
-    static size_t buf_size = 256u*1024*1024;
-    static void * buf = malloc(buf_size);
+    std::vector<gpt_vocab::id> ids(n_seq);
 
-    if (mem_per_token > 0 && mem_per_token*N > buf_size) {
-        const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        //printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, buf_size, buf_size_new);
+    auto eval = [&]() {
+        const int64_t t_start_us = ggml_time_us();
 
-        // reallocate
-        buf_size = buf_size_new;
-        buf = realloc(buf, buf_size);
-        if (buf == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, buf_size);
+        if (!gpt2_eval_batch(model, pool, batch, embd_w, mem_per_token)) {
             return false;
         }
-    }
-
-    struct ggml_init_params params = {
-        .mem_size   = buf_size,
-        .mem_buffer = buf,
-    };
 
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf = { .n_threads = n_threads };
+        for (auto & st : batch) {
+            st.n_past += st.tokens.size();
+            n_eval    += st.tokens.size();
+        }
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+        t_predict_us += ggml_time_us() - t_start_us;
 
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
-    }
+        return true;
+    };
 
-    // wte + wpe
-    struct ggml_tensor * inpL =
-        ggml_add(ctx0,
-                ggml_get_rows(ctx0, model.wte, embd),
-                ggml_get_rows(ctx0, model.wpe, position));
+    // the prompt is the same for all the sequences, but each of them needs it in its own slot
+    for (size_t i0 = n_prefix; i0 < embd_inp.size(); i0 += params.n_batch) {
+        const size_t i1 = std::min(embd_inp.size(), i0 + params.n_batch);
 
-    for (int il = 0; il < n_layer; ++il) {
-        struct ggml_tensor * cur;
+        for (auto & st : batch) {
+            st.tokens.assign(embd_inp.begin() + i0, embd_inp.begin() + i1);
+        }
 
-        // norm
-        {
-            // [ 768, N]
-            cur = ggml_norm(ctx0, inpL);
-
-            // cur = ln_1_g*cur + ln_1_b
-            // [ 768, N]
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.layers[il].ln_1_g, cur),
-                        cur),
-                    ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
+        if (!eval()) {
+            return false;
         }
+    }
 
-        // attn
-        // [2304, 768] - model.layers[il].c_attn_attn_w
-        // [2304,   1] - model.layers[il].c_attn_attn_b
-        // [ 768,   N] - cur (in)
-        // [2304,   N] - cur (out)
-        //
-        // cur = attn_w*cur + attn_b
-        // [2304, N]
+    for (int i = 0; i < params.n_predict; ++i) {
+        // sample the next token of each sequence
         {
-            cur = ggml_mul_mat(ctx0,
-                    ggml_transpose(ctx0, model.layers[il].c_attn_attn_w),
-                    cur);
+            const int64_t t_start_sample_us = ggml_time_us();
 
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].c_attn_attn_b, cur),
-                    cur);
-        }
+            gpt_sampler_sample_batch(sampler, embd_w.data(), n_vocab, batch.size(), rng, ids.data());
 
-        // self-attention
-        {
-            struct ggml_tensor * Qcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 0*sizeof(float)*n_embd);
-            struct ggml_tensor * Kcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 1*sizeof(float)*n_embd);
-            struct ggml_tensor * Vcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 2*sizeof(float)*n_embd);
+            for (size_t ib = 0; ib < batch.size(); ++ib) {
+                const gpt_vocab::id id = ids[ib];
 
-            // store key and value to memory
-            if (N >= 1) {
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.memory_k, N*n_embd, (ggml_element_size(model.memory_k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctx0, model.memory_v, N*n_embd, (ggml_element_size(model.memory_v)*n_embd)*(il*n_ctx + n_past));
+                batch[ib].tokens = { id };
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                text[batch[ib].seq] += vocab.id_to_token.at(id);
             }
 
-            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-            // [64, N, 12]
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
-                        0, 2, 1, 3);
-
-            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
-            // [64, n_past + N, 12]
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.memory_k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.memory_k)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
-
-            // GG: flash attention
-            //struct ggml_tensor * V =
-            //    ggml_cpy(ctx0,
-            //            ggml_permute(ctx0,
-            //                ggml_reshape_3d(ctx0,
-            //                    ggml_view_1d(ctx0, model.memory_v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.memory_v)*n_embd),
-            //                    n_embd/n_head, n_head, n_past + N),
-            //                1, 2, 0, 3),
-            //            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_past + N, n_embd/n_head, n_head));
-
-            //struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, true);
-
-            // K * Q
-            // [n_past + N, N, 12]
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            // [n_past + N, N, 12]
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0,
-                        KQ,
-                        ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
-                        );
-
-            // KQ_masked = mask_past(KQ_scaled)
-            // [n_past + N, N, 12]
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            // [n_past + N, N, 12]
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
-            // [n_past + N, 64, 12]
-            struct ggml_tensor * V_trans =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.memory_v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.memory_v)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
-                        1, 2, 0, 3);
-
-            // KQV = transpose(V) * KQ_soft_max
-            // [64, N, 12]
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            // [64, 12, N]
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            // [768, N]
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+            t_sample_us += ggml_time_us() - t_start_sample_us;
         }
 
-        // projection
-        // [ 768, 768] - model.layers[il].c_attn_proj_w
-        // [ 768,   1] - model.layers[il].c_attn_proj_b
-        // [ 768,   N] - cur (in)
-        // [ 768,   N] - cur (out)
-        //
-        // cur = proj_w*cur + proj_b
-        // [768, N]
-        {
-            cur = ggml_mul_mat(ctx0,
-                    ggml_transpose(ctx0, model.layers[il].c_attn_proj_w),
-                    cur);
+        // the sequences that reach the end of text token leave the batch
+        batch.erase(std::remove_if(batch.begin(), batch.end(), [](const gpt2_seq_tokens & st) {
+            return st.tokens[0] == 50256;
+        }), batch.end());
 
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].c_attn_proj_b, cur),
-                    cur);
+        if (batch.empty() || i == params.n_predict - 1) {
+            break;
         }
 
-        // add the input
-        cur = ggml_add(ctx0, cur, inpL);
-
-        struct ggml_tensor * inpFF = cur;
-
-        // feed-forward network
-        {
-            // norm
-            {
-                cur = ggml_norm(ctx0, inpFF);
-
-                // cur = ln_2_g*cur + ln_2_b
-                // [ 768, N]
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            ggml_repeat(ctx0, model.layers[il].ln_2_g, cur),
-                            cur),
-                        ggml_repeat(ctx0, model.layers[il].ln_2_b, cur));
-            }
-
-            // fully connected
-            // [3072, 768] - model.layers[il].c_mlp_fc_w
-            // [3072,   1] - model.layers[il].c_mlp_fc_b
-            // [ 768,   N] - cur (in)
-            // [3072,   N] - cur (out)
-            //
-            // cur = fc_w*cur + fc_b
-            // [3072, N]
-            cur = ggml_mul_mat(ctx0,
-                    ggml_transpose(ctx0, model.layers[il].c_mlp_fc_w),
-                    cur);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].c_mlp_fc_b, cur),
-                    cur);
-
-            // GELU activation
-            // [3072, N]
-            cur = ggml_gelu(ctx0, cur);
-
-            // projection
-            // [ 768, 3072] - model.layers[il].c_mlp_proj_w
-            // [ 768,    1] - model.layers[il].c_mlp_proj_b
-            // [3072,    N] - cur (in)
-            // [ 768,    N] - cur (out)
-            //
-            // cur = proj_w*cur + proj_b
-            // [768, N]
-            cur = ggml_mul_mat(ctx0,
-                    model.layers[il].c_mlp_proj_w_trans,
-                    cur);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].c_mlp_proj_b, cur),
-                    cur);
+        if (!eval()) {
+            return false;
         }
-
-        // input for next layer
-        inpL = ggml_add(ctx0, cur, inpFF);
     }
 
-    // norm
-    {
-        // [ 768, N]
-        inpL = ggml_norm(ctx0, inpL);
-
-        // inpL = ln_f_g*inpL + ln_f_b
-        // [ 768, N]
-        inpL = ggml_add(ctx0,
-                ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.ln_f_g, inpL),
-                    inpL),
-                ggml_repeat(ctx0, model.ln_f_b, inpL));
+    for (int s = 0; s < n_seq; ++s) {
+        printf("sequence %d: %s%s\n\n", s, params.prompt.c_str(), text[s].c_str());
     }
 
-    // inpL = WTE * inpL
-    // [ 768, 50257] - model.wte
-    // [ 768, N]     - inpL
-    inpL = ggml_mul_mat(ctx0, model.wte, inpL);
-
-    // logits -> probs
-    inpL = ggml_soft_max(ctx0, inpL);
-
-    // run the computation
-    ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute       (ctx0, &gf);
+    return true;
+}
 
-    //if (n_past%100 == 0) {
-    //    ggml_graph_print   (&gf);
-    //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
-    //}
+// place the weights on the NUMA nodes of the threads that read them: the rows of a matrix that is src0 of a
+// ggml_mul_mat() on the nodes of the threads that compute them, the other tensors and the key + value memory
+// interleaved over the nodes - false if some of the pages could not be moved
+bool gpt2_numa_place(const gpt2_model & model, const struct ggml_threadpool * pool) {
+    bool ok = true;
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+    for (const auto & it : model.tensors) {
+        struct ggml_tensor * t = it.second;
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+        // the quantized weights and the token embedding are multiplied untransposed (see gpt2_mul_mat_t)
+        const bool rows = t->n_dims == 2 && (ggml_is_quantized(t->type) || t == model.wte);
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
+        ok = ggml_numa_place(pool, t, rows ? GGML_NUMA_ROWS : GGML_NUMA_INTERLEAVE) && ok;
     }
-    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
-    ggml_free(ctx0);
+    ok = ggml_numa_place(pool, model.memory_k, GGML_NUMA_INTERLEAVE) && ok;
+    ok = ggml_numa_place(pool, model.memory_v, GGML_NUMA_INTERLEAVE) && ok;
 
-    return true;
+    return ok;
 }
 
 int main(int argc, char ** argv) {
@@ -681,11 +284,41 @@ int main(int argc, char ** argv) {
     gpt_vocab vocab;
     gpt2_model model;
 
+    ggml_type qtype = GGML_TYPE_COUNT;
+    if (params.quantize == "q4_0") {
+        qtype = GGML_TYPE_Q4_0;
+    } else if (params.quantize == "q8_0") {
+        qtype = GGML_TYPE_Q8_0;
+    } else if (!params.quantize.empty()) {
+        fprintf(stderr, "%s: unknown quantization type '%s'\n", __func__, params.quantize.c_str());
+        return 1;
+    }
+
+    ggml_type kv_type = GGML_TYPE_F16;
+    if (params.kv_type == "f32") {
+        kv_type = GGML_TYPE_F32;
+    } else if (params.kv_type == "q8_0") {
+        kv_type = GGML_TYPE_Q8_0;
+    } else if (params.kv_type != "f16") {
+        fprintf(stderr, "%s: unknown key / value memory type '%s'\n", __func__, params.kv_type.c_str());
+        return 1;
+    }
+
+    if (params.n_seq < 1) {
+        fprintf(stderr, "%s: invalid number of sequences %d\n", __func__, params.n_seq);
+        return 1;
+    }
+
+    // the pages of a memory mapping of the model file cannot be placed on the nodes
+    if (params.numa) {
+        params.use_mmap = false;
+    }
+
     // load the model
     {
         const int64_t t_start_us = ggml_time_us();
 
-        if (!gpt2_model_load(params.model, model, vocab)) {
+        if (!gpt2_model_load(params.model, model, vocab, qtype, kv_type, params.n_seq, params.use_mmap)) {
             fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
             return 1;
         }
@@ -700,6 +333,11 @@ int main(int argc, char ** argv) {
 
     std::vector<float> embd_w;
 
+    gpt_sampler sampler;
+    sampler.top_k = params.top_k;
+    sampler.top_p = params.top_p;
+    sampler.temp  = params.temp;
+
     // tokenize the prompt
     std::vector<gpt_vocab::id> embd_inp = ::gpt_tokenize(vocab, params.prompt);
 
@@ -714,64 +352,138 @@ int main(int argc, char ** argv) {
 
     // determine the required inference memory per token:
     size_t mem_per_token = 0;
-    gpt2_eval(model, params.n_threads, 0, { 0, 1, 2, 3 }, embd_w, mem_per_token);
 
-    for (int i = embd.size(); i < embd_inp.size() + params.n_predict; i++) {
-        // predict
-        if (embd.size() > 0) {
-            const int64_t t_start_us = ggml_time_us();
+    if (params.tune_threads) {
+        params.n_threads = gpt_tune_n_threads(params.n_threads, params.numa, [&](struct ggml_threadpool * pool) {
+            return gpt2_eval(model, pool, 0, { 0, 1, 2, 3 }, embd_w, mem_per_token);
+        });
 
-            if (!gpt2_eval(model, params.n_threads, n_past, embd, embd_w, mem_per_token)) {
-                printf("Failed to predict\n");
-                return 1;
-            }
+        printf("%s: using %d threads\n", __func__, params.n_threads);
+    }
+
+    // the worker threads are reused for every evaluated token
+    struct ggml_threadpool * pool = ggml_threadpool_new(params.n_threads);
+
+    if (params.numa) {
+        if (!ggml_threadpool_set_affinity(pool)) {
+            fprintf(stderr, "%s: failed to pin the threads to the NUMA nodes\n", __func__);
+        }
+
+        if (!gpt2_numa_place(model, pool)) {
+            fprintf(stderr, "%s: failed to place the weights on the NUMA nodes\n", __func__);
+        }
+
+        printf("%s: %d threads on %d NUMA nodes\n", __func__, params.n_threads, ggml_numa_n_nodes());
+    }
+
+    gpt2_eval(model, pool, 0, { 0, 1, 2, 3 }, embd_w, mem_per_token);
 
-            t_predict_us += ggml_time_us() - t_start_us;
+    // reuse the key + value memory of the longest prefix of the prompt that was saved before
+    gpt_prefix_cache cache;
+
+    int n_prefix = 0;
+
+    if (!params.prompt_cache.empty()) {
+        const int64_t t_start_us = ggml_time_us();
+
+        gpt_kv_snapshot snap;
+        if (gpt_kv_snapshot_read(params.prompt_cache, snap)) {
+            gpt_prefix_cache_add(cache, std::move(snap));
+        }
+
+        for (int s = 0; s < params.n_seq; ++s) {
+            n_prefix = gpt2_prefix_cache_restore(model, s, cache, embd_inp);
         }
 
-        n_past += embd.size();
-        embd.clear();
+        printf("%s: reused %d tokens of the prompt from '%s' in %.2f ms\n", __func__, n_prefix, params.prompt_cache.c_str(), (ggml_time_us() - t_start_us)/1000.0f);
+        printf("\n");
+    }
 
-        if (i >= embd_inp.size()) {
-            // sample next token
-            const int   top_k = params.top_k;
-            const float top_p = params.top_p;
-            const float temp  = params.temp;
+    // profile the evaluation of the prompt and of the predicted tokens
+    struct ggml_profiler * prof = NULL;
+    if (!params.profile.empty()) {
+        prof = ggml_profiler_new();
+        ggml_profiler_set_active(prof);
+    }
 
-            const int n_vocab = model.hparams.n_vocab;
+    if (params.n_seq > 1) {
+        if (!gpt2_generate_parallel(model, vocab, pool, params, embd_inp, n_prefix, rng, mem_per_token, t_sample_us, t_predict_us, n_past)) {
+            printf("Failed to predict\n");
+            return 1;
+        }
+    } else {
+        n_past = n_prefix;
 
-            gpt_vocab::id id = 0;
+        for (int k = 0; k < n_prefix; k++) {
+            printf("%s", vocab.id_to_token[embd_inp[k]].c_str());
+        }
 
-            {
-                const int64_t t_start_sample_us = ggml_time_us();
+        for (int i = n_prefix; i < embd_inp.size() + params.n_predict; i++) {
+            // predict
+            if (embd.size() > 0) {
+                const int64_t t_start_us = ggml_time_us();
 
-                id = gpt_sample_top_k_top_p(vocab, embd_w.data() + (embd_w.size() - n_vocab), top_k, top_p, temp, rng);
+                if (!gpt2_eval(model, pool, n_past, embd, embd_w, mem_per_token)) {
+                    printf("Failed to predict\n");
+                    return 1;
+                }
 
-                t_sample_us += ggml_time_us() - t_start_sample_us;
+                t_predict_us += ggml_time_us() - t_start_us;
             }
 
-            // add it to the context
-            embd.push_back(id);
-        } else {
-            // if here, it means we are still processing the input prompt
-            for (int k = i; k < embd_inp.size(); k++) {
-                embd.push_back(embd_inp[k]);
-                if (embd.size() > params.n_batch) {
-                    break;
+            n_past += embd.size();
+            embd.clear();
+
+            if (i >= embd_inp.size()) {
+                // sample next token
+                const int n_vocab = model.hparams.n_vocab;
+
+                gpt_vocab::id id = 0;
+
+                {
+                    const int64_t t_start_sample_us = ggml_time_us();
+
+                    id = gpt_sampler_sample(sampler, embd_w.data() + (embd_w.size() - n_vocab), n_vocab, rng);
+
+                    t_sample_us += ggml_time_us() - t_start_sample_us;
+                }
+
+                // add it to the context
+                embd.push_back(id);
+            } else {
+                // if here, it means we are still processing the input prompt
+                for (int k = i; k < embd_inp.size(); k++) {
+                    embd.push_back(embd_inp[k]);
+                    if (embd.size() > params.n_batch) {
+                        break;
+                    }
                 }
+                i += embd.size() - 1;
             }
-            i += embd.size() - 1;
-        }
 
-        // display text
-        for (auto id : embd) {
-            printf("%s", vocab.id_to_token[id].c_str());
+            // display text
+            for (auto id : embd) {
+                printf("%s", vocab.id_to_token[id].c_str());
+            }
+            fflush(stdout);
+
+            // end of text token
+            if (embd.back() == 50256) {
+                break;
+            }
         }
-        fflush(stdout);
+    }
 
-        // end of text token
-        if (embd.back() == 50256) {
-            break;
+    // the snapshot file may be mapped by the cache
+    gpt_prefix_cache_free(cache);
+
+    // the positions of the prompt in the first slot are not changed by the generation
+    if (!params.prompt_cache.empty() && n_prefix < (int) embd_inp.size() - 1) {
+        gpt_kv_snapshot snap;
+        gpt2_kv_save(model, 0, embd_inp, snap);
+
+        if (!gpt_kv_snapshot_write(params.prompt_cache, snap)) {
+            fprintf(stderr, "%s: failed to save the prompt to '%s'\n", __func__, params.prompt_cache.c_str());
         }
     }
 
@@ -787,7 +499,22 @@ int main(int argc, char ** argv) {
         printf("%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
     }
 
+    if (prof) {
+        ggml_profiler_set_active(NULL);
+        ggml_profiler_print(prof);
+
+        if (!ggml_profiler_write_trace(prof, params.profile.c_str())) {
+            fprintf(stderr, "%s: failed to write the trace to '%s'\n", __func__, params.profile.c_str());
+        }
+
+        ggml_profiler_free(prof);
+    }
+
+    ggml_threadpool_free(pool);
+
     ggml_free(model.ctx);
 
+    gpt_mmap_close(model.mm);
+
     return 0;
 }
@@ -8,6 +8,7 @@
 #   - Name length (int)
 #   - Dimensions (int[n_dims])
 #   - Name (char[name_length])
+#   - Padding (zero bytes up to the next multiple of 32 bytes from the beginning of the file)
 #   - Data (float[n_dims])
 #
 # By default, the bigger matrices are converted to 16-bit floats.
@@ -78,7 +79,7 @@ list_vars = model.state_dict()
 
 fout = open(fname_out, "wb")
 
-fout.write(struct.pack("i", 0x67676d6c)) # magic: ggml in hex
+fout.write(struct.pack("i", 0x67676a74)) # magic: ggjt in hex - ggml with aligned tensor data
 fout.write(struct.pack("i", hparams["vocab_size"]))
 fout.write(struct.pack("i", hparams["n_positions"]))
 fout.write(struct.pack("i", hparams["n_embd"]))
@@ -141,6 +142,9 @@ for name in list_vars.keys():
         fout.write(struct.pack("i", data.shape[n_dims - 1 - i]))
     fout.write(str);
 
+    # pad the data to a multiple of 32 bytes from the beginning of the file, so it can be used from a memory mapping
+    fout.write(b"\0" * (-fout.tell() % 32))
+
     # data
     data.tofile(fout)
 
@@ -8,6 +8,7 @@
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -56,17 +57,118 @@ struct gptj_model {
 
     std::vector<gptj_layer> layers;
 
-    // key + value memory
+    // key + value memory, stored per head so that the attention reads it without permutes (see gptj_view_k/v)
     struct ggml_tensor * memory_k;
     struct ggml_tensor * memory_v;
 
     //
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
+
+    // the model file, if the weights are used in place from a memory mapping of it
+    gpt_mmap mm;
+
+    // identifies the weights in the key + value memory snapshots (see gpt_model_id)
+    uint64_t id = 0;
 };
 
+// the key + value memory of each layer holds the keys and values of each head in contiguous rows:
+//
+//   keys:   [n_embd/n_head, n_ctx, n_head]
+//   values: [n_ctx, n_embd/n_head, n_head] - transposed, so that they multiply the attention weights directly
+//
+// the keys can be block-quantized, since each token writes whole rows of them. each token writes a column of the
+// values, so they are kept in f16 when the keys are quantized
+ggml_type gptj_kv_type_k(ggml_type kv_type) {
+    return kv_type;
+}
+
+ggml_type gptj_kv_type_v(ggml_type kv_type) {
+    return ggml_is_quantized(kv_type) ? GGML_TYPE_F16 : kv_type;
+}
+
+// offset of the key of position i of the first head of layer il
+size_t gptj_offs_k(const gptj_model & model, int il, int i) {
+    const auto & hparams = model.hparams;
+
+    const size_t nb_k = ggml_type_size(model.memory_k->type)*(hparams.n_embd/hparams.n_head)/ggml_blck_size(model.memory_k->type);
+
+    return nb_k*((size_t) il*hparams.n_ctx*hparams.n_head + i);
+}
+
+// offset of the values of position i of the first head of layer il
+size_t gptj_offs_v(const gptj_model & model, int il, int i) {
+    const auto & hparams = model.hparams;
+
+    return ggml_type_size(model.memory_v->type)*((size_t) il*hparams.n_ctx*hparams.n_embd + i);
+}
+
+// the keys of layer il for the positions [i0, i0 + n)
+// [n_embd/n_head, n, n_head]
+struct ggml_tensor * gptj_view_k(struct ggml_context * ctx0, const gptj_model & model, int il, int i0, int n) {
+    const auto & hparams = model.hparams;
+
+    const size_t nb_k = ggml_type_size(model.memory_k->type)*(hparams.n_embd/hparams.n_head)/ggml_blck_size(model.memory_k->type);
+
+    return ggml_view_3d(ctx0, model.memory_k,
+            hparams.n_embd/hparams.n_head, n, hparams.n_head,
+            nb_k, nb_k*hparams.n_ctx,
+            gptj_offs_k(model, il, i0));
+}
+
+// the values of layer il for the positions [i0, i0 + n)
+// [n, n_embd/n_head, n_head]
+struct ggml_tensor * gptj_view_v(struct ggml_context * ctx0, const gptj_model & model, int il, int i0, int n) {
+    const auto & hparams = model.hparams;
+
+    const size_t nb_v = ggml_type_size(model.memory_v->type);
+
+    return ggml_view_3d(ctx0, model.memory_v,
+            n, hparams.n_embd/hparams.n_head, hparams.n_head,
+            nb_v*hparams.n_ctx, nb_v*hparams.n_ctx*(hparams.n_embd/hparams.n_head),
+            gptj_offs_v(model, il, i0));
+}
+
+// read a tensor stored as f32 or f16 in the model file and quantize it into the given tensor
+// if transpose is true, the tensor holds the transpose of the data in the file
+void gptj_read_quantized(std::ifstream & fin, int32_t ftype, struct ggml_tensor * tensor, bool transpose) {
+    const int n0 = transpose ? tensor->ne[1] : tensor->ne[0]; // row length in the file
+    const int n1 = transpose ? tensor->ne[0] : tensor->ne[1];
+    const int n  = n0*n1;
+
+    std::vector<float> data(n);
+
+    if (ftype == 0) {
+        fin.read(reinterpret_cast<char *>(data.data()), n*sizeof(float));
+    } else {
+        std::vector<ggml_fp16_t> tmp(n);
+        fin.read(reinterpret_cast<char *>(tmp.data()), n*sizeof(ggml_fp16_t));
+
+        for (int i = 0; i < n; ++i) {
+            data[i] = ggml_fp16_to_fp32(tmp[i]);
+        }
+    }
+
+    if (transpose) {
+        std::vector<float> tmp(n);
+        for (int i1 = 0; i1 < n1; ++i1) {
+            for (int i0 = 0; i0 < n0; ++i0) {
+                tmp[i0*n1 + i1] = data[i1*n0 + i0];
+            }
+        }
+        data.swap(tmp);
+    }
+
+    ggml_quantize(tensor->type, data.data(), tensor->data, n);
+}
+
 // load the model's weights from a file
-bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab) {
+//
+//   - qtype:    quantize the 2D weights to this type at load time (GGML_TYPE_COUNT - keep the type in the model file)
+//   - kv_type:  the type of the key + value memory (see gptj_kv_type_k/v)
+//   - use_mmap: use the weights in place from a memory mapping of the file, if it has the aligned format
+//
+bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab, ggml_type qtype, ggml_type kv_type, bool use_mmap) {
     printf("%s: loading model from '%s' - please wait ...\n", __func__, fname.c_str());
 
     auto fin = std::ifstream(fname, std::ios::binary);
@@ -76,10 +178,10 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
     }
 
     // verify magic
+    uint32_t magic;
     {
-        uint32_t magic;
         fin.read((char *) &magic, sizeof(magic));
-        if (magic != 0x67676d6c) {
+        if (magic != GGML_FILE_MAGIC && magic != GGML_FILE_MAGIC_ALIGNED) {
             fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname.c_str());
             return false;
         }
@@ -104,6 +206,13 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
         printf("%s: n_layer = %d\n", __func__, hparams.n_layer);
         printf("%s: n_rot   = %d\n", __func__, hparams.n_rot);
         printf("%s: f16     = %d\n", __func__, hparams.f16);
+
+        // the keys of a head are quantized in whole blocks
+        if (ggml_is_quantized(kv_type) && (hparams.n_embd/hparams.n_head) % ggml_blck_size(kv_type) != 0) {
+            fprintf(stderr, "%s: the head size %d is not a multiple of %d, using f16 keys\n",
+                    __func__, hparams.n_embd/hparams.n_head, ggml_blck_size(kv_type));
+            kv_type = GGML_TYPE_F16;
+        }
     }
 
     // load vocab
@@ -132,7 +241,22 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
 
     // for the big tensors, we have the option to store the data in 16-bit floats
     // in order to save memory and also to speed up the computation
-    const ggml_type wtype = model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    // they can also be quantized at load time
+    const ggml_type wtype = qtype != GGML_TYPE_COUNT ? qtype : model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
+    // the attention and fc weights are stored transposed in the model file
+    // when quantized, they are transposed back at load time (see gptj_mul_mat_t)
+    const bool quantized = ggml_is_quantized(wtype);
+    std::set<struct ggml_tensor *> transposed;
+
+    // the weights that don't have to be converted at load time can point straight into the mapped file
+    if (use_mmap && magic == GGML_FILE_MAGIC_ALIGNED && !quantized) {
+        if (!gpt_mmap_open(fname, model.mm)) {
+            fprintf(stderr, "%s: failed to mmap '%s' - reading the weights instead\n", __func__, fname.c_str());
+        }
+    }
+
+    const bool mapped = model.mm.addr != nullptr;
 
     auto & ctx = model.ctx;
 
@@ -149,28 +273,33 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
         ctx_size += n_embd*ggml_type_size(GGML_TYPE_F32); // ln_f_g
         ctx_size += n_embd*ggml_type_size(GGML_TYPE_F32); // ln_f_b
 
-        ctx_size += n_embd*n_vocab*ggml_type_size(wtype); // wte
+        ctx_size += n_embd*n_vocab*ggml_type_sizef(wtype); // wte
 
-        ctx_size += n_embd*n_vocab*ggml_type_size(wtype);         // lmh_g
+        ctx_size += n_embd*n_vocab*ggml_type_sizef(wtype);         // lmh_g
         ctx_size +=        n_vocab*ggml_type_size(GGML_TYPE_F32); // lmh_b
 
         ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_1_g
         ctx_size += n_layer*(n_embd*ggml_type_size(GGML_TYPE_F32)); // ln_1_b
 
-        ctx_size += n_layer*(n_embd*n_embd*ggml_type_size(wtype)); // c_attn_q_proj_w
-        ctx_size += n_layer*(n_embd*n_embd*ggml_type_size(wtype)); // c_attn_k_proj_w
-        ctx_size += n_layer*(n_embd*n_embd*ggml_type_size(wtype)); // c_attn_v_proj_w
+        ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_q_proj_w
+        ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_k_proj_w
+        ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_v_proj_w
 
-        ctx_size += n_layer*(n_embd*n_embd*ggml_type_size(wtype)); // c_attn_proj_w
+        ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_proj_w
 
-        ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_size(wtype));         // c_mlp_fc_w
+        ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_sizef(wtype));         // c_mlp_fc_w
         ctx_size += n_layer*(       4*n_embd*ggml_type_size(GGML_TYPE_F32)); // c_mlp_fc_b
 
-        ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_size(wtype));         // c_mlp_proj_w_trans
+        ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_sizef(wtype));         // c_mlp_proj_w_trans
         ctx_size += n_layer*(         n_embd*ggml_type_size(GGML_TYPE_F32)); // c_mlp_proj_b
 
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_size(GGML_TYPE_F32); // memory_k
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_size(GGML_TYPE_F32); // memory_v
+        // the context only holds the tensor objects of the mapped weights
+        if (mapped) {
+            ctx_size = 0;
+        }
+
+        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(gptj_kv_type_k(kv_type)); // memory_k
+        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(gptj_kv_type_v(kv_type)); // memory_v
 
         ctx_size += (5 + 10*n_layer)*256; // object overhead
 
@@ -182,6 +311,7 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
         struct ggml_init_params params = {
             .mem_size   = ctx_size,
             .mem_buffer = NULL,
+            .no_alloc   = mapped,
         };
 
         model.ctx = ggml_init(params);
@@ -231,12 +361,21 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
 
             layer.c_attn_proj_w         = ggml_new_tensor_2d(ctx, wtype,           n_embd,   n_embd);
 
-            layer.c_mlp_fc_w            = ggml_new_tensor_2d(ctx, wtype,         4*n_embd,   n_embd);
+            layer.c_mlp_fc_w            = quantized ? ggml_new_tensor_2d(ctx, wtype, n_embd, 4*n_embd)
+                                                    : ggml_new_tensor_2d(ctx, wtype, 4*n_embd, n_embd);
             layer.c_mlp_fc_b            = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_embd);
 
             layer.c_mlp_proj_w_trans    = ggml_new_tensor_2d(ctx, wtype,         4*n_embd,   n_embd);
             layer.c_mlp_proj_b          = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
 
+            if (quantized) {
+                transposed.insert(layer.c_attn_q_proj_w);
+                transposed.insert(layer.c_attn_k_proj_w);
+                transposed.insert(layer.c_attn_v_proj_w);
+                transposed.insert(layer.c_attn_proj_w);
+                transposed.insert(layer.c_mlp_fc_w);
+            }
+
             // map by name
             model.tensors["transformer.h." + std::to_string(i) + ".ln_1.weight"]          = layer.ln_1_g;
             model.tensors["transformer.h." + std::to_string(i) + ".ln_1.bias"]            = layer.ln_1_b;
@@ -266,8 +405,15 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
         const int n_mem      = n_layer*n_ctx;
         const int n_elements = n_embd*n_mem;
 
-        model.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
-        model.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
+        // the memory is written during inference, so it always lives in the context
+        ggml_set_no_alloc(ctx, false);
+
+        model.memory_k = ggml_new_tensor_1d(ctx, gptj_kv_type_k(kv_type), n_elements);
+        model.memory_v = ggml_new_tensor_1d(ctx, gptj_kv_type_v(kv_type), n_elements);
+
+        // the graphs attend to a few masked positions past the context (see gptj_graph), so they must be finite
+        ggml_set_zero(model.memory_k);
+        ggml_set_zero(model.memory_v);
 
         const size_t memory_size = ggml_nbytes(model.memory_k) + ggml_nbytes(model.memory_v);
 
@@ -304,6 +450,12 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
             std::string name(length, 0);
             fin.read(&name[0], length);
 
+            // in the aligned format, the data starts at the next multiple of GGML_FILE_ALIGN
+            if (magic == GGML_FILE_MAGIC_ALIGNED) {
+                const size_t offset = fin.tellg();
+                fin.seekg((GGML_FILE_ALIGN - offset % GGML_FILE_ALIGN) % GGML_FILE_ALIGN, std::ios::cur);
+            }
+
             if (model.tensors.find(name.data()) == model.tensors.end()) {
                 fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
                 return false;
@@ -315,21 +467,46 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
                 return false;
             }
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1]) {
+            const bool transpose = transposed.count(tensor) > 0;
+
+            const int ne0 = transpose ? tensor->ne[1] : tensor->ne[0];
+            const int ne1 = transpose ? tensor->ne[0] : tensor->ne[1];
+
+            if (ne0 != ne[0] || ne1 != ne[1]) {
                 fprintf(stderr, "%s: tensor '%s' has wrong shape in model file: got [%d, %d], expected [%d, %d]\n",
-                        __func__, name.data(), tensor->ne[0], tensor->ne[1], ne[0], ne[1]);
+                        __func__, name.data(), ne0, ne1, ne[0], ne[1]);
                 return false;
             }
 
-            const size_t bpe = tensor->type == GGML_TYPE_I8 ? 1 : (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
+            if (ggml_is_quantized(tensor->type)) {
+                if (ftype != 0 && ftype != 1) {
+                    fprintf(stderr, "%s: tensor '%s' has unsupported type %d in model file\n", __func__, name.data(), ftype);
+                    return false;
+                }
 
-            if (nelements*bpe != ggml_nbytes(tensor)) {
-                fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
-            }
+                gptj_read_quantized(fin, ftype, tensor, transpose);
+            } else {
+                const size_t bpe = tensor->type == GGML_TYPE_I8 ? 1 : (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+                if (nelements*bpe != ggml_nbytes(tensor)) {
+                    fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                            __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                    return false;
+                }
+
+                if (mapped) {
+                    const size_t offset = fin.tellg();
+                    if (offset + ggml_nbytes(tensor) > model.mm.size) {
+                        fprintf(stderr, "%s: tensor '%s' is out of bounds of the model file\n", __func__, name.data());
+                        return false;
+                    }
+
+                    tensor->data = (char *) model.mm.addr + offset;
+                    fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+                } else {
+                    fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+                }
+            }
 
             //printf("%42s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
@@ -341,70 +518,117 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
 
         printf(" done\n");
 
-        printf("%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
+        // the mapped weights that are not in the file have no data at all
+        if (mapped) {
+            for (const auto & it : model.tensors) {
+                if (it.second->data == nullptr) {
+                    fprintf(stderr, "%s: tensor '%s' is missing from the model file\n", __func__, it.first.c_str());
+                    return false;
+                }
+            }
+        }
+
+        printf("%s: model size = %8.2f MB / num tensors = %d%s\n", __func__, total_size/1024.0/1024.0, n_tensors, mapped ? " (mmap)" : "");
     }
 
     fin.close();
 
+    model.id = gpt_model_id(model.tensors, &model.hparams, sizeof(model.hparams), qtype);
+
     return true;
 }
 
-// evaluate the transformer
+// multiply by a weight matrix that is stored transposed in the model file
+// quantized weights have been transposed back at load time, the f16 ones are multiplied transposed by the blocked
+// gemm of ggml_mul_mat() for batches of tokens
+struct ggml_tensor * gptj_mul_mat_t(struct ggml_context * ctx0, struct ggml_tensor * w, struct ggml_tensor * cur) {
+    if (ggml_is_quantized(w->type)) {
+        return ggml_mul_mat(ctx0, w, cur);
+    }
+
+    return ggml_mul_mat(ctx0, ggml_transpose(ctx0, w), cur);
+}
+
+// the number of keys / values that a graph attends to is rounded up to a multiple of this, so that the graph
+// can be computed again for the following tokens - the positions past n_past + N are skipped by the attention
+#define GPTJ_KV_BLOCK 32
+
+// a graph of the transformer for N tokens that is built once and computed again for the following evaluations
+// with the same number of tokens, by rebinding its inputs, as long as the context fits in the n_kv keys / values
+struct gptj_graph {
+    std::vector<uint8_t> buf_meta; // tensor objects of the graph
+    std::vector<uint8_t> buf;      // data of the intermediate tensors, placed by ggml_graph_alloc()
+
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph    gf  = {};
+
+    int N    = 0;
+    int n_kv = 0;
+
+    // inputs
+    struct ggml_tensor * embd;
+
+    std::vector<struct ggml_tensor *> k;      // views of the memory where the new keys / values are stored
+    std::vector<struct ggml_tensor *> v;
+    std::vector<struct ggml_tensor *> n_past; // n_past parameters of the rotary embeddings and the attention
+
+    // output
+    struct ggml_tensor * logits;
+};
+
+// build the graph of the transformer for N tokens that attend to n_kv keys / values and plan its memory
 //
-//   - model:     the model
-//   - n_threads: number of threads to use
-//   - n_past:    the context size so far
-//   - embd_inp:  the embeddings of the tokens in the context
-//   - embd_w:    the predicted probabilities of the next token
+//   - model: the model
+//   - pool:  the worker threads that will compute the graph
+//   - N:     the number of tokens
+//   - n_kv:  the number of keys / values in the memory that the tokens attend to
+//   - graph: the graph, replacing the previous one
 //
 // The GPT-J model requires about 16MB of memory per input token.
 //
-bool gptj_eval(
+bool gptj_build_graph(
         const gptj_model & model,
-        const int n_threads,
-        const int n_past,
-        const std::vector<gpt_vocab::id> & embd_inp,
-              std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
-    const int N = embd_inp.size();
-
+        struct ggml_threadpool * pool,
+        const int N,
+        const int n_kv,
+              gptj_graph & graph) {
     const auto & hparams = model.hparams;
 
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
     const int n_ctx   = hparams.n_ctx;
     const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
     const int n_rot   = hparams.n_rot;
 
-    const int d_key = n_embd/n_head;
-
-    static size_t buf_size = 256u*1024*1024;
-    static void * buf = malloc(buf_size);
-
-    if (mem_per_token > 0 && mem_per_token*N > buf_size) {
-        const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        //printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, buf_size, buf_size_new);
-
-        // reallocate
-        buf_size = buf_size_new;
-        buf = realloc(buf, buf_size);
-        if (buf == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, buf_size);
-            return false;
-        }
+    if (graph.ctx) {
+        ggml_free(graph.ctx);
     }
 
+    // the context only holds the tensor objects of the graph (and a few scalars)
+    // the data of the intermediate tensors is placed in graph.buf by ggml_graph_alloc()
+    graph.buf_meta.resize(2*GGML_DEFAULT_GRAPH_SIZE*(ggml_tensor_overhead() + 16) + ggml_graph_overhead(GGML_DEFAULT_GRAPH_SIZE, false));
+
     struct ggml_init_params params = {
-        .mem_size   = buf_size,
-        .mem_buffer = buf,
+        .mem_size   = graph.buf_meta.size(),
+        .mem_buffer = graph.buf_meta.data(),
+        .no_alloc   = true,
     };
 
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf = { .n_threads = n_threads };
+    graph.ctx  = ggml_init(params);
+    graph.gf   = *ggml_new_graph(graph.ctx);
+    graph.N    = N;
+    graph.n_kv = n_kv;
+
+    graph.k.resize(n_layer);
+    graph.v.resize(n_layer);
+    graph.n_past.clear();
+
+    struct ggml_context * ctx0 = graph.ctx;
+    struct ggml_cgraph  & gf   = graph.gf;
 
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+
+    graph.embd = embd;
 
     // wte
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, embd);
@@ -419,74 +643,70 @@ bool gptj_eval(
             // cur = ln_1_g*cur + ln_1_b
             cur = ggml_add(ctx0,
                     ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.layers[il].ln_1_g, cur),
-                        cur),
-                    ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
+                        cur,
+                        model.layers[il].ln_1_g),
+                    model.layers[il].ln_1_b);
         }
 
         struct ggml_tensor * inpSA = cur;
 
         // self-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, ggml_transpose(ctx0, model.layers[il].c_attn_q_proj_w), cur);
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, ggml_transpose(ctx0, model.layers[il].c_attn_k_proj_w), cur);
-            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, ggml_transpose(ctx0, model.layers[il].c_attn_v_proj_w), cur);
+            struct ggml_tensor * Qcur = gptj_mul_mat_t(ctx0, model.layers[il].c_attn_q_proj_w, cur);
+            struct ggml_tensor * Kcur = gptj_mul_mat_t(ctx0, model.layers[il].c_attn_k_proj_w, cur);
+            struct ggml_tensor * Vcur = gptj_mul_mat_t(ctx0, model.layers[il].c_attn_v_proj_w, cur);
+
+            // the keys are stored with the rotary embedding of their position, so it is applied only once
+            Kcur = ggml_rope(ctx0,
+                    ggml_reshape_3d(ctx0, Kcur, n_embd/n_head, n_head, N),
+                    0, n_rot, 0);
+
+            graph.n_past.push_back(Kcur->src1);
+
+            // [64, N, 16]
+            Kcur = ggml_permute(ctx0, Kcur, 0, 2, 1, 3);
+
+            // Vcur = Vcur.view(n_embd/n_head, n_head, N).permute(1, 2, 0, 3)
+            // [N, 64, 16]
+            Vcur = ggml_permute(ctx0, ggml_reshape_3d(ctx0, Vcur, n_embd/n_head, n_head, N), 1, 2, 0, 3);
 
             // store key and value to memory
+            // the views are moved to n_past when the graph is computed (see gptj_eval)
             if (N >= 1) {
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.memory_k, N*n_embd, (ggml_element_size(model.memory_k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctx0, model.memory_v, N*n_embd, (ggml_element_size(model.memory_v)*n_embd)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = gptj_view_k(ctx0, model, il, 0, N);
+                struct ggml_tensor * v = gptj_view_v(ctx0, model, il, 0, N);
+
+                graph.k[il] = k;
+                graph.v[il] = v;
 
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
             }
 
             // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_rope(ctx0,
-                            ggml_cpy(ctx0,
-                                Qcur,
-                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
-                            n_past, n_rot, 0),
-                        0, 2, 1, 3);
-
-            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_rope(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, model.memory_k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.memory_k)*n_embd),
-                                n_embd/n_head, n_head, n_past + N),
-                            n_past, n_rot, 1),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0,
-                        KQ,
-                        ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
-                        );
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
-            struct ggml_tensor * V_trans =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.memory_v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.memory_v)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
-                        1, 2, 0, 3);
-
-            // KQV = transpose(V) * KQ_soft_max
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+            struct ggml_tensor * Qrot =
+                ggml_rope(ctx0,
+                        ggml_cpy(ctx0,
+                            Qcur,
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
+                        0, n_rot, 0);
+
+            graph.n_past.push_back(Qrot->src1);
+
+            struct ggml_tensor * Q = ggml_permute(ctx0, Qrot, 0, 2, 1, 3);
+
+            // K = Kmem[il, :n_kv]
+            struct ggml_tensor * K = gptj_view_k(ctx0, model, il, 0, n_kv);
+
+            // V_trans = Vmem[il, :n_kv]
+            struct ggml_tensor * V_trans = gptj_view_v(ctx0, model, il, 0, n_kv);
+
+            // KQV = transpose(V) * soft_max(mask_past(K * Q / sqrt(n_embd/n_head)))
+            // the keys / values are streamed in tiles and the positions past n_past + N are skipped - n_past is set when
+            // the graph is computed
+            struct ggml_tensor * KQV = ggml_flash_attn_kv(ctx0, Q, K, V_trans, nullptr, 0, 1.0f/sqrt(float(n_embd)/n_head));
+
+            graph.n_past.push_back(KQV->opt[1]);
 
             // KQV_merged = KQV.permute(0, 2, 1, 3)
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
@@ -497,8 +717,8 @@ bool gptj_eval(
                     ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
 
             // projection (no bias)
-            cur = ggml_mul_mat(ctx0,
-                    ggml_transpose(ctx0, model.layers[il].c_attn_proj_w),
+            cur = gptj_mul_mat_t(ctx0,
+                    model.layers[il].c_attn_proj_w,
                     cur);
         }
 
@@ -508,13 +728,13 @@ bool gptj_eval(
         // this is independent of the self-attention result, so it could be done in parallel to the self-attention
         {
             // note here we pass inpSA instead of cur
-            cur = ggml_mul_mat(ctx0,
-                    ggml_transpose(ctx0, model.layers[il].c_mlp_fc_w),
+            cur = gptj_mul_mat_t(ctx0,
+                    model.layers[il].c_mlp_fc_w,
                     inpSA);
 
             cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].c_mlp_fc_b, cur),
-                    cur);
+                    cur,
+                    model.layers[il].c_mlp_fc_b);
 
             // GELU activation
             cur = ggml_gelu(ctx0, cur);
@@ -526,8 +746,8 @@ bool gptj_eval(
                     cur);
 
             cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].c_mlp_proj_b, cur),
-                    cur);
+                    cur,
+                    model.layers[il].c_mlp_proj_b);
         }
 
         // self-attention + FF
@@ -544,9 +764,9 @@ bool gptj_eval(
         // inpL = ln_f_g*inpL + ln_f_b
         inpL = ggml_add(ctx0,
                 ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.ln_f_g, inpL),
-                    inpL),
-                ggml_repeat(ctx0, model.ln_f_b, inpL));
+                    inpL,
+                    model.ln_f_g),
+                model.ln_f_b);
     }
 
     // lm_head
@@ -554,39 +774,249 @@ bool gptj_eval(
         inpL = ggml_mul_mat(ctx0, model.lmh_g, inpL);
 
         inpL = ggml_add(ctx0,
-                ggml_repeat(ctx0, model.lmh_b, inpL),
-                inpL);
+                inpL,
+                model.lmh_b);
+    }
+
+    // the softmax is left to the sampler, which only needs it for the top tokens
+    ggml_build_forward_expand(&gf, inpL);
+
+    graph.logits = inpL;
+
+    // merge the layer norms, the bias + GELU and the scaled masked soft max into single nodes
+    ggml_graph_fuse(&gf);
+
+    // the work buffer is planned for the number of threads of the pool
+    gf.n_threads = ggml_threadpool_n_threads(pool);
+
+    // place the intermediate tensors, growing the buffer when the graph needs more memory
+    {
+        const size_t buf_size = ggml_graph_alloc(ctx0, &gf, NULL, 0);
+
+        if (buf_size > graph.buf.size()) {
+            //printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, graph.buf.size(), buf_size);
+            graph.buf.resize(buf_size);
+        }
+
+        ggml_graph_alloc(ctx0, &gf, graph.buf.data(), graph.buf.size());
     }
 
-    // logits -> probs
-    inpL = ggml_soft_max(ctx0, inpL);
+    return true;
+}
+
+// evaluate the transformer
+//
+//   - model:     the model
+//   - pool:      the worker threads to use for the computation
+//   - n_past:    the context size so far
+//   - embd_inp:  the embeddings of the tokens in the context
+//   - embd_w:    the predicted logits of the next token
+//
+bool gptj_eval(
+        const gptj_model & model,
+        struct ggml_threadpool * pool,
+        const int n_past,
+        const std::vector<gpt_vocab::id> & embd_inp,
+              std::vector<float>         & embd_w,
+              size_t                     & mem_per_token) {
+    const int N = embd_inp.size();
+
+    const auto & hparams = model.hparams;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx   = hparams.n_ctx;
+    const int n_vocab = hparams.n_vocab;
+
+    static gptj_graph graph;
+
+    // build a new graph when the number of tokens changes, the context no longer fits in the previous one or the work
+    // buffer was planned for another number of threads
+    if (graph.ctx == nullptr || graph.N != N || n_past + N > graph.n_kv || graph.gf.n_threads != ggml_threadpool_n_threads(pool)) {
+        const int n_kv = std::min(n_ctx, ((n_past + N + GPTJ_KV_BLOCK - 1)/GPTJ_KV_BLOCK)*GPTJ_KV_BLOCK);
+
+        if (!gptj_build_graph(model, pool, N, n_kv, graph)) {
+            fprintf(stderr, "%s: failed to build the graph\n", __func__);
+            return false;
+        }
+
+        if (mem_per_token == 0) {
+            mem_per_token = graph.buf.size()/N;
+        }
+    }
+
+    // rebind the inputs of the graph
+    memcpy(graph.embd->data, embd_inp.data(), N*ggml_element_size(graph.embd));
+
+    for (int il = 0; il < n_layer; ++il) {
+        graph.k[il]->view_offs = gptj_offs_k(model, il, n_past);
+        graph.v[il]->view_offs = gptj_offs_v(model, il, n_past);
+    }
+
+    for (auto * t : graph.n_past) {
+        ggml_set_i32_1d(t, 0, n_past);
+    }
+
+    ggml_graph_update_views(&graph.gf);
 
     // run the computation
-    ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute       (ctx0, &gf);
+    ggml_graph_compute_with_pool(graph.ctx, &graph.gf, pool);
 
     //if (n_past%100 == 0) {
-    //    ggml_graph_print   (&gf);
-    //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
+    //    ggml_graph_print   (&graph.gf);
+    //    ggml_graph_dump_dot(&graph.gf, NULL, "gpt-j.dot");
     //}
 
     //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+    //memcpy(embd_w.data(), ggml_get_data(graph.logits), sizeof(float)*n_vocab*N);
 
     // return result for just the last token
     embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    memcpy(embd_w.data(), (float *) ggml_get_data(graph.logits) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+
+    return true;
+}
+
+// a snapshot of n positions of the key + value memory holds, for each layer and head, the keys of the n positions, then
+// for each layer, head and dimension, the values of the n positions (the same layout as for gpt-2)
+size_t gptj_kv_size(const gptj_model & model, int n) {
+    const auto & hparams = model.hparams;
+
+    const size_t nb_k = ggml_type_size(model.memory_k->type)*(hparams.n_embd/hparams.n_head)/ggml_blck_size(model.memory_k->type);
+    const size_t nb_v = ggml_type_size(model.memory_v->type);
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
+    return (size_t) n*hparams.n_layer*(hparams.n_head*nb_k + hparams.n_embd*nb_v);
+}
+
+// copy or restore the first n positions of the memory, from / to a snapshot of n_snap positions
+static void gptj_kv_copy(const gptj_model & model, uint8_t * snap, int n_snap, int n, bool save) {
+    const auto & hparams = model.hparams;
+
+    const int n_layer = hparams.n_layer;
+    const int n_embd  = hparams.n_embd;
+    const int n_head  = hparams.n_head;
+    const int n_ctx   = hparams.n_ctx;
+
+    const size_t nb_k = ggml_type_size(model.memory_k->type)*(n_embd/n_head)/ggml_blck_size(model.memory_k->type);
+    const size_t nb_v = ggml_type_size(model.memory_v->type);
+
+    uint8_t * mem_k = (uint8_t *) model.memory_k->data;
+    uint8_t * mem_v = (uint8_t *) model.memory_v->data;
+
+    for (int il = 0; il < n_layer; ++il) {
+        for (int h = 0; h < n_head; ++h) {
+            uint8_t * src = mem_k + gptj_offs_k(model, il, 0) + h*nb_k*n_ctx;
+            uint8_t * dst = snap + (size_t) (il*n_head + h)*n_snap*nb_k;
+
+            save ? memcpy(dst, src, n*nb_k) : memcpy(src, dst, n*nb_k);
+        }
+    }
+
+    snap += (size_t) n_snap*n_layer*n_head*nb_k;
+
+    for (int il = 0; il < n_layer; ++il) {
+        for (int j = 0; j < n_embd; ++j) {
+            uint8_t * src = mem_v + gptj_offs_v(model, il, 0) + j*nb_v*n_ctx;
+            uint8_t * dst = snap + (size_t) (il*n_embd + j)*n_snap*nb_v;
+
+            save ? memcpy(dst, src, n*nb_v) : memcpy(src, dst, n*nb_v);
+        }
     }
-    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
+}
+
+// the description of the snapshots of the key + value memory of the model
+static gpt_kv_desc gptj_kv_desc(const gptj_model & model) {
+    gpt_kv_desc desc;
+
+    desc.n_layer  = model.hparams.n_layer;
+    desc.n_head   = model.hparams.n_head;
+    desc.n_embd   = model.hparams.n_embd;
+    desc.n_ctx    = model.hparams.n_ctx;
+    desc.type_k   = model.memory_k->type;
+    desc.type_v   = model.memory_v->type;
+    desc.model_id = model.id;
+
+    return desc;
+}
+
+// save the key + value memory after the evaluation of the given tokens
+void gptj_kv_save(const gptj_model & model, const std::vector<gpt_vocab::id> & tokens, gpt_kv_snapshot & snap) {
+    const int n = tokens.size();
 
-    ggml_free(ctx0);
+    snap = {};
+    snap.desc   = gptj_kv_desc(model);
+    snap.tokens = tokens;
+    snap.size   = gptj_kv_size(model, n);
+    snap.buf.resize(snap.size);
+
+    gptj_kv_copy(model, snap.buf.data(), n, n, true);
+}
+
+// restore the first n positions of a snapshot
+bool gptj_kv_load(const gptj_model & model, const gpt_kv_snapshot & snap, int n) {
+    const int n_snap = snap.tokens.size();
+
+    if (n < 0 || n > n_snap || n_snap > model.hparams.n_ctx) {
+        fprintf(stderr, "%s: invalid restore of %d positions\n", __func__, n);
+        return false;
+    }
+
+    if (!gpt_kv_desc_match(snap.desc, gptj_kv_desc(model))) {
+        fprintf(stderr, "%s: the snapshot was saved from another model or key + value memory type\n", __func__);
+        return false;
+    }
+
+    if (snap.size != gptj_kv_size(model, n_snap)) {
+        fprintf(stderr, "%s: the snapshot does not match the key + value memory of the model\n", __func__);
+        return false;
+    }
+
+    gptj_kv_copy(model, (uint8_t *) gpt_kv_data(snap), n_snap, n, false);
 
     return true;
 }
 
+// restore the longest prefix of tokens found in the cache and return its length
+// the last token is always left to evaluate, since its logits are needed to predict the next one
+int gptj_prefix_cache_restore(const gptj_model & model, gpt_prefix_cache & cache, const std::vector<gpt_vocab::id> & tokens) {
+    int n_match = 0;
+
+    const gpt_kv_snapshot * snap = gpt_prefix_cache_find(cache, tokens, n_match);
+
+    n_match = std::min(n_match, (int) tokens.size() - 1);
+
+    if (snap == nullptr || n_match <= 0 || !gptj_kv_load(model, *snap, n_match)) {
+        return 0;
+    }
+
+    return n_match;
+}
+
+// place the weights on the NUMA nodes of the threads that read them: the rows of a matrix that is src0 of a
+// ggml_mul_mat() on the nodes of the threads that compute them, the other tensors and the key + value memory
+// interleaved over the nodes - false if some of the pages could not be moved
+bool gptj_numa_place(const gptj_model & model, const struct ggml_threadpool * pool) {
+    bool ok = true;
+
+    for (const auto & it : model.tensors) {
+        struct ggml_tensor * t = it.second;
+
+        // the quantized weights, the output projection of the mlp and the lm head are multiplied untransposed (see
+        // gptj_mul_mat_t)
+        bool rows = t->n_dims == 2 && (ggml_is_quantized(t->type) || t == model.lmh_g);
+        for (const auto & layer : model.layers) {
+            rows = rows || t == layer.c_mlp_proj_w_trans;
+        }
+
+        ok = ggml_numa_place(pool, t, rows ? GGML_NUMA_ROWS : GGML_NUMA_INTERLEAVE) && ok;
+    }
+
+    ok = ggml_numa_place(pool, model.memory_k, GGML_NUMA_INTERLEAVE) && ok;
+    ok = ggml_numa_place(pool, model.memory_v, GGML_NUMA_INTERLEAVE) && ok;
+
+    return ok;
+}
+
 int main(int argc, char ** argv) {
     const int64_t t_main_start_us = ggml_time_us();
 
@@ -613,11 +1043,36 @@ int main(int argc, char ** argv) {
     gpt_vocab vocab;
     gptj_model model;
 
+    ggml_type qtype = GGML_TYPE_COUNT;
+    if (params.quantize == "q4_0") {
+        qtype = GGML_TYPE_Q4_0;
+    } else if (params.quantize == "q8_0") {
+        qtype = GGML_TYPE_Q8_0;
+    } else if (!params.quantize.empty()) {
+        fprintf(stderr, "%s: unknown quantization type '%s'\n", __func__, params.quantize.c_str());
+        return 1;
+    }
+
+    ggml_type kv_type = GGML_TYPE_F16;
+    if (params.kv_type == "f32") {
+        kv_type = GGML_TYPE_F32;
+    } else if (params.kv_type == "q8_0") {
+        kv_type = GGML_TYPE_Q8_0;
+    } else if (params.kv_type != "f16") {
+        fprintf(stderr, "%s: unknown key / value memory type '%s'\n", __func__, params.kv_type.c_str());
+        return 1;
+    }
+
+    // the pages of a memory mapping of the model file cannot be placed on the nodes
+    if (params.numa) {
+        params.use_mmap = false;
+    }
+
     // load the model
     {
         const int64_t t_start_us = ggml_time_us();
 
-        if (!gptj_model_load(params.model, model, vocab)) {
+        if (!gptj_model_load(params.model, model, vocab, qtype, kv_type, params.use_mmap)) {
             fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
             return 1;
         }
@@ -632,6 +1087,11 @@ int main(int argc, char ** argv) {
 
     std::vector<float> embd_w;
 
+    gpt_sampler sampler;
+    sampler.top_k = params.top_k;
+    sampler.top_p = params.top_p;
+    sampler.temp  = params.temp;
+
     // tokenize the prompt
     std::vector<gpt_vocab::id> embd_inp = ::gpt_tokenize(vocab, params.prompt);
 
@@ -644,14 +1104,70 @@ int main(int argc, char ** argv) {
 
     // determine the required inference memory per token:
     size_t mem_per_token = 0;
-    gptj_eval(model, params.n_threads, 0, { 0, 1, 2, 3 }, embd_w, mem_per_token);
 
-    for (int i = embd.size(); i < embd_inp.size() + params.n_predict; i++) {
+    if (params.tune_threads) {
+        params.n_threads = gpt_tune_n_threads(params.n_threads, params.numa, [&](struct ggml_threadpool * pool) {
+            return gptj_eval(model, pool, 0, { 0, 1, 2, 3 }, embd_w, mem_per_token);
+        });
+
+        printf("%s: using %d threads\n", __func__, params.n_threads);
+    }
+
+    // the worker threads are reused for every evaluated token
+    struct ggml_threadpool * pool = ggml_threadpool_new(params.n_threads);
+
+    if (params.numa) {
+        if (!ggml_threadpool_set_affinity(pool)) {
+            fprintf(stderr, "%s: failed to pin the threads to the NUMA nodes\n", __func__);
+        }
+
+        if (!gptj_numa_place(model, pool)) {
+            fprintf(stderr, "%s: failed to place the weights on the NUMA nodes\n", __func__);
+        }
+
+        printf("%s: %d threads on %d NUMA nodes\n", __func__, params.n_threads, ggml_numa_n_nodes());
+    }
+
+    gptj_eval(model, pool, 0, { 0, 1, 2, 3 }, embd_w, mem_per_token);
+
+    // reuse the key + value memory of the longest prefix of the prompt that was saved before
+    gpt_prefix_cache cache;
+
+    int n_prefix = 0;
+
+    if (!params.prompt_cache.empty()) {
+        const int64_t t_start_us = ggml_time_us();
+
+        gpt_kv_snapshot snap;
+        if (gpt_kv_snapshot_read(params.prompt_cache, snap)) {
+            gpt_prefix_cache_add(cache, std::move(snap));
+        }
+
+        n_prefix = gptj_prefix_cache_restore(model, cache, embd_inp);
+
+        printf("%s: reused %d tokens of the prompt from '%s' in %.2f ms\n", __func__, n_prefix, params.prompt_cache.c_str(), (ggml_time_us() - t_start_us)/1000.0f);
+        printf("\n");
+    }
+
+    // profile the evaluation of the prompt and of the predicted tokens
+    struct ggml_profiler * prof = NULL;
+    if (!params.profile.empty()) {
+        prof = ggml_profiler_new();
+        ggml_profiler_set_active(prof);
+    }
+
+    n_past = n_prefix;
+
+    for (int k = 0; k < n_prefix; k++) {
+        printf("%s", vocab.id_to_token[embd_inp[k]].c_str());
+    }
+
+    for (int i = n_prefix; i < embd_inp.size() + params.n_predict; i++) {
         // predict
         if (embd.size() > 0) {
             const int64_t t_start_us = ggml_time_us();
 
-            if (!gptj_eval(model, params.n_threads, n_past, embd, embd_w, mem_per_token)) {
+            if (!gptj_eval(model, pool, n_past, embd, embd_w, mem_per_token)) {
                 printf("Failed to predict\n");
                 return 1;
             }
@@ -664,10 +1180,6 @@ int main(int argc, char ** argv) {
 
         if (i >= embd_inp.size()) {
             // sample next token
-            const int   top_k = params.top_k;
-            const float top_p = params.top_p;
-            const float temp  = params.temp;
-
             const int n_vocab = model.hparams.n_vocab;
 
             gpt_vocab::id id = 0;
@@ -675,7 +1187,7 @@ int main(int argc, char ** argv) {
             {
                 const int64_t t_start_sample_us = ggml_time_us();
 
-                id = gpt_sample_top_k_top_p(vocab, embd_w.data() + (embd_w.size() - n_vocab), top_k, top_p, temp, rng);
+                id = gpt_sampler_sample(sampler, embd_w.data() + (embd_w.size() - n_vocab), n_vocab, rng);
 
                 t_sample_us += ggml_time_us() - t_start_sample_us;
             }
@@ -705,6 +1217,19 @@ int main(int argc, char ** argv) {
         }
     }
 
+    // the snapshot file may be mapped by the cache
+    gpt_prefix_cache_free(cache);
+
+    // the positions of the prompt are not changed by the generation
+    if (!params.prompt_cache.empty() && n_prefix < (int) embd_inp.size() - 1) {
+        gpt_kv_snapshot snap;
+        gptj_kv_save(model, embd_inp, snap);
+
+        if (!gpt_kv_snapshot_write(params.prompt_cache, snap)) {
+            fprintf(stderr, "%s: failed to save the prompt to '%s'\n", __func__, params.prompt_cache.c_str());
+        }
+    }
+
     // report timing
     {
         const int64_t t_main_end_us = ggml_time_us();
@@ -717,7 +1242,22 @@ int main(int argc, char ** argv) {
         printf("%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
     }
 
+    if (prof) {
+        ggml_profiler_set_active(NULL);
+        ggml_profiler_print(prof);
+
+        if (!ggml_profiler_write_trace(prof, params.profile.c_str())) {
+            fprintf(stderr, "%s: failed to write the trace to '%s'\n", __func__, params.profile.c_str());
+        }
+
+        ggml_profiler_free(prof);
+    }
+
+    ggml_threadpool_free(pool);
+
     ggml_free(model.ctx);
 
+    gpt_mmap_close(model.mm);
+
     return 0;
 }
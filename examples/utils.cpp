@@ -1,7 +1,27 @@
 #include "utils.h"
 
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream>
-#include <regex>
+#include <queue>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
     for (int i = 1; i < argc; i++) {
@@ -23,8 +43,24 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.temp = std::stof(argv[++i]);
         } else if (arg == "-b" || arg == "--batch_size") {
             params.n_batch = std::stoi(argv[++i]);
+        } else if (arg == "--n-seq") {
+            params.n_seq = std::stoi(argv[++i]);
         } else if (arg == "-m" || arg == "--model") {
             params.model = argv[++i];
+        } else if (arg == "-q" || arg == "--quantize") {
+            params.quantize = argv[++i];
+        } else if (arg == "--no-mmap") {
+            params.use_mmap = false;
+        } else if (arg == "--kv-type") {
+            params.kv_type = argv[++i];
+        } else if (arg == "--profile") {
+            params.profile = argv[++i];
+        } else if (arg == "--prompt-cache") {
+            params.prompt_cache = argv[++i];
+        } else if (arg == "--numa") {
+            params.numa = true;
+        } else if (arg == "--tune-threads") {
+            params.tune_threads = true;
         } else if (arg == "-h" || arg == "--help") {
             gpt_print_usage(argc, argv, params);
             exit(0);
@@ -52,8 +88,17 @@ void gpt_print_usage(int argc, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --top_p N             top-p sampling (default: %.1f)\n", params.top_p);
     fprintf(stderr, "  --temp N              temperature (default: %.1f)\n", params.temp);
     fprintf(stderr, "  -b N, --batch_size N  batch size for prompt processing (default: %d)\n", params.n_batch);
+    fprintf(stderr, "  --n-seq N             number of sequences generated from the prompt together (default: %d)\n", params.n_seq);
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -q TYPE, --quantize TYPE\n");
+    fprintf(stderr, "                        quantize the weights at load time: q4_0 or q8_0 (default: none)\n");
+    fprintf(stderr, "  --no-mmap             read the weights into memory instead of mapping the model file\n");
+    fprintf(stderr, "  --kv-type TYPE        type of the key + value memory: f32, f16 or q8_0 (default: %s)\n", params.kv_type.c_str());
+    fprintf(stderr, "  --profile FNAME       print a per-op profile and write a Chrome trace of the graph computations to FNAME\n");
+    fprintf(stderr, "  --prompt-cache FNAME  reuse the key + value memory of the prompt saved in FNAME, and save it there\n");
+    fprintf(stderr, "  --numa                pin the threads to the NUMA nodes and place the weights on the nodes that read them\n");
+    fprintf(stderr, "  --tune-threads        use fewer threads if more threads do not speed up the evaluation\n");
     fprintf(stderr, "\n");
 }
 
@@ -76,6 +121,114 @@ std::string gpt_random_prompt(std::mt19937 & rng) {
     return "The";
 }
 
+int gpt_tune_n_threads(int n_max, bool numa, const std::function<bool(struct ggml_threadpool *)> & eval) {
+    int     n_best = 1;
+    int64_t t_best = 0;
+
+    for (int n = 1; n <= n_max; n++) {
+        struct ggml_threadpool * pool = ggml_threadpool_new(n);
+
+        if (numa) {
+            ggml_threadpool_set_affinity(pool);
+        }
+
+        // the first run plans the graph for the pool, the best of the next ones is the time
+        int64_t t_min = INT64_MAX;
+
+        bool ok = eval(pool);
+        for (int i = 0; i < 3 && ok; i++) {
+            const int64_t t_start_us = ggml_time_us();
+            ok = eval(pool);
+            t_min = std::min(t_min, ggml_time_us() - t_start_us);
+        }
+
+        ggml_threadpool_free(pool);
+
+        if (!ok) {
+            break;
+        }
+
+        if (n > 1 && t_min > 0.95*t_best) {
+            break;
+        }
+
+        n_best = n;
+        t_best = t_min;
+    }
+
+    return n_best;
+}
+
+bool gpt_mmap_open(const std::string & fname, gpt_mmap & mm) {
+    mm = {};
+
+#if defined(_WIN32)
+    HANDLE hfile = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hfile, &size) || size.QuadPart == 0) {
+        CloseHandle(hfile);
+        return false;
+    }
+
+    // the view keeps the mapping alive, so both handles can be closed right away
+    HANDLE hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hfile);
+    if (hmap == NULL) {
+        return false;
+    }
+
+    void * addr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmap);
+    if (addr == NULL) {
+        return false;
+    }
+
+    mm.addr = addr;
+    mm.size = size.QuadPart;
+#else
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    // the mapping keeps the file referenced, so the descriptor can be closed right away
+    void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    mm.addr = addr;
+    mm.size = st.st_size;
+#endif
+
+    return true;
+}
+
+void gpt_mmap_close(gpt_mmap & mm) {
+    if (mm.addr == nullptr) {
+        return;
+    }
+
+#if defined(_WIN32)
+    UnmapViewOfFile(mm.addr);
+#else
+    munmap(mm.addr, mm.size);
+#endif
+
+    mm = {};
+}
+
 void replace(std::string & str, const std::string & needle, const std::string & replacement) {
     size_t pos = 0;
     while ((pos = str.find(needle, pos)) != std::string::npos) {
@@ -175,65 +328,291 @@ std::map<std::string, int32_t> json_parse(const std::string & fname) {
     return result;
 }
 
-std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// character classes of the pre-tokenizer: \p{L}, \p{N}, \s and the rest
+enum gpt_char_class {
+    GPT_CHAR_LETTER,
+    GPT_CHAR_DIGIT,
+    GPT_CHAR_SPACE,
+    GPT_CHAR_OTHER,
+};
+
+// decode the UTF-8 code point at text[i], its length in bytes is returned in len - an invalid byte is a single
+// U+FFFD replacement character
+static uint32_t gpt_utf8_decode(const std::string & text, size_t i, int & len) {
+    const uint8_t c = text[i];
+
+    len = c < 0x80 ? 1 : (c >> 5) == 0x06 ? 2 : (c >> 4) == 0x0e ? 3 : (c >> 3) == 0x1e ? 4 : 1;
+    if (i + len > text.size()) {
+        len = 1;
+    }
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+    if (len == 1) {
+        return c < 0x80 ? c : 0xfffd;
+    }
 
-        std::regex re(pat);
-        std::smatch m;
+    uint32_t cp = c & (0x7f >> len);
+    for (int k = 1; k < len; ++k) {
+        const uint8_t cc = text[i + k];
+        if ((cc & 0xc0) != 0x80) {
+            len = 1;
+            return 0xfffd;
+        }
+        cp = (cp << 6) | (cc & 0x3f);
+    }
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+    return cp;
+}
+
+// the ASCII characters are classified exactly - above, the spaces, punctuation and symbols of the common blocks are
+// recognized and everything else counts as a letter
+static gpt_char_class gpt_char_classify(uint32_t cp) {
+    if (cp < 0x80) {
+        if ((cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z')) {
+            return GPT_CHAR_LETTER;
         }
+        if (cp >= '0' && cp <= '9') {
+            return GPT_CHAR_DIGIT;
+        }
+        if (cp == ' ' || (cp >= 0x09 && cp <= 0x0d) || (cp >= 0x1c && cp <= 0x1f)) {
+            return GPT_CHAR_SPACE;
+        }
+        return GPT_CHAR_OTHER;
     }
 
-    // find the longest tokens that form the words:
-    std::vector<gpt_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.size() == 0) continue;
-
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            while (j > i) {
-                auto it = vocab.token_to_id.find(word.substr(i, j-i));
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    break;
-                }
-                --j;
-            }
-            if (i == n) {
-                break;
+    if (cp == 0x85 || cp == 0xa0 || cp == 0x1680 || (cp >= 0x2000 && cp <= 0x200a) ||
+        cp == 0x2028 || cp == 0x2029 || cp == 0x202f || cp == 0x205f || cp == 0x3000) {
+        return GPT_CHAR_SPACE;
+    }
+
+    if (cp < 0xa0 || (cp >= 0xa1 && cp <= 0xbf && cp != 0xaa && cp != 0xb2 && cp != 0xb3 && cp != 0xb5 && cp != 0xb9 && cp != 0xba && cp != 0xbc && cp != 0xbd && cp != 0xbe) ||
+        cp == 0xd7 || cp == 0xf7 ||
+        (cp >= 0x2010 && cp <= 0x2bff) || (cp >= 0x3001 && cp <= 0x3003) || (cp >= 0x3008 && cp <= 0x3020) ||
+        (cp >= 0xfe30 && cp <= 0xfe4f) || (cp >= 0xff01 && cp <= 0xff0f) || (cp >= 0xff1a && cp <= 0xff20) ||
+        (cp >= 0x1f000 && cp <= 0x1faff) || (cp >= 0xfff0 && cp <= 0xffff)) {
+        return GPT_CHAR_OTHER;
+    }
+
+    if (cp == 0xb2 || cp == 0xb3 || cp == 0xb9 || cp == 0xbc || cp == 0xbd || cp == 0xbe || (cp >= 0xff10 && cp <= 0xff19)) {
+        return GPT_CHAR_DIGIT;
+    }
+
+    return GPT_CHAR_LETTER;
+}
+
+// split the text into the words of the GPT-2 regex, as (offset, length) pairs in bytes
+static void gpt_split_words(const std::string & text, std::vector<std::pair<size_t, size_t>> & words) {
+    // code points of the text with their class
+    struct cpt {
+        size_t         offs;
+        gpt_char_class cls;
+    };
+
+    std::vector<cpt> cpts;
+    cpts.reserve(text.size() + 1);
+
+    for (size_t i = 0; i < text.size(); ) {
+        int len = 1;
+        const uint32_t cp = gpt_utf8_decode(text, i, len);
+        cpts.push_back({ i, gpt_char_classify(cp) });
+        i += len;
+    }
+
+    const size_t n = cpts.size();
+    cpts.push_back({ text.size(), GPT_CHAR_OTHER });
+
+    const auto cls = [&](size_t k) { return k < n ? cpts[k].cls : GPT_CHAR_SPACE; };
+    const auto chr = [&](size_t k) { return k < n ? text[cpts[k].offs] : '\0'; };
+
+    size_t k = 0;
+    while (k < n) {
+        size_t e = k;
+
+        if (chr(k) == '\'') {
+            // 's|'t|'re|'ve|'m|'ll|'d
+            const char c1 = chr(k + 1);
+            const char c2 = chr(k + 2);
+            if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+                e = k + 2;
+            } else if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                e = k + 3;
             }
-            if (j == i) {
-                auto sub = word.substr(i, 1);
-                if (vocab.token_to_id.find(sub) != vocab.token_to_id.end()) {
-                    tokens.push_back(vocab.token_to_id.at(sub));
-                } else {
-                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, sub.data());
+        }
+
+        if (e == k) {
+            //  ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+
+            const size_t b = chr(k) == ' ' && cls(k + 1) != GPT_CHAR_SPACE ? k + 1 : k;
+            const gpt_char_class c = cls(b);
+
+            if (c != GPT_CHAR_SPACE) {
+                e = b + 1;
+                while (e < n && cls(e) == c) {
+                    e++;
+                }
+            } else {
+                // \s+(?!\S)|\s+ - a run of spaces leaves its last one to the word that follows
+                e = k + 1;
+                while (e < n && cls(e) == GPT_CHAR_SPACE) {
+                    e++;
+                }
+                if (e < n && e - k > 1) {
+                    e--;
                 }
-                ++i;
             }
         }
+
+        words.push_back({ cpts[k].offs, cpts[e].offs - cpts[k].offs });
+        k = e;
+    }
+}
+
+// a pair of adjacent symbols of a word that can be merged into the token with the given rank (id)
+struct gpt_bigram {
+    gpt_vocab::id rank;
+    int    left;
+    int    right;
+    size_t size; // size of the merged symbol, to discard the pairs whose symbols have changed since
+
+    bool operator>(const gpt_bigram & other) const {
+        return rank > other.rank || (rank == other.rank && left > other.left);
+    }
+};
+
+// the symbols of a word being merged, as a linked list over the bytes of the text
+struct gpt_symbol {
+    int    prev;
+    int    next;
+    size_t offs;
+    size_t size;
+};
+
+// byte-level BPE of a word, the tokens are appended to tokens
+static void gpt_bpe_word(
+        const gpt_vocab & vocab,
+        const std::string & text,
+        size_t offs,
+        size_t size,
+        std::vector<gpt_symbol> & symbols,
+        std::string & key,
+        std::vector<gpt_vocab::id> & tokens) {
+    // the whole word is a token
+    key.assign(text, offs, size);
+    {
+        auto it = vocab.token_to_id.find(key);
+        if (it != vocab.token_to_id.end()) {
+            tokens.push_back(it->second);
+            return;
+        }
+    }
+
+    symbols.clear();
+    for (size_t i = 0; i < size; ++i) {
+        symbols.push_back({ (int) i - 1, i + 1 < size ? (int) i + 1 : -1, offs + i, 1 });
+    }
+
+    std::priority_queue<gpt_bigram, std::vector<gpt_bigram>, std::greater<gpt_bigram>> queue;
+
+    const auto try_add = [&](int left, int right) {
+        if (left < 0 || right < 0) {
+            return;
+        }
+
+        key.assign(text, symbols[left].offs, symbols[left].size + symbols[right].size);
+
+        auto it = vocab.token_to_id.find(key);
+        if (it != vocab.token_to_id.end()) {
+            queue.push({ it->second, left, right, key.size() });
+        }
+    };
+
+    for (int i = 0; i + 1 < (int) symbols.size(); ++i) {
+        try_add(i, i + 1);
+    }
+
+    // merge the pair with the lowest rank until no pair of adjacent symbols forms a token
+    while (!queue.empty()) {
+        const gpt_bigram bigram = queue.top();
+        queue.pop();
+
+        gpt_symbol & left  = symbols[bigram.left];
+        gpt_symbol & right = symbols[bigram.right];
+
+        // one of the symbols has been merged into another pair since
+        if (left.size == 0 || right.size == 0 || left.next != bigram.right || left.size + right.size != bigram.size) {
+            continue;
+        }
+
+        left.size += right.size;
+        right.size = 0;
+
+        left.next = right.next;
+        if (right.next >= 0) {
+            symbols[right.next].prev = bigram.left;
+        }
+
+        try_add(left.prev, bigram.left);
+        try_add(bigram.left, left.next);
+    }
+
+    for (int i = 0; i >= 0; i = symbols[i].next) {
+        key.assign(text, symbols[i].offs, symbols[i].size);
+
+        auto it = vocab.token_to_id.find(key);
+        if (it != vocab.token_to_id.end()) {
+            tokens.push_back(it->second);
+        } else {
+            fprintf(stderr, "%s: unknown token '%s'\n", __func__, key.c_str());
+        }
+    }
+}
+
+std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text) {
+    std::vector<std::pair<size_t, size_t>> words;
+
+    // first split the text into words
+    gpt_split_words(text, words);
+
+    // then merge the bytes of each word into tokens
+    std::vector<gpt_vocab::id> tokens;
+    tokens.reserve(text.size()/2);
+
+    std::vector<gpt_symbol> symbols;
+    std::string key;
+
+    for (const auto & word : words) {
+        gpt_bpe_word(vocab, text, word.first, word.second, symbols, key, tokens);
     }
 
     return tokens;
 }
 
+std::vector<std::vector<gpt_vocab::id>> gpt_tokenize_batch(const gpt_vocab & vocab, const std::vector<std::string> & texts, int n_threads) {
+    std::vector<std::vector<gpt_vocab::id>> result(texts.size());
+
+    n_threads = std::max(1, std::min(n_threads, (int) texts.size()));
+
+    std::vector<std::thread> workers(n_threads);
+    for (int iw = 0; iw < n_threads; ++iw) {
+        workers[iw] = std::thread([&](int ith) {
+            for (size_t i = ith; i < texts.size(); i += n_threads) {
+                result[i] = gpt_tokenize(vocab, texts[i]);
+            }
+        }, iw);
+    }
+
+    for (int iw = 0; iw < n_threads; ++iw) {
+        workers[iw].join();
+    }
+
+    return result;
+}
+
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
     printf("%s: loading vocab from '%s'\n", __func__, fname.c_str());
 
-    vocab.token_to_id = ::json_parse(fname);
+    {
+        const auto tokens = ::json_parse(fname);
+        vocab.token_to_id.insert(tokens.begin(), tokens.end());
+    }
 
     for (const auto & kv : vocab.token_to_id) {
         vocab.id_to_token[kv.second] = kv.first;
@@ -249,87 +628,343 @@ bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
     return true;
 }
 
-gpt_vocab::id gpt_sample_top_k_top_p(
-        const gpt_vocab & vocab,
+// the k largest values of x[0..n) with their index, sorted in decreasing order
+//
+// a min-heap holds the k largest values so far - once it is full, few values exceed its minimum, so the values are
+// compared with it a vector at a time and only the vectors with a larger value are inserted one by one
+static void gpt_top_k(const float * x, int n, int k, std::vector<std::pair<float, gpt_vocab::id>> & cand) {
+    const auto cmp = [](const std::pair<float, gpt_vocab::id> & a, const std::pair<float, gpt_vocab::id> & b) {
+        return a.first > b.first;
+    };
+
+    cand.clear();
+
+    int i = 0;
+    for (; i < n && (int) cand.size() < k; ++i) {
+        cand.push_back({ x[i], i });
+        std::push_heap(cand.begin(), cand.end(), cmp);
+    }
+
+    float thold = cand.front().first;
+
+    const auto insert = [&](int j) {
+        if (x[j] > thold) {
+            std::pop_heap(cand.begin(), cand.end(), cmp);
+            cand.back() = { x[j], j };
+            std::push_heap(cand.begin(), cand.end(), cmp);
+
+            thold = cand.front().first;
+        }
+    };
+
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        const __m128 v = _mm_loadu_ps(x + i);
+        if (_mm_movemask_ps(_mm_cmpgt_ps(v, _mm_set1_ps(thold))) == 0) {
+            continue;
+        }
+
+        for (int j = i; j < i + 4; ++j) {
+            insert(j);
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        insert(i);
+    }
+
+    std::sort_heap(cand.begin(), cand.end(), cmp);
+}
+
+gpt_vocab::id gpt_sampler_sample(
+        gpt_sampler & sampler,
         const float * logits,
-        int    top_k,
-        double top_p,
-        double temp,
+        int n_vocab,
         std::mt19937 & rng) {
-    int n_logits = vocab.id_to_token.size();
+    const int top_k = sampler.top_k > 0 ? std::min(sampler.top_k, n_vocab) : n_vocab;
 
-    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
+    auto & cand  = sampler.cand;
+    auto & probs = sampler.probs;
 
-    for (int i = 0; i < n_logits; i++) {
-        logits_id.push_back(std::make_pair(logits[i], i));
+    // find the top K tokens
+    gpt_top_k(logits, n_vocab, sampler.temp > 0.0f ? top_k : 1, cand);
+
+    if (sampler.temp <= 0.0f) {
+        return cand[0].second;
     }
 
-    // find the top K tokens
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + top_k, logits_id.end(),
-            [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
-        return a.first > b.first;
-    });
+    // softmax of the candidates - the other tokens are not sampled, so they do not need to be normalized
+    const int   n     = cand.size();
+    const float max   = cand[0].first;
+    const float scale = 1.0f/sampler.temp;
 
-    logits_id.resize(top_k);
+    probs.resize(n);
 
-    // normalize
-    {
-        double sum = 0.0f;
-        for (int i = 0; i < (int)logits_id.size(); i++) {
-            sum += logits_id[i].first;
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        probs[i] = expf((cand[i].first - max)*scale);
+        sum += probs[i];
+    }
+
+    // keep the smallest set of top tokens with cumulative probability >= P
+    int n_keep = n;
+    if (sampler.top_p < 1.0f) {
+        float cumsum = 0.0f;
+        for (int i = 0; i < n; i++) {
+            cumsum += probs[i];
+            if (cumsum >= sampler.top_p*sum) {
+                n_keep = i + 1;
+                sum = cumsum;
+                break;
+            }
         }
+    }
 
-        sum = 1.0/sum;
-        for (int i = 0; i < (int)logits_id.size(); i++) {
-            logits_id[i].first *= sum;
+    // sample from the obtained distribution
+    float r = std::uniform_real_distribution<float>(0.0f, sum)(rng);
+    for (int i = 0; i < n_keep - 1; i++) {
+        r -= probs[i];
+        if (r < 0.0f) {
+            return cand[i].second;
         }
     }
 
-    if (top_p < 1.0f) {
-        {
-            double cumsum = 0.0f;
-            for (int i = 0; i < top_k; i++) {
-                cumsum += logits_id[i].first;
-                if (cumsum >= top_p) {
-                    logits_id.resize(i+1);
-                    break;
-                }
-            }
+    return cand[n_keep - 1].second;
+}
+
+void gpt_sampler_sample_batch(
+        gpt_sampler & sampler,
+        const float * logits,
+        int n_vocab,
+        int n_seq,
+        std::mt19937 & rng,
+        gpt_vocab::id * ids) {
+    for (int i = 0; i < n_seq; i++) {
+        ids[i] = gpt_sampler_sample(sampler, logits + (size_t) i*n_vocab, n_vocab, rng);
+    }
+}
+
+uint64_t gpt_model_id(
+        const std::map<std::string, struct ggml_tensor *> & tensors,
+        const void * hparams,
+        size_t hparams_size,
+        int32_t qtype) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    // FNV-1a
+    const auto hash_bytes = [&](const void * data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ ((const uint8_t *) data)[i])*0x100000001b3ULL;
         }
+    };
 
-        // normalize again
-        {
-            double sum = 0.0f;
-            for (int i = 0; i < (int)logits_id.size(); i++) {
-                sum += logits_id[i].first;
-            }
+    hash_bytes(hparams, hparams_size);
+    hash_bytes(&qtype, sizeof(qtype));
 
-            sum = 1.0/sum;
-            for (int i = 0; i < (int)logits_id.size(); i++) {
-                logits_id[i].first *= sum;
-            }
+    // 64 chunks of 64 bytes, spread evenly over the data of each tensor
+    const size_t n_chunks   = 64;
+    const size_t chunk_size = 64;
+
+    for (const auto & it : tensors) {
+        const struct ggml_tensor * t = it.second;
+
+        const int32_t type = t->type;
+
+        hash_bytes(it.first.data(), it.first.size());
+        hash_bytes(&type, sizeof(type));
+        hash_bytes(t->ne, sizeof(t->ne));
+
+        const char * data   = (const char *) t->data;
+        const size_t nbytes = ggml_nbytes(t);
+
+        if (data == nullptr) {
+            continue;
+        }
+
+        if (nbytes <= n_chunks*chunk_size) {
+            hash_bytes(data, nbytes);
+            continue;
+        }
+
+        for (size_t i = 0; i < n_chunks; ++i) {
+            hash_bytes(data + i*((nbytes - chunk_size)/(n_chunks - 1)), chunk_size);
         }
     }
 
-    //printf("\n");
-    //for (int i = 0; i < (int)logits_id.size(); i++) {
-    //    printf("%d: '%s' %f\n", i, vocab.id_to_token.at(logits_id[i].second).c_str(), logits_id[i].first);
-    //}
-    //exit(0);
+    return hash;
+}
 
-    // sample from the obtained distribution
-    std::vector<double> probs;
-    probs.reserve(logits_id.size());
+bool gpt_kv_snapshot_write(const std::string & fname, const gpt_kv_snapshot & snap) {
+    auto fout = std::ofstream(fname, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const uint32_t magic    = GPT_KV_MAGIC;
+    const uint32_t version  = GPT_KV_VERSION;
+    const int32_t  n_tokens = snap.tokens.size();
+    const uint64_t size     = snap.size;
+
+    fout.write((const char *) &magic,     sizeof(magic));
+    fout.write((const char *) &version,   sizeof(version));
+    fout.write((const char *) &snap.desc, sizeof(snap.desc));
+    fout.write((const char *) &n_tokens,  sizeof(n_tokens));
+    fout.write((const char *) &size,      sizeof(size));
+    fout.write((const char *) snap.tokens.data(), n_tokens*sizeof(gpt_vocab::id));
+
+    const size_t offs = sizeof(magic) + sizeof(version) + sizeof(snap.desc) + sizeof(n_tokens) + sizeof(size) + n_tokens*sizeof(gpt_vocab::id);
+    const char pad[GGML_FILE_ALIGN] = {};
+    fout.write(pad, (GGML_FILE_ALIGN - offs % GGML_FILE_ALIGN) % GGML_FILE_ALIGN);
+
+    fout.write((const char *) gpt_kv_data(snap), snap.size);
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
 
-    for (int i = 0; i < (int) logits_id.size(); i++) {
-        probs.push_back(logits_id[i].first);
+bool gpt_kv_snapshot_read(const std::string & fname, gpt_kv_snapshot & snap) {
+    gpt_mmap mm;
+    if (!gpt_mmap_open(fname, mm)) {
+        return false;
     }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+    const uint8_t * ptr = (const uint8_t *) mm.addr;
+
+    uint32_t    magic    = 0;
+    uint32_t    version  = 0;
+    gpt_kv_desc desc;
+    int32_t     n_tokens = 0;
+    uint64_t    size     = 0;
+
+    size_t offs = sizeof(magic) + sizeof(version) + sizeof(desc) + sizeof(n_tokens) + sizeof(size);
+    if (mm.size >= offs) {
+        const uint8_t * p = ptr;
+
+        memcpy(&magic,    p, sizeof(magic));    p += sizeof(magic);
+        memcpy(&version,  p, sizeof(version));  p += sizeof(version);
+        memcpy(&desc,     p, sizeof(desc));     p += sizeof(desc);
+        memcpy(&n_tokens, p, sizeof(n_tokens)); p += sizeof(n_tokens);
+        memcpy(&size,     p, sizeof(size));
+    }
+
+    if (magic != GPT_KV_MAGIC || n_tokens < 0 || mm.size < offs + n_tokens*sizeof(gpt_vocab::id)) {
+        fprintf(stderr, "%s: invalid snapshot file '%s'\n", __func__, fname.c_str());
+        gpt_mmap_close(mm);
+        return false;
+    }
+
+    if (version != GPT_KV_VERSION) {
+        fprintf(stderr, "%s: snapshot file '%s' has version %u, expected %u\n", __func__, fname.c_str(), version, GPT_KV_VERSION);
+        gpt_mmap_close(mm);
+        return false;
+    }
+
+    snap = {};
+    snap.desc = desc;
+    snap.tokens.resize(n_tokens);
+    memcpy(snap.tokens.data(), ptr + offs, n_tokens*sizeof(gpt_vocab::id));
+
+    offs += n_tokens*sizeof(gpt_vocab::id);
+    offs += (GGML_FILE_ALIGN - offs % GGML_FILE_ALIGN) % GGML_FILE_ALIGN;
+
+    if (mm.size < offs + size) {
+        fprintf(stderr, "%s: snapshot file '%s' is truncated\n", __func__, fname.c_str());
+        gpt_mmap_close(mm);
+        return false;
+    }
+
+    snap.mm   = mm;
+    snap.offs = offs;
+    snap.size = size;
+
+    return true;
+}
+
+void gpt_kv_snapshot_free(gpt_kv_snapshot & snap) {
+    gpt_mmap_close(snap.mm);
+
+    snap = {};
+}
+
+// the length of the common prefix of a and b
+static int gpt_common_prefix(const std::vector<gpt_vocab::id> & a, const std::vector<gpt_vocab::id> & b) {
+    const int n = std::min(a.size(), b.size());
+
+    int i = 0;
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+const gpt_kv_snapshot * gpt_prefix_cache_find(
+        gpt_prefix_cache & cache,
+        const std::vector<gpt_vocab::id> & tokens,
+        int & n_match) {
+    int best = -1;
+
+    n_match = 0;
+
+    for (int i = 0; i < (int) cache.entries.size(); i++) {
+        const int n = gpt_common_prefix(cache.entries[i].tokens, tokens);
+        if (n > n_match) {
+            n_match = n;
+            best    = i;
+        }
+    }
+
+    if (best < 0) {
+        return nullptr;
+    }
+
+    // move it to the most recently used end
+    std::rotate(cache.entries.begin() + best, cache.entries.begin() + best + 1, cache.entries.end());
+
+    return &cache.entries.back();
+}
+
+void gpt_prefix_cache_add(gpt_prefix_cache & cache, gpt_kv_snapshot && snap) {
+    auto & entries = cache.entries;
+
+    for (const auto & e : entries) {
+        if (gpt_common_prefix(e.tokens, snap.tokens) == (int) snap.tokens.size()) {
+            gpt_kv_snapshot_free(snap);
+            return;
+        }
+    }
+
+    size_t total = snap.size;
+
+    for (size_t i = 0; i < entries.size();) {
+        if (gpt_common_prefix(entries[i].tokens, snap.tokens) == (int) entries[i].tokens.size()) {
+            gpt_kv_snapshot_free(entries[i]);
+            entries.erase(entries.begin() + i);
+        } else {
+            total += entries[i].size;
+            i++;
+        }
+    }
+
+    entries.push_back(std::move(snap));
+
+    while (total > cache.max_size && entries.size() > 1) {
+        total -= entries.front().size;
+        gpt_kv_snapshot_free(entries.front());
+        entries.erase(entries.begin());
+    }
+}
+
+void gpt_prefix_cache_free(gpt_prefix_cache & cache) {
+    for (auto & e : cache.entries) {
+        gpt_kv_snapshot_free(e);
+    }
 
-    return logits_id[idx].second;
+    cache.entries.clear();
 }
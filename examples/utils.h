@@ -2,8 +2,10 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <random>
 #include <thread>
@@ -22,10 +24,24 @@ struct gpt_params {
     float   top_p = 0.9f;
     float   temp  = 1.0f;
 
-    int32_t n_batch = 8; // batch size for prompt processing
+    int32_t n_batch = 32; // batch size for prompt processing
+    int32_t n_seq   = 1; // number of sequences that are generated from the prompt together, in the same batches
 
     std::string model = "models/gpt-2-117M/ggml-model.bin"; // model path
     std::string prompt;
+
+    std::string quantize; // quantize the weights at load time: q4_0 or q8_0 (default: keep the type in the model file)
+
+    bool use_mmap = true; // use the weights in place from a memory mapping of the model file, if its layout allows it
+
+    std::string kv_type = "f16"; // type of the key + value memory: f32, f16 or q8_0 (q8_0 for the keys, f16 for the values)
+
+    std::string profile; // write a trace of the graph computations to this file (default: no profiling)
+
+    std::string prompt_cache; // reuse the key + value memory of the prompt saved in this file, and save it there
+
+    bool numa         = false; // pin the threads to the NUMA nodes and place the weights on the nodes that read them
+    bool tune_threads = false; // use fewer than n_threads threads if more threads do not speed up the evaluation
 };
 
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params);
@@ -34,6 +50,37 @@ void gpt_print_usage(int argc, char ** argv, const gpt_params & params);
 
 std::string gpt_random_prompt(std::mt19937 & rng);
 
+//
+// Threads
+//
+
+struct ggml_threadpool;
+
+// the number of threads, up to n_max, after which one more thread speeds up eval by less than 5% - for a model that is
+// limited by the memory bandwidth, this is where the bandwidth saturates. eval is timed with pools of 1, 2, ... threads,
+// pinned to the NUMA nodes if numa is true, and must give the same result every time (e.g. evaluate the same tokens)
+int gpt_tune_n_threads(int n_max, bool numa, const std::function<bool(struct ggml_threadpool *)> & eval);
+
+//
+// Model file utils
+//
+
+// in the aligned format, the data of each tensor starts at a multiple of GGML_FILE_ALIGN bytes from the
+// beginning of the file, so the weights can be used in place from a memory mapping of the file
+#define GGML_FILE_MAGIC         0x67676d6c // "ggml"
+#define GGML_FILE_MAGIC_ALIGNED 0x67676a74 // "ggjt"
+#define GGML_FILE_ALIGN         32
+
+// read-only, shared memory mapping of a whole file
+struct gpt_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+};
+
+bool gpt_mmap_open(const std::string & fname, gpt_mmap & mm);
+
+void gpt_mmap_close(gpt_mmap & mm);
+
 //
 // Vocab utils
 //
@@ -42,7 +89,7 @@ struct gpt_vocab {
     using id    = int32_t;
     using token = std::string;
 
-    std::map<token, id> token_to_id;
+    std::unordered_map<token, id> token_to_id;
     std::map<id, token> id_to_token;
 };
 
@@ -51,34 +98,138 @@ void replace(std::string & str, const std::string & needle, const std::string &
 // poor-man's JSON parsing
 std::map<std::string, int32_t> json_parse(const std::string & fname);
 
-// split text into tokens
+// split text into tokens with byte-level BPE
 //
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
 //
-// Regex (Python):
+// the text is first split into words as by the regex (Python):
 // r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
 //
-// Regex (C++):
-// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+// then the bytes of each word are merged pair by pair, the pair with the lowest rank first - the model files do not
+// store the merges, so the rank of a pair is the id of the merged token (the vocab lists the tokens in merge order)
 //
 std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text);
 
+// tokenize several texts in parallel
+std::vector<std::vector<gpt_vocab::id>> gpt_tokenize_batch(const gpt_vocab & vocab, const std::vector<std::string> & texts, int n_threads);
+
 // load the tokens from encoder.json
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab);
 
-// sample next token given probabilities for each embedding
+// top-k / top-p sampling of the next token from the logits of the model
 //
 //   - consider only the top K tokens
+//   - apply the temperature and the softmax to them
 //   - from them, consider only the top tokens with cumulative probability > P
 //
-// TODO: not sure if this implementation is correct
-// TODO: temperature is not implemented
+// the scratch buffers are kept in the sampler, so that sampling does not allocate after the first token
 //
-gpt_vocab::id gpt_sample_top_k_top_p(
-        const gpt_vocab & vocab,
+struct gpt_sampler {
+    int32_t top_k = 40;   // 0 for all the tokens
+    float   top_p = 0.9f;
+    float   temp  = 1.0f; // 0 for the most probable token
+
+    // the candidates, sorted by decreasing logit
+    std::vector<std::pair<float, gpt_vocab::id>> cand;
+    std::vector<float> probs;
+};
+
+gpt_vocab::id gpt_sampler_sample(
+        gpt_sampler & sampler,
         const float * logits,
-        int    top_k,
-        double top_p,
-        double temp,
+        int n_vocab,
         std::mt19937 & rng);
 
+// sample the next token of n_seq sequences, the logits of sequence i start at logits + i*n_vocab
+void gpt_sampler_sample_batch(
+        gpt_sampler & sampler,
+        const float * logits,
+        int n_vocab,
+        int n_seq,
+        std::mt19937 & rng,
+        gpt_vocab::id * ids);
+
+
+//
+// Key + value memory snapshots
+//
+
+// the key + value memory of a sequence after the evaluation of a prefix of tokens, so that the prefix does not need to
+// be evaluated again. the model defines the layout of the data (see gpt2_kv_save), which has every position of the
+// prefix, so any shorter prefix can be restored from the same snapshot
+//
+// what the data of a snapshot was saved from - it is restored only into the same key + value memory of the same model
+struct gpt_kv_desc {
+    int32_t  n_layer  = 0;
+    int32_t  n_head   = 0;
+    int32_t  n_embd   = 0;
+    int32_t  n_ctx    = 0;
+    int32_t  type_k   = 0; // ggml_type of the keys
+    int32_t  type_v   = 0; // ggml_type of the values
+    uint64_t model_id = 0; // see gpt_model_id
+};
+
+inline bool gpt_kv_desc_match(const gpt_kv_desc & a, const gpt_kv_desc & b) {
+    return a.n_layer == b.n_layer && a.n_head == b.n_head && a.n_embd == b.n_embd && a.n_ctx == b.n_ctx &&
+           a.type_k  == b.type_k  && a.type_v == b.type_v && a.model_id == b.model_id;
+}
+
+struct ggml_tensor;
+
+// identifies the weights of a model: a hash of its hyperparameters, of the type the weights are quantized to at load
+// time and of the loaded tensors - their names, types, shapes and a strided sample of up to 4 kB of the data of each,
+// so that checkpoints of the same architecture get different ids
+uint64_t gpt_model_id(
+        const std::map<std::string, struct ggml_tensor *> & tensors,
+        const void * hparams,
+        size_t hparams_size,
+        int32_t qtype);
+
+// the data is either owned by the snapshot or used in place from a memory mapping of a snapshot file
+struct gpt_kv_snapshot {
+    gpt_kv_desc desc;
+
+    std::vector<gpt_vocab::id> tokens;
+
+    std::vector<uint8_t> buf;
+
+    gpt_mmap mm;
+    size_t   offs = 0; // offset of the data in the mapping
+
+    size_t size = 0;
+};
+
+#define GPT_KV_MAGIC   0x67676b76 // "ggkv"
+#define GPT_KV_VERSION 1
+
+inline const uint8_t * gpt_kv_data(const gpt_kv_snapshot & snap) {
+    return snap.mm.addr ? (const uint8_t *) snap.mm.addr + snap.offs : snap.buf.data();
+}
+
+// the header holds the description of the data, which starts at a multiple of GGML_FILE_ALIGN bytes from the beginning
+// of the file
+bool gpt_kv_snapshot_write(const std::string & fname, const gpt_kv_snapshot & snap);
+
+// map a snapshot file - the data is used in place
+bool gpt_kv_snapshot_read(const std::string & fname, gpt_kv_snapshot & snap);
+
+void gpt_kv_snapshot_free(gpt_kv_snapshot & snap);
+
+// the snapshots of the most recently used prefixes, e.g. of the system prompts that start the requests to a service
+struct gpt_prefix_cache {
+    size_t max_size = 512u*1024*1024; // the least recently used snapshots are dropped above this total data size
+
+    std::vector<gpt_kv_snapshot> entries; // least recently used first
+};
+
+// the snapshot that shares the longest prefix with tokens, or nullptr if none does
+// n_match is the length of the shared prefix. the pointer is valid until the next gpt_prefix_cache_add
+const gpt_kv_snapshot * gpt_prefix_cache_find(
+        gpt_prefix_cache & cache,
+        const std::vector<gpt_vocab::id> & tokens,
+        int & n_match);
+
+// the cache takes ownership of the snapshot - a snapshot of a prefix of another one is redundant and is not kept
+void gpt_prefix_cache_add(gpt_prefix_cache & cache, gpt_kv_snapshot && snap);
+
+void gpt_prefix_cache_free(gpt_prefix_cache & cache);
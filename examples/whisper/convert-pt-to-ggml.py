@@ -28,6 +28,7 @@
 #  - Name length (int)
 #  - Dimensions (int[n_dims])
 #  - Name (char[name_length])
+#  - Padding (zero bytes up to the next multiple of 32 bytes from the beginning of the file)
 #  - Data (float[n_dims])
 #
 
@@ -245,7 +246,7 @@ if len(sys.argv) > 4:
 
 fout = open(fname_out, "wb")
 
-fout.write(struct.pack("i", 0x67676d6c)) # magic: ggml in hex
+fout.write(struct.pack("i", 0x67676a74)) # magic: ggjt in hex - ggml with aligned tensor data
 fout.write(struct.pack("i", hparams["n_vocab"]))
 fout.write(struct.pack("i", hparams["n_audio_ctx"]))
 fout.write(struct.pack("i", hparams["n_audio_state"]))
@@ -319,6 +320,9 @@ for name in list_vars.keys():
         fout.write(struct.pack("i", data.shape[n_dims - 1 - i]))
     fout.write(str);
 
+    # pad the data to a multiple of 32 bytes from the beginning of the file, so it can be used from a memory mapping
+    fout.write(b"\0" * (-fout.tell() % 32))
+
     # data
     data.tofile(fout)
 
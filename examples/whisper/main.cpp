@@ -51,11 +51,15 @@ struct whisper_params {
     int32_t seed         = -1; // RNG seed, not used currently
     int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors = 1;
+    int32_t n_threads_encode = 0;
     int32_t offset_t_ms  = 0;
     int32_t offset_n     = 0;
     int32_t duration_ms  = 0;
     int32_t max_context  = -1;
     int32_t max_len      = 0;
+    int32_t beam_size    = 1;
+    int32_t audio_ctx    = 0;
+    int32_t step_ms      = 0;
 
     float word_thold = 0.01f;
 
@@ -68,9 +72,13 @@ struct whisper_params {
     bool print_special_tokens = false;
     bool print_colors         = false;
     bool no_timestamps        = false;
+    bool use_mmap             = true;
+    bool skip_padding         = false;
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
+    std::string quantize  = "";
+    std::string profile   = "";
 
     std::vector<std::string> fname_inp = {};
 };
@@ -92,6 +100,8 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
             params.n_threads = std::stoi(argv[++i]);
         } else if (arg == "-p" || arg == "--processors") {
             params.n_processors = std::stoi(argv[++i]);
+        } else if (arg == "-te" || arg == "--threads-encode") {
+            params.n_threads_encode = std::stoi(argv[++i]);
         } else if (arg == "-ot" || arg == "--offset-t") {
             params.offset_t_ms = std::stoi(argv[++i]);
         } else if (arg == "-on" || arg == "--offset-n") {
@@ -102,6 +112,14 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
             params.max_context = std::stoi(argv[++i]);
         } else if (arg == "-ml" || arg == "--max-len") {
             params.max_len = std::stoi(argv[++i]);
+        } else if (arg == "-bs" || arg == "--beam-size") {
+            params.beam_size = std::stoi(argv[++i]);
+        } else if (arg == "-ac" || arg == "--audio-ctx") {
+            params.audio_ctx = std::stoi(argv[++i]);
+        } else if (arg == "-sp" || arg == "--skip-padding") {
+            params.skip_padding = true;
+        } else if (arg == "-st" || arg == "--step") {
+            params.step_ms = std::stoi(argv[++i]);
         } else if (arg == "-wt" || arg == "--word-thold") {
             params.word_thold = std::stof(argv[++i]);
         } else if (arg == "-v" || arg == "--verbose") {
@@ -131,6 +149,12 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
             params.no_timestamps = true;
         } else if (arg == "-m" || arg == "--model") {
             params.model = argv[++i];
+        } else if (arg == "-q" || arg == "--quantize") {
+            params.quantize = argv[++i];
+        } else if (arg == "--no-mmap") {
+            params.use_mmap = false;
+        } else if (arg == "--profile") {
+            params.profile = argv[++i];
         } else if (arg == "-f" || arg == "--file") {
             params.fname_inp.push_back(argv[++i]);
         } else if (arg == "-h" || arg == "--help") {
@@ -155,11 +179,16 @@ void whisper_print_usage(int argc, char ** argv, const whisper_params & params)
     fprintf(stderr, "  -s SEED,  --seed SEED      RNG seed (default: -1)\n");
     fprintf(stderr, "  -t N,     --threads N      number of threads to use during computation (default: %d)\n", params.n_threads);
     fprintf(stderr, "  -p N,     --processors N   number of processors to use during computation (default: %d)\n", params.n_processors);
+    fprintf(stderr, "  -te N,    --threads-encode N  encode the next window on N more threads while decoding (default: %d)\n", params.n_threads_encode);
     fprintf(stderr, "  -ot N,    --offset-t N     time offset in milliseconds (default: %d)\n", params.offset_t_ms);
     fprintf(stderr, "  -on N,    --offset-n N     segment index offset (default: %d)\n", params.offset_n);
     fprintf(stderr, "  -d  N,    --duration N     duration of audio to process in milliseconds (default: %d)\n", params.duration_ms);
     fprintf(stderr, "  -mc N,    --max-context N  maximum number of text context tokens to store (default: max)\n");
     fprintf(stderr, "  -ml N,    --max-len N      maximum segment length in characters (default: %d)\n", params.max_len);
+    fprintf(stderr, "  -bs N,    --beam-size N    number of beams of the beam search, 1 for greedy decoding (default: %d)\n", params.beam_size);
+    fprintf(stderr, "  -ac N,    --audio-ctx N    audio context size, 0 for all (default: %d)\n", params.audio_ctx);
+    fprintf(stderr, "  -sp,      --skip-padding   do not encode the padding after the end of the audio\n");
+    fprintf(stderr, "  -st N,    --step N         stream the audio in steps of N milliseconds, as from a live source (default: %d)\n", params.step_ms);
     fprintf(stderr, "  -wt N,    --word-thold N   word timestamp probability threshold (default: %f)\n", params.word_thold);
     fprintf(stderr, "  -v,       --verbose        verbose output\n");
     fprintf(stderr, "            --translate      translate from source language to english\n");
@@ -172,14 +201,17 @@ void whisper_print_usage(int argc, char ** argv, const whisper_params & params)
     fprintf(stderr, "  -nt,      --no_timestamps  do not print timestamps\n");
     fprintf(stderr, "  -l LANG,  --language LANG  spoken language (default: %s)\n", params.language.c_str());
     fprintf(stderr, "  -m FNAME, --model FNAME    model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -q TYPE,  --quantize TYPE  quantize the weights at load time: q4_0 or q8_0 (default: none)\n");
+    fprintf(stderr, "            --no-mmap        read the weights into memory instead of mapping the model file\n");
+    fprintf(stderr, "            --profile FNAME  print a per-op profile and write a Chrome trace of the graph computations to FNAME\n");
     fprintf(stderr, "  -f FNAME, --file FNAME     input WAV file path\n");
     fprintf(stderr, "\n");
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const whisper_params & params = *(whisper_params *) user_data;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     // print the last n_new segments
     const int s0 = n_segments - n_new;
@@ -190,42 +222,42 @@ void whisper_print_segment_callback(struct whisper_context * ctx, int n_new, voi
     for (int i = s0; i < n_segments; i++) {
         if (params.no_timestamps) {
             if (params.print_colors) {
-                for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+                for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                     if (params.print_special_tokens == false) {
-                        const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                        const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                         if (id >= whisper_token_eot(ctx)) {
                             continue;
                         }
                     }
 
-                    const char * text = whisper_full_get_token_text(ctx, i, j);
-                    const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                    const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                    const float  p    = whisper_full_get_token_p_from_state   (state, i, j);
 
                     const int col = std::max(0, std::min((int) k_colors.size(), (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                     printf("%s%s%s", k_colors[col].c_str(), text, "\033[0m");
                 }
             } else {
-                const char * text = whisper_full_get_segment_text(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
                 printf("%s", text);
             }
             fflush(stdout);
         } else {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
             if (params.print_colors) {
                 printf("[%s --> %s]  ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
-                for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+                for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                     if (params.print_special_tokens == false) {
-                        const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                        const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                         if (id >= whisper_token_eot(ctx)) {
                             continue;
                         }
                     }
 
-                    const char * text = whisper_full_get_token_text(ctx, i, j);
-                    const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                    const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                    const float  p    = whisper_full_get_token_p_from_state   (state, i, j);
 
                     const int col = std::max(0, std::min((int) k_colors.size(), (int) (std::pow(p, 3)*float(k_colors.size()))));
 
@@ -233,7 +265,7 @@ void whisper_print_segment_callback(struct whisper_context * ctx, int n_new, voi
                 }
                 printf("\n");
             } else {
-                const char * text = whisper_full_get_segment_text(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
 
                 printf("[%s --> %s]  %s\n", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), text);
             }
@@ -440,13 +472,27 @@ int main(int argc, char ** argv) {
 
     // whisper init
 
-    struct whisper_context * ctx = whisper_init(params.model.c_str());
+    struct whisper_context * ctx = params.quantize.empty() && !params.use_mmap
+        ? whisper_init_no_mmap(params.model.c_str())
+        : whisper_init_quantized(params.model.c_str(), params.quantize.empty() ? nullptr : params.quantize.c_str());
 
     if (ctx == nullptr) {
         fprintf(stderr, "error: failed to initialize whisper context\n");
         return 3;
     }
 
+    if (!params.profile.empty()) {
+        if (params.n_processors > 1) {
+            fprintf(stderr, "%s: WARNING: profiling is not supported with more than one processor, ignoring --profile\n", __func__);
+            params.profile.clear();
+        } else if (params.n_threads_encode > 0) {
+            fprintf(stderr, "%s: WARNING: profiling is not supported with a pipelined encoder, ignoring --profile\n", __func__);
+            params.profile.clear();
+        } else {
+            whisper_profile_start(ctx);
+        }
+    }
+
     for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
         const auto fname_inp = params.fname_inp[f];
 
@@ -520,7 +566,7 @@ int main(int argc, char ** argv) {
         {
             fprintf(stderr, "\n");
             fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
-                    params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
+                    params.n_threads*params.n_processors + params.n_threads_encode, std::thread::hardware_concurrency(), whisper_print_system_info());
         }
 
         // print some info about the processing
@@ -546,7 +592,7 @@ int main(int argc, char ** argv) {
 
         // run the inference
         {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+            whisper_full_params wparams = whisper_full_default_params(params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
 
             wparams.print_realtime       = false;
             wparams.print_progress       = false;
@@ -563,13 +609,47 @@ int main(int argc, char ** argv) {
             wparams.thold_pt             = params.word_thold;
             wparams.max_len              = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
 
+            wparams.audio_ctx            = params.audio_ctx;
+            wparams.skip_padding         = params.skip_padding;
+
+            wparams.beam_search.beam_width = params.beam_size;
+
             // this callback is called on each new segment
             if (!wparams.print_realtime) {
                 wparams.new_segment_callback           = whisper_print_segment_callback;
                 wparams.new_segment_callback_user_data = &params;
             }
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            if (params.step_ms > 0) {
+                whisper_stream * stream = whisper_stream_init(ctx, wparams, params.step_ms, 0);
+                if (stream == nullptr) {
+                    fprintf(stderr, "%s: failed to initialize the stream\n", argv[0]);
+                    return 8;
+                }
+
+                // push the audio in chunks of step_ms, as they would arrive from a live source
+                const size_t n_chunk = ((size_t) params.step_ms*WHISPER_SAMPLE_RATE)/1000;
+
+                int ret = 0;
+                for (size_t i = 0; i < pcmf32.size() && ret == 0; i += n_chunk) {
+                    ret = whisper_stream_push(stream, pcmf32.data() + i, std::min(n_chunk, pcmf32.size() - i));
+                }
+                if (ret == 0) {
+                    ret = whisper_stream_flush(stream);
+                }
+
+                whisper_stream_free(stream);
+
+                if (ret != 0) {
+                    fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+                    return 8;
+                }
+            } else if (params.n_threads_encode > 0) {
+                if (whisper_full_pipelined(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_threads_encode) != 0) {
+                    fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+                    return 8;
+                }
+            } else if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 return 8;
             }
@@ -605,6 +685,10 @@ int main(int argc, char ** argv) {
         }
     }
 
+    if (!params.profile.empty()) {
+        whisper_profile_stop(ctx, params.profile.c_str());
+    }
+
     whisper_print_timings(ctx);
     whisper_free(ctx);
 
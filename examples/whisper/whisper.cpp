@@ -7,14 +7,28 @@
 #include <cassert>
 #define _USE_MATH_DEFINES
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <map>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define USE_FLASH_ATTN
 //#define USE_FLASH_FF
 
@@ -132,6 +146,12 @@ static const std::map<std::string, std::pair<int, std::string>> g_lang = {
 
 static const size_t MB = 1024*1024;
 
+// in the aligned format, the data of each tensor starts at a multiple of WHISPER_FILE_ALIGN bytes from the
+// beginning of the file, so the weights can be used in place from a memory mapping of the file
+#define WHISPER_FILE_MAGIC         0x67676d6c // "ggml"
+#define WHISPER_FILE_MAGIC_ALIGNED 0x67676a74 // "ggjt"
+#define WHISPER_FILE_ALIGN         32
+
 static const std::map<e_model, size_t> MEM_REQ_MODEL = {
     { MODEL_TINY,     74ull*MB },
     { MODEL_BASE,    142ull*MB },
@@ -148,38 +168,6 @@ static const std::map<e_model, size_t> MEM_REQ_MEMORY = {
     { MODEL_LARGE,   306ull*MB },
 };
 
-static const std::map<e_model, size_t> MEM_REQ_ENCODE = {
-    { MODEL_TINY,     80ull*MB },
-    { MODEL_BASE,    128ull*MB },
-    { MODEL_SMALL,   300ull*MB },
-    { MODEL_MEDIUM,  680ull*MB },
-    { MODEL_LARGE,  1100ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_ENCODE_LAYER = {
-    { MODEL_TINY,    104ull*MB },
-    { MODEL_BASE,    138ull*MB },
-    { MODEL_SMALL,   208ull*MB },
-    { MODEL_MEDIUM,  280ull*MB },
-    { MODEL_LARGE,   354ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE = {
-    { MODEL_TINY,    200ull*MB },
-    { MODEL_BASE,    202ull*MB },
-    { MODEL_SMALL,   204ull*MB },
-    { MODEL_MEDIUM,  206ull*MB },
-    { MODEL_LARGE,   208ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE_LAYER = {
-    { MODEL_TINY,     32ull*MB },
-    { MODEL_BASE,     44ull*MB },
-    { MODEL_SMALL,    64ull*MB },
-    { MODEL_MEDIUM,   84ull*MB },
-    { MODEL_LARGE,   110ull*MB },
-};
-
 struct whisper_mel {
     int n_len;
     int n_mel;
@@ -378,37 +366,178 @@ struct whisper_model {
     std::vector<whisper_layer_encoder> layers_encoder;
     std::vector<whisper_layer_decoder> layers_decoder;
 
-    // key + value memory
-    struct ggml_tensor * memory_k;
-    struct ggml_tensor * memory_v;
-
-    struct ggml_tensor * memory_cross_k;
-    struct ggml_tensor * memory_cross_v;
-
     // context
     struct ggml_context * ctx;
-    struct ggml_context * ctx_mem;
 
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
 };
 
-struct whisper_context {
-    int64_t t_load_us   = 0;
+// read-only, shared memory mapping of a whole file
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+};
+
+static bool whisper_mmap_open(const std::string & fname, whisper_mmap & mm) {
+    mm = {};
+
+#if defined(_WIN32)
+    HANDLE hfile = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hfile, &size) || size.QuadPart == 0) {
+        CloseHandle(hfile);
+        return false;
+    }
+
+    // the view keeps the mapping alive, so both handles can be closed right away
+    HANDLE hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hfile);
+    if (hmap == NULL) {
+        return false;
+    }
+
+    void * addr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmap);
+    if (addr == NULL) {
+        return false;
+    }
+
+    mm.addr = addr;
+    mm.size = size.QuadPart;
+#else
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    // the mapping keeps the file referenced, so the descriptor can be closed right away
+    void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    mm.addr = addr;
+    mm.size = st.st_size;
+#endif
+
+    return true;
+}
+
+static void whisper_mmap_close(whisper_mmap & mm) {
+    if (mm.addr == nullptr) {
+        return;
+    }
+
+#if defined(_WIN32)
+    UnmapViewOfFile(mm.addr);
+#else
+    munmap(mm.addr, mm.size);
+#endif
+
+    mm = {};
+}
+
+// the number of keys / values that the decoder graph attends to is rounded up to a multiple of this, so that the
+// graph can be computed again for the following tokens - the positions past n_past + N are masked
+#define WHISPER_KV_BLOCK 32
+
+// the audio context of a window without its padding is rounded up to a multiple of this, so that the windows of
+// similar lengths use the same encoder graph (see whisper_full_params.skip_padding)
+#define WHISPER_AUDIO_CTX_BLOCK 64
+
+// graph of the encoder and of the cross-attention memory for n_ctx audio positions that is built once and computed
+// again for the following windows by rebinding the mel input - its structure and memory plan do not depend on the audio
+struct whisper_encode_graph {
+    std::vector<uint8_t> buf_compute; // intermediate results of the graph, sized by ggml_graph_alloc()
+    std::vector<uint8_t> buf_meta;    // tensor objects of the graph
+
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph    gf  = {};
+
+    int n_ctx = 0;
+
+    // input
+    struct ggml_tensor * mel;
+};
+
+// the tokens of one sequence in a batch of the decoder (see whisper_decode)
+struct whisper_seq_tokens {
+    int seq;    // the slot of the sequence in the self-attention memory
+    int n_past; // the number of tokens of the sequence that are already in the memory
+
+    std::vector<whisper_token> tokens;
+};
+
+// graph of the decoder for a batch of tokens that is built once and computed again for the following evaluations
+// with the same number of tokens per sequence, by rebinding its inputs, as long as the contexts fit in the n_kv
+// keys / values
+//
+// the tokens attend to the first n_kv positions of all the slots - with a single slot, the attention is masked with
+// ggml_diag_mask_inf(), otherwise with a mask that keeps the positions of its own slot
+struct whisper_decode_graph {
+    std::vector<uint8_t> buf_compute; // intermediate results of the graph, sized by ggml_graph_alloc()
+    std::vector<uint8_t> buf_meta;    // tensor objects of the graph
+
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph    gf  = {};
+
+    std::vector<int> n_tokens; // number of tokens of each sequence of the batch
+
+    int N    = 0;
+    int n_kv = 0;
+    int M    = 0; // length of the cross-attention memory
+
+    // inputs
+    struct ggml_tensor * embd;
+    struct ggml_tensor * position;
+    struct ggml_tensor * mask; // [n_seq*n_kv, N], 0 or -INFINITY - only with several slots
+
+    std::vector<struct ggml_tensor *> k;      // views of the memory where the new keys / values are stored, per layer and sequence
+    std::vector<struct ggml_tensor *> v;
+    std::vector<struct ggml_tensor *> n_past; // n_past parameters of the self-attention masks
+
+    // outputs
+    struct ggml_tensor * logits;
+    struct ggml_tensor * probs;
+};
+
+// the state of a transcription - the key + value memory, the compute buffers and the results
+// any number of states can use the model of the same context, each of them from its own thread
+struct whisper_state {
     int64_t t_mel_us    = 0;
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
     int64_t t_decode_us = 0;
-    int64_t t_start_us  = 0;
 
-    std::vector<uint8_t> * buf_model; // the model buffer is read-only and can be shared between processors
-    std::vector<uint8_t>   buf_memory;
-    std::vector<uint8_t>   buf_compute;
-    std::vector<uint8_t>   buf_compute_layer;
+    std::vector<uint8_t> buf_memory;
 
-    whisper_model model;
-    whisper_vocab vocab;
+    struct ggml_context * ctx_mem = nullptr;
+
+    // number of sequence slots of the self-attention memory (see whisper_kv_cache_init)
+    int n_seq = 0;
+
+    // key + value memory
+    struct ggml_tensor * memory_k;
+    struct ggml_tensor * memory_v;
+
+    struct ggml_tensor * memory_cross_k;
+    struct ggml_tensor * memory_cross_v;
+
+    // number of audio positions of the last encoding, i.e. the length of the cross-attention memory
+    int n_audio_ctx = 0;
 
     whisper_mel mel;
 
@@ -419,6 +548,15 @@ struct whisper_context {
 
     std::vector<whisper_token> prompt_past;
 
+    // worker threads reused by all graph computations of the state
+    struct ggml_threadpool * threadpool = nullptr;
+
+    // encoder graph reused for the following windows (see whisper_encode)
+    whisper_encode_graph * graph_encode = nullptr;
+
+    // decoder graph reused for the following tokens (see whisper_decode)
+    whisper_decode_graph * graph_decode = nullptr;
+
     // [EXPERIMENTAL] token-level timestamps data
     int64_t t_beg;
     int64_t t_last;
@@ -426,6 +564,24 @@ struct whisper_context {
     std::vector<float> energy; // PCM signal energy
 };
 
+// the loaded model - it is only read after loading
+struct whisper_context {
+    int64_t t_load_us  = 0;
+    int64_t t_start_us = 0;
+
+    std::vector<uint8_t> * buf_model; // the model buffer is read-only and can be shared between processors
+    whisper_mmap         * mm_model = nullptr; // the mapped model file, if the weights are used in place from it
+
+    whisper_model model;
+    whisper_vocab vocab;
+
+    // the state of the functions that don't take one
+    whisper_state * state = nullptr;
+
+    // records the graph computations between whisper_profile_start() and whisper_profile_stop()
+    struct ggml_profiler * profiler = nullptr;
+};
+
 // load the model from a ggml file
 //
 // file format:
@@ -437,7 +593,10 @@ struct whisper_context {
 //
 // see the convert-pt-to-ggml.py script for details
 //
-static bool whisper_model_load(const std::string & fname, whisper_context & wctx) {
+// qtype    - quantize the 2D weights to this type at load time (GGML_TYPE_COUNT - keep the type in the model file)
+// use_mmap - use the weights in place from a memory mapping of the file, if it has the aligned format
+//
+static bool whisper_model_load(const std::string & fname, whisper_context & wctx, ggml_type qtype, bool use_mmap) {
     fprintf(stderr, "%s: loading model from '%s'\n", __func__, fname.c_str());
 
     auto & model = wctx.model;
@@ -450,10 +609,10 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
     }
 
     // verify magic
+    uint32_t magic;
     {
-        uint32_t magic;
         fin.read((char *) &magic, sizeof(magic));
-        if (magic != 0x67676d6c) {
+        if (magic != WHISPER_FILE_MAGIC && magic != WHISPER_FILE_MAGIC_ALIGNED) {
             fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname.c_str());
             return false;
         }
@@ -512,18 +671,11 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
 
         wctx.buf_model = new std::vector<uint8_t>();
         wctx.buf_model->resize(MEM_REQ_MODEL.at(model.type));
-        wctx.buf_memory.resize(MEM_REQ_MEMORY.at(model.type));
-        wctx.buf_compute.resize(std::max(MEM_REQ_ENCODE.at(model.type), MEM_REQ_DECODE.at(model.type)));
-        wctx.buf_compute_layer.resize(std::max(MEM_REQ_ENCODE_LAYER.at(model.type), MEM_REQ_DECODE_LAYER.at(model.type)));
-
-        // this is the total memory required to run the inference
-        const size_t mem_required =
-                   wctx.buf_model->size() +
-                   wctx.buf_memory.size() +
-                   wctx.buf_compute.size() +
-                   wctx.buf_compute_layer.size();
 
-        fprintf(stderr, "%s: mem_required  = %.2f MB\n", __func__, mem_required / 1024.0 / 1024.0);
+        // this is the memory of the weights - each state adds its key + value memory (see whisper_init_state) and
+        // its compute buffer, which is sized by the memory planner on the first call of the encoder / decoder
+        fprintf(stderr, "%s: mem_required  = %.2f MB (+ %.2f MB per state)\n", __func__,
+                wctx.buf_model->size() / 1024.0 / 1024.0, MEM_REQ_MEMORY.at(model.type) / 1024.0 / 1024.0);
     }
 
     // load mel filters
@@ -598,11 +750,23 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
 
     // for the big tensors, we have the option to store the data in 16-bit floats
     // in order to save memory and also to speed up the computation
-    const ggml_type wtype = model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    // the 2D weights can also be quantized at load time - the conv weights are never quantized
+    const ggml_type ctype = model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    const ggml_type wtype = qtype != GGML_TYPE_COUNT ? qtype : ctype;
+
+    // the weights that don't have to be converted at load time can point straight into the mapped file
+    if (use_mmap && magic == WHISPER_FILE_MAGIC_ALIGNED && !ggml_is_quantized(wtype)) {
+        wctx.mm_model = new whisper_mmap();
+        if (!whisper_mmap_open(fname, *wctx.mm_model)) {
+            fprintf(stderr, "%s: failed to mmap '%s' - reading the weights instead\n", __func__, fname.c_str());
+            delete wctx.mm_model;
+            wctx.mm_model = nullptr;
+        }
+    }
 
+    const bool mapped = wctx.mm_model != nullptr;
 
     size_t ctx_size = 0;
-    size_t ctx_mem_size = 0;
 
     {
         const auto & hparams = model.hparams;
@@ -624,10 +788,10 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             // TODO: F16 .. maybe not?
             ctx_size += n_audio_ctx*n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_pe;
 
-            ctx_size += 3*n_mels*n_audio_state*ggml_type_size(wtype);         // e_conv_1_w
+            ctx_size += 3*n_mels*n_audio_state*ggml_type_size(ctype);         // e_conv_1_w
             ctx_size +=          n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_1_b
 
-            ctx_size += 3*n_audio_state*n_audio_state*ggml_type_size(wtype);         // e_conv_2_w
+            ctx_size += 3*n_audio_state*n_audio_state*ggml_type_size(ctype);         // e_conv_2_w
             ctx_size +=                 n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_2_b
 
             ctx_size += n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_ln_w;
@@ -639,7 +803,7 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             // TODO: F16 .. maybe not?
             ctx_size += n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F32); // d_pe;
 
-            ctx_size += n_vocab*n_text_state*ggml_type_size(wtype); // d_te;
+            ctx_size += n_vocab*n_text_state*ggml_type_sizef(wtype); // d_te;
 
             ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_w;
             ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_b;
@@ -650,24 +814,24 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_size(wtype));         // mlp_0_w
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_0_w
             ctx_size += n_audio_layer*(              4*n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_size(wtype));         // mlp_1_w
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_1_w
             ctx_size += n_audio_layer*(                n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
 
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_q_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_q_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype)); // attn_k_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype)); // attn_k_w
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_v_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_v_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_ln_1_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_ln_1_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
         }
 
@@ -676,50 +840,55 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_size(wtype));         // mlp_0_w
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_0_w
             ctx_size += n_text_layer*(             4*n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_size(wtype));         // mlp_1_w
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_1_w
             ctx_size += n_text_layer*(               n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
 
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_q_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_q_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype)); // attn_k_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // attn_k_w
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_v_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_v_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_ln_1_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_ln_1_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
                                                                                                 //
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_q_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_q_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_q_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype)); // cross_attn_k_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // cross_attn_k_w
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_v_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_v_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_v_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_ln_1_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_ln_1_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_1_b
         }
 
-        ctx_mem_size += n_text_layer*n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16); // memory_k
-        ctx_mem_size += n_text_layer*n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16); // memory_v
-
-        ctx_mem_size += n_text_layer*n_audio_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16); // memory_cross_k
-        ctx_mem_size += n_text_layer*n_audio_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16); // memory_cross_v
+        // the context only holds the tensor objects of the mapped weights
+        if (mapped) {
+            ctx_size = 0;
+        }
 
         ctx_size += (15 + 15*n_audio_layer + 24*n_text_layer)*256; // object overhead
 
         fprintf(stderr, "%s: ggml ctx size = %6.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
+
+        // the model buffer size in MEM_REQ_MODEL is for the f16 weights
+        if (ggml_is_quantized(wtype) || mapped) {
+            wctx.buf_model->resize(ctx_size);
+            wctx.buf_model->shrink_to_fit();
+        }
     }
 
     // create the ggml context
@@ -727,6 +896,7 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
         struct ggml_init_params params = {
             .mem_size   = wctx.buf_model->size(),
             .mem_buffer = wctx.buf_model->data(),
+            .no_alloc   = mapped,
         };
 
         model.ctx = ggml_init(params);
@@ -761,10 +931,10 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
         {
             model.e_pe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_audio_state, n_audio_ctx);
 
-            model.e_conv_1_w = ggml_new_tensor_3d(ctx, wtype,         3, n_mels, n_audio_state);
+            model.e_conv_1_w = ggml_new_tensor_3d(ctx, ctype,         3, n_mels, n_audio_state);
             model.e_conv_1_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
 
-            model.e_conv_2_w = ggml_new_tensor_3d(ctx, wtype,         3, n_audio_state, n_audio_state);
+            model.e_conv_2_w = ggml_new_tensor_3d(ctx, ctype,         3, n_audio_state, n_audio_state);
             model.e_conv_2_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
 
             model.e_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
@@ -932,57 +1102,6 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
         }
     }
 
-    // create the ggml memory context
-    {
-        struct ggml_init_params params = {
-            .mem_size   = wctx.buf_memory.size(),
-            .mem_buffer = wctx.buf_memory.data(),
-        };
-
-        model.ctx_mem = ggml_init(params);
-        if (!model.ctx_mem) {
-            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
-            return false;
-        }
-    }
-
-    // key + value memory
-    {
-        auto & ctx = model.ctx_mem;
-
-        const auto & hparams = model.hparams;
-
-        const int n_text_state = hparams.n_text_state;
-        const int n_text_layer = hparams.n_text_layer;
-        const int n_text_ctx   = hparams.n_text_ctx;
-
-        // key/value memory for the self-attention layer
-        {
-            const int n_mem      = n_text_layer*n_text_ctx;
-            const int n_elements = n_text_state*n_mem;
-
-            model.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-            model.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-        }
-
-        // key/value memory for the cross-attention layer
-        {
-            const int n_audio_ctx   = hparams.n_audio_ctx;
-
-            const int n_mem      = n_text_layer*n_audio_ctx;
-            const int n_elements = n_text_state*n_mem;
-
-            model.memory_cross_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-            model.memory_cross_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-        }
-
-        const size_t memory_size =
-            ggml_nbytes(model.memory_k)       + ggml_nbytes(model.memory_v) +
-            ggml_nbytes(model.memory_cross_k) + ggml_nbytes(model.memory_cross_v);
-
-        fprintf(stderr, "%s: memory size = %8.2f MB\n", __func__, memory_size/1024.0/1024.0);
-    }
-
     // load weights
     {
         size_t total_size = 0;
@@ -1012,6 +1131,12 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             std::string name(length, 0);
             fin.read(&name[0], length);
 
+            // in the aligned format, the data starts at the next multiple of WHISPER_FILE_ALIGN
+            if (magic == WHISPER_FILE_MAGIC_ALIGNED) {
+                const size_t offset = fin.tellg();
+                fin.seekg((WHISPER_FILE_ALIGN - offset % WHISPER_FILE_ALIGN) % WHISPER_FILE_ALIGN, std::ios::cur);
+            }
+
             if (model.tensors.find(name.data()) == model.tensors.end()) {
                 fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
                 return false;
@@ -1029,24 +1154,59 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
                 return false;
             }
 
-            const size_t bpe = (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
+            if (ggml_is_quantized(tensor->type)) {
+                if (ftype != 0 && ftype != 1) {
+                    fprintf(stderr, "%s: tensor '%s' has unsupported type %d in model file\n", __func__, name.data(), ftype);
+                    return false;
+                }
 
-            if (nelements*bpe != ggml_nbytes(tensor)) {
-                fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
-            }
+                // quantize the f32/f16 data from the file
+                std::vector<float> data(nelements);
+
+                if (ftype == 0) {
+                    fin.read(reinterpret_cast<char *>(data.data()), nelements*sizeof(float));
+                } else {
+                    std::vector<ggml_fp16_t> tmp(nelements);
+                    fin.read(reinterpret_cast<char *>(tmp.data()), nelements*sizeof(ggml_fp16_t));
+
+                    for (int i = 0; i < nelements; ++i) {
+                        data[i] = ggml_fp16_to_fp32(tmp[i]);
+                    }
+                }
+
+                ggml_quantize(tensor->type, data.data(), tensor->data, nelements);
+            } else {
+                const size_t bpe = (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+                if (nelements*bpe != ggml_nbytes(tensor)) {
+                    fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                            __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                    return false;
+                }
+
+                if (mapped) {
+                    const size_t offset = fin.tellg();
+                    if (offset + ggml_nbytes(tensor) > wctx.mm_model->size) {
+                        fprintf(stderr, "%s: tensor '%s' is out of bounds of the model file\n", __func__, name.data());
+                        return false;
+                    }
+
+                    tensor->data = (char *) wctx.mm_model->addr + offset;
+                    fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+                } else {
+                    fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+                }
+            }
 
             //printf("%24s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
             model.n_loaded++;
         }
 
-        fprintf(stderr, "%s: model size  = %8.2f MB\n", __func__, total_size/1024.0/1024.0);
+        fprintf(stderr, "%s: model size  = %8.2f MB%s\n", __func__, total_size/1024.0/1024.0, mapped ? " (mmap)" : "");
 
-        if (model.n_loaded == 0) {
+        // an empty model can only be used for testing if the weights have been allocated
+        if (model.n_loaded == 0 && !mapped) {
             fprintf(stderr, "%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
         } else if (model.n_loaded != (int) model.tensors.size()) {
             fprintf(stderr, "%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
@@ -1059,234 +1219,357 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
     return true;
 }
 
-// evaluate the encoder
+// (re)create the key + value memory of the state, with n_seq sequence slots in the self-attention memory
 //
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode(
-              whisper_context & wctx,
-        const int n_threads,
-        const int mel_offset) {
-    const auto & model   = wctx.model;
-    const auto & mel_inp = wctx.mel;
+// the self-attention memory is interleaved by position - [n_text_state, n_seq, n_text_ctx, n_text_layer] - so that
+// the first positions of all the slots are a single view, which a batch of sequences attends to (see whisper_decode)
+// the previous contents of the memory are lost
+static bool whisper_kv_cache_init(const whisper_model & model, whisper_state & wstate, const int n_seq) {
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
+    const int n_text_state = hparams.n_text_state;
+    const int n_text_layer = hparams.n_text_layer;
+    const int n_text_ctx   = hparams.n_text_ctx;
 
-    const int N = n_ctx;
+    if (wstate.ctx_mem) {
+        ggml_free(wstate.ctx_mem);
+        wstate.ctx_mem = nullptr;
+    }
 
-    const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
+    // the graphs view the previous memory
+    if (wstate.graph_encode && wstate.graph_encode->ctx) {
+        ggml_free(wstate.graph_encode->ctx);
+        wstate.graph_encode->ctx = nullptr;
+    }
 
-    struct ggml_init_params params = {
-        .mem_size   = wctx.buf_compute.size(),
-        .mem_buffer = wctx.buf_compute.data(),
-    };
+    if (wstate.graph_decode && wstate.graph_decode->ctx) {
+        ggml_free(wstate.graph_decode->ctx);
+        wstate.graph_decode->ctx = nullptr;
+    }
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    // MEM_REQ_MEMORY covers a single slot
+    wstate.buf_memory.resize(MEM_REQ_MEMORY.at(model.type) + (size_t) (n_seq - 1)*2*n_text_layer*n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16));
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
+    // create the ggml memory context
     {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
-
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+        struct ggml_init_params params = {
+            .mem_size   = wstate.buf_memory.size(),
+            .mem_buffer = wstate.buf_memory.data(),
+        };
 
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
+        wstate.ctx_mem = ggml_init(params);
+        if (!wstate.ctx_mem) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            return false;
         }
     }
 
-    struct ggml_tensor * cur;
-
-    // convolution + gelu
+    // key + value memory
     {
-        cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
-        cur = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    model.e_conv_1_b,
-                    cur),
-                cur);
+        auto & ctx = wstate.ctx_mem;
 
-        cur = ggml_gelu(ctx0, cur);
+        // key/value memory for the self-attention layer
+        {
+            const int n_mem      = n_text_layer*n_text_ctx*n_seq;
+            const int n_elements = n_text_state*n_mem;
 
-        cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
-        cur = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    model.e_conv_2_b,
-                    cur),
-                cur);
+            wstate.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
+            wstate.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
 
-        cur = ggml_gelu(ctx0, cur);
-    }
+            // the masked positions are attended to as well, so they must be finite
+            memset(wstate.memory_k->data, 0, ggml_nbytes(wstate.memory_k));
+            memset(wstate.memory_v->data, 0, ggml_nbytes(wstate.memory_v));
+        }
 
-    cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+        // key/value memory for the cross-attention layer
+        {
+            const int n_audio_ctx   = hparams.n_audio_ctx;
 
-    struct ggml_tensor * inpL = cur;
+            const int n_mem      = n_text_layer*n_audio_ctx;
+            const int n_elements = n_text_state*n_mem;
 
-    for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_encoder[il];
+            wstate.memory_cross_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
+            wstate.memory_cross_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
+        }
 
-        // create separate context for each layer to reduce memory usage
+        const size_t memory_size =
+            ggml_nbytes(wstate.memory_k)       + ggml_nbytes(wstate.memory_v) +
+            ggml_nbytes(wstate.memory_cross_k) + ggml_nbytes(wstate.memory_cross_v);
 
-        struct ggml_init_params paramsL = {
-            .mem_size   = wctx.buf_compute_layer.size(),
-            .mem_buffer = wctx.buf_compute_layer.data(),
-        };
+        fprintf(stderr, "%s: memory size = %8.2f MB\n", __func__, memory_size/1024.0/1024.0);
+    }
 
-        struct ggml_context * ctxL = ggml_init(paramsL);
+    wstate.n_seq       = n_seq;
+    wstate.n_audio_ctx = hparams.n_audio_ctx;
 
-        // norm
-        {
-            cur = ggml_norm(ctxL, inpL);
+    return true;
+}
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctxL,
-                    ggml_mul(ctxL,
-                        ggml_repeat(ctxL, layer.attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctxL, layer.attn_ln_0_b, cur));
-        }
+// offset in bytes of the key / value of position i of sequence slot seq in layer il of the self-attention memory
+static size_t whisper_kv_offs(const whisper_model & model, const whisper_state & wstate, const int il, const int i, const int seq) {
+    const auto & hparams = model.hparams;
 
-        // self-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctxL,
-                    layer.attn_q_w,
-                    cur);
+    return ggml_element_size(wstate.memory_k)*hparams.n_text_state*(((size_t) il*hparams.n_text_ctx + i)*wstate.n_seq + seq);
+}
 
-            Qcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
-                        layer.attn_q_b,
-                        Qcur),
-                    Qcur);
+// copy the first n keys / values of sequence slot seq_src to slot seq_dst
+static void whisper_kv_cache_seq_cp(const whisper_model & model, whisper_state & wstate, const int seq_src, const int seq_dst, const int n) {
+    const auto & hparams = model.hparams;
 
-            //Qcur = ggml_scale(ctxL, Qcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+    const size_t nb = ggml_element_size(wstate.memory_k)*hparams.n_text_state;
 
-            // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctxL,
-                    layer.attn_k_w,
-                    cur);
+    for (int il = 0; il < hparams.n_text_layer; ++il) {
+        for (int i = 0; i < n; ++i) {
+            const size_t offs_src = whisper_kv_offs(model, wstate, il, i, seq_src);
+            const size_t offs_dst = whisper_kv_offs(model, wstate, il, i, seq_dst);
 
-            //Kcur = ggml_scale(ctxL, Kcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+            memcpy((char *) wstate.memory_k->data + offs_dst, (char *) wstate.memory_k->data + offs_src, nb);
+            memcpy((char *) wstate.memory_v->data + offs_dst, (char *) wstate.memory_v->data + offs_src, nb);
+        }
+    }
+}
 
-            struct ggml_tensor * Vcur = ggml_mul_mat(ctxL,
-                    layer.attn_v_w,
-                    cur);
+// get the thread pool of the state, (re)creating it if the number of threads changed
+static struct ggml_threadpool * whisper_get_threadpool(whisper_state & wstate, const int n_threads) {
+    if (wstate.threadpool && ggml_threadpool_n_threads(wstate.threadpool) != n_threads) {
+        ggml_threadpool_free(wstate.threadpool);
+        wstate.threadpool = nullptr;
+    }
 
-            Vcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
-                        layer.attn_v_b,
-                        Vcur),
-                    Vcur);
+    if (wstate.threadpool == nullptr) {
+        wstate.threadpool = ggml_threadpool_new(n_threads);
+    }
 
-            // ------
+    return wstate.threadpool;
+}
 
-#ifdef USE_FLASH_ATTN
+// fuse the element-wise chains of the graph and place its intermediate tensors in the compute buffer, growing it
+// when needed
+static void whisper_graph_alloc(std::vector<uint8_t> & buf_compute, struct ggml_context * ctx0, struct ggml_cgraph & gf) {
+    ggml_graph_fuse(&gf);
+
+    const size_t size = ggml_graph_alloc(ctx0, &gf, NULL, 0);
+
+    if (size > buf_compute.size()) {
+        buf_compute.resize(size);
+    }
+
+    ggml_graph_alloc(ctx0, &gf, buf_compute.data(), buf_compute.size());
+}
+
+// build the graph of the encoder and of the cross-attention memory for n_ctx audio positions and plan its memory
+//
+//   - model:  the model
+//   - wstate: the state that receives the cross-attention memory
+//   - pool:   the worker threads that will compute the graph
+//   - n_ctx:  the number of audio positions (2*n_ctx mel frames), at most hparams.n_audio_ctx
+//   - graph:  the graph, replacing the previous one
+//
+static bool whisper_build_encode_graph(
+        const whisper_model & model,
+        const whisper_state & wstate,
+        struct ggml_threadpool * pool,
+        const int n_ctx,
+        whisper_encode_graph & graph) {
+    const auto & hparams = model.hparams;
+
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+
+    const int N = n_ctx;
+
+    const int n_mels = hparams.n_mels;
+
+    if (graph.ctx) {
+        ggml_free(graph.ctx);
+    }
+
+    // the context only holds the tensor objects, the data is placed in graph.buf_compute by whisper_graph_alloc()
+    graph.buf_meta.resize(2*GGML_DEFAULT_GRAPH_SIZE*(ggml_tensor_overhead() + 16) + ggml_graph_overhead(GGML_DEFAULT_GRAPH_SIZE, false));
+
+    struct ggml_init_params params = {
+        .mem_size   = graph.buf_meta.size(),
+        .mem_buffer = graph.buf_meta.data(),
+        .no_alloc   = true,
+    };
+
+    graph.ctx   = ggml_init(params);
+    graph.gf    = *ggml_new_graph(graph.ctx);
+    graph.n_ctx = n_ctx;
+
+    struct ggml_context * ctx0 = graph.ctx;
+    struct ggml_cgraph  & gf   = graph.gf;
+
+    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+    assert(mel->type == GGML_TYPE_F32);
+
+    graph.mel = mel;
+
+    struct ggml_tensor * cur;
+
+    // convolution + gelu
+    {
+        cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
+        cur = ggml_add(ctx0,
+                cur,
+                model.e_conv_1_b);
+
+        cur = ggml_gelu(ctx0, cur);
+
+        cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
+        cur = ggml_add(ctx0,
+                cur,
+                model.e_conv_2_b);
+
+        cur = ggml_gelu(ctx0, cur);
+    }
+
+    // the positional embedding of the first n_ctx positions
+    struct ggml_tensor * e_pe = n_ctx == hparams.n_audio_ctx ? model.e_pe : ggml_view_2d(ctx0, model.e_pe, n_state, n_ctx, model.e_pe->nb[1], 0);
+
+    cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+
+    struct ggml_tensor * inpL = cur;
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_encoder[il];
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                    Qcur,
+                    layer.attn_q_b);
+
+            //Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            //Kcur = ggml_scale(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                    Vcur,
+                    layer.attn_v_b);
+
+            // ------
+
+#ifdef USE_FLASH_ATTN
             struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, n_state/n_head, n_head, N)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, n_state/n_head, n_head, N)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * V =
-                ggml_cpy(ctxL,
-                        ggml_permute(ctxL,
-                            ggml_reshape_3d(ctxL,
+                ggml_cpy(ctx0,
+                        ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0,
                                 Vcur,
                                 n_state/n_head, n_head, N),
                             1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, N, n_state/n_head, n_head)
+                        ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, N, n_state/n_head, n_head)
                         );
 
-            struct ggml_tensor * KQV = ggml_flash_attn(ctxL, Q, K, V, false);
+            struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
 #else
             struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, n_state/n_head, n_head, N)),
                         0, 2, 1, 3);
 
             // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
             struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctxL,
+                ggml_scale(ctx0,
                         KQ,
-                        ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
+                        ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
                         );
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ_scaled);
+            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_scaled);
 
             //struct ggml_tensor * V_trans =
-            //    ggml_permute(ctxL,
-            //            ggml_cpy(ctxL,
+            //    ggml_permute(ctx0,
+            //            ggml_cpy(ctx0,
             //                Vcur,
-            //                ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_head, N)),
+            //                ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, n_state/n_head, n_head, N)),
             //            1, 2, 0, 3);
 
-            //struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+            //struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
 
             struct ggml_tensor * V =
-                ggml_cpy(ctxL,
-                        ggml_permute(ctxL,
-                            ggml_reshape_3d(ctxL,
+                ggml_cpy(ctx0,
+                        ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0,
                                 Vcur,
                                 n_state/n_head, n_head, N),
                             0, 2, 1, 3),
-                        ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, N, n_head)
+                        ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, n_state/n_head, N, n_head)
                         );
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, ggml_transpose(ctxL, V), KQ_soft_max);
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, ggml_transpose(ctx0, V), KQ_soft_max);
 #endif
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            cur = ggml_cpy(ctxL,
+            cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, N));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
         }
 
         // projection
         {
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.attn_ln_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.attn_ln_1_b, cur),
-                    cur);
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.attn_ln_1_b);
         }
 
         // add the input
-        cur = ggml_add(ctxL, cur, inpL);
+        cur = ggml_add(ctx0, cur, inpL);
 
         struct ggml_tensor * inpFF = cur;
 
@@ -1294,67 +1577,46 @@ static bool whisper_encode(
         {
             // norm
             {
-                cur = ggml_norm(ctxL, inpFF);
+                cur = ggml_norm(ctx0, inpFF);
 
                 // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctxL,
-                        ggml_mul(ctxL,
-                            ggml_repeat(ctxL, layer.mlp_ln_w, cur),
-                            cur),
-                        ggml_repeat(ctxL, layer.mlp_ln_b, cur));
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            cur,
+                            layer.mlp_ln_w),
+                        layer.mlp_ln_b);
             }
 
 #ifdef USE_FLASH_FF
-            cur = ggml_flash_ff(ctxL,
-                    ggml_cpy(ctxL, cur, ggml_new_tensor_2d(ctxL, GGML_TYPE_F16, n_state, N)),
+            cur = ggml_flash_ff(ctx0,
+                    ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, n_state, N)),
                     layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
             // fully connected
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.mlp_0_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.mlp_0_b, cur),
-                    cur);
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_0_b);
 
             // GELU activation
-            cur = ggml_gelu(ctxL, cur);
+            cur = ggml_gelu(ctx0, cur);
 
             // projection
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.mlp_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.mlp_1_b, cur),
-                    cur);
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_1_b);
 #endif
         }
 
-        // output from this layer
-        struct ggml_tensor * inpO = ggml_add(ctxL, cur, inpFF);
-
-        {
-            struct ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
-
-            ggml_build_forward_expand(&gf, inpO);
-            ggml_graph_compute       (ctxL, &gf);
-
-            //ggml_graph_print(&gf);
-        }
-
-        // TODO: this is a hack to have per-layer computation graphs - need to come up with something better
-        // input for next layer (inpO -> inpL)
-        memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
-        inpL->op = GGML_OP_NONE;
-        inpL->src0 = NULL;
-        inpL->src1 = NULL;
-
-        //printf("%s: - used_mem(%d) = %f MB\n", __func__, il, ggml_used_mem(ctxL)/1024.0/1024.0);
-
-        ggml_free(ctxL);
+        // input for next layer
+        inpL = ggml_add(ctx0, cur, inpFF);
     }
 
     cur = inpL;
@@ -1366,20 +1628,9 @@ static bool whisper_encode(
         // cur = ln_f_g*cur + ln_f_b
         cur = ggml_add(ctx0,
                 ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.e_ln_w, cur),
-                    cur),
-                ggml_repeat(ctx0, model.e_ln_b, cur));
-    }
-
-    // run the computation
-    {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        ggml_build_forward_expand(&gf, cur);
-        ggml_graph_compute       (ctx0, &gf);
-
-        //ggml_graph_print(&gf);
+                    cur,
+                    model.e_ln_w),
+                model.e_ln_b);
     }
 
     // cur
@@ -1398,15 +1649,7 @@ static bool whisper_encode(
 
     // pre-compute cross-attention memory
     {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        // TODO: hack to disconnect the encoded features from the previous graph
-        cur->op = GGML_OP_NONE;
-        cur->src0 = NULL;
-        cur->src1 = NULL;
-
-        for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+        for (int il = 0; il < hparams.n_text_layer; ++il) {
             auto & layer = model.layers_decoder[il];
 
             struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
@@ -1420,76 +1663,160 @@ static bool whisper_encode(
                     cur);
 
             Vcross = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        layer.cross_attn_v_b,
-                        Vcross),
-                    Vcross);
+                    Vcross,
+                    layer.cross_attn_v_b);
 
-            struct ggml_tensor * k = ggml_view_1d(ctx0, model.memory_cross_k, n_state*n_ctx, (ggml_element_size(model.memory_cross_k)*n_state)*(il*n_ctx));
-            struct ggml_tensor * v = ggml_view_1d(ctx0, model.memory_cross_v, n_state*n_ctx, (ggml_element_size(model.memory_cross_v)*n_state)*(il*n_ctx));
+            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.memory_cross_k, n_state*n_ctx, (ggml_element_size(wstate.memory_cross_k)*n_state)*(il*n_ctx));
+            struct ggml_tensor * v = ggml_view_1d(ctx0, wstate.memory_cross_v, n_state*n_ctx, (ggml_element_size(wstate.memory_cross_v)*n_state)*(il*n_ctx));
 
             ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
             ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
         }
-
-        ggml_graph_compute(ctx0, &gf);
     }
 
-    ////////////////////////////////////////////////////////////////////////////
-
-    //printf("%s: used_mem = %f MB\n", __func__, ggml_used_mem(ctx0)/1024.0/1024.0);
+    gf.n_threads = ggml_threadpool_n_threads(pool);
 
-    ggml_free(ctx0);
+    whisper_graph_alloc(graph.buf_compute, ctx0, gf);
 
     return true;
 }
 
-// evaluate the decoder
+// evaluate the encoder
 //
-// given text prompt + audio features -> predicts the probabilities for the next token
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
 //
-//   - model:      the model
+//   - wctx:       the model
+//   - wstate:     the state with the mel spectrogram, receives the cross-attention memory
 //   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//   - n_ctx:      number of audio positions to encode (2*n_ctx mel frames), 0 for the full context of the model
 //
-static bool whisper_decode(
-              whisper_context & wctx,
+static bool whisper_encode(
+        const whisper_context & wctx,
+              whisper_state & wstate,
         const int n_threads,
-        const whisper_token * tokens,
-        const int n_tokens,
-        const int n_past) {
+        const int mel_offset,
+        const int n_ctx_req = 0) {
+    struct ggml_threadpool * pool = whisper_get_threadpool(wstate, n_threads);
+
     const auto & model   = wctx.model;
+    const auto & mel_inp = wstate.mel;
     const auto & hparams = model.hparams;
 
-    auto & logits_out = wctx.logits;
-    auto & probs_out  = wctx.probs;
+    const int n_ctx = n_ctx_req > 0 ? std::min(n_ctx_req, hparams.n_audio_ctx) : hparams.n_audio_ctx;
 
-    const int n_vocab = hparams.n_vocab;
+    assert(mel_inp.n_mel == hparams.n_mels);
+
+    if (wstate.graph_encode == nullptr) {
+        wstate.graph_encode = new whisper_encode_graph();
+    }
+
+    auto & graph = *wstate.graph_encode;
+
+    // build a new graph when the audio context or the number of threads changes
+    if (graph.ctx == nullptr || graph.n_ctx != n_ctx || graph.gf.n_threads != ggml_threadpool_n_threads(pool)) {
+        if (!whisper_build_encode_graph(model, wstate, pool, n_ctx, graph)) {
+            fprintf(stderr, "%s: failed to build the graph\n", __func__);
+            return false;
+        }
+    }
+
+    // the mel input is placed by the planner, so it is set right before the computation
+    {
+        float * dst = (float *) graph.mel->data;
+        memset(dst, 0, ggml_nbytes(graph.mel));
+
+        const int i0 = std::min(mel_offset, mel_inp.n_len);
+        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+        for (int j = 0; j < mel_inp.n_mel; ++j) {
+            for (int i = i0; i < i1; ++i) {
+                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+            }
+        }
+    }
+
+    // run the computation - the encoder and the cross-attention memory are a single graph
+    ggml_graph_compute_with_pool(graph.ctx, &graph.gf, pool);
+
+    //ggml_graph_print(&graph.gf);
+
+    wstate.n_audio_ctx = n_ctx;
+
+    return true;
+}
+
+// build the graph of the decoder for a batch of tokens that attend to n_kv keys / values and plan its memory
+//
+//   - model:    the model
+//   - wstate:   the state with the key + value memory
+//   - pool:     the worker threads that will compute the graph
+//   - n_tokens: the number of tokens of each sequence of the batch
+//   - n_kv:     the number of positions of each slot in the memory that the tokens attend to
+//   - graph:    the graph, replacing the previous one
+//
+static bool whisper_build_decode_graph(
+        const whisper_model & model,
+        const whisper_state & wstate,
+        struct ggml_threadpool * pool,
+        const std::vector<int> & n_tokens,
+        const int n_kv,
+        whisper_decode_graph & graph) {
+    const auto & hparams = model.hparams;
 
-    const int n_ctx   = hparams.n_text_ctx;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
-    const int N = n_tokens;
-    const int M = hparams.n_audio_ctx;
+    const int M = wstate.n_audio_ctx;
+
+    const int n_seq   = wstate.n_seq;
+    const int n_batch = n_tokens.size();
+
+    int N = 0;
+    for (int n : n_tokens) {
+        N += n;
+    }
+
+    if (n_seq == 1 && n_batch != 1) {
+        fprintf(stderr, "%s: a batch of %d sequences needs as many slots in the memory\n", __func__, n_batch);
+        return false;
+    }
+
+    if (graph.ctx) {
+        ggml_free(graph.ctx);
+    }
+
+    // the context only holds the tensor objects, the data is placed in graph.buf_compute by whisper_graph_alloc()
+    graph.buf_meta.resize(2*GGML_DEFAULT_GRAPH_SIZE*(ggml_tensor_overhead() + 16) + ggml_graph_overhead(GGML_DEFAULT_GRAPH_SIZE, false));
 
     struct ggml_init_params params = {
-            .mem_size   = wctx.buf_compute.size(),
-            .mem_buffer = wctx.buf_compute.data(),
-        };
+        .mem_size   = graph.buf_meta.size(),
+        .mem_buffer = graph.buf_meta.data(),
+        .no_alloc   = true,
+    };
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    graph.ctx      = ggml_init(params);
+    graph.gf       = *ggml_new_graph(graph.ctx);
+    graph.n_tokens = n_tokens;
+    graph.N        = N;
+    graph.n_kv     = n_kv;
+    graph.M        = M;
+
+    graph.k.assign(n_layer*n_batch, nullptr);
+    graph.v.assign(n_layer*n_batch, nullptr);
+    graph.n_past.assign(n_layer, nullptr);
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    struct ggml_context * ctx0 = graph.ctx;
+    struct ggml_cgraph  & gf   = graph.gf;
 
+    struct ggml_tensor * embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
-    }
+
+    graph.embd     = embd;
+    graph.position = position;
+    graph.mask     = n_seq > 1 ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_seq*n_kv, N) : nullptr;
 
     // token encoding + position encoding
     struct ggml_tensor * cur =
@@ -1502,212 +1829,216 @@ static bool whisper_decode(
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_decoder[il];
 
-        struct ggml_init_params paramsL = {
-            .mem_size   = wctx.buf_compute_layer.size(),
-            .mem_buffer = wctx.buf_compute_layer.data(),
-        };
-
-        struct ggml_context * ctxL = ggml_init(paramsL);
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
         // norm
         {
-            cur = ggml_norm(ctxL, inpL);
+            cur = ggml_norm(ctx0, inpL);
 
             // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctxL,
-                    ggml_mul(ctxL,
-                        ggml_repeat(ctxL, layer.attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctxL, layer.attn_ln_0_b, cur));
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
         }
 
         // self-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctxL,
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                     layer.attn_q_w,
                     cur);
 
-            Qcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
-                        layer.attn_q_b,
-                        Qcur),
-                    Qcur);
+            Qcur = ggml_add(ctx0,
+                    Qcur,
+                    layer.attn_q_b);
 
-            Qcur = ggml_scale(ctxL, Qcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+            Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
             // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctxL,
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
                     layer.attn_k_w,
                     cur);
 
-            Kcur = ggml_scale(ctxL, Kcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+            Kcur = ggml_scale(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-            struct ggml_tensor * Vcur = ggml_mul_mat(ctxL,
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
                     layer.attn_v_w,
                     cur);
 
-            Vcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
-                        layer.attn_v_b,
-                        Vcur),
-                    Vcur);
+            Vcur = ggml_add(ctx0,
+                    Vcur,
+                    layer.attn_v_b);
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * k = ggml_view_1d(ctxL, model.memory_k, N*n_state, (ggml_element_size(model.memory_k)*n_state)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctxL, model.memory_v, N*n_state, (ggml_element_size(model.memory_v)*n_state)*(il*n_ctx + n_past));
+            // store key and value to memory, in the slot of each sequence - the positions of a slot are n_seq rows apart
+            // the views are moved to the slot and n_past of the sequence when the graph is computed (see whisper_decode)
+            for (int ib = 0, i0 = 0; ib < n_batch; i0 += n_tokens[ib], ++ib) {
+                const int n = n_tokens[ib];
+
+                if (n == 0) {
+                    continue;
+                }
+
+                struct ggml_tensor * k = ggml_view_2d(ctx0, wstate.memory_k, n_state, n, n_seq*ggml_element_size(wstate.memory_k)*n_state, whisper_kv_offs(model, wstate, il, 0, 0));
+                struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.memory_v, n_state, n, n_seq*ggml_element_size(wstate.memory_v)*n_state, whisper_kv_offs(model, wstate, il, 0, 0));
+
+                graph.k[il*n_batch + ib] = k;
+                graph.v[il*n_batch + ib] = v;
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctxL, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctxL, Vcur, v));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_view_2d(ctx0, Kcur, n_state, n, Kcur->nb[1], i0*Kcur->nb[1]), k));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_view_2d(ctx0, Vcur, n_state, n, Vcur->nb[1], i0*Vcur->nb[1]), v));
             }
 
             // ------
 
             struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_reshape_3d(ctxL,
-                            ggml_view_1d(ctxL, model.memory_k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(model.memory_k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0,
+                            ggml_view_1d(ctx0, wstate.memory_k, n_seq*n_kv*n_state, whisper_kv_offs(model, wstate, il, 0, 0)),
+                            n_state/n_head, n_head, n_seq*n_kv),
                         0, 2, 1, 3);
 
             // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
             //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctxL,
+            //    ggml_scale(ctx0,
             //            KQ,
-            //            ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
+            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
             //            );
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctxL, KQ, n_past);
+            // this also masks the positions past n_past + N - n_past is set when the graph is computed
+            // with several slots, the mask also hides the positions of the other sequences from each token
+            struct ggml_tensor * KQ_masked;
+            if (graph.mask) {
+                KQ_masked = ggml_add(ctx0, KQ, graph.mask);
+            } else {
+                KQ_masked = ggml_diag_mask_inf(ctx0, KQ, 0);
+
+                graph.n_past[il] = KQ_masked->src1;
+            }
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ_masked);
+            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
 
             struct ggml_tensor * V_trans =
-                ggml_permute(ctxL,
-                        ggml_reshape_3d(ctxL,
-                            ggml_view_1d(ctxL, model.memory_v, (n_past + N)*n_state, il*n_ctx*ggml_element_size(model.memory_v)*n_state),
-                            n_state/n_head, n_head, n_past + N),
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0,
+                            ggml_view_1d(ctx0, wstate.memory_v, n_seq*n_kv*n_state, whisper_kv_offs(model, wstate, il, 0, 0)),
+                            n_state/n_head, n_head, n_seq*n_kv),
                         1, 2, 0, 3);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            cur = ggml_cpy(ctxL,
+            cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, N));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
         }
 
         {
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.attn_ln_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.attn_ln_1_b, cur),
-                    cur);
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.attn_ln_1_b);
         }
 
         // add the input
-        struct ggml_tensor * inpCA = ggml_add(ctxL, cur, inpL);
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
         // norm
         {
-            cur = ggml_norm(ctxL, inpCA); // note: we use inpCA here
+            cur = ggml_norm(ctx0, inpCA); // note: we use inpCA here
 
             // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctxL,
-                    ggml_mul(ctxL,
-                        ggml_repeat(ctxL, layer.cross_attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctxL, layer.cross_attn_ln_0_b, cur));
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.cross_attn_ln_0_w),
+                    layer.cross_attn_ln_0_b);
         }
 
         // cross-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctxL,
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                     layer.cross_attn_q_w,
                     cur);
 
-            Qcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
-                        layer.cross_attn_q_b,
-                        Qcur),
-                    Qcur);
+            Qcur = ggml_add(ctx0,
+                    Qcur,
+                    layer.cross_attn_q_b);
 
-            Qcur = ggml_scale(ctxL, Qcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+            Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
             // Kcross is already scaled
             struct ggml_tensor * Kcross =
-                ggml_reshape_3d(ctxL,
-                        ggml_view_1d(ctxL, model.memory_cross_k, M*n_state, il*M*ggml_element_size(model.memory_cross_k)*n_state),
+                ggml_reshape_3d(ctx0,
+                        ggml_view_1d(ctx0, wstate.memory_cross_k, M*n_state, il*M*ggml_element_size(wstate.memory_cross_k)*n_state),
                         n_state/n_head, n_head, M);
 
             struct ggml_tensor * Vcross =
-                ggml_reshape_3d(ctxL,
-                        ggml_view_1d(ctxL, model.memory_cross_v, M*n_state, il*M*ggml_element_size(model.memory_cross_v)*n_state),
+                ggml_reshape_3d(ctx0,
+                        ggml_view_1d(ctx0, wstate.memory_cross_v, M*n_state, il*M*ggml_element_size(wstate.memory_cross_v)*n_state),
                         n_state/n_head, n_head, M);
 
             // ------
 
             struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
                         0, 2, 1, 3);
 
-            struct ggml_tensor * K = ggml_permute(ctxL, Kcross, 0, 2, 1, 3);
+            struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
 
             // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
             //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctxL,
+            //    ggml_scale(ctx0,
             //            KQ,
-            //            ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
+            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
             //            );
 
             // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctxL, KQ_scaled, n_past);
+            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ);
+            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
 
-            struct ggml_tensor * V_trans = ggml_permute(ctxL, Vcross, 1, 2, 0, 3);
+            struct ggml_tensor * V_trans = ggml_permute(ctx0, Vcross, 1, 2, 0, 3);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
             // cur = KQV_merged.contiguous().view(n_state, N)
-            cur = ggml_cpy(ctxL,
+            cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, N));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
         }
 
         // projection
         {
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.cross_attn_ln_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.cross_attn_ln_1_b, cur),
-                    cur);
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.cross_attn_ln_1_b);
         }
 
         // add the input
-        cur = ggml_add(ctxL, cur, inpCA);
+        cur = ggml_add(ctx0, cur, inpCA);
 
         struct ggml_tensor * inpFF = cur;
 
@@ -1715,60 +2046,40 @@ static bool whisper_decode(
         {
             // norm
             {
-                cur = ggml_norm(ctxL, inpFF);
+                cur = ggml_norm(ctx0, inpFF);
 
                 // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctxL,
-                        ggml_mul(ctxL,
-                            ggml_repeat(ctxL, layer.mlp_ln_w, cur),
-                            cur),
-                        ggml_repeat(ctxL, layer.mlp_ln_b, cur));
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            cur,
+                            layer.mlp_ln_w),
+                        layer.mlp_ln_b);
             }
 
             // fully connected
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.mlp_0_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.mlp_0_b, cur),
-                    cur);
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_0_b);
 
             // GELU activation
-            cur = ggml_gelu(ctxL, cur);
+            cur = ggml_gelu(ctx0, cur);
 
             // projection
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.mlp_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.mlp_1_b, cur),
-                    cur);
-        }
-
-        // output from this layer
-        struct ggml_tensor * inpO = ggml_add(ctxL, cur, inpFF);
-
-        {
-            ggml_build_forward_expand(&gf, inpO);
-            ggml_graph_compute       (ctxL, &gf);
-
-            //ggml_graph_print(&gf);
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_1_b);
         }
 
-        // TODO: this is a hack to have per-layer computation graphs - need to come up with something better
-        // input for next layer (inpO -> inpL)
-        memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
-        inpL->op = GGML_OP_NONE;
-        inpL->src0 = NULL;
-        inpL->src1 = NULL;
-
-        if (N > 1) {
-            //printf("%s: - used_mem(%d) = %f MB\n", __func__, il, ggml_used_mem(ctxL)/1024.0/1024.0);
-        }
-
-        ggml_free(ctxL);
+        // input for next layer
+        inpL = ggml_add(ctx0, cur, inpFF);
     }
 
     cur = inpL;
@@ -1779,159 +2090,311 @@ static bool whisper_decode(
 
         cur = ggml_add(ctx0,
                 ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.d_ln_w, cur),
-                    cur),
-                ggml_repeat(ctx0, model.d_ln_b, cur));
+                    cur,
+                    model.d_ln_w),
+                model.d_ln_b);
     }
 
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
+    // the logits are read after the computation too
+    ggml_set_output(logits);
+
     // logits -> probs
     cur = ggml_dup(ctx0, logits);
     cur = ggml_soft_max(ctx0, cur); // in-place
 
-    // run the computation
-    {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        ggml_build_forward_expand(&gf, cur);
-        ggml_graph_compute       (ctx0, &gf);
-    }
+    ggml_build_forward_expand(&gf, cur);
 
-    logits_out.resize(N*n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
-
-    probs_out.resize(N*n_vocab);
-    memcpy(probs_out.data(), ggml_get_data(cur), sizeof(float)*N*n_vocab);
+    graph.logits = logits;
+    graph.probs  = cur;
 
-    if (N > 1) {
-        //const float mem_per_token = ggml_used_mem(ctx0)/1024.0/1024.0/N;
-        //printf("%s: used_mem = %f MB / %f per token\n", __func__, ggml_used_mem(ctx0)/1024.0/1024.0, mem_per_token);
-        //printf("%s: max mem = %f MB\n", __func__, mem_per_token*model.hparams.n_text_ctx);
-    }
+    gf.n_threads = ggml_threadpool_n_threads(pool);
 
-    ggml_free(ctx0);
+    whisper_graph_alloc(graph.buf_compute, ctx0, gf);
 
     return true;
 }
 
-// the most basic sampling scheme - select the top token
-static whisper_token_data whisper_sample_best(
-        const whisper_vocab & vocab,
-        const float * probs) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
-    };
+// evaluate the decoder for a batch of sequences
+//
+// given text prompts + audio features -> predicts the probabilities for the next token of each prompt
+// the sequences share the weights and the cross-attention memory, so the matrix multiplications process the tokens
+// of all of them at once - each sequence attends only to its own slot of the self-attention memory
+//
+//   - wctx:       the model
+//   - wstate:     the state with the key + value memory, receives the logits and the probabilities of all the tokens
+//   - n_threads:  number of threads to use
+//   - batch:      the new tokens of each sequence - a slot appears at most once
+//
+static bool whisper_decode(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+        const int n_threads,
+        const std::vector<whisper_seq_tokens> & batch) {
+    struct ggml_threadpool * pool = whisper_get_threadpool(wstate, n_threads);
+
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-    int n_logits = vocab.id_to_token.size();
+    auto & logits_out = wstate.logits;
+    auto & probs_out  = wstate.probs;
 
-    std::vector<std::pair<double, whisper_vocab::id>> probs_id;
-    probs_id.reserve(n_logits);
+    const int n_vocab = hparams.n_vocab;
 
-    for (int i = 0; i < n_logits; i++) {
-        probs_id.push_back(std::make_pair(probs[i], i));
-    }
+    const int n_ctx   = hparams.n_text_ctx;
+    const int n_layer = hparams.n_text_layer;
 
-    {
-        double sum_ts =  0.0;
-        double max_ts = -1.0;
-        double max_tx = -1.0;
+    const int n_seq   = wstate.n_seq;
+    const int n_batch = batch.size();
 
-        for (int i = 0; i < vocab.token_beg; i++) {
-            max_tx = std::max(max_tx, probs_id[i].first);
-        }
+    std::vector<int> n_tokens(n_batch);
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            sum_ts += probs_id[i].first;
-            if  (probs_id[i].first > max_ts) {
-                max_ts = probs_id[i].first;
-                result.tid = probs_id[i].second;
-            }
-        }
+    int n_kv = 0;
 
-        // if the probability sum of all timestamp tokens is higher than the max probability of the text tokens - sample a
-        // timestamp token
-        if (sum_ts > max_tx) {
-            // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L430-L438
-            for (int i = 0; i < vocab.token_beg; i++) {
-                probs_id[i].first = -INFINITY;
-            }
+    for (int ib = 0; ib < n_batch; ++ib) {
+        const auto & st = batch[ib];
+
+        if (st.seq < 0 || st.seq >= n_seq || st.n_past + (int) st.tokens.size() > n_ctx) {
+            fprintf(stderr, "%s: sequence %d does not fit in the key + value memory\n", __func__, st.seq);
+            return false;
         }
 
-        result.pt = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+        n_tokens[ib] = st.tokens.size();
+
+        n_kv = std::max(n_kv, st.n_past + n_tokens[ib]);
     }
 
-    // find the top K tokens
-    const int top_k = 4;
+    if (wstate.graph_decode == nullptr) {
+        wstate.graph_decode = new whisper_decode_graph();
+    }
 
-    std::partial_sort(
-            probs_id.begin(),
-            probs_id.begin() + top_k, probs_id.end(),
-            [](const std::pair<double, whisper_vocab::id> & a, const std::pair<double, whisper_vocab::id> & b) {
-        return a.first > b.first;
-    });
+    auto & graph = *wstate.graph_decode;
 
-    probs_id.resize(top_k);
+    // build a new graph when the tokens or the audio context change or the contexts no longer fit in the previous one
+    if (graph.ctx == nullptr || graph.n_tokens != n_tokens || n_kv > graph.n_kv || graph.M != wstate.n_audio_ctx) {
+        n_kv = std::min(n_ctx, ((n_kv + WHISPER_KV_BLOCK - 1)/WHISPER_KV_BLOCK)*WHISPER_KV_BLOCK);
 
-    //printf("\n");
-    //for (int i = 0; i < (int) probs_id.size(); i++) {
-    //    printf("%d: '%s' %f, %d\n", i, vocab.id_to_token.at(probs_id[i].second).c_str(), probs_id[i].first, probs_id[i].second);
-    //}
+        if (!whisper_build_decode_graph(model, wstate, pool, n_tokens, n_kv, graph)) {
+            fprintf(stderr, "%s: failed to build the graph\n", __func__);
+            return false;
+        }
+    }
+
+    const int N = graph.N;
+
+    // rebind the inputs of the graph
+    for (int ib = 0, i0 = 0; ib < n_batch; i0 += n_tokens[ib], ++ib) {
+        const auto & st = batch[ib];
+
+        for (int i = 0; i < n_tokens[ib]; ++i) {
+            ((int32_t *) graph.embd->data)[i0 + i]     = st.tokens[i];
+            ((int32_t *) graph.position->data)[i0 + i] = st.n_past + i;
+        }
+
+        for (int il = 0; il < n_layer; ++il) {
+            if (graph.k[il*n_batch + ib] == nullptr) {
+                continue;
+            }
 
-    int res = 0;
-    while ((probs_id[res].second == vocab.token_sot ||
-            probs_id[res].second == vocab.token_solm ||
-            probs_id[res].second == vocab.token_not) &&
-            res < (int) probs_id.size() - 1) {
-        res++;
+            graph.k[il*n_batch + ib]->view_offs = whisper_kv_offs(model, wstate, il, st.n_past, st.seq);
+            graph.v[il*n_batch + ib]->view_offs = whisper_kv_offs(model, wstate, il, st.n_past, st.seq);
+        }
     }
 
-    result.id = probs_id[res].second;
-    result.p  = probs_id[res].first;
+    for (int il = 0; il < n_layer; ++il) {
+        if (graph.n_past[il]) {
+            ggml_set_i32_1d(graph.n_past[il], 0, batch[0].n_past);
+        }
+    }
 
-    return result;
-}
+    // token i of a sequence sees the positions [0, n_past + i] of its slot - position j of slot s is at j*n_seq + s
+    if (graph.mask) {
+        float * mask = (float *) graph.mask->data;
 
-// samples only from the timestamps tokens
-static whisper_vocab::id whisper_sample_timestamp(
-        const whisper_vocab & vocab,
-        const float * probs) {
-    int n_logits = vocab.id_to_token.size();
+        for (int ib = 0, i0 = 0; ib < n_batch; i0 += n_tokens[ib], ++ib) {
+            const auto & st = batch[ib];
 
-    std::vector<std::pair<double, whisper_vocab::id>> probs_id;
-    probs_id.reserve(n_logits);
+            for (int i = 0; i < n_tokens[ib]; ++i) {
+                float * row = mask + (size_t) (i0 + i)*n_seq*graph.n_kv;
 
-    for (int i = vocab.token_beg + 1; i < n_logits; i++) {
-        probs_id.push_back(std::make_pair(probs[i], i));
+                for (int j = 0; j < n_seq*graph.n_kv; ++j) {
+                    row[j] = j % n_seq == st.seq && j/n_seq <= st.n_past + i ? 0.0f : -INFINITY;
+                }
+            }
+        }
     }
 
-    const int top_k = 10;
+    ggml_graph_update_views(&graph.gf);
 
-    // find the top K tokens
-    std::partial_sort(
-            probs_id.begin(),
-            probs_id.begin() + top_k, probs_id.end(),
-            [](const std::pair<double, whisper_vocab::id> & a, const std::pair<double, whisper_vocab::id> & b) {
-        return a.first > b.first;
-    });
+    // run the computation
+    ggml_graph_compute_with_pool(graph.ctx, &graph.gf, pool);
 
-    probs_id.resize(top_k);
+    logits_out.resize(N*n_vocab);
+    memcpy(logits_out.data(), ggml_get_data(graph.logits), sizeof(float)*N*n_vocab);
 
-    //printf("\n");
-    //for (int i = 0; i < (int) probs_id.size(); i++) {
-    //    printf("%d: '%s' %f, %d\n", i, vocab.id_to_token.at(probs_id[i].second).c_str(), probs_id[i].first, probs_id[i].second);
-    //}
+    probs_out.resize(N*n_vocab);
+    memcpy(probs_out.data(), ggml_get_data(graph.probs), sizeof(float)*N*n_vocab);
 
-    return probs_id[0].second;
+    return true;
 }
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
+// evaluate the decoder
+//
+// given text prompt + audio features -> predicts the probabilities for the next token
+//
+//   - wctx:       the model
+//   - wstate:     the state with the key + value memory, receives the logits and the probabilities
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//
+static bool whisper_decode(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+        const int n_threads,
+        const whisper_token * tokens,
+        const int n_tokens,
+        const int n_past) {
+    return whisper_decode(wctx, wstate, n_threads, { { 0, n_past, std::vector<whisper_token>(tokens, tokens + n_tokens) } });
+}
+
+// find the most probable timestamp token and check if the timestamp tokens are more probable than any text token, in
+// which case the text tokens are excluded from the sampling - returns true when they are
+static bool whisper_sample_timestamp_rule(
+        const whisper_vocab & vocab,
+        const float * probs,
+        whisper_token_data & result) {
+    const int n_logits = vocab.id_to_token.size();
+
+    double sum_ts =  0.0;
+    double max_ts = -1.0;
+    double max_tx = -1.0;
+
+    for (int i = 0; i < vocab.token_beg; i++) {
+        max_tx = std::max(max_tx, (double) probs[i]);
+    }
+
+    for (int i = vocab.token_beg; i < n_logits; i++) {
+        sum_ts += probs[i];
+        if  (probs[i] > max_ts) {
+            max_ts = probs[i];
+            result.tid = i;
+        }
+    }
+
+    result.pt = max_ts/(sum_ts + 1e-10);
+    result.ptsum = sum_ts;
+
+    // if the probability sum of all timestamp tokens is higher than the max probability of the text tokens - sample a
+    // timestamp token
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L430-L438
+    return sum_ts > max_tx;
+}
+
+// the special tokens that are never sampled
+static bool whisper_is_sampleable(const whisper_vocab & vocab, whisper_vocab::id id) {
+    return id != vocab.token_sot && id != vocab.token_solm && id != vocab.token_not;
+}
+
+// the most basic sampling scheme - select the top token
+static whisper_token_data whisper_sample_best(
+        const whisper_vocab & vocab,
+        const float * probs) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
+
+    const int n_logits = vocab.id_to_token.size();
+
+    const int i0 = whisper_sample_timestamp_rule(vocab, probs, result) ? vocab.token_beg : 0;
+
+    // single pass over the vocabulary - no candidate list is built
+    int   best   = -1;
+    float best_p = -INFINITY;
+
+    for (int i = i0; i < n_logits; i++) {
+        if (probs[i] > best_p && whisper_is_sampleable(vocab, i)) {
+            best_p = probs[i];
+            best   = i;
+        }
+    }
+
+    if (best >= 0) {
+        result.id = best;
+        result.p  = best_p;
+    }
+
+    return result;
+}
+
+// the k most probable tokens, with the same rules as whisper_sample_best() - used by the beam search
+static std::vector<whisper_token_data> whisper_sample_top_k(
+        const whisper_vocab & vocab,
+        const float * probs,
+        const int k) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
+
+    const int n_logits = vocab.id_to_token.size();
+
+    const int i0 = whisper_sample_timestamp_rule(vocab, probs, result) ? vocab.token_beg : 0;
+
+    // k is the beam size, so the candidates are kept sorted with an insertion into a short list
+    std::vector<whisper_token_data> res;
+    res.reserve(k + 1);
+
+    for (int i = i0; i < n_logits; i++) {
+        if ((int) res.size() == k && probs[i] <= res.back().p) {
+            continue;
+        }
+
+        if (!whisper_is_sampleable(vocab, i)) {
+            continue;
+        }
+
+        int j = res.size();
+        while (j > 0 && res[j - 1].p < probs[i]) {
+            j--;
+        }
+
+        result.id = i;
+        result.p  = probs[i];
+
+        res.insert(res.begin() + j, result);
+
+        if ((int) res.size() > k) {
+            res.pop_back();
+        }
+    }
+
+    return res;
+}
+
+// samples only from the timestamps tokens
+static whisper_vocab::id whisper_sample_timestamp(
+        const whisper_vocab & vocab,
+        const float * probs) {
+    const int n_logits = vocab.id_to_token.size();
+
+    whisper_vocab::id best = vocab.token_beg + 1;
+
+    for (int i = vocab.token_beg + 2; i < n_logits; i++) {
+        if (probs[i] > probs[best]) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
     msec = msec - hr * (1000 * 60 * 60);
     int64_t min = msec / (1000 * 60);
     msec = msec - min * (1000 * 60);
@@ -1947,91 +2410,184 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
 // naive Discrete Fourier Transform
 // input is real-valued
 // output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+// real-valued FFT of a fixed even size n, computed as a complex FFT of size m = n/2 over the pairs of samples
+//
+// the complex FFT is iterative and mixed-radix: the input is reordered by digit reversal, after which each stage
+// combines the sub-transforms of the previous one in place - the twiddle factors of all stages are precomputed
+struct whisper_fft {
+    int n = 0;
+    int m = 0;
+
+    std::vector<int>   radix; // factors of m, the last one is applied by the first stage
+    std::vector<int>   rev;   // rev[i] is the pair of samples that goes to position i
+    std::vector<float> w;     // exp(-2*pi*i*k/n) for k in [0, n) as (re, im) pairs
+};
 
-    out.resize(N*2);
+static void whisper_fft_init(whisper_fft & fft, int n) {
+    assert(n % 2 == 0);
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+    fft.n = n;
+    fft.m = n/2;
 
-        for (int n = 0; n < N; n++) {
-            float angle = 2*M_PI*k*n/N;
-            re += in[n]*cos(angle);
-            im -= in[n]*sin(angle);
+    fft.radix.clear();
+    for (int r = fft.m; r > 1; ) {
+        int p = r % 4 == 0 ? 4 : 2;
+        while (r % p != 0) {
+            p++;
         }
+        // the butterflies keep a radix in registers
+        assert(p <= 8);
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+        fft.radix.push_back(p);
+        r /= p;
     }
-}
-
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
 
-    int N = in.size();
+    // position of the pair i: its digits in the mixed radix, in reverse order
+    fft.rev.resize(fft.m);
+    for (int i = 0; i < fft.m; ++i) {
+        int pos  = 0;
+        int span = fft.m;
+        int rem  = i;
+        for (int p : fft.radix) {
+            span /= p;
+            pos  += (rem % p)*span;
+            rem  /= p;
+        }
+        fft.rev[pos] = i;
+    }
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+    fft.w.resize(2*n);
+    for (int k = 0; k < n; ++k) {
+        fft.w[2*k + 0] =  cos((2.0*M_PI*k)/n);
+        fft.w[2*k + 1] = -sin((2.0*M_PI*k)/n);
     }
+}
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
+// power spectrum |X[k]|^2, k in [0, n/2], of the real input in[0..n)
+//
+//   - work:  2*m floats of scratch memory
+//   - power: n/2 + 1 floats
+//
+static void whisper_fft_power(const whisper_fft & fft, const float * in, float * work, float * power) {
+    const int n = fft.n;
+    const int m = fft.m;
+
+    const float * w = fft.w.data();
+
+    // z[t] = in[2t] + i*in[2t + 1], in digit-reversed order
+    for (int i = 0; i < m; ++i) {
+        work[2*i + 0] = in[2*fft.rev[i] + 0];
+        work[2*i + 1] = in[2*fft.rev[i] + 1];
     }
 
-    std::vector<float> even;
-    std::vector<float> odd;
+    // combine p sub-transforms of size L into transforms of size L*p, exp(-2*pi*i*j/m) is w[2*j*(n/m)]
+    int L = 1;
+    for (int l = (int) fft.radix.size() - 1; l >= 0; --l) {
+        const int p  = fft.radix[l];
+        const int Lp = L*p;
+        const int ws = 2*(m/Lp); // stride of exp(-2*pi*i*k/Lp) in w, in complex values
+
+        for (int b = 0; b < m; b += Lp) {
+            for (int k = 0; k < L; ++k) {
+                float tr[8];
+                float ti[8];
+
+                float * x = work + 2*(b + k);
+
+                // twiddle
+                for (int r = 0; r < p; ++r) {
+                    const float xr = x[2*r*L + 0];
+                    const float xi = x[2*r*L + 1];
+                    const int   j  = 2*((r*k*ws) % n);
+                    tr[r] = xr*w[j + 0] - xi*w[j + 1];
+                    ti[r] = xr*w[j + 1] + xi*w[j + 0];
+                }
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
+                if (p == 2) {
+                    x[0]       = tr[0] + tr[1];
+                    x[1]       = ti[0] + ti[1];
+                    x[2*L + 0] = tr[0] - tr[1];
+                    x[2*L + 1] = ti[0] - ti[1];
+                } else if (p == 4) {
+                    const float ar = tr[0] + tr[2], ai = ti[0] + ti[2];
+                    const float br = tr[0] - tr[2], bi = ti[0] - ti[2];
+                    const float cr = tr[1] + tr[3], ci = ti[1] + ti[3];
+                    const float dr = tr[1] - tr[3], di = ti[1] - ti[3];
+
+                    // multiplied by -i
+                    x[0]       = ar + cr;
+                    x[1]       = ai + ci;
+                    x[2*L + 0] = br + di;
+                    x[2*L + 1] = bi - dr;
+                    x[4*L + 0] = ar - cr;
+                    x[4*L + 1] = ai - ci;
+                    x[6*L + 0] = br - di;
+                    x[6*L + 1] = bi + dr;
+                } else {
+                    // generic radix, exp(-2*pi*i*r*q/p) = w[2*r*q*(n/p)]
+                    for (int q = 0; q < p; ++q) {
+                        float sr = 0.0f;
+                        float si = 0.0f;
+                        for (int r = 0; r < p; ++r) {
+                            const int j = 2*(((r*q) % p)*(n/p));
+                            sr += tr[r]*w[j + 0] - ti[r]*w[j + 1];
+                            si += tr[r]*w[j + 1] + ti[r]*w[j + 0];
+                        }
+                        x[2*q*L + 0] = sr;
+                        x[2*q*L + 1] = si;
+                    }
+                }
+            }
         }
-    }
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+        L = Lp;
+    }
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+    // split the transform of the pairs into the transform of the real input:
+    //   X[k] = (Z[k] + conj(Z[m - k]))/2 - i*exp(-2*pi*i*k/n)*(Z[k] - conj(Z[m - k]))/2
+    for (int k = 0; k <= m; ++k) {
+        const int k0 = k % m;
+        const int k1 = (m - k) % m;
 
-    for (int k = 0; k < N/2; k++) {
-        float theta = 2*M_PI*k/N;
+        const float zr = work[2*k0 + 0];
+        const float zi = work[2*k0 + 1];
+        const float cr =  work[2*k1 + 0];
+        const float ci = -work[2*k1 + 1];
 
-        float re = cos(theta);
-        float im = -sin(theta);
+        const float er = 0.5f*(zr + cr);
+        const float ei = 0.5f*(zi + ci);
+        const float or_ = 0.5f*(zi - ci);
+        const float oi  = -0.5f*(zr - cr);
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+        const float wr = w[2*k + 0];
+        const float wi = w[2*k + 1];
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+        const float xr = er + wr*or_ - wi*oi;
+        const float xi = ei + wr*oi  + wi*or_;
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+        power[k] = xr*xr + xi*xi;
     }
 }
 
 // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L92-L124
-static bool log_mel_spectrogram(
+// compute the log mel spectrogram of the frames [i0, i1), without the normalization of log_mel_spectrogram()
+//
+// frame i starts at samples[i*fft_step], the samples past n_samples are zero - its value in band j is stored in
+// dst[(i - i0)*nb_frame + j*nb_mel], so that the frames can be stored as columns or as rows
+//
+static void log_mel_spectrogram_frames(
     const float * samples,
     const int n_samples,
-    const int sample_rate,
     const int fft_size,
     const int fft_step,
     const int n_mel,
     const int n_threads,
     const whisper_filters & filters,
-    whisper_mel & mel) {
+    const int i0,
+    const int i1,
+    float * dst,
+    const int nb_frame,
+    const int nb_mel) {
 
     // Hanning window
     std::vector<float> hann;
@@ -2040,79 +2596,142 @@ static bool log_mel_spectrogram(
         hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(fft_size)));
     }
 
-    mel.n_mel = n_mel;
-    mel.n_len = (n_samples)/fft_step;
-    mel.data.resize(mel.n_mel*mel.n_len);
-
     const int n_fft = 1 + fft_size/2;
 
-    //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
-    //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
+    assert(filters.n_fft == n_fft && filters.n_mel == n_mel);
 
-    std::vector<std::thread> workers(n_threads);
-    for (int iw = 0; iw < n_threads; ++iw) {
-        workers[iw] = std::thread([&](int ith) {
-            std::vector<float> fft_in;
-            fft_in.resize(fft_size);
-            for (int i = 0; i < fft_size; i++) {
-                fft_in[i] = 0.0;
-            }
+    whisper_fft fft;
+    whisper_fft_init(fft, fft_size);
 
-            std::vector<float> fft_out;
-            fft_out.resize(2*fft_size);
+    // the frames are processed in blocks of up to n_block frames: the threads compute the power spectra of contiguous
+    // ranges of frames of the block, which are then projected on the mel filterbank by a single matrix multiplication
+    // on a pool of n_threads threads - only the calling thread computes ggml graphs, as the profiler (see
+    // whisper_profile_start()) does not support concurrent graph computations
+    const int n_block = std::max(1, std::min(1024, i1 - i0));
 
-            for (int i = ith; i < mel.n_len; i += n_threads) {
-                const int offset = i*fft_step;
+    std::vector<float> power((size_t) n_fft*n_block);
+    std::vector<float> result((size_t) n_mel*n_block);
 
-                // apply Hanning window
-                for (int j = 0; j < fft_size; j++) {
-                    if (offset + j < n_samples) {
-                        fft_in[j] = hann[j]*samples[offset + j];
-                    } else {
-                        fft_in[j] = 0.0;
-                    }
-                }
+    // mel = filters x power, the data of the tensors is in the vectors above
+    std::vector<uint8_t> buf_meta(4*ggml_tensor_overhead() + ggml_graph_overhead(2, false));
+
+    struct ggml_init_params params = {
+        .mem_size   = buf_meta.size(),
+        .mem_buffer = buf_meta.data(),
+        .no_alloc   = true,
+    };
 
-                // FFT -> mag^2
-                fft(fft_in, fft_out);
+    struct ggml_context * ctx0 = ggml_init(params);
 
-                for (int j = 0; j < fft_size; j++) {
-                    fft_out[j] = (fft_out[2*j + 0]*fft_out[2*j + 0] + fft_out[2*j + 1]*fft_out[2*j + 1]);
-                }
-                for (int j = 1; j < fft_size/2; j++) {
-                    //if (i == 0) {
-                    //    printf("%d: %f %f\n", j, fft_out[j], fft_out[fft_size - j]);
-                    //}
-                    fft_out[j] += fft_out[fft_size - j];
-                }
-                if (i == 0) {
-                    //for (int j = 0; j < fft_size; j++) {
-                    //    printf("%d: %e\n", j, fft_out[j]);
-                    //}
-                }
+    struct ggml_tensor * filt = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_fft, n_mel);
+    struct ggml_tensor * pwr  = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_fft, n_block);
+    struct ggml_tensor * mel  = ggml_mul_mat(ctx0, filt, pwr);
+
+    filt->data = (void *) filters.data.data();
+    pwr->data  = power.data();
+    mel->data  = result.data();
 
-                // mel spectrogram
-                for (int j = 0; j < mel.n_mel; j++) {
-                    double sum = 0.0;
+    struct ggml_cgraph gf = *ggml_new_graph_custom(ctx0, 2, false);
+    ggml_build_forward_expand(&gf, mel);
 
-                    for (int k = 0; k < n_fft; k++) {
-                        sum += fft_out[k]*filters.data[j*n_fft + k];
+    struct ggml_threadpool * pool = ggml_threadpool_new(n_threads);
+
+    std::vector<std::vector<float>> fft_in(n_threads, std::vector<float>(fft_size, 0.0f));
+    std::vector<std::vector<float>> fft_work(n_threads, std::vector<float>(2*fft_size));
+
+    for (int ib = i0; ib < i1; ib += n_block) {
+        const int nb = std::min(n_block, i1 - ib);
+
+        const int n_per_thread = (nb + n_threads - 1)/n_threads;
+
+        std::vector<std::thread> workers(n_threads);
+        for (int iw = 0; iw < n_threads; ++iw) {
+            workers[iw] = std::thread([&](int ith) {
+                const int ie0 = std::min(ib + nb, ib + ith*n_per_thread);
+                const int ie1 = std::min(ib + nb, ie0 + n_per_thread);
+
+                float * in = fft_in[ith].data();
+
+                for (int i = ie0; i < ie1; i++) {
+                    const int offset = i*fft_step;
+
+                    // apply Hanning window
+                    for (int j = 0; j < fft_size; j++) {
+                        if (offset + j < n_samples) {
+                            in[j] = hann[j]*samples[offset + j];
+                        } else {
+                            in[j] = 0.0;
+                        }
                     }
-                    if (sum < 1e-10) {
-                        sum = 1e-10;
+
+                    // FFT -> mag^2, the bins above fft_size/2 mirror the ones below
+                    float * pw = power.data() + (size_t) (i - ib)*n_fft;
+
+                    whisper_fft_power(fft, in, fft_work[ith].data(), pw);
+
+                    for (int j = 1; j < fft_size/2; j++) {
+                        pw[j] *= 2.0f;
                     }
+                }
+            }, iw);
+        }
+
+        for (int iw = 0; iw < n_threads; ++iw) {
+            workers[iw].join();
+        }
 
-                    sum = log10(sum);
+        // mel spectrogram
+        ggml_graph_compute_with_pool(ctx0, &gf, pool);
 
-                    mel.data[j*mel.n_len + i] = sum;
+        for (int i = 0; i < nb; i++) {
+            for (int j = 0; j < n_mel; j++) {
+                float sum = result[(size_t) i*n_mel + j];
+                if (sum < 1e-10f) {
+                    sum = 1e-10f;
                 }
+
+                dst[(size_t) (ib + i - i0)*nb_frame + (size_t) j*nb_mel] = log10f(sum);
             }
-        }, iw);
+        }
     }
 
-    for (int iw = 0; iw < n_threads; ++iw) {
-        workers[iw].join();
+    ggml_threadpool_free(pool);
+
+    ggml_free(ctx0);
+}
+
+// clamp the log mel values to 8 below their maximum mmax and normalize them
+static void log_mel_spectrogram_normalize(float * data, const int n, double mmax) {
+    mmax -= 8.0;
+
+    for (int i = 0; i < n; i++) {
+        if (data[i] < mmax) {
+            data[i] = mmax;
+        }
+
+        data[i] = (data[i] + 4.0)/4.0;
     }
+}
+
+static bool log_mel_spectrogram(
+    const float * samples,
+    const int n_samples,
+    const int sample_rate,
+    const int fft_size,
+    const int fft_step,
+    const int n_mel,
+    const int n_threads,
+    const whisper_filters & filters,
+    whisper_mel & mel) {
+
+    mel.n_mel = n_mel;
+    mel.n_len = (n_samples)/fft_step;
+    mel.data.resize(mel.n_mel*mel.n_len);
+
+    //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
+    //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
+
+    log_mel_spectrogram_frames(samples, n_samples, fft_size, fft_step, n_mel, n_threads, filters, 0, mel.n_len, mel.data.data(), 1, mel.n_len);
 
     // clamping and normalization
     double mmax = -1e20;
@@ -2123,15 +2742,7 @@ static bool log_mel_spectrogram(
     }
     //printf("%s: max = %f\n", __func__, mmax);
 
-    mmax -= 8.0;
-
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
-
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+    log_mel_spectrogram_normalize(mel.data.data(), mel.n_mel*mel.n_len, mmax);
 
     return true;
 }
@@ -2140,49 +2751,126 @@ static bool log_mel_spectrogram(
 // interface implementation
 //
 
-struct whisper_context * whisper_init(const char * path_model) {
+static struct whisper_context * whisper_init_impl(const char * path_model, const char * qtype, bool use_mmap) {
     ggml_time_init();
 
+    ggml_type type = GGML_TYPE_COUNT;
+    if (qtype != nullptr) {
+        if (strcmp(qtype, "q4_0") == 0) {
+            type = GGML_TYPE_Q4_0;
+        } else if (strcmp(qtype, "q8_0") == 0) {
+            type = GGML_TYPE_Q8_0;
+        } else {
+            fprintf(stderr, "%s: unknown quantization type '%s'\n", __func__, qtype);
+            return NULL;
+        }
+    }
+
     whisper_context * ctx = new whisper_context;
 
     const int64_t t_start_us = ggml_time_us();
 
     ctx->t_start_us = t_start_us;
 
-    if (!whisper_model_load(path_model, *ctx)) {
+    if (!whisper_model_load(path_model, *ctx, type, use_mmap)) {
         fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, path_model);
         return NULL;
     }
 
     ctx->t_load_us = ggml_time_us() - t_start_us;
 
+    ctx->state = whisper_init_state(ctx);
+    if (ctx->state == nullptr) {
+        whisper_free(ctx);
+        return NULL;
+    }
+
     return ctx;
 }
 
+struct whisper_state * whisper_init_state(struct whisper_context * ctx) {
+    whisper_state * state = new whisper_state;
+
+    if (!whisper_kv_cache_init(ctx->model, *state, 1)) {
+        fprintf(stderr, "%s: failed to allocate the key + value memory\n", __func__);
+        delete state;
+        return nullptr;
+    }
+
+    return state;
+}
+
+struct whisper_context * whisper_init(const char * path_model) {
+    return whisper_init_impl(path_model, nullptr, true);
+}
+
+struct whisper_context * whisper_init_quantized(const char * path_model, const char * qtype) {
+    return whisper_init_impl(path_model, qtype, true);
+}
+
+struct whisper_context * whisper_init_no_mmap(const char * path_model) {
+    return whisper_init_impl(path_model, nullptr, false);
+}
+
 void whisper_free(struct whisper_context * ctx) {
     if (ctx) {
         if (ctx->buf_model) {
             delete ctx->buf_model;
         }
+        if (ctx->mm_model) {
+            whisper_mmap_close(*ctx->mm_model);
+            delete ctx->mm_model;
+        }
+        if (ctx->state) {
+            whisper_free_state(ctx->state);
+        }
+        if (ctx->profiler) {
+            ggml_profiler_free(ctx->profiler);
+        }
         delete ctx;
     }
 }
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+void whisper_free_state(struct whisper_state * state) {
+    if (state) {
+        if (state->ctx_mem) {
+            ggml_free(state->ctx_mem);
+        }
+        if (state->threadpool) {
+            ggml_threadpool_free(state->threadpool);
+        }
+        if (state->graph_encode) {
+            ggml_free(state->graph_encode->ctx);
+            delete state->graph_encode;
+        }
+        if (state->graph_decode) {
+            ggml_free(state->graph_decode->ctx);
+            delete state->graph_decode;
+        }
+        delete state;
+    }
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
     const int64_t t_start_us = ggml_time_us();
 
-    if (!log_mel_spectrogram(samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, ctx->mel)) {
+    if (!log_mel_spectrogram(samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, state->mel)) {
         fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
 
-    ctx->t_mel_us = ggml_time_us() - t_start_us;
+    state->t_mel_us = ggml_time_us() - t_start_us;
 
     return 0;
 }
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_set_mel_with_state(
+        struct whisper_context * /*ctx*/,
+        struct whisper_state * state,
         const float * data,
         int n_len,
         int n_mel) {
@@ -2191,63 +2879,87 @@ int whisper_set_mel(
         return -1;
     }
 
-    ctx->mel.n_len = n_len;
-    ctx->mel.n_mel = n_mel;
+    state->mel.n_len = n_len;
+    state->mel.n_mel = n_mel;
 
-    ctx->mel.data.resize(n_len*n_mel);
-    memcpy(ctx->mel.data.data(), data, n_len*n_mel*sizeof(float));
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
 
     return 0;
 }
 
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
     const int64_t t_start_us = ggml_time_us();
 
-    if (!whisper_encode(*ctx, n_threads, offset)) {
+    if (!whisper_encode(*ctx, *state, n_threads, offset)) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return -1;
     }
 
-    ctx->t_encode_us += ggml_time_us() - t_start_us;
+    state->t_encode_us += ggml_time_us() - t_start_us;
 
     return 0;
 }
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    return whisper_encode_with_state(ctx, ctx->state, offset, n_threads);
+}
+
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     const int64_t t_start_us = ggml_time_us();
 
-    if (!whisper_decode(*ctx, n_threads, tokens, n_tokens, n_past)) {
+    if (!whisper_decode(*ctx, *state, n_threads, tokens, n_tokens, n_past)) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return 1;
     }
 
-    ctx->t_decode_us += ggml_time_us() - t_start_us;
+    state->t_decode_us += ggml_time_us() - t_start_us;
 
     return 0;
 }
 
-struct whisper_token_data whisper_sample_best(struct whisper_context * ctx) {
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+}
+
+struct whisper_token_data whisper_sample_best_with_state(struct whisper_context * ctx, struct whisper_state * state) {
     const int64_t t_start_sample_us = ggml_time_us();
 
     // TODO: simplify
-    auto res = whisper_sample_best(ctx->vocab, ctx->probs.data() + (ctx->probs.size() - ctx->vocab.n_vocab));
+    auto res = whisper_sample_best(ctx->vocab, state->probs.data() + (state->probs.size() - ctx->vocab.n_vocab));
 
-    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
     return res;
 }
 
-whisper_token whisper_sample_timestamp(struct whisper_context * ctx) {
+struct whisper_token_data whisper_sample_best(struct whisper_context * ctx) {
+    return whisper_sample_best_with_state(ctx, ctx->state);
+}
+
+whisper_token whisper_sample_timestamp_with_state(struct whisper_context * ctx, struct whisper_state * state) {
     const int64_t t_start_sample_us = ggml_time_us();
 
     // TODO: simplify
-    auto res = whisper_sample_timestamp(ctx->vocab, ctx->probs.data() + (ctx->probs.size() - ctx->vocab.n_vocab));
+    auto res = whisper_sample_timestamp(ctx->vocab, state->probs.data() + (state->probs.size() - ctx->vocab.n_vocab));
 
-    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
     return res;
 }
 
+whisper_token whisper_sample_timestamp(struct whisper_context * ctx) {
+    return whisper_sample_timestamp_with_state(ctx, ctx->state);
+}
+
 int whisper_lang_id(const char * lang) {
     if (!g_lang.count(lang)) {
         fprintf(stderr, "%s: unknown language '%s'\n", __func__, lang);
@@ -2257,14 +2969,22 @@ int whisper_lang_id(const char * lang) {
     return g_lang.at(lang).first;
 }
 
+int whisper_n_len_from_state(struct whisper_state * state) {
+    return state->mel.n_len;
+}
+
 int whisper_n_len(struct whisper_context * ctx) {
-    return ctx->mel.n_len;
+    return whisper_n_len_from_state(ctx->state);
 }
 
 int whisper_n_vocab(struct whisper_context * ctx) {
     return ctx->vocab.n_vocab;
 }
 
+int whisper_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
 int whisper_n_text_ctx(struct whisper_context * ctx) {
     return ctx->model.hparams.n_text_ctx;
 }
@@ -2273,8 +2993,12 @@ int whisper_is_multilingual(struct whisper_context * ctx) {
     return ctx->vocab.is_multilingual() ? 1 : 0;
 }
 
+float * whisper_get_probs_from_state(struct whisper_state * state) {
+    return state->probs.data();
+}
+
 float * whisper_get_probs(struct whisper_context * ctx) {
-    return ctx->probs.data();
+    return whisper_get_probs_from_state(ctx->state);
 }
 
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
@@ -2318,16 +3042,42 @@ void whisper_print_timings(struct whisper_context * ctx) {
 
     fprintf(stderr, "\n");
     fprintf(stderr, "%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us/1000.0f);
-    fprintf(stderr, "%s:      mel time = %8.2f ms\n", __func__, ctx->t_mel_us/1000.0f);
-    fprintf(stderr, "%s:   sample time = %8.2f ms\n", __func__, ctx->t_sample_us/1000.0f);
-    fprintf(stderr, "%s:   encode time = %8.2f ms / %.2f ms per layer\n", __func__, ctx->t_encode_us/1000.0f, ctx->t_encode_us/1000.0f/ctx->model.hparams.n_audio_layer);
-    fprintf(stderr, "%s:   decode time = %8.2f ms / %.2f ms per layer\n", __func__, ctx->t_decode_us/1000.0f, ctx->t_decode_us/1000.0f/ctx->model.hparams.n_text_layer);
+    fprintf(stderr, "%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us/1000.0f);
+    fprintf(stderr, "%s:   sample time = %8.2f ms\n", __func__, ctx->state->t_sample_us/1000.0f);
+    fprintf(stderr, "%s:   encode time = %8.2f ms / %.2f ms per layer\n", __func__, ctx->state->t_encode_us/1000.0f, ctx->state->t_encode_us/1000.0f/ctx->model.hparams.n_audio_layer);
+    fprintf(stderr, "%s:   decode time = %8.2f ms / %.2f ms per layer\n", __func__, ctx->state->t_decode_us/1000.0f, ctx->state->t_decode_us/1000.0f/ctx->model.hparams.n_text_layer);
     fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
 
-////////////////////////////////////////////////////////////////////////////
+void whisper_profile_start(struct whisper_context * ctx) {
+    if (ctx->profiler == nullptr) {
+        ctx->profiler = ggml_profiler_new();
+    }
 
-struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
+    ggml_profiler_reset(ctx->profiler);
+    ggml_profiler_set_active(ctx->profiler);
+}
+
+int whisper_profile_stop(struct whisper_context * ctx, const char * fname_trace) {
+    if (ctx->profiler == nullptr) {
+        fprintf(stderr, "%s: the profiling was not started\n", __func__);
+        return -1;
+    }
+
+    ggml_profiler_set_active(nullptr);
+    ggml_profiler_print(ctx->profiler);
+
+    if (fname_trace && !ggml_profiler_write_trace(ctx->profiler, fname_trace)) {
+        fprintf(stderr, "%s: failed to write the trace to '%s'\n", __func__, fname_trace);
+        return -2;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
     struct whisper_full_params result;
 
     switch (strategy) {
@@ -2353,6 +3103,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
                     /*.thold_ptsum          =*/ 0.01f,
                     /*.max_len              =*/ 0,
 
+                    /*.audio_ctx            =*/ 0,
+                    /*.skip_padding         =*/ false,
+
                     /*.language             =*/ "en",
 
                     /*.greedy               =*/ {
@@ -2391,6 +3144,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
                     /*.thold_ptsum          =*/ 0.01f,
                     /*.max_len              =*/ 0,
 
+                    /*.audio_ctx            =*/ 0,
+                    /*.skip_padding         =*/ false,
+
                     /*.language             =*/ "en",
 
                     /*.greedy               =*/ {
@@ -2416,14 +3172,15 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context * ctx,
+        struct whisper_state * state,
         int   i_segment,
         float thold_pt,
         float thold_ptsum);
 
 // wrap the last segment to max_len characters
 // returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context * ctx, int max_len) {
-    auto segment = ctx->result_all.back();
+static int whisper_wrap_segment(struct whisper_context * ctx, struct whisper_state * state, int max_len) {
+    auto segment = state->result_all.back();
 
     int res = 1;
     int acc = 0;
@@ -2442,24 +3199,24 @@ static int whisper_wrap_segment(struct whisper_context * ctx, int max_len) {
 
         if (acc + cur > max_len && i > 0) {
             // split here
-            ctx->result_all.back().text = std::move(text);
-            ctx->result_all.back().t1 = token.t0;
-            ctx->result_all.back().tokens.resize(i);
+            state->result_all.back().text = std::move(text);
+            state->result_all.back().t1 = token.t0;
+            state->result_all.back().tokens.resize(i);
 
-            ctx->result_all.push_back({});
-            ctx->result_all.back().t0 = token.t0;
-            ctx->result_all.back().t1 = segment.t1;
+            state->result_all.push_back({});
+            state->result_all.back().t0 = token.t0;
+            state->result_all.back().t1 = segment.t1;
 
             // add tokens [i, end] to the new segment
-            ctx->result_all.back().tokens.insert(
-                    ctx->result_all.back().tokens.end(),
+            state->result_all.back().tokens.insert(
+                    state->result_all.back().tokens.end(),
                     segment.tokens.begin() + i,
                     segment.tokens.end());
 
             acc = 0;
             text = "";
 
-            segment = ctx->result_all.back();
+            segment = state->result_all.back();
             i = -1;
 
             res++;
@@ -2469,51 +3226,215 @@ static int whisper_wrap_segment(struct whisper_context * ctx, int max_len) {
         }
     }
 
-    ctx->result_all.back().text = std::move(text);
+    state->result_all.back().text = std::move(text);
 
     return res;
 }
 
-int whisper_full(
-        struct whisper_context * ctx,
-        struct whisper_full_params params,
-        const float * samples,
-        int n_samples) {
-    // clear old results
-    auto & result_all = ctx->result_all;
+// a hypothesis of the beam search
+struct whisper_beam {
+    int seq; // the slot of the beam in the self-attention memory
 
-    result_all.clear();
+    double sum_logprob;
 
-    // compute log mel spectrogram
-    if (whisper_pcm_to_mel(ctx, samples, n_samples, params.n_threads) != 0) {
-        fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
+    int seek_delta;
+    int result_len;
+
+    std::vector<whisper_token_data> tokens;
+};
+
+// decode the tokens of a window with beam search
+//
+// the prompt is decoded once, in slot 0, and the beams then advance in lock-step as a single batch, each one in its own
+// slot of the self-attention memory. a beam that is continued more than once is forked by copying the keys / values of
+// its slot, so the common prefixes are never decoded again
+//
+// the search stops once params.beam_search.n_best hypotheses reached the end of text token. the hypothesis with the
+// highest average log probability per token is returned in tokens_cur, seek_delta and result_len
+static int whisper_beam_search(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        const struct whisper_full_params & params,
+        const std::vector<whisper_token> & prompt,
+        int seek,
+        int seek_end,
+        std::vector<whisper_token_data> & tokens_cur,
+        int & seek_delta,
+        int & result_len) {
+    const auto & vocab = ctx->vocab;
+
+    const int n_vocab = vocab.n_vocab;
+    const int n_beam  = state->n_seq;
+    const int n_best  = std::max(1, params.beam_search.n_best);
+
+    const whisper_token token_beg = whisper_token_beg(ctx);
+    const whisper_token token_eot = whisper_token_eot(ctx);
+
+    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, params.n_threads) != 0) {
         return -1;
     }
 
-    if (params.token_timestamps) {
-        ctx->t_beg = 0;
-        ctx->t_last = 0;
-        ctx->tid_last = 0;
-        ctx->energy = get_signal_energy(samples, n_samples, 32);
+    int n_past = prompt.size();
+
+    std::vector<whisper_beam> beams = { { 0, 0.0, 2*state->n_audio_ctx, 0, {} } };
+    std::vector<whisper_beam> beams_next;
+    std::vector<whisper_beam> finished;
+
+    // the probabilities of the next token of each beam
+    std::vector<float> probs(state->probs.end() - n_vocab, state->probs.end());
+
+    struct candidate {
+        int ib;
+        whisper_token_data token;
+        double sum_logprob;
+    };
+
+    std::vector<candidate> candidates;
+    std::vector<whisper_seq_tokens> batch;
+    std::vector<bool> seq_used(n_beam);
+
+    for (int i = 0; i < whisper_n_text_ctx(ctx)/2 - 4; ++i) {
+        // the n_beam best continuations of each beam
+        {
+            const int64_t t_start_sample_us = ggml_time_us();
+
+            candidates.clear();
+
+            for (int ib = 0; ib < (int) beams.size(); ++ib) {
+                for (auto & token : whisper_sample_top_k(vocab, probs.data() + ib*n_vocab, n_beam)) {
+                    if (i == 0) {
+                        token.tid = token_beg;
+                    }
+
+                    candidates.push_back({ ib, token, beams[ib].sum_logprob + log(token.p) });
+                }
+            }
+
+            std::stable_sort(candidates.begin(), candidates.end(), [](const candidate & a, const candidate & b) {
+                return a.sum_logprob > b.sum_logprob;
+            });
+
+            state->t_sample_us += ggml_time_us() - t_start_sample_us;
+        }
+
+        // keep the n_beam best ones - the hypotheses that end here are set aside
+        beams_next.clear();
+
+        for (const auto & c : candidates) {
+            if ((int) beams_next.size() == n_beam) {
+                break;
+            }
+
+            whisper_beam beam = beams[c.ib];
+
+            beam.sum_logprob = c.sum_logprob;
+            beam.tokens.push_back(c.token);
+
+            // timestamp token - update sliding window
+            if (c.token.id > token_beg) {
+                beam.seek_delta = 2*(c.token.id - token_beg);
+                beam.result_len = i + 1;
+            }
+
+            // end of text token
+            if (c.token.id == token_eot) {
+                if (beam.result_len == 0 && seek + beam.seek_delta + 100 >= seek_end) {
+                    beam.result_len = i + 1;
+                }
+
+                finished.push_back(std::move(beam));
+                continue;
+            }
+
+            beams_next.push_back(std::move(beam));
+        }
+
+        // TESTS: if no tensors are loaded, it means we are running tests
+        if (ctx->model.n_loaded == 0) {
+            beams = std::move(beams_next);
+            beams.insert(beams.end(), finished.begin(), finished.end());
+            finished.clear();
+
+            for (auto & beam : beams) {
+                beam.seek_delta = 2*state->n_audio_ctx;
+            }
+            break;
+        }
+
+        if ((int) finished.size() >= n_best || beams_next.empty()) {
+            break;
+        }
+
+        // the first continuation of a beam keeps its slot, the other ones fork it into the slots of the dropped beams
+        std::fill(seq_used.begin(), seq_used.end(), false);
+
+        std::vector<int> forks;
+        for (int ib = 0; ib < (int) beams_next.size(); ++ib) {
+            if (seq_used[beams_next[ib].seq]) {
+                forks.push_back(ib);
+            } else {
+                seq_used[beams_next[ib].seq] = true;
+            }
+        }
+
+        for (int ib : forks) {
+            const int seq = std::find(seq_used.begin(), seq_used.end(), false) - seq_used.begin();
+
+            whisper_kv_cache_seq_cp(ctx->model, *state, beams_next[ib].seq, seq, n_past);
+
+            beams_next[ib].seq = seq;
+            seq_used[seq] = true;
+        }
+
+        beams = std::move(beams_next);
+
+        // decode the new token of all the beams as one batch
+        batch.resize(beams.size());
+        for (int ib = 0; ib < (int) beams.size(); ++ib) {
+            batch[ib] = { beams[ib].seq, n_past, { beams[ib].tokens.back().id } };
+        }
+
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            if (!whisper_decode(*ctx, *state, params.n_threads, batch)) {
+                return -1;
+            }
+
+            state->t_decode_us += ggml_time_us() - t_start_us;
+        }
+
+        n_past += 1;
+
+        probs = state->probs;
     }
 
-    const int seek_start = params.offset_ms/10;
-    const int seek_end = seek_start + (params.duration_ms == 0 ? whisper_n_len(ctx) : params.duration_ms/10);
+    // the best hypothesis, by average log probability per token
+    const auto & hyps = finished.empty() ? beams : finished;
 
-    // if length of spectrogram is less than 1s (100 samples), then return
-    // basically don't process anything that is less than 1s
-    // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
-    if (seek_end < 100 + seek_start) {
-        return 0;
+    int i_best = 0;
+    for (int ih = 1; ih < (int) hyps.size(); ++ih) {
+        if (hyps[ih].sum_logprob/hyps[ih].tokens.size() > hyps[i_best].sum_logprob/hyps[i_best].tokens.size()) {
+            i_best = ih;
+        }
     }
 
-    // the accumulated text context so far
-    auto & prompt_past = ctx->prompt_past;
-    if (params.no_context) {
-        prompt_past.clear();
+    const auto & best = hyps[i_best];
+
+    if (best.result_len == 0 && !best.tokens.empty() && best.tokens.back().id == token_eot) {
+        // TODO: figure out how to resolve this
+        fprintf(stderr, "\n%s: failed to generate timestamp token - this should not happen\n\n", __func__);
     }
 
-    // these tokens determine the task that will be performed
+    tokens_cur = best.tokens;
+    seek_delta = best.seek_delta;
+    result_len = best.result_len;
+
+    return 0;
+}
+
+// the tokens that start the prompt of each window and determine the task that will be performed
+static std::vector<whisper_token> whisper_prompt_init(struct whisper_context * ctx, const struct whisper_full_params & params) {
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
     if (whisper_is_multilingual(ctx)) {
         prompt_init.push_back(whisper_token_sot(ctx) + 1 + whisper_lang_id(params.language));
@@ -2524,68 +3445,233 @@ int whisper_full(
         }
     }
 
-    int progress_prev = 0;
-    int progress_step = 5;
+    return prompt_init;
+}
 
-    std::vector<whisper_token_data> tokens_cur;
-    tokens_cur.reserve(whisper_n_text_ctx(ctx));
+// encode the window of the mel spectrogram that starts at mel_offset, n_len frames of audio are left from there
+static bool whisper_encode_window(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        const struct whisper_full_params & params,
+        int mel_offset,
+        int n_len) {
+    // number of audio positions of the window, the encoder skips the padding after the end of the audio if requested
+    int n_audio_ctx = params.audio_ctx > 0 ? std::min(params.audio_ctx, whisper_n_audio_ctx(ctx)) : whisper_n_audio_ctx(ctx);
+    if (params.skip_padding) {
+        const int n_pos = (std::min(n_len, 2*n_audio_ctx) + 1)/2;
+        n_audio_ctx = std::min(n_audio_ctx, ((n_pos + WHISPER_AUDIO_CTX_BLOCK - 1)/WHISPER_AUDIO_CTX_BLOCK)*WHISPER_AUDIO_CTX_BLOCK);
+    }
 
-    std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!whisper_encode(*ctx, *state, params.n_threads, mel_offset, n_audio_ctx)) {
+        return false;
+    }
+
+    state->t_encode_us += ggml_time_us() - t_start_us;
+
+    return true;
+}
+
+// max number of encoded windows that are kept for the decoder in whisper_full_pipelined()
+#define WHISPER_PIPELINE_WINDOWS 2
+
+// a window encoded ahead of the decoder - the part of the cross-attention memory that it fills
+struct whisper_encoded_window {
+    int seek;
+    int n_audio_ctx;
+
+    std::vector<uint8_t> memory_cross_k;
+    std::vector<uint8_t> memory_cross_v;
+};
+
+// the windows that the encoder thread of whisper_full_pipelined() encodes ahead of the decoder
+//
+// the next window starts at the last timestamp of the current one, which is only known once it is decoded, so the
+// encoder speculates that it is the last timestamp sampled so far and encodes the window again when it is not
+struct whisper_pipeline {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    int seek_next = -1; // the window to encode next, -1 if none
+    int seek_busy = -1; // the window that is being encoded, -1 if none
+
+    std::deque<whisper_encoded_window> windows; // the latest encoded windows
+
+    bool error = false; // the encoder failed
+    bool stop  = false; // the decoder does not take more windows
+};
+
+// ask the encoder for the window that starts at seek, unless it is already encoded or being encoded
+// it replaces the window that was requested before, if the encoder has not started it yet
+static void whisper_pipeline_request(whisper_pipeline & pipeline, int seek) {
+    std::lock_guard<std::mutex> lock(pipeline.mutex);
+
+    if (seek == pipeline.seek_busy) {
+        return;
+    }
+
+    for (const auto & window : pipeline.windows) {
+        if (window.seek == seek) {
+            return;
+        }
+    }
+
+    pipeline.seek_next = seek;
+    pipeline.cv.notify_all();
+}
+
+// encode the windows requested by the decoder until it stops the pipeline, keeping the latest ones
+static void whisper_pipeline_encode(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        const struct whisper_full_params & params,
+        int seek_end,
+        whisper_pipeline & pipeline) {
+    const auto & hparams = ctx->model.hparams;
 
-    // main loop
-    int seek = seek_start;
     while (true) {
-        const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
-        while (progress_cur >= progress_prev + progress_step) {
-            progress_prev += progress_step;
-            if (params.print_progress) {
-                fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress_prev);
+        int seek = 0;
+
+        {
+            std::unique_lock<std::mutex> lock(pipeline.mutex);
+            pipeline.cv.wait(lock, [&] { return pipeline.stop || pipeline.seek_next >= 0; });
+
+            if (pipeline.stop) {
+                return;
             }
+
+            seek = pipeline.seek_next;
+
+            pipeline.seek_next = -1;
+            pipeline.seek_busy = seek;
         }
 
-        if (seek + 100 >= seek_end) {
-            break;
+        if (!whisper_encode_window(ctx, state, params, seek, seek_end - seek)) {
+            std::lock_guard<std::mutex> lock(pipeline.mutex);
+            pipeline.error     = true;
+            pipeline.seek_busy = -1;
+            pipeline.cv.notify_all();
+            return;
         }
 
-        // encode audio features starting at offset seek
-        if (whisper_encode(ctx, seek, params.n_threads) != 0) {
-            fprintf(stderr, "%s: failed to encode\n", __func__);
-            return 7;
+        whisper_encoded_window window;
+
+        window.seek        = seek;
+        window.n_audio_ctx = state->n_audio_ctx;
+
+        // the memory of layer il starts at il*n_audio_ctx positions, so the window fills the front of the tensors
+        const size_t nbytes = ggml_element_size(state->memory_cross_k)*hparams.n_text_state*hparams.n_text_layer*window.n_audio_ctx;
+
+        window.memory_cross_k.assign((const uint8_t *) state->memory_cross_k->data, (const uint8_t *) state->memory_cross_k->data + nbytes);
+        window.memory_cross_v.assign((const uint8_t *) state->memory_cross_v->data, (const uint8_t *) state->memory_cross_v->data + nbytes);
+
+        {
+            std::lock_guard<std::mutex> lock(pipeline.mutex);
+
+            pipeline.windows.push_back(std::move(window));
+            if (pipeline.windows.size() > WHISPER_PIPELINE_WINDOWS) {
+                pipeline.windows.pop_front();
+            }
+
+            pipeline.seek_busy = -1;
+            pipeline.cv.notify_all();
         }
+    }
+}
+
+// wait for the window that starts at seek and load it into the cross-attention memory of the state
+// the other windows are dropped, since the decoder does not go back - false if the encoder failed
+static bool whisper_pipeline_take(whisper_pipeline & pipeline, struct whisper_state * state, int seek) {
+    whisper_pipeline_request(pipeline, seek);
 
-        int n_past = 0;
-        prompt.clear();
+    whisper_encoded_window window;
 
-        // if we have already generated some text, use it as a prompt to condition the next generation
-        if (prompt_past.size() > 0) {
-            int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+    {
+        std::unique_lock<std::mutex> lock(pipeline.mutex);
+
+        auto it = pipeline.windows.end();
 
-            prompt = { whisper_token_prev(ctx) };
-            prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
+        pipeline.cv.wait(lock, [&] {
+            it = std::find_if(pipeline.windows.begin(), pipeline.windows.end(), [&](const whisper_encoded_window & w) { return w.seek == seek; });
+            return it != pipeline.windows.end() || pipeline.error;
+        });
 
-            prompt_past.clear();
-            prompt_past.insert(prompt_past.end(), prompt.begin() + 1, prompt.end());
+        if (it == pipeline.windows.end()) {
+            return false;
         }
 
-        prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+        window = std::move(*it);
+        pipeline.windows.clear();
+    }
+
+    memcpy(state->memory_cross_k->data, window.memory_cross_k.data(), window.memory_cross_k.size());
+    memcpy(state->memory_cross_v->data, window.memory_cross_v.data(), window.memory_cross_v.size());
 
-        bool done = false;
-        int seek_delta = 100*WHISPER_CHUNK_SIZE;
+    state->n_audio_ctx = window.n_audio_ctx;
 
-        // print the prompt
-        //printf("\n\n");
-        //for (int i = 0; i < prompt.size(); i++) {
-        //    printf("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token[prompt[i]].c_str());
-        //}
-        //printf("\n\n");
+    return true;
+}
+
+// decode the encoded window that starts at seek, conditioned on the text so far in state->prompt_past
+//
+// the text of the window is returned in tokens_cur, cut after its last timestamp token, and seek_delta is the
+// offset of the audio after that timestamp (or the length of the window if there is none)
+//
+// with a pipeline, the encoder is asked for the window that starts at each timestamp token as soon as it is sampled
+// by the greedy decoder, since the last one is where the next window starts
+static int whisper_decode_window(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        const struct whisper_full_params & params,
+        const std::vector<whisper_token> & prompt_init,
+        int n_beam,
+        int seek,
+        int seek_end,
+        whisper_pipeline * pipeline,
+        std::vector<whisper_token> & prompt,
+        std::vector<whisper_token_data> & tokens_cur,
+        int & seek_delta) {
+    auto & prompt_past = state->prompt_past;
+
+    int n_past = 0;
+    prompt.clear();
+
+    // if we have already generated some text, use it as a prompt to condition the next generation
+    if (prompt_past.size() > 0) {
+        int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+
+        prompt = { whisper_token_prev(ctx) };
+        prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
 
-        // the accumulated transcription in the current interation
-        int result_len = 0;
-        tokens_cur.clear();
+        prompt_past.clear();
+        prompt_past.insert(prompt_past.end(), prompt.begin() + 1, prompt.end());
+    }
+
+    prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+
+    bool done = false;
+    seek_delta = 2*state->n_audio_ctx; // without a timestamp, continue after the encoded window
 
+    // print the prompt
+    //printf("\n\n");
+    //for (int i = 0; i < prompt.size(); i++) {
+    //    printf("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token[prompt[i]].c_str());
+    //}
+    //printf("\n\n");
+
+    // the accumulated transcription in the current interation
+    int result_len = 0;
+    tokens_cur.clear();
+
+    if (n_beam > 1) {
+        if (whisper_beam_search(ctx, state, params, prompt, seek, seek_end, tokens_cur, seek_delta, result_len) != 0) {
+            fprintf(stderr, "%s: failed to decode\n", __func__);
+            return 8;
+        }
+    } else {
         for (int i = 0; i < whisper_n_text_ctx(ctx)/2 - 4; ++i) {
-            if (whisper_decode(ctx, prompt.data(), prompt.size(), n_past, params.n_threads) != 0) {
+            if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), n_past, params.n_threads) != 0) {
                 fprintf(stderr, "%s: failed to decode\n", __func__);
                 return 8;
             }
@@ -2601,7 +3687,7 @@ int whisper_full(
             // feel free to experiment!
             //
             {
-                auto token = whisper_sample_best(ctx);
+                auto token = whisper_sample_best_with_state(ctx, state);
 
                 if (i == 0) {
                     token.tid = whisper_token_beg(ctx);
@@ -2611,6 +3697,10 @@ int whisper_full(
                 if (token.id > whisper_token_beg(ctx)) {
                     seek_delta = 2*(token.id - whisper_token_beg(ctx));
                     result_len = i + 1;
+
+                    if (pipeline && seek + seek_delta + 100 < seek_end) {
+                        whisper_pipeline_request(*pipeline, seek + seek_delta);
+                    }
                 }
 
                 // add it to the context
@@ -2637,7 +3727,7 @@ int whisper_full(
 
                 // TESTS: if no tensors are loaded, it means we are running tests
                 if (ctx->model.n_loaded == 0) {
-                    seek_delta = 100*WHISPER_CHUNK_SIZE;
+                    seek_delta = 2*state->n_audio_ctx;
                     break;
                 }
             }
@@ -2646,177 +3736,377 @@ int whisper_full(
                 break;
             }
         }
+    }
 
-        // shrink down to result_len
-        tokens_cur.resize(result_len);
+    // shrink down to result_len
+    tokens_cur.resize(result_len);
 
-        for (const auto & r : tokens_cur) {
-            prompt_past.push_back(r.id);
-        }
+    return 0;
+}
 
-        // store the text from this iteration
-        if (tokens_cur.size() > 0) {
-            int  i0 = 0;
-            auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
+// store the text of a decoded window as segments of state->result_all and report the new segments
+static void whisper_store_segments(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        const struct whisper_full_params & params,
+        const std::vector<whisper_token_data> & tokens_cur,
+        int seek,
+        int seek_delta) {
+    auto & result_all = state->result_all;
 
-            std::string text = "";
+    if (tokens_cur.size() > 0) {
+        int  i0 = 0;
+        auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
 
-            for (int i = 0; i < (int) tokens_cur.size(); i++) {
-                //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
-                //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
-                //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+        std::string text = "";
 
-                if (params.print_special_tokens == false && tokens_cur[i].id >= whisper_token_eot(ctx)) {
-                } else {
-                    text += whisper_token_to_str(ctx, tokens_cur[i].id);
-                }
-                if (tokens_cur[i].id > whisper_token_beg(ctx)) {
-                    const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
-                    if (!text.empty()) {
-                        if (params.print_realtime) {
-                            if (params.print_timestamps) {
-                                printf("[%s --> %s]  %s\n", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), text.c_str());
-                            } else {
-                                printf("%s", text.c_str());
-                                fflush(stdout);
-                            }
-                        }
+        for (int i = 0; i < (int) tokens_cur.size(); i++) {
+            //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
+            //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
+            //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
 
-                        result_all.push_back({ t0, t1, text, {} });
-                        for (int j = i0; j <= i; j++) {
-                            result_all.back().tokens.push_back(tokens_cur[j]);
+            if (params.print_special_tokens == false && tokens_cur[i].id >= whisper_token_eot(ctx)) {
+            } else {
+                text += whisper_token_to_str(ctx, tokens_cur[i].id);
+            }
+            if (tokens_cur[i].id > whisper_token_beg(ctx)) {
+                const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
+                if (!text.empty()) {
+                    if (params.print_realtime) {
+                        if (params.print_timestamps) {
+                            printf("[%s --> %s]  %s\n", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), text.c_str());
+                        } else {
+                            printf("%s", text.c_str());
+                            fflush(stdout);
                         }
+                    }
+
+                    result_all.push_back({ t0, t1, text, {} });
+                    for (int j = i0; j <= i; j++) {
+                        result_all.back().tokens.push_back(tokens_cur[j]);
+                    }
 
-                        int n_new = 1;
+                    int n_new = 1;
 
-                        if (params.token_timestamps) {
-                            whisper_exp_compute_token_level_timestamps(
-                                    ctx, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+                    if (params.token_timestamps) {
+                        whisper_exp_compute_token_level_timestamps(
+                                ctx, state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
 
-                            if (params.max_len > 0) {
-                                n_new = whisper_wrap_segment(ctx, params.max_len);
-                            }
-                        }
-                        if (params.new_segment_callback) {
-                            params.new_segment_callback(ctx, n_new, params.new_segment_callback_user_data);
+                        if (params.max_len > 0) {
+                            n_new = whisper_wrap_segment(ctx, state, params.max_len);
                         }
                     }
-                    text = "";
-                    while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
-                        i++;
+                    if (params.new_segment_callback) {
+                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                     }
-                    i--;
-                    t0 = t1;
-                    i0 = i + 1;
                 }
+                text = "";
+                while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
+                    i++;
+                }
+                i--;
+                t0 = t1;
+                i0 = i + 1;
             }
+        }
 
-            if (!text.empty()) {
-                const auto t1 = seek + seek_delta;
+        if (!text.empty()) {
+            const auto t1 = seek + seek_delta;
 
-                if (params.print_realtime) {
-                    if (params.print_timestamps) {
-                        printf("[%s --> %s]  %s\n", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), text.c_str());
-                    } else {
-                        printf("%s", text.c_str());
-                        fflush(stdout);
-                    }
+            if (params.print_realtime) {
+                if (params.print_timestamps) {
+                    printf("[%s --> %s]  %s\n", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), text.c_str());
+                } else {
+                    printf("%s", text.c_str());
+                    fflush(stdout);
                 }
+            }
 
-                result_all.push_back({ t0, t1, text, {} });
-                for (int j = i0; j < (int) tokens_cur.size(); j++) {
-                    result_all.back().tokens.push_back(tokens_cur[j]);
-                }
+            result_all.push_back({ t0, t1, text, {} });
+            for (int j = i0; j < (int) tokens_cur.size(); j++) {
+                result_all.back().tokens.push_back(tokens_cur[j]);
+            }
 
-                int n_new = 1;
+            int n_new = 1;
 
-                if (params.token_timestamps) {
-                    whisper_exp_compute_token_level_timestamps(
-                            ctx, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+            if (params.token_timestamps) {
+                whisper_exp_compute_token_level_timestamps(
+                        ctx, state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
 
-                    if (params.max_len > 0) {
-                        n_new = whisper_wrap_segment(ctx, params.max_len);
-                    }
-                }
-                if (params.new_segment_callback) {
-                    params.new_segment_callback(ctx, n_new, params.new_segment_callback_user_data);
+                if (params.max_len > 0) {
+                    n_new = whisper_wrap_segment(ctx, state, params.max_len);
                 }
             }
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+            }
         }
-
-        seek += seek_delta;
     }
 
-    return 0;
 }
 
-int whisper_full_parallel(
+// clear the results of the state and prepare it for the transcription of the samples: compute the log mel
+// spectrogram and make room for the beams in the self-attention memory
+//
+// the mel frames [seek_start, seek_end) are to be transcribed, and n_beam is the number of beams of the decoder
+static int whisper_full_begin(
         struct whisper_context * ctx,
-        struct whisper_full_params params,
+        struct whisper_state * state,
+        const struct whisper_full_params & params,
         const float * samples,
         int n_samples,
-        const int n_processors) {
-    if (n_processors == 1) {
-        return whisper_full(ctx, params, samples, n_samples);
-    }
-
-    int ret = 0;
+        int & n_beam,
+        int & seek_start,
+        int & seek_end) {
+    // clear old results
+    state->result_all.clear();
 
-    // prepare separate contexts for each thread
-    std::vector<struct whisper_context> ctxs(n_processors - 1);
+    // compute log mel spectrogram
+    if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+        fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
+        return -1;
+    }
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        ctxs[i] = *ctx;
+    // each beam of the beam search decodes in its own slot of the self-attention memory
+    n_beam = params.strategy == WHISPER_SAMPLING_BEAM_SEARCH ? std::max(1, params.beam_search.beam_width) : 1;
 
-        auto & model = ctxs[i].model;
+    if (n_beam > state->n_seq && !whisper_kv_cache_init(ctx->model, *state, n_beam)) {
+        fprintf(stderr, "%s: failed to allocate the key + value memory for %d beams\n", __func__, n_beam);
+        return -1;
+    }
 
-        // create the ggml memory context
-        {
-            struct ggml_init_params params = {
-                .mem_size   = ctxs[i].buf_memory.size(),
-                .mem_buffer = ctxs[i].buf_memory.data(),
-            };
-
-            model.ctx_mem = ggml_init(params);
-            if (!model.ctx_mem) {
-                fprintf(stderr, "%s: ggml_init() failed\n", __func__);
-                return false;
-            }
-        }
+    if (params.token_timestamps) {
+        state->t_beg = 0;
+        state->t_last = 0;
+        state->tid_last = 0;
+        state->energy = get_signal_energy(samples, n_samples, 32);
+    }
 
-        // separate key + value memory for each processor
-        {
-            auto & ctx = model.ctx_mem;
+    seek_start = params.offset_ms/10;
+    seek_end = seek_start + (params.duration_ms == 0 ? whisper_n_len_from_state(state) : params.duration_ms/10);
 
-            const auto & hparams = model.hparams;
+    // the accumulated text context so far
+    if (params.no_context) {
+        state->prompt_past.clear();
+    }
 
-            const int n_text_state = hparams.n_text_state;
-            const int n_text_layer = hparams.n_text_layer;
-            const int n_text_ctx   = hparams.n_text_ctx;
+    return 0;
+}
 
-            // key/value memory for the self-attention layer
-            {
-                const int n_mem      = n_text_layer*n_text_ctx;
-                const int n_elements = n_text_state*n_mem;
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples) {
+    int n_beam     = 1;
+    int seek_start = 0;
+    int seek_end   = 0;
 
-                model.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-                model.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
+    if (whisper_full_begin(ctx, state, params, samples, n_samples, n_beam, seek_start, seek_end) != 0) {
+        return -1;
+    }
+
+    // if length of spectrogram is less than 1s (100 samples), then return
+    // basically don't process anything that is less than 1s
+    // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
+    if (seek_end < 100 + seek_start) {
+        return 0;
+    }
+
+    auto & prompt_past = state->prompt_past;
+
+    // these tokens determine the task that will be performed
+    const std::vector<whisper_token> prompt_init = whisper_prompt_init(ctx, params);
+
+    int progress_prev = 0;
+    int progress_step = 5;
+
+    std::vector<whisper_token_data> tokens_cur;
+    tokens_cur.reserve(whisper_n_text_ctx(ctx));
+
+    std::vector<whisper_token> prompt;
+    prompt.reserve(whisper_n_text_ctx(ctx));
+
+    // main loop
+    int seek = seek_start;
+    while (true) {
+        const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+        while (progress_cur >= progress_prev + progress_step) {
+            progress_prev += progress_step;
+            if (params.print_progress) {
+                fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress_prev);
             }
+        }
 
-            // key/value memory for the cross-attention layer
-            {
-                const int n_audio_ctx   = hparams.n_audio_ctx;
+        if (seek + 100 >= seek_end) {
+            break;
+        }
+
+        // encode audio features starting at offset seek
+        if (!whisper_encode_window(ctx, state, params, seek, seek_end - seek)) {
+            fprintf(stderr, "%s: failed to encode\n", __func__);
+            return 7;
+        }
+
+        int seek_delta = 0;
+
+        {
+            const int ret = whisper_decode_window(ctx, state, params, prompt_init, n_beam, seek, seek_end, nullptr, prompt, tokens_cur, seek_delta);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+
+        for (const auto & r : tokens_cur) {
+            prompt_past.push_back(r.id);
+        }
+
+        // store the text from this iteration
+        whisper_store_segments(ctx, state, params, tokens_cur, seek, seek_delta);
+
+        seek += seek_delta;
+    }
+
+    return 0;
+}
+
+int whisper_full(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+int whisper_full_pipelined(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        const int n_threads_encode) {
+    if (n_threads_encode <= 0) {
+        return whisper_full(ctx, params, samples, n_samples);
+    }
+
+    whisper_state * state = ctx->state;
+
+    int n_beam     = 1;
+    int seek_start = 0;
+    int seek_end   = 0;
+
+    if (whisper_full_begin(ctx, state, params, samples, n_samples, n_beam, seek_start, seek_end) != 0) {
+        return -1;
+    }
 
-                const int n_mem      = n_text_layer*n_audio_ctx;
-                const int n_elements = n_text_state*n_mem;
+    if (seek_end < 100 + seek_start) {
+        return 0;
+    }
 
-                model.memory_cross_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-                model.memory_cross_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
+    // the encoder has a state of its own, with its threads and graph, and takes the mel spectrogram while it runs
+    whisper_state * state_enc = whisper_init_state(ctx);
+    if (state_enc == nullptr) {
+        return -1;
+    }
+
+    std::swap(state_enc->mel, state->mel);
+
+    auto params_enc = params;
+    params_enc.n_threads = n_threads_encode;
+
+    whisper_pipeline pipeline;
+
+    std::thread worker(whisper_pipeline_encode, ctx, state_enc, std::cref(params_enc), seek_end, std::ref(pipeline));
+
+    const std::vector<whisper_token> prompt_init = whisper_prompt_init(ctx, params);
+
+    int progress_prev = 0;
+    int progress_step = 5;
+
+    std::vector<whisper_token_data> tokens_cur;
+    tokens_cur.reserve(whisper_n_text_ctx(ctx));
+
+    std::vector<whisper_token> prompt;
+    prompt.reserve(whisper_n_text_ctx(ctx));
+
+    int ret = 0;
+
+    // the windows start where they do in whisper_full_with_state(): at the last timestamp of the previous one
+    int seek = seek_start;
+    while (true) {
+        const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+        while (progress_cur >= progress_prev + progress_step) {
+            progress_prev += progress_step;
+            if (params.print_progress) {
+                fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress_prev);
             }
+        }
+
+        if (seek + 100 >= seek_end) {
+            break;
+        }
+
+        // the decoder attends to the cross-attention memory of the window
+        if (!whisper_pipeline_take(pipeline, state, seek)) {
+            fprintf(stderr, "%s: failed to encode\n", __func__);
+            ret = 7;
+            break;
+        }
+
+        int seek_delta = 0;
+
+        ret = whisper_decode_window(ctx, state, params, prompt_init, n_beam, seek, seek_end, &pipeline, prompt, tokens_cur, seek_delta);
+        if (ret != 0) {
+            break;
+        }
+
+        for (const auto & r : tokens_cur) {
+            state->prompt_past.push_back(r.id);
+        }
+
+        whisper_store_segments(ctx, state, params, tokens_cur, seek, seek_delta);
+
+        seek += seek_delta;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pipeline.mutex);
+        pipeline.stop = true;
+        pipeline.cv.notify_all();
+    }
+
+    worker.join();
+
+    std::swap(state_enc->mel, state->mel);
+
+    state->t_encode_us += state_enc->t_encode_us;
+
+    whisper_free_state(state_enc);
+
+    return ret;
+}
+int whisper_full_parallel(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        const int n_processors) {
+    if (n_processors == 1) {
+        return whisper_full(ctx, params, samples, n_samples);
+    }
+
+    int ret = 0;
 
-            const size_t memory_size =
-                ggml_nbytes(model.memory_k)       + ggml_nbytes(model.memory_v) +
-                ggml_nbytes(model.memory_cross_k) + ggml_nbytes(model.memory_cross_v);
+    // the model is shared, each of the other threads decodes with its own state
+    std::vector<struct whisper_state *> states(n_processors - 1);
+
+    for (int i = 0; i < n_processors - 1; ++i) {
+        states[i] = whisper_init_state(ctx);
+        if (states[i] == nullptr) {
+            for (int j = 0; j < i; ++j) {
+                whisper_free_state(states[j]);
+            }
+            return -1;
         }
     }
 
@@ -2840,7 +4130,7 @@ int whisper_full_parallel(
         params_cur.new_segment_callback = nullptr;
         params_cur.new_segment_callback_user_data = nullptr;
 
-        workers[i] = std::thread(whisper_full, &ctxs[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
     }
 
     {
@@ -2855,9 +4145,11 @@ int whisper_full_parallel(
 
     const int64_t offset_t = (int64_t) params.offset_ms/10.0;
 
-    // combine results into ctx->result_all
+    // combine results into the state of the context
+    auto & result_all = ctx->state->result_all;
+
     for (int i = 0; i < n_processors - 1; ++i) {
-        auto & results_i = ctxs[i].result_all;
+        auto & results_i = states[i]->result_all;
 
         for (int j = 0; j < (int) results_i.size(); ++j) {
             // correct the segment timestamp taking into account the offset
@@ -2865,29 +4157,31 @@ int whisper_full_parallel(
             results_i[j].t1 += 100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t;
 
             // make sure that segments are not overlapping
-            if (ctx->result_all.size() > 0) {
-                results_i[j].t0 = std::max(results_i[j].t0, ctx->result_all.back().t1);
+            if (result_all.size() > 0) {
+                results_i[j].t0 = std::max(results_i[j].t0, result_all.back().t1);
             }
 
-            ctx->result_all.push_back(std::move(results_i[j]));
+            result_all.push_back(std::move(results_i[j]));
 
             // call the new_segment_callback for each segment
             if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, 1, params.new_segment_callback_user_data);
+                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
             }
         }
 
-        ctx->t_mel_us    += ctxs[i].t_mel_us;
-        ctx->t_sample_us += ctxs[i].t_sample_us;
-        ctx->t_encode_us += ctxs[i].t_encode_us;
-        ctx->t_decode_us += ctxs[i].t_decode_us;
+        ctx->state->t_mel_us    += states[i]->t_mel_us;
+        ctx->state->t_sample_us += states[i]->t_sample_us;
+        ctx->state->t_encode_us += states[i]->t_encode_us;
+        ctx->state->t_decode_us += states[i]->t_decode_us;
+
+        whisper_free_state(states[i]);
     }
 
     // average the timings
-    ctx->t_mel_us    /= n_processors;
-    ctx->t_sample_us /= n_processors;
-    ctx->t_encode_us /= n_processors;
-    ctx->t_decode_us /= n_processors;
+    ctx->state->t_mel_us    /= n_processors;
+    ctx->state->t_sample_us /= n_processors;
+    ctx->state->t_encode_us /= n_processors;
+    ctx->state->t_decode_us /= n_processors;
 
     // print information about the audio boundaries
     fprintf(stderr, "\n");
@@ -2900,40 +4194,326 @@ int whisper_full_parallel(
     return ret;
 }
 
+//
+// streaming
+//
+
+// a segment that ends closer than this to the end of the received audio may still change with more audio (in mel frames)
+#define WHISPER_STREAM_GUARD 100
+
+struct whisper_stream {
+    whisper_context * ctx;
+    whisper_state   * state;
+
+    whisper_full_params params;
+
+    int n_beam;
+    int n_step;   // mel frames of new audio between two decodes
+    int n_length; // mel frames of pending audio after which all its segments are finished
+
+    // the samples still needed by the frames after n_frames, pcm[0] is sample n_frames*WHISPER_HOP_LENGTH
+    std::vector<float> pcm;
+
+    // log mel spectrogram of the frames [frame0, n_frames) before the normalization, WHISPER_N_MEL values per frame
+    std::vector<float> frames;
+
+    int frame0   = 0;
+    int n_frames = 0;
+
+    // maximum of the log mel values so far - the normalization can not see the audio to come, unlike in whisper_full()
+    double mmax = -1e20;
+
+    int seek   = 0; // first frame after the finished segments
+    int n_last = 0; // number of frames at the last decode
+
+    bool flushed = false;
+
+    std::vector<whisper_token> prompt_init;
+    std::vector<whisper_token> prompt;
+
+    std::vector<whisper_token_data> tokens_cur;
+};
+
+struct whisper_stream * whisper_stream_init_with_state(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        struct whisper_full_params params,
+        int step_ms,
+        int length_ms) {
+    const int n_window = 2*whisper_n_audio_ctx(ctx);
+
+    whisper_stream * stream = new whisper_stream;
+
+    stream->ctx   = ctx;
+    stream->state = state;
+
+    // the energy of the whole signal is not available
+    params.token_timestamps = false;
+
+    stream->params   = params;
+    stream->n_beam   = params.strategy == WHISPER_SAMPLING_BEAM_SEARCH ? std::max(1, params.beam_search.beam_width) : 1;
+    stream->n_step   = std::max(1, step_ms/10);
+    stream->n_length = length_ms > 0 ? std::min(std::max(length_ms/10, WHISPER_STREAM_GUARD + 1), n_window) : n_window;
+
+    if (stream->n_beam > state->n_seq && !whisper_kv_cache_init(ctx->model, *state, stream->n_beam)) {
+        fprintf(stderr, "%s: failed to allocate the key + value memory for %d beams\n", __func__, stream->n_beam);
+        delete stream;
+        return nullptr;
+    }
+
+    stream->prompt_init = whisper_prompt_init(ctx, params);
+    stream->prompt.reserve(whisper_n_text_ctx(ctx));
+    stream->tokens_cur.reserve(whisper_n_text_ctx(ctx));
+
+    state->result_all.clear();
+    if (params.no_context) {
+        state->prompt_past.clear();
+    }
+
+    return stream;
+}
+
+struct whisper_stream * whisper_stream_init(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        int step_ms,
+        int length_ms) {
+    return whisper_stream_init_with_state(ctx, ctx->state, params, step_ms, length_ms);
+}
+
+void whisper_stream_free(struct whisper_stream * stream) {
+    delete stream;
+}
+
+// compute the log mel spectrogram of the next n_new frames from the received samples
+static void whisper_stream_add_frames(whisper_stream & stream, int n_new) {
+    if (n_new <= 0) {
+        return;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const size_t n0 = (size_t) (stream.n_frames - stream.frame0)*WHISPER_N_MEL;
+
+    stream.frames.resize(n0 + (size_t) n_new*WHISPER_N_MEL);
+
+    float * dst = stream.frames.data() + n0;
+
+    log_mel_spectrogram_frames(
+            stream.pcm.data(), stream.pcm.size(), WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, stream.params.n_threads,
+            stream.ctx->model.filters, 0, n_new, dst, WHISPER_N_MEL, 1);
+
+    for (int i = 0; i < n_new*WHISPER_N_MEL; ++i) {
+        stream.mmax = std::max(stream.mmax, (double) dst[i]);
+    }
+
+    stream.pcm.erase(stream.pcm.begin(), stream.pcm.begin() + std::min(stream.pcm.size(), (size_t) n_new*WHISPER_HOP_LENGTH));
+    stream.n_frames += n_new;
+
+    stream.state->t_mel_us += ggml_time_us() - t_start_us;
+}
+
+// set the normalized mel spectrogram of the pending audio [seek, n_frames) as the input of the encoder
+static void whisper_stream_set_mel(whisper_stream & stream) {
+    // the frames of the finished segments are no longer needed
+    stream.frames.erase(stream.frames.begin(), stream.frames.begin() + (size_t) (stream.seek - stream.frame0)*WHISPER_N_MEL);
+    stream.frame0 = stream.seek;
+
+    auto & mel = stream.state->mel;
+
+    mel.n_mel = WHISPER_N_MEL;
+    mel.n_len = stream.n_frames - stream.frame0;
+    mel.data.resize(mel.n_mel*mel.n_len);
+
+    for (int i = 0; i < mel.n_len; ++i) {
+        for (int j = 0; j < mel.n_mel; ++j) {
+            mel.data[j*mel.n_len + i] = stream.frames[i*WHISPER_N_MEL + j];
+        }
+    }
+
+    log_mel_spectrogram_normalize(mel.data.data(), mel.n_mel*mel.n_len, stream.mmax);
+}
+
+// decode the pending audio and store its finished segments, all of them on flush
+static int whisper_stream_decode(whisper_stream & stream, bool flush) {
+    whisper_context * ctx   = stream.ctx;
+    whisper_state   * state = stream.state;
+
+    const auto & params = stream.params;
+
+    stream.n_last = stream.n_frames;
+
+    while (true) {
+        const int n_pending = stream.n_frames - stream.seek;
+
+        // don't process anything that is less than 1s
+        if (n_pending <= 100) {
+            break;
+        }
+
+        // the window is decoded again with more audio until it reaches n_length
+        const bool finish = flush || n_pending >= stream.n_length;
+
+        whisper_stream_set_mel(stream);
+
+        if (!whisper_encode_window(ctx, state, params, 0, n_pending)) {
+            fprintf(stderr, "%s: failed to encode\n", __func__);
+            return 7;
+        }
+
+        auto & tokens_cur = stream.tokens_cur;
+
+        int seek_delta = 0;
+
+        {
+            const int ret = whisper_decode_window(ctx, state, params, stream.prompt_init, stream.n_beam, stream.seek, stream.n_frames, nullptr, stream.prompt, tokens_cur, seek_delta);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+
+        if (finish) {
+            seek_delta = std::min(seek_delta, n_pending);
+        } else {
+            // keep the segments that end far enough from the end of the audio, the rest may change with more audio
+            int n_keep = 0;
+
+            for (int i = 0; i < (int) tokens_cur.size(); ++i) {
+                if (tokens_cur[i].id <= whisper_token_beg(ctx)) {
+                    continue;
+                }
+
+                const int t = 2*(tokens_cur[i].id - whisper_token_beg(ctx));
+                if (t > 0 && t <= n_pending - WHISPER_STREAM_GUARD) {
+                    n_keep     = i + 1;
+                    seek_delta = t;
+                }
+            }
+
+            if (n_keep == 0) {
+                break;
+            }
+
+            tokens_cur.resize(n_keep);
+        }
+
+        for (const auto & r : tokens_cur) {
+            state->prompt_past.push_back(r.id);
+        }
+
+        whisper_store_segments(ctx, state, params, tokens_cur, stream.seek, seek_delta);
+
+        stream.seek += seek_delta;
+
+        // the rest is decoded again at the next step
+        if (!flush && stream.n_frames - stream.seek < stream.n_length) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int whisper_stream_push(struct whisper_stream * stream, const float * samples, int n_samples) {
+    if (stream->flushed) {
+        fprintf(stderr, "%s: the stream has been flushed\n", __func__);
+        return -1;
+    }
+
+    stream->pcm.insert(stream->pcm.end(), samples, samples + n_samples);
+
+    // the frames that lie entirely within the received samples
+    const int n_pcm = stream->pcm.size();
+    const int n_new = n_pcm < WHISPER_N_FFT ? 0 : (n_pcm - WHISPER_N_FFT)/WHISPER_HOP_LENGTH + 1;
+
+    whisper_stream_add_frames(*stream, n_new);
+
+    if (stream->n_frames - stream->n_last >= stream->n_step) {
+        return whisper_stream_decode(*stream, false);
+    }
+
+    return 0;
+}
+
+int whisper_stream_flush(struct whisper_stream * stream) {
+    stream->flushed = true;
+
+    // the last frames are padded with zeros, as in whisper_pcm_to_mel()
+    whisper_stream_add_frames(*stream, stream->pcm.size()/WHISPER_HOP_LENGTH);
+
+    return whisper_stream_decode(*stream, true);
+}
+
+int whisper_full_n_segments_from_state(struct whisper_state * state) {
+    return state->result_all.size();
+}
+
 int whisper_full_n_segments(struct whisper_context * ctx) {
-    return ctx->result_all.size();
+    return whisper_full_n_segments_from_state(ctx->state);
+}
+
+int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t0;
 }
 
 int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].t0;
+    return whisper_full_get_segment_t0_from_state(ctx->state, i_segment);
+}
+
+int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t1;
 }
 
 int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].t1;
+    return whisper_full_get_segment_t1_from_state(ctx->state, i_segment);
+}
+
+const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].text.c_str();
 }
 
 const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].text.c_str();
+    return whisper_full_get_segment_text_from_state(ctx->state, i_segment);
+}
+
+int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].tokens.size();
 }
 
 int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].tokens.size();
+    return whisper_full_n_tokens_from_state(ctx->state, i_segment);
+}
+
+const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
 }
 
 const char * whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->result_all[i_segment].tokens[i_token].id].c_str();
+    return whisper_full_get_token_text_from_state(ctx, ctx->state, i_segment, i_token);
+}
+
+whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].id;
 }
 
 whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token].id;
+    return whisper_full_get_token_id_from_state(ctx->state, i_segment, i_token);
+}
+
+struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token];
 }
 
 struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token];
+    return whisper_full_get_token_data_from_state(ctx->state, i_segment, i_token);
+}
+
+float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].p;
 }
 
 float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token].p;
+    return whisper_full_get_token_p_from_state(ctx->state, i_segment, i_token);
 }
 
 const char * whisper_print_system_info() {
@@ -2946,6 +4526,7 @@ const char * whisper_print_system_info() {
     s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
     s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
     s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
+    s += "ISA = "       + std::string(ggml_cpu_isa())              + " | ";
 
     return s.c_str();
 }
@@ -3020,13 +4601,14 @@ static std::vector<float> get_signal_energy(const float * signal, int n_samples,
 
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context * ctx,
+        struct whisper_state * state,
         int   i_segment,
         float thold_pt,
         float thold_ptsum) {
-    auto & segment = ctx->result_all[i_segment];
+    auto & segment = state->result_all[i_segment];
     auto & tokens  = segment.tokens;
 
-    const int n_samples = ctx->energy.size();
+    const int n_samples = state->energy.size();
 
     if (n_samples == 0) {
         fprintf(stderr, "%s: no signal data available\n", __func__);
@@ -3052,9 +4634,9 @@ static void whisper_exp_compute_token_level_timestamps(
         return;
     }
 
-    auto & t_beg    = ctx->t_beg;
-    auto & t_last   = ctx->t_last;
-    auto & tid_last = ctx->tid_last;
+    auto & t_beg    = state->t_beg;
+    auto & t_last   = state->t_last;
+    auto & tid_last = state->tid_last;
 
     for (int j = 0; j < n; ++j) {
         auto & token = tokens[j];
@@ -3175,15 +4757,15 @@ static void whisper_exp_compute_token_level_timestamps(
             float sum = 0.0f;
 
             for (int k = ss0; k < ss1; k++) {
-                sum += ctx->energy[k];
+                sum += state->energy[k];
             }
 
             const float thold = 0.5*sum/ns;
 
             {
                 int k = s0;
-                if (ctx->energy[k] > thold && j > 0) {
-                    while (k > 0 && ctx->energy[k] > thold) {
+                if (state->energy[k] > thold && j > 0) {
+                    while (k > 0 && state->energy[k] > thold) {
                         k--;
                     }
                     tokens[j].t0 = sample_to_timestamp(k);
@@ -3193,7 +4775,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s0 = k;
                     }
                 } else {
-                    while (ctx->energy[k] < thold && k < s1) {
+                    while (state->energy[k] < thold && k < s1) {
                         k++;
                     }
                     s0 = k;
@@ -3203,8 +4785,8 @@ static void whisper_exp_compute_token_level_timestamps(
 
             {
                 int k = s1;
-                if (ctx->energy[k] > thold) {
-                    while (k < n_samples - 1 && ctx->energy[k] > thold) {
+                if (state->energy[k] > thold) {
+                    while (k < n_samples - 1 && state->energy[k] > thold) {
                         k++;
                     }
                     tokens[j].t1 = sample_to_timestamp(k);
@@ -3214,7 +4796,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s1 = k;
                     }
                 } else {
-                    while (ctx->energy[k] < thold && k > s0) {
+                    while (state->energy[k] < thold && k > s0) {
                         k--;
                     }
                     s1 = k;
@@ -34,6 +34,11 @@ extern "C" {
     // The following interface is thread-safe as long as the sample whisper_context is not used by multiple threads
     // concurrently.
     //
+    // The whisper_context holds the loaded model (weights, vocabulary, mel filters) and a default whisper_state with
+    // the data of a transcription (key + value memory, compute buffers, mel spectrogram, results). The model is only
+    // read after loading, so additional states created with whisper_init_state() can be used concurrently from
+    // different threads with the ..._with_state() and ..._from_state() functions - each state by one thread at a time.
+    //
     // Basic usage:
     //
     //     #include "whisper.h"
@@ -65,6 +70,7 @@ extern "C" {
     //
 
     struct whisper_context;
+    struct whisper_state;
 
     typedef int whisper_token;
 
@@ -85,14 +91,28 @@ extern "C" {
     } whisper_token_data;
 
     // Allocates all memory needed for the model and loads the model from the given file.
+    // If the file has the aligned format, the weights are used in place from a memory mapping of it.
     // Returns NULL on failure.
     WHISPER_API struct whisper_context * whisper_init(const char * path_model);
 
-    // Frees all memory allocated by the model.
+    // Same as whisper_init(), but always reads the weights into memory.
+    WHISPER_API struct whisper_context * whisper_init_no_mmap(const char * path_model);
+
+    // Same as whisper_init(), but quantizes the weights to the given type ("q4_0" or "q8_0") while loading.
+    // If qtype is NULL, the weights are kept in the type stored in the model file.
+    WHISPER_API struct whisper_context * whisper_init_quantized(const char * path_model, const char * qtype);
+
+    // Allocates a new state for the model of the given context (key + value memory and compute buffers).
+    // The state must be freed with whisper_free_state() before the context.
+    // Returns NULL on failure.
+    WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
+
+    // Frees all memory allocated by the model and its default state.
     WHISPER_API void whisper_free(struct whisper_context * ctx);
+    WHISPER_API void whisper_free_state(struct whisper_state * state);
 
     // Convert RAW PCM audio to log mel spectrogram.
-    // The resulting spectrogram is stored inside the provided whisper context.
+    // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
     WHISPER_API int whisper_pcm_to_mel(
             struct whisper_context * ctx,
@@ -100,7 +120,14 @@ extern "C" {
             int n_samples,
             int n_threads);
 
-    // This can be used to set a custom log mel spectrogram inside the provided whisper context.
+    WHISPER_API int whisper_pcm_to_mel_with_state(
+            struct whisper_context * ctx,
+            struct whisper_state * state,
+            const float * samples,
+            int n_samples,
+            int n_threads);
+
+    // This can be used to set a custom log mel spectrogram inside the default state of the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
     // Returns 0 on success
@@ -110,7 +137,14 @@ extern "C" {
             int n_len,
             int n_mel);
 
-    // Run the Whisper encoder on the log mel spectrogram stored inside the provided whisper context.
+    WHISPER_API int whisper_set_mel_with_state(
+            struct whisper_context * ctx,
+            struct whisper_state * state,
+            const float * data,
+            int n_len,
+            int n_mel);
+
+    // Run the Whisper encoder on the log mel spectrogram stored inside the default state of the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
     // Returns 0 on success
@@ -119,6 +153,12 @@ extern "C" {
             int offset,
             int n_threads);
 
+    WHISPER_API int whisper_encode_with_state(
+            struct whisper_context * ctx,
+            struct whisper_state * state,
+            int offset,
+            int n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -131,6 +171,14 @@ extern "C" {
             int n_past,
             int n_threads);
 
+    WHISPER_API int whisper_decode_with_state(
+            struct whisper_context * ctx,
+            struct whisper_state * state,
+            const whisper_token * tokens,
+            int n_tokens,
+            int n_past,
+            int n_threads);
+
     // Token sampling methods.
     // These are provided for convenience and can be used after each call to whisper_decode().
     // You can also implement your own sampling method using the whisper_get_probs() function.
@@ -139,16 +187,22 @@ extern "C" {
     WHISPER_API whisper_token_data whisper_sample_best(struct whisper_context * ctx);
     WHISPER_API whisper_token whisper_sample_timestamp(struct whisper_context * ctx);
 
+    WHISPER_API whisper_token_data whisper_sample_best_with_state(struct whisper_context * ctx, struct whisper_state * state);
+    WHISPER_API whisper_token whisper_sample_timestamp_with_state(struct whisper_context * ctx, struct whisper_state * state);
+
     // Return the id of the specified language, returns -1 if not found
     WHISPER_API int whisper_lang_id(const char * lang);
 
     WHISPER_API int whisper_n_len          (struct whisper_context * ctx); // mel length
+    WHISPER_API int whisper_n_len_from_state(struct whisper_state * state);
     WHISPER_API int whisper_n_vocab        (struct whisper_context * ctx);
+    WHISPER_API int whisper_n_audio_ctx    (struct whisper_context * ctx);
     WHISPER_API int whisper_n_text_ctx     (struct whisper_context * ctx);
     WHISPER_API int whisper_is_multilingual(struct whisper_context * ctx);
 
     // The probabilities for the next token
     WHISPER_API float * whisper_get_probs(struct whisper_context * ctx);
+    WHISPER_API float * whisper_get_probs_from_state(struct whisper_state * state);
 
     // Token Id -> String. Uses the vocabulary in the provided context
     WHISPER_API const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token);
@@ -165,21 +219,29 @@ extern "C" {
     WHISPER_API whisper_token whisper_token_translate ();
     WHISPER_API whisper_token whisper_token_transcribe();
 
-    // Performance information
+    // Performance information of the default state
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
 
+    // Record the graph computations of the following calls into a per-op profile (see ggml_profiler_new)
+    // Only one context can be profiled at a time and the graphs must not be computed in parallel
+    WHISPER_API void whisper_profile_start(struct whisper_context * ctx);
+
+    // Stop the recording, print the per-op profile and write a Chrome trace to fname_trace (can be NULL)
+    // Returns 0 on success
+    WHISPER_API int whisper_profile_stop(struct whisper_context * ctx, const char * fname_trace);
+
     ////////////////////////////////////////////////////////////////////////////
 
     // Available sampling strategies
     enum whisper_sampling_strategy {
         WHISPER_SAMPLING_GREEDY,      // Always select the most probable token
-        WHISPER_SAMPLING_BEAM_SEARCH, // TODO: not implemented yet!
+        WHISPER_SAMPLING_BEAM_SEARCH, // Keep the beam_width most probable sequences, decoded together as one batch
     };
 
     // Text segment callback
     // Called on every newly generated text segment
-    // Use the whisper_full_...() functions to obtain the text segments
-    typedef void (*whisper_new_segment_callback)(struct whisper_context * ctx, int n_new, void * user_data);
+    // Use the whisper_full_..._from_state() functions with the given state to obtain the text segments
+    typedef void (*whisper_new_segment_callback)(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data);
 
     struct whisper_full_params {
         enum whisper_sampling_strategy strategy;
@@ -202,6 +264,10 @@ extern "C" {
         float thold_ptsum;      // timestamp token sum probability threshold (~0.01)
         int   max_len;          // max segment length in characters
 
+        // [EXPERIMENTAL] shortened audio context of the encoder
+        int  audio_ctx;    // number of audio positions (20 ms each) encoded per window, 0 for the full context of the model (30 s)
+        bool skip_padding; // do not encode the padding after the end of the audio in the last window
+
         const char * language;
 
         struct {
@@ -210,8 +276,8 @@ extern "C" {
 
         struct {
             int n_past;
-            int beam_width;
-            int n_best;
+            int beam_width; // number of sequences that are kept at each step
+            int n_best;     // number of finished sequences to collect before picking the most probable one
         } beam_search;
 
         whisper_new_segment_callback new_segment_callback;
@@ -228,7 +294,17 @@ extern "C" {
             const float * samples,
             int n_samples);
 
-    // Split the input audio in chunks and process each chunk separately using whisper_full()
+    // Same as whisper_full(), but the results are stored in the given state
+    // Several threads can transcribe at the same time with the same context, each one with its own state
+    WHISPER_API int whisper_full_with_state(
+            struct whisper_context * ctx,
+            struct whisper_state * state,
+            struct whisper_full_params params,
+            const float * samples,
+            int n_samples);
+
+    // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
+    // The chunks are processed with separate states that share the model, the results are stored in the default state
     // It seems this approach can offer some speedup in some cases.
     // However, the transcription accuracy can be worse at the beginning and end of each chunk.
     WHISPER_API int whisper_full_parallel(
@@ -238,30 +314,91 @@ extern "C" {
             int n_samples,
             const int n_processors);
 
+    // Same as whisper_full(), but the windows are encoded ahead of the decoder on n_threads_encode threads of their own:
+    // while window k is decoded on params.n_threads threads, window k + 1 is encoded from the last timestamp that the
+    // decoder has sampled so far, and encoded again if the decoder ends window k at a later timestamp. The windows
+    // start at the same timestamps as in whisper_full(), so the transcription is the same - the encoder only gets
+    // ahead when the last timestamp of a window is sampled before its last tokens, as with a segment cut by the end
+    // of the window. With n_threads_encode = 0, it is the same as whisper_full().
+    // The encoder and the decoder compute their graphs at the same time, so the context must not be profiled.
+    WHISPER_API int whisper_full_pipelined(
+            struct whisper_context * ctx,
+            struct whisper_full_params params,
+            const float * samples,
+            int n_samples,
+            const int n_threads_encode);
+
+    // Streaming transcription of audio that arrives in chunks, e.g. from a live source.
+    // The mel spectrogram is extended with the frames of the new samples only. Every step_ms of new audio, the window
+    // that starts after the last finished segment is encoded and decoded again, with the text so far as the prompt.
+    // A segment is finished once it ends at least 1 s before the end of the audio received so far, or when the
+    // window reaches length_ms of audio (0 or at most 30 s), which bounds the latency. The finished segments are stored
+    // in the state like the results of whisper_full() and are reported through params.new_segment_callback.
+    // Set params.skip_padding to encode only the received audio of each window.
+    // Token-level timestamps are not supported and params.offset_ms / params.duration_ms are ignored.
+    struct whisper_stream;
+
+    // Returns NULL on failure
+    WHISPER_API struct whisper_stream * whisper_stream_init(
+            struct whisper_context * ctx,
+            struct whisper_full_params params,
+            int step_ms,
+            int length_ms);
+
+    // The stream uses the given state instead of the default state of the context, which must outlive the stream
+    WHISPER_API struct whisper_stream * whisper_stream_init_with_state(
+            struct whisper_context * ctx,
+            struct whisper_state * state,
+            struct whisper_full_params params,
+            int step_ms,
+            int length_ms);
+
+    WHISPER_API void whisper_stream_free(struct whisper_stream * stream);
+
+    // Append n_samples of 16 kHz mono PCM to the stream and decode the pending audio every step_ms.
+    // Returns 0 on success
+    WHISPER_API int whisper_stream_push(struct whisper_stream * stream, const float * samples, int n_samples);
+
+    // Decode the rest of the audio received so far and finish all its segments, no more audio can be pushed after it.
+    // Returns 0 on success
+    WHISPER_API int whisper_stream_flush(struct whisper_stream * stream);
+
     // Number of generated text segments.
     // A segment can be a few words, a sentence, or even a paragraph.
+    // The ..._from_state() variants return the results of whisper_full_with_state() for the given state.
     WHISPER_API int whisper_full_n_segments(struct whisper_context * ctx);
+    WHISPER_API int whisper_full_n_segments_from_state(struct whisper_state * state);
 
     // Get the start and end time of the specified segment.
     WHISPER_API int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment);
     WHISPER_API int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment);
 
+    WHISPER_API int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment);
+    WHISPER_API int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment);
+
     // Get the text of the specified segment.
     WHISPER_API const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment);
+    WHISPER_API const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment);
 
     // Get number of tokens in the specified segment.
     WHISPER_API int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment);
 
     // Get the token text of the specified token in the specified segment.
     WHISPER_API const char * whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token);
     WHISPER_API whisper_token whisper_full_get_token_id (struct whisper_context * ctx, int i_segment, int i_token);
 
+    WHISPER_API const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token);
+    WHISPER_API whisper_token whisper_full_get_token_id_from_state (struct whisper_state * state, int i_segment, int i_token);
+
     // Get token data for the specified token in the specified segment.
     // This contains probabilities, timestamps, etc.
     WHISPER_API whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token);
 
     // Get the probability of the specified token in the specified segment.
     WHISPER_API float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token);
 
     // Print system information
     WHISPER_API const char * whisper_print_system_info();
@@ -58,7 +58,7 @@
 //   {
 //       ...
 //
-//       struct ggml_cgraph gf = ggml_build_forward(f);
+//       struct ggml_cgraph gf = ggml_build_forward(ctx, f);
 //
 //       // set the input variable and parameter values
 //       ggml_set_f32(x, 2.0f);
@@ -96,8 +96,7 @@
 // yet, but a few examples are demonstrated in the following operations:
 //
 //   - ggml_permute()
-//   - ggml_conv_1d_1s()
-//   - ggml_conv_1d_2s()
+//   - ggml_conv_1d()
 //
 // For each tensor operator, the library implements a forward and backward computation function. The forward function
 // computes the output tensor value given the input tensor values. The backward function computes the adjoint of the
@@ -178,11 +177,12 @@ extern "C" {
 #include <stdbool.h>
 
 #define GGML_MAX_DIMS     4
-#define GGML_MAX_NODES    4096
-#define GGML_MAX_PARAMS   16
-#define GGML_MAX_CONTEXTS 64
+#define GGML_DEFAULT_GRAPH_SIZE 4096
+#define GGML_MAX_CONTEXTS 64 // contexts with preallocated state, more are allocated on the heap
 #define GGML_MAX_OPT      4
 
+#define GGML_DEFAULT_N_SPIN 1024
+
 #ifdef __ARM_NEON
 // we use the built-in 16-bit float type
 typedef __fp16 ggml_fp16_t;
@@ -196,6 +196,7 @@ ggml_fp16_t ggml_fp32_to_fp16(float x);
 
 struct ggml_object;
 struct ggml_context;
+struct ggml_threadpool;
 
 enum ggml_type {
     GGML_TYPE_I8,
@@ -203,6 +204,8 @@ enum ggml_type {
     GGML_TYPE_I32,
     GGML_TYPE_F16,
     GGML_TYPE_F32,
+    GGML_TYPE_Q4_0, // 4-bit quantization, blocks of 32 elements with a per-block fp16 scale
+    GGML_TYPE_Q8_0, // 8-bit quantization, blocks of 32 elements with a per-block fp16 scale
     GGML_TYPE_COUNT,
 };
 
@@ -240,11 +243,18 @@ enum ggml_op {
     GGML_OP_DIAG_MASK_INF,
     GGML_OP_SOFT_MAX,
     GGML_OP_ROPE,
-    GGML_OP_CONV_1D_1S,
-    GGML_OP_CONV_1D_2S,
+    GGML_OP_CONV_1D,
 
     GGML_OP_FLASH_ATTN,
     GGML_OP_FLASH_FF,
+    GGML_OP_FLASH_ATTN_KV,
+
+    GGML_OP_OPT_ADAM,
+
+    // fused element-wise chains, created by ggml_graph_fuse()
+    GGML_OP_NORM_MUL_ADD,
+    GGML_OP_ADD_GELU,
+    GGML_OP_SCALE_MASK_SOFT_MAX,
 
     GGML_OP_COUNT,
 };
@@ -257,13 +267,14 @@ struct ggml_tensor {
     int    ne[GGML_MAX_DIMS]; // number of elements
     size_t nb[GGML_MAX_DIMS]; // stride in bytes:
                               // nb[0] = sizeof(type)
-                              // nb[1] = nb[0]   * ne[0] + padding
+                              // nb[1] = nb[0]   * (ne[0] / ggml_blck_size(type)) + padding
                               // nb[i] = nb[i-1] * ne[i-1]
 
     // compute data
     enum ggml_op op;
 
     bool is_param;
+    bool is_output; // see ggml_set_output()
 
     struct ggml_tensor * grad;
     struct ggml_tensor * src0;
@@ -279,6 +290,11 @@ struct ggml_tensor {
     int64_t perf_time_us;
 
     void * data;
+
+    // the tensor shares the memory of view_src, starting at view_offs bytes (e.g. reshape, permute, in-place ops)
+    struct ggml_tensor * view_src;
+    size_t               view_offs;
+
     char padding[8];
 };
 
@@ -291,9 +307,19 @@ struct ggml_cgraph {
     size_t work_size;
     struct ggml_tensor * work;
 
-    struct ggml_tensor * nodes[GGML_MAX_NODES];
-    struct ggml_tensor * grads[GGML_MAX_NODES];
-    struct ggml_tensor * leafs[GGML_MAX_NODES];
+    // the n_tasks of the nodes and the work buffer are planned for this number of threads (0 - not planned yet)
+    int n_threads_plan;
+
+    // the arrays are allocated in a context with room for size nodes and size leafs (see ggml_new_graph_custom)
+    int size;
+
+    struct ggml_tensor ** nodes;
+    struct ggml_tensor ** grads; // NULL if the graph does not keep the gradients of its nodes
+    struct ggml_tensor ** leafs;
+
+    // open addressing hash set of the nodes and leafs, so that ggml_build_forward_expand() visits each tensor once
+    int                   visited_size;
+    struct ggml_tensor ** visited;
 
     // performance
     int     perf_runs;
@@ -305,11 +331,13 @@ struct ggml_init_params {
     // memory pool
     size_t mem_size;   // bytes
     void * mem_buffer; // if NULL, memory will be allocated internally
+    bool   no_alloc;   // don't allocate memory for the tensor data (e.g. it points into a memory-mapped file)
 };
 
 void    ggml_time_init(void); // call this once at the beginning of the program
 int64_t ggml_time_ms(void);
 int64_t ggml_time_us(void);
+int64_t ggml_time_ns(void);
 int64_t ggml_cycles(void);
 int64_t ggml_cycles_per_ms(void);
 
@@ -319,14 +347,34 @@ void ggml_print_objects(const struct ggml_context * ctx);
 int    ggml_nelements(const struct ggml_tensor * tensor);
 size_t ggml_nbytes   (const struct ggml_tensor * tensor);
 
-size_t ggml_type_size   (enum ggml_type type);
+int    ggml_blck_size   (enum ggml_type type);
+size_t ggml_type_size   (enum ggml_type type); // size in bytes for all elements in a block
+float  ggml_type_sizef  (enum ggml_type type); // ggml_type_size()/ggml_blck_size() as float
 size_t ggml_element_size(const struct ggml_tensor * tensor);
 
+bool ggml_is_quantized(enum ggml_type type);
+
+// true if the memory spanned by the elements of the two tensors overlaps - a tensor without elements overlaps nothing
+// this is how the graph compute decides if two nodes can be computed concurrently
+bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b);
+
+// ggml_init() and ggml_free() can be called concurrently from any number of threads
 struct ggml_context * ggml_init(struct ggml_init_params params);
 void ggml_free(struct ggml_context * ctx);
 
+// drop all the objects of the context and keep its memory buffer, so a per-thread scratch context can be reused
+// for the next graph without ggml_free() + ggml_init() - the tensors and graphs of the context become invalid
+void ggml_reset(struct ggml_context * ctx);
+
 size_t ggml_used_mem(const struct ggml_context * ctx);
 
+// when set, new tensors are created with data == NULL and the caller has to point tensor->data to the memory
+// (or let ggml_graph_alloc() do it) - scalars from ggml_new_i32/f32() are still allocated in the context
+void ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc);
+
+// size of a tensor object in the context's memory pool, without its data
+size_t ggml_tensor_overhead(void);
+
 struct ggml_tensor * ggml_new_tensor(
         struct ggml_context * ctx,
         enum   ggml_type type,
@@ -363,7 +411,7 @@ struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
 struct ggml_tensor * ggml_dup_tensor (struct ggml_context * ctx, const struct ggml_tensor * src);
-struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, const struct ggml_tensor * src);
+struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, struct ggml_tensor * src);
 
 struct ggml_tensor * ggml_set_zero(struct ggml_tensor * tensor);
 struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value);
@@ -386,6 +434,8 @@ struct ggml_tensor * ggml_dup(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// b is broadcast to the shape of a when its dimensions divide the ones of a (e.g. a bias row added to all rows)
+// no ggml_repeat() is needed for that - the backward pass still needs the same shapes
 struct ggml_tensor * ggml_add(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -396,6 +446,7 @@ struct ggml_tensor * ggml_sub(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// b is broadcast to the shape of a, as in ggml_add()
 struct ggml_tensor * ggml_mul(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -482,6 +533,7 @@ struct ggml_tensor * ggml_scale(
         struct ggml_tensor  * b);
 
 // a -> b, return view(b)
+// b can also be a strided view (e.g. of a cache) or quantized, if it has the shape of a
 struct ggml_tensor * ggml_cpy(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -526,6 +578,16 @@ struct ggml_tensor * ggml_view_2d(
         size_t                nb1, // row stride in bytes
         size_t                offset);
 
+struct ggml_tensor * ggml_view_3d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        size_t                nb1, // row stride in bytes
+        size_t                nb2, // slice stride in bytes
+        size_t                offset);
+
 struct ggml_tensor * ggml_permute(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -567,10 +629,18 @@ struct ggml_tensor * ggml_rope(
         int                   n_dims,
         int                   mode);
 
-// padding = 1
-// TODO: we don't support extra parameters for now
-//       that's why we are hard-coding the stride, padding, and dilation
-//       not great ..
+// convolution of the rows of b [L, C_in] f32 with the kernels a [K, C_in, C_out] f16 or f32,
+// with stride s0 and p0 zeros of padding on both sides of the rows
+// the result is [(L + 2*p0 - K)/s0 + 1, C_out] f32
+// TODO: dilation
+struct ggml_tensor * ggml_conv_1d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   s0,
+        int                   p0);
+
+// ggml_conv_1d() with stride 1 and stride 2, padded to keep the kernel centered (p0 = K/2)
 struct ggml_tensor * ggml_conv_1d_1s(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -588,6 +658,26 @@ struct ggml_tensor * ggml_flash_attn(
         struct ggml_tensor  * v,
         bool                  masked);
 
+// causal attention of N new tokens to a key + value memory, computed in tiles of the memory with an online soft max,
+// so the [n_kv, N, n_head] attention weights are never stored
+//
+//   q:    [D, N, n_head] f32
+//   k:    [D, n_kv, n_head] f32, f16 or q8_0 - the keys of the memory
+//   v:    [n_kv, D, n_head] f32 or f16       - the values of the memory, transposed
+//   mask: [n_kv, N] f32 that is added to the scaled scores, or NULL
+//
+// without a mask, token i attends to the positions [0, n_past + i] of the memory. the n_past parameter is the scalar
+// tensor result->opt[1], so it can be changed before each computation of the graph, as for ggml_diag_mask_inf()
+// the rows of the result are softmax(k*q*scale + mask)*v: [D, N, n_head] f32
+struct ggml_tensor * ggml_flash_attn_kv(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        int                   n_past,
+        float                 scale);
+
 struct ggml_tensor * ggml_flash_ff(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -596,28 +686,177 @@ struct ggml_tensor * ggml_flash_ff(
         struct ggml_tensor  * c0,
         struct ggml_tensor  * c1);
 
+// one Adam step of the parameter a with its gradient a->grad, in-place, returns view(a)
+//
+//   m, v: the f32 first and second moments, with the shape of a
+//   w:    the f32 master copy of an f16 parameter, NULL for f32 - the step is applied to w and a is rounded from it
+//   hp:   f32 [alpha_t, beta1, beta2, eps, vh_scale], with the learning rate corrected for the bias of the moments
+//         alpha_t = alpha/(1 - beta1^t) and vh_scale = 1/(1 - beta2^t), set by the optimizer before each step
+struct ggml_tensor * ggml_opt_adam_step(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * m,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * hp);
+
 //
 // automatic differentiation
 //
 
+// the gradient of a parameter is always f32, so f16 parameters accumulate their gradients in full precision
 void ggml_set_param(
         struct ggml_context * ctx,
         struct ggml_tensor * tensor);
 
+// an empty graph with room for size nodes and size leafs, allocated in ctx (also in a no_alloc context)
+// with grads, the graph also keeps the gradient of each node, as needed by ggml_build_backward() and ggml_graph_reset()
+struct ggml_cgraph * ggml_new_graph_custom(struct ggml_context * ctx, int size, bool grads);
+struct ggml_cgraph * ggml_new_graph       (struct ggml_context * ctx); // GGML_DEFAULT_GRAPH_SIZE, no grads
+
+// the memory of ggml_new_graph_custom() in the context, to size the context
+size_t ggml_graph_overhead(int size, bool grads);
+
 void ggml_build_forward_expand(struct ggml_cgraph * cgraph, struct ggml_tensor * tensor);
 
-struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
+// the returned graph is a handle to arrays allocated in ctx - GGML_DEFAULT_GRAPH_SIZE, with grads
+// the backward graph has the size of gf and its own arrays
+struct ggml_cgraph ggml_build_forward (struct ggml_context * ctx, struct ggml_tensor * tensor);
 struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
 void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+// memory planner for the tensors of the graph that have no data (e.g. created in a no_alloc context)
+//
+// the tensors are placed in buf so that intermediate results whose lifetimes don't overlap share memory
+// views get the memory of the tensor they view, and the work buffer for cgraph->n_threads threads is placed in buf too
+// (computed with more threads, the graph may need a larger work buffer, which is then allocated in the context)
+// the leafs without data (the inputs) are placed before the first node is computed, so they can be set after planning
+//
+// returns the number of bytes of buf that are used - with buf == NULL nothing is assigned and only the size is returned
+// the result is only kept for the nodes that no other node uses and for the tensors marked with ggml_set_output()
+size_t ggml_graph_alloc(struct ggml_context * ctx, struct ggml_cgraph * cgraph, void * buf, size_t buf_size);
+
+// keep the result of an intermediate tensor of the graph for reading after the computation (see ggml_graph_alloc())
+void ggml_set_output(struct ggml_tensor * tensor);
+
+// a graph can be computed again with new data in its inputs - the planning of the tasks is not repeated as long as
+// the number of threads stays the same. to rebind a view in the graph (e.g. the slot of a cache that is written),
+// set its view_offs (or the data of the tensor it views) and call this to update the data of all views in the graph
+void ggml_graph_update_views(struct ggml_cgraph * cgraph);
+
+// merge the chains of element-wise nodes that only feed each other into single nodes: norm(x)*w + b, gelu(x + b) and
+// soft_max(diag_mask_inf(x*v)), with w and b broadcast as in ggml_add() / ggml_mul()
+// call it when the graph is complete and before ggml_graph_alloc() - the nodes with gradients and the ones marked
+// with ggml_set_output() are kept
+void ggml_graph_fuse(struct ggml_cgraph * cgraph);
+
+// persistent pool of worker threads that can be reused across ggml_graph_compute_with_pool() calls
+// the workers are parked between graphs, so creating the pool once avoids spawning threads for each graph
+// the number of threads of the pool overrides cgraph->n_threads
+struct ggml_threadpool * ggml_threadpool_new (int n_threads);
+void                     ggml_threadpool_free(struct ggml_threadpool * pool);
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
+
+// number of busy loop iterations a waiting thread spends before it goes to sleep
+// 0 - always sleep, < 0 - never sleep (default: GGML_DEFAULT_N_SPIN)
+// call it between graph computations - unless n_spin < 0, it returns once the idle workers went to sleep
+void ggml_threadpool_set_n_spin(struct ggml_threadpool * pool, int n_spin);
+
+// number of waits that were satisfied while spinning and number of waits that had to sleep
+// summed over all threads of the pool - call these only between graph computations
+// like ggml_threadpool_set_n_spin(), ggml_threadpool_reset_stats() waits for the idle workers to go to sleep
+struct ggml_threadpool_stats {
+    int64_t n_spin;
+    int64_t n_sleep;
+};
+
+struct ggml_threadpool_stats ggml_threadpool_get_stats  (const struct ggml_threadpool * pool);
+void                         ggml_threadpool_reset_stats(struct ggml_threadpool * pool);
+
+void ggml_graph_compute_with_pool(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool);
+
+//
+// NUMA
+//
+// on a system with several NUMA nodes, the threads of a pool can be pinned to the cpus of the nodes, and the pages of
+// the weights placed on the nodes of the threads that read them. the nodes are read from /sys/devices/system/node,
+// so this is only supported on Linux - elsewhere the functions do nothing and return false
+//
+
+// number of NUMA nodes with cpus (1 if the system has no NUMA information)
+int ggml_numa_n_nodes(void);
+
+// pin each thread of the pool to a cpu, with the nodes in blocks of consecutive threads: the threads
+// [i*n_threads/n_nodes, (i + 1)*n_threads/n_nodes) run on node i. the calling thread, which acts as thread 0 of the
+// pool, is pinned too
+bool ggml_threadpool_set_affinity(struct ggml_threadpool * pool);
+
+enum ggml_numa_placement {
+    GGML_NUMA_INTERLEAVE, // the pages round-robin over all the nodes
+    GGML_NUMA_ROWS,       // the rows that each thread of the pool computes in a ggml_mul_mat(), on the node of the thread
+};
+
+// move the pages of the data of a tensor to the nodes - GGML_NUMA_ROWS needs a pool pinned with
+// ggml_threadpool_set_affinity() and matches the split of the rows of src0 when the tensor is src0 of a ggml_mul_mat()
+// computed by all the threads of the pool, otherwise the pages are interleaved
+// only whole pages are placed. returns false if the pages could not be moved, which is checked on a sample of them
+// (e.g. the pages of a file mapping that other processes share stay where they are)
+bool ggml_numa_place(const struct ggml_threadpool * pool, struct ggml_tensor * tensor, enum ggml_numa_placement placement);
+
 // print info and performance information for the graph
 void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
 // dump the graph into a file using the dot format
 void ggml_graph_dump_dot(const struct ggml_cgraph * gb, const struct ggml_cgraph * gf, const char * filename);
 
+//
+// profiling
+//
+// while a profiler is active, every graph computation records the wall time of each node and the time each thread
+// spent computing it - no rebuild with GGML_PERF is needed and nothing is recorded while no profiler is active
+// the FLOPs and bytes of the nodes are estimates from their shapes (the bytes are the sizes of the node and its srcs)
+//
+
+struct ggml_profiler;
+
+struct ggml_profiler * ggml_profiler_new (void);
+void                   ggml_profiler_free(struct ggml_profiler * prof);
+
+// record the following graph computations into prof - NULL stops the recording
+// set it only while no graph is being computed
+void ggml_profiler_set_active(struct ggml_profiler * prof);
+
+// drop the recorded events
+void ggml_profiler_reset(struct ggml_profiler * prof);
+
+// totals over all the recorded nodes of an op
+//   time_ns - wall time of the nodes
+//   max_ns  - busy time of the slowest thread of each node, max_ns/mean_ns is the imbalance between the threads
+//   mean_ns - average busy time of the threads of each node, time_ns - max_ns is spent in the barriers
+struct ggml_profiler_op_stats {
+    int     n_nodes;
+    int64_t time_ns;
+    int64_t max_ns;
+    int64_t mean_ns;
+    int64_t flops;
+    int64_t bytes;
+};
+
+struct ggml_profiler_op_stats ggml_profiler_get_op_stats(const struct ggml_profiler * prof, enum ggml_op op);
+
+// print the per-op time, GFLOP/s, GB/s, thread imbalance and sync time and the busy time of each thread
+void ggml_profiler_print(const struct ggml_profiler * prof);
+
+// write the events in the Chrome trace format (chrome://tracing, Perfetto) - the nodes are in process 0 and the
+// per-thread compute spans in process 1, with one track per thread
+bool ggml_profiler_write_trace(const struct ggml_profiler * prof, const char * fname);
+
+// write the per-op and per-thread totals as JSON
+bool ggml_profiler_write_summary(const struct ggml_profiler * prof, const char * fname);
+
 //
 // optimization
 //
@@ -714,15 +953,29 @@ struct ggml_opt_params {
 struct ggml_opt_params ggml_opt_default_params(enum ggml_opt_type type);
 
 // optimize the function defined by the tensor f
+// the parameters are all the tensors of the graph of f marked with ggml_set_param(), f32 or f16
+// Adam updates them in place with a graph of ggml_opt_adam_step() nodes, computed with params.n_threads threads
 enum ggml_opt_result ggml_opt(
         struct ggml_context * ctx,
         struct ggml_opt_params params,
         struct ggml_tensor * f);
 
+//
+// quantization
+//
+
+// quantize n floats from src into dst, n must be a multiple of ggml_blck_size(type)
+// returns the number of bytes written to dst
+size_t ggml_quantize(enum ggml_type type, const float * src, void * dst, int n);
+
+// dequantize n elements from src into dst
+void ggml_dequantize(enum ggml_type type, const void * src, float * dst, int n);
+
 //
 // system info
 //
 
+// avx2 and avx512 are detected at runtime (once, on the first call or in the first ggml_init), the others are compile-time
 int ggml_cpu_has_avx2(void);
 int ggml_cpu_has_avx512(void);
 int ggml_cpu_has_neon(void);
@@ -730,6 +983,10 @@ int ggml_cpu_has_fp16_va(void);
 int ggml_cpu_has_wasm_simd(void);
 int ggml_cpu_has_blas(void);
 
+// name of the SIMD kernels used for the host CPU (e.g. "avx2", "generic")
+// set GGML_CPU_ISA in the environment to force a lower instruction set
+const char * ggml_cpu_isa(void);
+
 #ifdef  __cplusplus
 }
 #endif
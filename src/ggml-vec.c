@@ -0,0 +1,1355 @@
+// SIMD kernels of ggml, see ggml-vec.h
+//
+// GGML_VEC_NAME is the name of the instruction set that this build of the file targets
+
+#include "ggml-vec.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#ifndef GGML_VEC_NAME
+#define GGML_VEC_NAME generic
+#endif
+
+#define GGML_VEC_STR_(x) #x
+#define GGML_VEC_STR(x)  GGML_VEC_STR_(x)
+
+#define GGML_VEC_FNS_(name) ggml_vec_fns_ ## name
+#define GGML_VEC_FNS(name)  GGML_VEC_FNS_(name)
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#if defined(__AVX512F__)
+// load 16 fp16 values as fp32
+#define GGML_F16x16_LOAD(x) _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(x)))
+#endif
+
+#define GGML_ASSERT(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "GGML_ASSERT: %s:%d: %s\n", __FILE__, __LINE__, #x); \
+            abort(); \
+        } \
+    } while (0)
+
+static void ggml_vec_dot_f32(const int n, float * restrict s, const float * restrict x, const float * restrict y) {
+    ggml_float sumf = 0.0;
+#ifdef __ARM_NEON
+    // NEON 128-bit
+    const int n16 = (n & ~15);
+
+    float32x4_t sum0 = vdupq_n_f32(0);
+    float32x4_t sum1 = vdupq_n_f32(0);
+    float32x4_t sum2 = vdupq_n_f32(0);
+    float32x4_t sum3 = vdupq_n_f32(0);
+
+    float32x4_t x0, x1, x2, x3;
+    float32x4_t y0, y1, y2, y3;
+
+    for (int i = 0; i < n16; i += 16) {
+        x0 = vld1q_f32(x + i + 0);
+        x1 = vld1q_f32(x + i + 4);
+        x2 = vld1q_f32(x + i + 8);
+        x3 = vld1q_f32(x + i + 12);
+
+        y0 = vld1q_f32(y + i + 0);
+        y1 = vld1q_f32(y + i + 4);
+        y2 = vld1q_f32(y + i + 8);
+        y3 = vld1q_f32(y + i + 12);
+
+        sum0 = vfmaq_f32(sum0, x0, y0);
+        sum1 = vfmaq_f32(sum1, x1, y1);
+        sum2 = vfmaq_f32(sum2, x2, y2);
+        sum3 = vfmaq_f32(sum3, x3, y3);
+    }
+
+    // reduce sum0..sum3 to sum0
+    sum0 = vaddq_f32(sum0, sum1);
+    sum2 = vaddq_f32(sum2, sum3);
+    sum0 = vaddq_f32(sum0, sum2);
+
+    float32x2_t sumf32 = vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0));
+    sumf = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
+
+    // leftovers
+    for (int i = n16; i < n; ++i) {
+        sumf += x[i]*y[i];
+    }
+#elif defined(__AVX512F__)
+    // AVX-512 512-bit
+    const int n64 = (n & ~63);
+
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    __m512 sum2 = _mm512_setzero_ps();
+    __m512 sum3 = _mm512_setzero_ps();
+
+    int i = 0;
+
+    for (; i < n64; i += 64) {
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 0 ), _mm512_loadu_ps(y + i + 0 ), sum0);
+        sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), sum1);
+        sum2 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 32), _mm512_loadu_ps(y + i + 32), sum2);
+        sum3 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 48), _mm512_loadu_ps(y + i + 48), sum3);
+    }
+
+    // short rows (e.g. attention heads) must not end up in the scalar leftovers
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), sum0);
+    }
+
+    sum0 = _mm512_add_ps(sum0, sum1);
+    sum2 = _mm512_add_ps(sum2, sum3);
+    sum0 = _mm512_add_ps(sum0, sum2);
+
+    sumf = _mm512_reduce_add_ps(sum0);
+
+    // leftovers
+    for (; i < n; ++i) {
+        sumf += x[i]*y[i];
+    }
+#elif defined(__AVX2__)
+    // AVX 256-bit
+    const int n32 = (n & ~31);
+
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    __m256 sum2 = _mm256_setzero_ps();
+    __m256 sum3 = _mm256_setzero_ps();
+
+    __m256 x0, x1, x2, x3;
+    __m256 y0, y1, y2, y3;
+
+    for (int i = 0; i < n32; i += 32) {
+        x0 = _mm256_loadu_ps(x + i + 0);
+        x1 = _mm256_loadu_ps(x + i + 8);
+        x2 = _mm256_loadu_ps(x + i + 16);
+        x3 = _mm256_loadu_ps(x + i + 24);
+
+        y0 = _mm256_loadu_ps(y + i + 0);
+        y1 = _mm256_loadu_ps(y + i + 8);
+        y2 = _mm256_loadu_ps(y + i + 16);
+        y3 = _mm256_loadu_ps(y + i + 24);
+
+        sum0 = _mm256_fmadd_ps(x0, y0, sum0);
+        sum1 = _mm256_fmadd_ps(x1, y1, sum1);
+        sum2 = _mm256_fmadd_ps(x2, y2, sum2);
+        sum3 = _mm256_fmadd_ps(x3, y3, sum3);
+    }
+
+    sum0 = _mm256_add_ps(sum0, sum1);
+    sum2 = _mm256_add_ps(sum2, sum3);
+    sum0 = _mm256_add_ps(sum0, sum2);
+
+    const __m128 r4 = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+    const __m128 r2 = _mm_add_ps(r4, _mm_movehl_ps(r4, r4));
+    const __m128 r1 = _mm_add_ss(r2, _mm_movehdup_ps(r2));
+
+    sumf = _mm_cvtss_f32(r1);
+
+    // leftovers
+    for (int i = n32; i < n; ++i) {
+        sumf += x[i]*y[i];
+    }
+#elif defined(__wasm_simd128__)
+    // WASM 128-bit
+    const int n16 = (n & ~15);
+
+    v128_t sum0 = wasm_f32x4_splat(0);
+    v128_t sum1 = wasm_f32x4_splat(0);
+    v128_t sum2 = wasm_f32x4_splat(0);
+    v128_t sum3 = wasm_f32x4_splat(0);
+
+    v128_t x0, x1, x2, x3;
+    v128_t y0, y1, y2, y3;
+
+    for (int i = 0; i < n16; i += 16) {
+        x0 = wasm_v128_load(x + i + 0);
+        x1 = wasm_v128_load(x + i + 4);
+        x2 = wasm_v128_load(x + i + 8);
+        x3 = wasm_v128_load(x + i + 12);
+
+        y0 = wasm_v128_load(y + i + 0);
+        y1 = wasm_v128_load(y + i + 4);
+        y2 = wasm_v128_load(y + i + 8);
+        y3 = wasm_v128_load(y + i + 12);
+
+        sum0 = wasm_f32x4_add(sum0, wasm_f32x4_mul(x0, y0));
+        sum1 = wasm_f32x4_add(sum1, wasm_f32x4_mul(x1, y1));
+        sum2 = wasm_f32x4_add(sum2, wasm_f32x4_mul(x2, y2));
+        sum3 = wasm_f32x4_add(sum3, wasm_f32x4_mul(x3, y3));
+    }
+
+    sum0 = wasm_f32x4_add(sum0, sum1);
+    sum2 = wasm_f32x4_add(sum2, sum3);
+    sum0 = wasm_f32x4_add(sum0, sum2);
+
+    sumf = wasm_f32x4_extract_lane(sum0, 0) + wasm_f32x4_extract_lane(sum0, 1) + wasm_f32x4_extract_lane(sum0, 2) + wasm_f32x4_extract_lane(sum0, 3);
+
+    // leftovers
+    for (int i = n16; i < n; ++i) {
+        sumf += x[i]*y[i];
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        sumf += x[i]*y[i];
+    }
+#endif
+
+    *s = sumf;
+}
+
+static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y) {
+    ggml_float sumf = 0.0;
+#ifdef __ARM_NEON
+    const int n32 = (n & ~31);
+
+#if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+    float16x8_t sum0 = vdupq_n_f16(0);
+    float16x8_t sum1 = vdupq_n_f16(0);
+    float16x8_t sum2 = vdupq_n_f16(0);
+    float16x8_t sum3 = vdupq_n_f16(0);
+
+    float16x8_t x0, x1, x2, x3;
+    float16x8_t y0, y1, y2, y3;
+
+    for (int i = 0; i < n32; i += 32) {
+        x0 = vld1q_f16(x + i + 0 );
+        x1 = vld1q_f16(x + i + 8 );
+        x2 = vld1q_f16(x + i + 16);
+        x3 = vld1q_f16(x + i + 24);
+
+        y0 = vld1q_f16(y + i + 0 );
+        y1 = vld1q_f16(y + i + 8 );
+        y2 = vld1q_f16(y + i + 16);
+        y3 = vld1q_f16(y + i + 24);
+
+        sum0 = vfmaq_f16(sum0, x0, y0);
+        sum1 = vfmaq_f16(sum1, x1, y1);
+        sum2 = vfmaq_f16(sum2, x2, y2);
+        sum3 = vfmaq_f16(sum3, x3, y3);
+    }
+
+    // reduce sum0..sum3 to sum0
+    sum0 = vaddq_f16(sum0, sum1);
+    sum2 = vaddq_f16(sum2, sum3);
+    sum0 = vaddq_f16(sum0, sum2);
+
+    // load sum0 into 2 float32x4_t
+    float32x4_t sum0f32 = vcvt_f32_f16(vget_low_f16(sum0));
+    float32x4_t sum1f32 = vcvt_f32_f16(vget_high_f16(sum0));
+
+    // reduce sum0f32 and sum1f32 to sumf
+    sum0f32 = vaddq_f32(sum0f32, sum1f32);
+
+    float32x2_t sumf32 = vadd_f32(vget_low_f32(sum0f32), vget_high_f32(sum0f32));
+    sumf = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
+#else
+    float32x4_t sum0 = vdupq_n_f32(0);
+    float32x4_t sum1 = vdupq_n_f32(0);
+    float32x4_t sum2 = vdupq_n_f32(0);
+    float32x4_t sum3 = vdupq_n_f32(0);
+    float32x4_t sum4 = vdupq_n_f32(0);
+    float32x4_t sum5 = vdupq_n_f32(0);
+    float32x4_t sum6 = vdupq_n_f32(0);
+    float32x4_t sum7 = vdupq_n_f32(0);
+
+    float32x4_t x0, x1, x2, x3, x4, x5, x6, x7;
+    float32x4_t y0, y1, y2, y3, y4, y5, y6, y7;
+
+    for (int i = 0; i < n32; i += 32) {
+        x0 = vcvt_f32_f16(vld1_f16(x + i + 0 ));
+        x1 = vcvt_f32_f16(vld1_f16(x + i + 4 ));
+        x2 = vcvt_f32_f16(vld1_f16(x + i + 8 ));
+        x3 = vcvt_f32_f16(vld1_f16(x + i + 12));
+        x4 = vcvt_f32_f16(vld1_f16(x + i + 16));
+        x5 = vcvt_f32_f16(vld1_f16(x + i + 20));
+        x6 = vcvt_f32_f16(vld1_f16(x + i + 24));
+        x7 = vcvt_f32_f16(vld1_f16(x + i + 28));
+
+        y0 = vcvt_f32_f16(vld1_f16(y + i + 0 ));
+        y1 = vcvt_f32_f16(vld1_f16(y + i + 4 ));
+        y2 = vcvt_f32_f16(vld1_f16(y + i + 8 ));
+        y3 = vcvt_f32_f16(vld1_f16(y + i + 12));
+        y4 = vcvt_f32_f16(vld1_f16(y + i + 16));
+        y5 = vcvt_f32_f16(vld1_f16(y + i + 20));
+        y6 = vcvt_f32_f16(vld1_f16(y + i + 24));
+        y7 = vcvt_f32_f16(vld1_f16(y + i + 28));
+
+        sum0 = vfmaq_f32(sum0, x0, y0);
+        sum1 = vfmaq_f32(sum1, x1, y1);
+        sum2 = vfmaq_f32(sum2, x2, y2);
+        sum3 = vfmaq_f32(sum3, x3, y3);
+        sum4 = vfmaq_f32(sum4, x4, y4);
+        sum5 = vfmaq_f32(sum5, x5, y5);
+        sum6 = vfmaq_f32(sum6, x6, y6);
+        sum7 = vfmaq_f32(sum7, x7, y7);
+    }
+
+    // reduce sum0..sum7 to sum0
+    sum0 = vaddq_f32(sum0, sum1);
+    sum2 = vaddq_f32(sum2, sum3);
+    sum4 = vaddq_f32(sum4, sum5);
+    sum6 = vaddq_f32(sum6, sum7);
+    sum0 = vaddq_f32(sum0, sum2);
+    sum4 = vaddq_f32(sum4, sum6);
+    sum0 = vaddq_f32(sum0, sum4);
+
+    // reduce sum0 to sumf
+    float32x2_t sumf32 = vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0));
+    sumf = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
+#endif
+
+    // leftovers
+    for (int i = n32; i < n; ++i) {
+        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
+    }
+#elif defined(__AVX512F__)
+    // AVX-512 512-bit
+    const int n64 = (n & ~63);
+
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    __m512 sum2 = _mm512_setzero_ps();
+    __m512 sum3 = _mm512_setzero_ps();
+
+    int i = 0;
+
+    for (; i < n64; i += 64) {
+        sum0 = _mm512_fmadd_ps(GGML_F16x16_LOAD(x + i + 0 ), GGML_F16x16_LOAD(y + i + 0 ), sum0);
+        sum1 = _mm512_fmadd_ps(GGML_F16x16_LOAD(x + i + 16), GGML_F16x16_LOAD(y + i + 16), sum1);
+        sum2 = _mm512_fmadd_ps(GGML_F16x16_LOAD(x + i + 32), GGML_F16x16_LOAD(y + i + 32), sum2);
+        sum3 = _mm512_fmadd_ps(GGML_F16x16_LOAD(x + i + 48), GGML_F16x16_LOAD(y + i + 48), sum3);
+    }
+
+    // short rows (e.g. attention heads) must not end up in the scalar leftovers
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm512_fmadd_ps(GGML_F16x16_LOAD(x + i), GGML_F16x16_LOAD(y + i), sum0);
+    }
+
+    sum0 = _mm512_add_ps(sum0, sum1);
+    sum2 = _mm512_add_ps(sum2, sum3);
+    sum0 = _mm512_add_ps(sum0, sum2);
+
+    sumf = _mm512_reduce_add_ps(sum0);
+
+    // leftovers
+    for (; i < n; ++i) {
+        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
+    }
+#elif defined(__AVX2__)
+    // AVX 256-bit
+    const int n32 = (n & ~31);
+
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    __m256 sum2 = _mm256_setzero_ps();
+    __m256 sum3 = _mm256_setzero_ps();
+
+    __m256 x0, x1, x2, x3;
+    __m256 y0, y1, y2, y3;
+
+    for (int i = 0; i < n32; i += 32) {
+        x0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 0 )));
+        x1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 8 )));
+        x2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 16)));
+        x3 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 24)));
+
+        y0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 0 )));
+        y1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 8 )));
+        y2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 16)));
+        y3 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 24)));
+
+        sum0 = _mm256_fmadd_ps(x0, y0, sum0);
+        sum1 = _mm256_fmadd_ps(x1, y1, sum1);
+        sum2 = _mm256_fmadd_ps(x2, y2, sum2);
+        sum3 = _mm256_fmadd_ps(x3, y3, sum3);
+    }
+
+    const __m256 sum01 = _mm256_add_ps(sum0, sum1);
+    const __m256 sum23 = _mm256_add_ps(sum2, sum3);
+    const __m256 sum0123 = _mm256_add_ps(sum01, sum23);
+
+    const __m128 r4 = _mm_add_ps(_mm256_castps256_ps128(sum0123), _mm256_extractf128_ps(sum0123, 1));
+    const __m128 r2 = _mm_add_ps(r4, _mm_movehl_ps(r4, r4));
+    const __m128 r1 = _mm_add_ss(r2, _mm_movehdup_ps(r2));
+
+    sumf = _mm_cvtss_f32(r1);
+
+    // leftovers
+    for (int i = n32; i < n; ++i) {
+        //GGML_ASSERT(false);
+        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
+    }
+#elif defined(__wasm_simd128__)
+    // WASM 128-bit
+    const int n16 = (n & ~15);
+
+    v128_t sum0 = wasm_f32x4_splat(0.0f);
+    v128_t sum1 = wasm_f32x4_splat(0.0f);
+    v128_t sum2 = wasm_f32x4_splat(0.0f);
+    v128_t sum3 = wasm_f32x4_splat(0.0f);
+
+    v128_t x0, x1, x2, x3;
+    v128_t y0, y1, y2, y3;
+
+    float tx[16];
+    float ty[16];
+
+    for (int i = 0; i < n16; i += 16) {
+        for (int k = 0; k < 16; ++k) {
+            tx[k] = ggml_fp16_to_fp32(x[i + k]);
+            ty[k] = ggml_fp16_to_fp32(y[i + k]);
+        }
+
+        x0 = wasm_v128_load(tx + 0);
+        x1 = wasm_v128_load(tx + 4);
+        x2 = wasm_v128_load(tx + 8);
+        x3 = wasm_v128_load(tx + 12);
+
+        y0 = wasm_v128_load(ty + 0);
+        y1 = wasm_v128_load(ty + 4);
+        y2 = wasm_v128_load(ty + 8);
+        y3 = wasm_v128_load(ty + 12);
+
+        sum0 = wasm_f32x4_add(sum0, wasm_f32x4_mul(x0, y0));
+        sum1 = wasm_f32x4_add(sum1, wasm_f32x4_mul(x1, y1));
+        sum2 = wasm_f32x4_add(sum2, wasm_f32x4_mul(x2, y2));
+        sum3 = wasm_f32x4_add(sum3, wasm_f32x4_mul(x3, y3));
+    }
+
+    sum0 = wasm_f32x4_add(sum0, sum1);
+    sum2 = wasm_f32x4_add(sum2, sum3);
+    sum0 = wasm_f32x4_add(sum0, sum2);
+
+    sumf = wasm_f32x4_extract_lane(sum0, 0) + wasm_f32x4_extract_lane(sum0, 1) + wasm_f32x4_extract_lane(sum0, 2) + wasm_f32x4_extract_lane(sum0, 3);
+
+    // leftovers
+    for (int i = n16; i < n; ++i) {
+        //GGML_ASSERT(false);
+        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
+    }
+#else
+    for (int i = 0; i < n; ++i) {
+        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
+    }
+#endif
+
+    *s = sumf;
+}
+
+//
+// quantization
+//
+
+static void quantize_row_q4_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    block_q4_0 * restrict y = vy;
+
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+        float max  = 0.0f;
+
+        for (int j = 0; j < QK; j++) {
+            const float v = x[i*QK + j];
+            if (amax < fabsf(v)) {
+                amax = fabsf(v);
+                max  = v;
+            }
+        }
+
+        // map the value with the largest magnitude to -8 to use the full range of the 4 bits
+        const float d  = max / -8;
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = ggml_fp32_to_fp16(d);
+
+        for (int j = 0; j < QK/2; ++j) {
+            const float x0 = x[i*QK + j]*id;
+            const float x1 = x[i*QK + QK/2 + j]*id;
+
+            const uint8_t xi0 = MIN(15, (int8_t)(x0 + 8.5f));
+            const uint8_t xi1 = MIN(15, (int8_t)(x1 + 8.5f));
+
+            y[i].qs[j] = xi0 | (xi1 << 4);
+        }
+    }
+}
+
+static void quantize_row_q8_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    block_q8_0 * restrict y = vy;
+
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+
+        for (int j = 0; j < QK; j++) {
+            amax = MAX(amax, fabsf(x[i*QK + j]));
+        }
+
+        const float d  = amax / 127;
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = ggml_fp32_to_fp16(d);
+
+        for (int j = 0; j < QK; ++j) {
+            y[i].qs[j] = roundf(x[i*QK + j]*id);
+        }
+    }
+}
+
+static void dequantize_row_q4_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    const block_q4_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = ggml_fp16_to_fp32(x[i].d);
+
+        for (int j = 0; j < QK/2; ++j) {
+            y[i*QK + j]        = ((x[i].qs[j] & 0x0F) - 8)*d;
+            y[i*QK + QK/2 + j] = ((x[i].qs[j] >>   4) - 8)*d;
+        }
+    }
+}
+
+static void dequantize_row_q8_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    const block_q8_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = ggml_fp16_to_fp32(x[i].d);
+
+        for (int j = 0; j < QK; ++j) {
+            y[i*QK + j] = x[i].qs[j]*d;
+        }
+    }
+}
+
+#if defined(__AVX2__)
+// horizontally add 8 floats
+static inline float hsum_float_8(const __m256 x) {
+    __m128 res = _mm256_extractf128_ps(x, 1);
+    res = _mm_add_ps(res, _mm256_castps256_ps128(x));
+    res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+    res = _mm_add_ss(res, _mm_movehdup_ps(res));
+    return _mm_cvtss_f32(res);
+}
+
+// multiply the signed int8 values in x and y and add the products pairwise into 8 floats
+static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
+    // there is no signed*signed maddubs - move the sign of x to y
+    const __m256i ax = _mm256_sign_epi8(x, x);
+    const __m256i sy = _mm256_sign_epi8(y, x);
+
+    const __m256i dot = _mm256_madd_epi16(_mm256_maddubs_epi16(ax, sy), _mm256_set1_epi16(1));
+
+    return _mm256_cvtepi32_ps(dot);
+}
+#endif
+
+// y is quantized with quantize_row_q8_0
+static void ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    float sumf = 0.0f;
+
+#if defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(8);
+
+    for (int i = 0; i < nb; i++) {
+        const uint8x16_t v0 = vld1q_u8(x[i].qs);
+
+        // 4-bit -> 8-bit and subtract the offset
+        const int8x16_t x0l = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(v0, m4b)), s8b);
+        const int8x16_t x0h = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0, 4)), s8b);
+
+        const int8x16_t y0l = vld1q_s8(y[i].qs);
+        const int8x16_t y0h = vld1q_s8(y[i].qs + QK/2);
+
+        const int16x8_t pl0 = vmull_s8(vget_low_s8 (x0l), vget_low_s8 (y0l));
+        const int16x8_t pl1 = vmull_s8(vget_high_s8(x0l), vget_high_s8(y0l));
+        const int16x8_t ph0 = vmull_s8(vget_low_s8 (x0h), vget_low_s8 (y0h));
+        const int16x8_t ph1 = vmull_s8(vget_high_s8(x0h), vget_high_s8(y0h));
+
+        const int32x4_t p = vaddq_s32(
+                vaddq_s32(vpaddlq_s16(pl0), vpaddlq_s16(pl1)),
+                vaddq_s32(vpaddlq_s16(ph0), vpaddlq_s16(ph1)));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), ggml_fp16_to_fp32(x[i].d)*ggml_fp16_to_fp32(y[i].d));
+    }
+
+    const float32x2_t sumf32 = vadd_f32(vget_low_f32(sumv), vget_high_f32(sumv));
+    sumf = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+
+    const __m256i m4b = _mm256_set1_epi8(0x0F);
+    const __m256i s8b = _mm256_set1_epi8(8);
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(ggml_fp16_to_fp32(x[i].d)*ggml_fp16_to_fp32(y[i].d));
+
+        // low nibbles in the lower 128 bits, high nibbles in the upper 128 bits
+        const __m128i tmp = _mm_loadu_si128((const __m128i *) x[i].qs);
+        __m256i bx = _mm256_insertf128_si256(_mm256_castsi128_si256(tmp), _mm_srli_epi16(tmp, 4), 1);
+        bx = _mm256_sub_epi8(_mm256_and_si256(bx, m4b), s8b);
+
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = _mm256_fmadd_ps(d, mul_sum_i8_pairs_float(bx, by), acc);
+    }
+
+    sumf = hsum_float_8(acc);
+#elif defined(__wasm_simd128__)
+    v128_t sumv = wasm_f32x4_splat(0.0f);
+
+    const v128_t m4b = wasm_i8x16_splat(0x0F);
+    const v128_t s8b = wasm_i8x16_splat(8);
+
+    for (int i = 0; i < nb; i++) {
+        const v128_t v0 = wasm_v128_load(x[i].qs);
+
+        // 4-bit -> 8-bit and subtract the offset
+        const v128_t x0l = wasm_i8x16_sub(wasm_v128_and(v0, m4b), s8b);
+        const v128_t x0h = wasm_i8x16_sub(wasm_u8x16_shr(v0, 4), s8b);
+
+        const v128_t y0l = wasm_v128_load(y[i].qs);
+        const v128_t y0h = wasm_v128_load(y[i].qs + QK/2);
+
+        // 8-bit -> 16-bit and dot product
+        const v128_t pl = wasm_i32x4_add(
+                wasm_i32x4_dot_i16x8(wasm_i16x8_extend_low_i8x16 (x0l), wasm_i16x8_extend_low_i8x16 (y0l)),
+                wasm_i32x4_dot_i16x8(wasm_i16x8_extend_high_i8x16(x0l), wasm_i16x8_extend_high_i8x16(y0l)));
+        const v128_t ph = wasm_i32x4_add(
+                wasm_i32x4_dot_i16x8(wasm_i16x8_extend_low_i8x16 (x0h), wasm_i16x8_extend_low_i8x16 (y0h)),
+                wasm_i32x4_dot_i16x8(wasm_i16x8_extend_high_i8x16(x0h), wasm_i16x8_extend_high_i8x16(y0h)));
+
+        sumv = wasm_f32x4_add(sumv, wasm_f32x4_mul(
+                    wasm_f32x4_convert_i32x4(wasm_i32x4_add(pl, ph)),
+                    wasm_f32x4_splat(ggml_fp16_to_fp32(x[i].d)*ggml_fp16_to_fp32(y[i].d))));
+    }
+
+    sumf = wasm_f32x4_extract_lane(sumv, 0) + wasm_f32x4_extract_lane(sumv, 1) +
+           wasm_f32x4_extract_lane(sumv, 2) + wasm_f32x4_extract_lane(sumv, 3);
+#else
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK/2; j++) {
+            const int v0 = (x[i].qs[j] & 0x0F) - 8;
+            const int v1 = (x[i].qs[j] >>   4) - 8;
+
+            sumi += v0*y[i].qs[j] + v1*y[i].qs[j + QK/2];
+        }
+
+        sumf += sumi*ggml_fp16_to_fp32(x[i].d)*ggml_fp16_to_fp32(y[i].d);
+    }
+#endif
+
+    *s = sumf;
+}
+
+static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    float sumf = 0.0f;
+
+#if defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; i++) {
+        const int8x16_t x0l = vld1q_s8(x[i].qs);
+        const int8x16_t x0h = vld1q_s8(x[i].qs + QK/2);
+
+        const int8x16_t y0l = vld1q_s8(y[i].qs);
+        const int8x16_t y0h = vld1q_s8(y[i].qs + QK/2);
+
+        const int16x8_t pl0 = vmull_s8(vget_low_s8 (x0l), vget_low_s8 (y0l));
+        const int16x8_t pl1 = vmull_s8(vget_high_s8(x0l), vget_high_s8(y0l));
+        const int16x8_t ph0 = vmull_s8(vget_low_s8 (x0h), vget_low_s8 (y0h));
+        const int16x8_t ph1 = vmull_s8(vget_high_s8(x0h), vget_high_s8(y0h));
+
+        const int32x4_t p = vaddq_s32(
+                vaddq_s32(vpaddlq_s16(pl0), vpaddlq_s16(pl1)),
+                vaddq_s32(vpaddlq_s16(ph0), vpaddlq_s16(ph1)));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), ggml_fp16_to_fp32(x[i].d)*ggml_fp16_to_fp32(y[i].d));
+    }
+
+    const float32x2_t sumf32 = vadd_f32(vget_low_f32(sumv), vget_high_f32(sumv));
+    sumf = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(ggml_fp16_to_fp32(x[i].d)*ggml_fp16_to_fp32(y[i].d));
+
+        const __m256i bx = _mm256_loadu_si256((const __m256i *) x[i].qs);
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = _mm256_fmadd_ps(d, mul_sum_i8_pairs_float(bx, by), acc);
+    }
+
+    sumf = hsum_float_8(acc);
+#elif defined(__wasm_simd128__)
+    v128_t sumv = wasm_f32x4_splat(0.0f);
+
+    for (int i = 0; i < nb; i++) {
+        const v128_t x0l = wasm_v128_load(x[i].qs);
+        const v128_t x0h = wasm_v128_load(x[i].qs + QK/2);
+
+        const v128_t y0l = wasm_v128_load(y[i].qs);
+        const v128_t y0h = wasm_v128_load(y[i].qs + QK/2);
+
+        // 8-bit -> 16-bit and dot product
+        const v128_t pl = wasm_i32x4_add(
+                wasm_i32x4_dot_i16x8(wasm_i16x8_extend_low_i8x16 (x0l), wasm_i16x8_extend_low_i8x16 (y0l)),
+                wasm_i32x4_dot_i16x8(wasm_i16x8_extend_high_i8x16(x0l), wasm_i16x8_extend_high_i8x16(y0l)));
+        const v128_t ph = wasm_i32x4_add(
+                wasm_i32x4_dot_i16x8(wasm_i16x8_extend_low_i8x16 (x0h), wasm_i16x8_extend_low_i8x16 (y0h)),
+                wasm_i32x4_dot_i16x8(wasm_i16x8_extend_high_i8x16(x0h), wasm_i16x8_extend_high_i8x16(y0h)));
+
+        sumv = wasm_f32x4_add(sumv, wasm_f32x4_mul(
+                    wasm_f32x4_convert_i32x4(wasm_i32x4_add(pl, ph)),
+                    wasm_f32x4_splat(ggml_fp16_to_fp32(x[i].d)*ggml_fp16_to_fp32(y[i].d))));
+    }
+
+    sumf = wasm_f32x4_extract_lane(sumv, 0) + wasm_f32x4_extract_lane(sumv, 1) +
+           wasm_f32x4_extract_lane(sumv, 2) + wasm_f32x4_extract_lane(sumv, 3);
+#else
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK; j++) {
+            sumi += x[i].qs[j]*y[i].qs[j];
+        }
+
+        sumf += sumi*ggml_fp16_to_fp32(x[i].d)*ggml_fp16_to_fp32(y[i].d);
+    }
+#endif
+
+    *s = sumf;
+}
+
+//
+// gemm
+//
+// blocked f16 x f32 matrix multiplication, used by mul_mat when src1 has many columns
+// a band of GGML_GEMM_MC src0 rows is converted to f32 once and stays in the cache for all src1 columns
+// each GGML_GEMM_MR x GGML_GEMM_NR tile of dst is computed with its accumulators kept in registers,
+// so every loaded src0 value is reused GGML_GEMM_NR times and every src1 value GGML_GEMM_MR times
+//
+
+// convert a row of n f16 values to f32
+static void ggml_gemm_pack_row_f16(const int n, float * restrict y, const ggml_fp16_t * restrict x) {
+    int i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(y + i, vcvt_f32_f16(vld1_f16(x + i)));
+    }
+#elif defined(__AVX512F__)
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(y + i, GGML_F16x16_LOAD(x + i));
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i))));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = ggml_fp16_to_fp32(x[i]);
+    }
+}
+
+// s[j*lds + i] = dot(x + i*ldx, y + j*ldy) for i < GGML_GEMM_MR, j < GGML_GEMM_NR
+static void ggml_gemm_tile_f32(
+        const int n,
+        float * restrict s, const int lds,
+        const float * restrict x, const int ldx,
+        const float * restrict y, const int ldy) {
+    float sum[GGML_GEMM_NR][GGML_GEMM_MR];
+
+    int k0 = 0;
+
+#if defined(__ARM_NEON)
+    float32x4_t acc[GGML_GEMM_NR][GGML_GEMM_MR];
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            acc[j][i] = vdupq_n_f32(0.0f);
+        }
+    }
+
+    for (; k0 + 4 <= n; k0 += 4) {
+        float32x4_t vy[GGML_GEMM_NR];
+        for (int j = 0; j < GGML_GEMM_NR; ++j) {
+            vy[j] = vld1q_f32(y + j*ldy + k0);
+        }
+
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            const float32x4_t vx = vld1q_f32(x + i*ldx + k0);
+            for (int j = 0; j < GGML_GEMM_NR; ++j) {
+                acc[j][i] = vfmaq_f32(acc[j][i], vx, vy[j]);
+            }
+        }
+    }
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            const float32x2_t t = vadd_f32(vget_low_f32(acc[j][i]), vget_high_f32(acc[j][i]));
+            sum[j][i] = vget_lane_f32(t, 0) + vget_lane_f32(t, 1);
+        }
+    }
+#elif defined(__AVX512F__)
+    __m512 acc[GGML_GEMM_NR][GGML_GEMM_MR];
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            acc[j][i] = _mm512_setzero_ps();
+        }
+    }
+
+    for (; k0 + 16 <= n; k0 += 16) {
+        __m512 vy[GGML_GEMM_NR];
+        for (int j = 0; j < GGML_GEMM_NR; ++j) {
+            vy[j] = _mm512_loadu_ps(y + j*ldy + k0);
+        }
+
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            const __m512 vx = _mm512_loadu_ps(x + i*ldx + k0);
+            for (int j = 0; j < GGML_GEMM_NR; ++j) {
+                acc[j][i] = _mm512_fmadd_ps(vx, vy[j], acc[j][i]);
+            }
+        }
+    }
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            sum[j][i] = _mm512_reduce_add_ps(acc[j][i]);
+        }
+    }
+#elif defined(__AVX2__)
+    __m256 acc[GGML_GEMM_NR][GGML_GEMM_MR];
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            acc[j][i] = _mm256_setzero_ps();
+        }
+    }
+
+    for (; k0 + 8 <= n; k0 += 8) {
+        __m256 vy[GGML_GEMM_NR];
+        for (int j = 0; j < GGML_GEMM_NR; ++j) {
+            vy[j] = _mm256_loadu_ps(y + j*ldy + k0);
+        }
+
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            const __m256 vx = _mm256_loadu_ps(x + i*ldx + k0);
+            for (int j = 0; j < GGML_GEMM_NR; ++j) {
+                acc[j][i] = _mm256_fmadd_ps(vx, vy[j], acc[j][i]);
+            }
+        }
+    }
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            sum[j][i] = hsum_float_8(acc[j][i]);
+        }
+    }
+#else
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            sum[j][i] = 0.0f;
+        }
+    }
+#endif
+
+    // leftovers
+    for (int k = k0; k < n; ++k) {
+        for (int j = 0; j < GGML_GEMM_NR; ++j) {
+            for (int i = 0; i < GGML_GEMM_MR; ++i) {
+                sum[j][i] += x[i*ldx + k]*y[j*ldy + k];
+            }
+        }
+    }
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        for (int i = 0; i < GGML_GEMM_MR; ++i) {
+            s[j*lds + i] = sum[j][i];
+        }
+    }
+}
+
+//
+// adam
+//
+// m = beta1*m + (1 - beta1)*g
+// v = beta2*v + (1 - beta2)*g^2
+// x = x - alpha_t*m/(sqrt(vh_scale*v) + eps)
+//
+// with hp = { alpha_t, beta1, beta2, eps, vh_scale }
+//
+
+static void ggml_vec_adam_f32(
+        const int n,
+        float * restrict x, float * restrict m, float * restrict v,
+        const float * restrict g, const float * restrict hp) {
+    const float alpha = hp[0];
+    const float beta1 = hp[1];
+    const float beta2 = hp[2];
+    const float eps   = hp[3];
+    const float scale = hp[4];
+
+    int i = 0;
+
+#if defined(__AVX512F__)
+    const __m512 alpha16  = _mm512_set1_ps(alpha);
+    const __m512 beta1_16 = _mm512_set1_ps(beta1);
+    const __m512 beta2_16 = _mm512_set1_ps(beta2);
+    const __m512 rest1_16 = _mm512_set1_ps(1.0f - beta1);
+    const __m512 rest2_16 = _mm512_set1_ps(1.0f - beta2);
+    const __m512 eps16    = _mm512_set1_ps(eps);
+    const __m512 scale16  = _mm512_set1_ps(scale);
+
+    for (; i + 16 <= n; i += 16) {
+        const __m512 g0 = _mm512_loadu_ps(g + i);
+
+        const __m512 m0 = _mm512_fmadd_ps(g0, rest1_16, _mm512_mul_ps(_mm512_loadu_ps(m + i), beta1_16));
+        const __m512 v0 = _mm512_fmadd_ps(_mm512_mul_ps(g0, g0), rest2_16, _mm512_mul_ps(_mm512_loadu_ps(v + i), beta2_16));
+
+        const __m512 d0 = _mm512_add_ps(_mm512_sqrt_ps(_mm512_mul_ps(v0, scale16)), eps16);
+
+        _mm512_storeu_ps(m + i, m0);
+        _mm512_storeu_ps(v + i, v0);
+        _mm512_storeu_ps(x + i, _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_div_ps(_mm512_mul_ps(m0, alpha16), d0)));
+    }
+#elif defined(__AVX2__)
+    const __m256 alpha8  = _mm256_set1_ps(alpha);
+    const __m256 beta1_8 = _mm256_set1_ps(beta1);
+    const __m256 beta2_8 = _mm256_set1_ps(beta2);
+    const __m256 rest1_8 = _mm256_set1_ps(1.0f - beta1);
+    const __m256 rest2_8 = _mm256_set1_ps(1.0f - beta2);
+    const __m256 eps8    = _mm256_set1_ps(eps);
+    const __m256 scale8  = _mm256_set1_ps(scale);
+
+    for (; i + 8 <= n; i += 8) {
+        const __m256 g0 = _mm256_loadu_ps(g + i);
+
+        const __m256 m0 = _mm256_fmadd_ps(g0, rest1_8, _mm256_mul_ps(_mm256_loadu_ps(m + i), beta1_8));
+        const __m256 v0 = _mm256_fmadd_ps(_mm256_mul_ps(g0, g0), rest2_8, _mm256_mul_ps(_mm256_loadu_ps(v + i), beta2_8));
+
+        const __m256 d0 = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(v0, scale8)), eps8);
+
+        _mm256_storeu_ps(m + i, m0);
+        _mm256_storeu_ps(v + i, v0);
+        _mm256_storeu_ps(x + i, _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_div_ps(_mm256_mul_ps(m0, alpha8), d0)));
+    }
+#endif
+
+    // leftovers
+    for (; i < n; ++i) {
+        m[i] = m[i]*beta1 + g[i]*(1.0f - beta1);
+        v[i] = v[i]*beta2 + g[i]*g[i]*(1.0f - beta2);
+
+        x[i] -= (m[i]*alpha)/(sqrtf(v[i]*scale) + eps);
+    }
+}
+
+static void ggml_vec_mad_f32(const int n, float * restrict y, const float * restrict x, const float v) {
+#ifdef __ARM_NEON
+    // NEON 128-bit
+    const int n16 = (n & ~15);
+
+    const float32x4_t v4 = vdupq_n_f32(v);
+
+    float32x4_t x0, x1, x2, x3;
+    float32x4_t y0, y1, y2, y3;
+
+    for (int i = 0; i < n16; i += 16) {
+        x0 = vld1q_f32(x + i + 0);
+        x1 = vld1q_f32(x + i + 4);
+        x2 = vld1q_f32(x + i + 8);
+        x3 = vld1q_f32(x + i + 12);
+
+        y0 = vld1q_f32(y + i + 0);
+        y1 = vld1q_f32(y + i + 4);
+        y2 = vld1q_f32(y + i + 8);
+        y3 = vld1q_f32(y + i + 12);
+
+        y0 = vfmaq_f32(y0, x0, v4);
+        y1 = vfmaq_f32(y1, x1, v4);
+        y2 = vfmaq_f32(y2, x2, v4);
+        y3 = vfmaq_f32(y3, x3, v4);
+
+        vst1q_f32(y + i + 0, y0);
+        vst1q_f32(y + i + 4, y1);
+        vst1q_f32(y + i + 8, y2);
+        vst1q_f32(y + i + 12, y3);
+    }
+
+    // leftovers
+    for (int i = n16; i < n; ++i) {
+        y[i] += x[i]*v;
+    }
+#elif defined(__AVX512F__)
+    // AVX-512 512-bit
+    const int n64 = (n & ~63);
+
+    const __m512 v16 = _mm512_set1_ps(v);
+
+    int i = 0;
+
+    for (; i < n64; i += 64) {
+        _mm512_storeu_ps(y + i + 0,  _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 0 ), v16, _mm512_loadu_ps(y + i + 0 )));
+        _mm512_storeu_ps(y + i + 16, _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), v16, _mm512_loadu_ps(y + i + 16)));
+        _mm512_storeu_ps(y + i + 32, _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 32), v16, _mm512_loadu_ps(y + i + 32)));
+        _mm512_storeu_ps(y + i + 48, _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 48), v16, _mm512_loadu_ps(y + i + 48)));
+    }
+
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(_mm512_loadu_ps(x + i), v16, _mm512_loadu_ps(y + i)));
+    }
+
+    // leftovers
+    for (; i < n; ++i) {
+        y[i] += x[i]*v;
+    }
+#elif defined(__AVX2__)
+    // AVX 256-bit
+    const int n32 = (n & ~31);
+
+    const __m256 v4 = _mm256_set1_ps(v);
+
+    __m256 x0, x1, x2, x3;
+    __m256 y0, y1, y2, y3;
+
+    for (int i = 0; i < n32; i += 32) {
+        x0 = _mm256_loadu_ps(x + i + 0);
+        x1 = _mm256_loadu_ps(x + i + 8);
+        x2 = _mm256_loadu_ps(x + i + 16);
+        x3 = _mm256_loadu_ps(x + i + 24);
+
+        y0 = _mm256_loadu_ps(y + i + 0);
+        y1 = _mm256_loadu_ps(y + i + 8);
+        y2 = _mm256_loadu_ps(y + i + 16);
+        y3 = _mm256_loadu_ps(y + i + 24);
+
+        y0 = _mm256_fmadd_ps(x0, v4, y0);
+        y1 = _mm256_fmadd_ps(x1, v4, y1);
+        y2 = _mm256_fmadd_ps(x2, v4, y2);
+        y3 = _mm256_fmadd_ps(x3, v4, y3);
+
+        _mm256_storeu_ps(y + i + 0, y0);
+        _mm256_storeu_ps(y + i + 8, y1);
+        _mm256_storeu_ps(y + i + 16, y2);
+        _mm256_storeu_ps(y + i + 24, y3);
+    }
+
+    // leftovers
+    for (int i = n32; i < n; ++i) {
+        y[i] += x[i]*v;
+    }
+#elif defined(__wasm_simd128__)
+    // WASM SIMD 128-bit
+    const int n16 = (n & ~15);
+
+    const v128_t v4 = wasm_f32x4_splat(v);
+
+    v128_t x0, x1, x2, x3;
+    v128_t y0, y1, y2, y3;
+
+    for (int i = 0; i < n16; i += 16) {
+        x0 = wasm_v128_load(x + i + 0);
+        x1 = wasm_v128_load(x + i + 4);
+        x2 = wasm_v128_load(x + i + 8);
+        x3 = wasm_v128_load(x + i + 12);
+
+        y0 = wasm_v128_load(y + i + 0);
+        y1 = wasm_v128_load(y + i + 4);
+        y2 = wasm_v128_load(y + i + 8);
+        y3 = wasm_v128_load(y + i + 12);
+
+        y0 = wasm_f32x4_add(y0, wasm_f32x4_mul(x0, v4));
+        y1 = wasm_f32x4_add(y1, wasm_f32x4_mul(x1, v4));
+        y2 = wasm_f32x4_add(y2, wasm_f32x4_mul(x2, v4));
+        y3 = wasm_f32x4_add(y3, wasm_f32x4_mul(x3, v4));
+
+        wasm_v128_store(y + i + 0, y0);
+        wasm_v128_store(y + i + 4, y1);
+        wasm_v128_store(y + i + 8, y2);
+        wasm_v128_store(y + i + 12, y3);
+    }
+
+    // leftovers
+    for (int i = n16; i < n; ++i) {
+        y[i] += x[i]*v;
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        y[i] += x[i]*v;
+    }
+#endif
+}
+
+static void ggml_vec_mad_f16(const int n, ggml_fp16_t * restrict y, ggml_fp16_t * restrict x, const float v) {
+#ifdef __ARM_NEON
+    // NEON 128-bit
+    const int n32 = (n & ~31);
+
+#if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+    const float16x8_t v8 = vdupq_n_f16(v);
+
+    float16x8_t x0, x1, x2, x3;
+    float16x8_t y0, y1, y2, y3;
+
+    for (int i = 0; i < n32; i += 32) {
+        y0 = vld1q_f16(y + i + 0 );
+        y1 = vld1q_f16(y + i + 8 );
+        y2 = vld1q_f16(y + i + 16);
+        y3 = vld1q_f16(y + i + 24);
+
+        x0 = vld1q_f16(x + i + 0 );
+        x1 = vld1q_f16(x + i + 8 );
+        x2 = vld1q_f16(x + i + 16);
+        x3 = vld1q_f16(x + i + 24);
+
+        y0 = vfmaq_f16(y0, x0, v8);
+        y1 = vfmaq_f16(y1, x1, v8);
+        y2 = vfmaq_f16(y2, x2, v8);
+        y3 = vfmaq_f16(y3, x3, v8);
+
+        vst1q_f16(y + i + 0 , y0);
+        vst1q_f16(y + i + 8 , y1);
+        vst1q_f16(y + i + 16, y2);
+        vst1q_f16(y + i + 24, y3);
+    }
+#else
+    const float32x4_t v40 = vdupq_n_f32(v);
+    const float32x4_t v41 = vdupq_n_f32(v);
+
+    float32x4_t x0, x1, x2, x3, x4, x5, x6, x7;
+    float32x4_t y0, y1, y2, y3, y4, y5, y6, y7;
+
+    for (int i = 0; i < n32; i += 32) {
+        y0 = vcvt_f32_f16(vld1_f16(y + i + 0 ));
+        y1 = vcvt_f32_f16(vld1_f16(y + i + 4 ));
+        y2 = vcvt_f32_f16(vld1_f16(y + i + 8 ));
+        y3 = vcvt_f32_f16(vld1_f16(y + i + 12));
+        y4 = vcvt_f32_f16(vld1_f16(y + i + 16));
+        y5 = vcvt_f32_f16(vld1_f16(y + i + 20));
+        y6 = vcvt_f32_f16(vld1_f16(y + i + 24));
+        y7 = vcvt_f32_f16(vld1_f16(y + i + 28));
+
+        x0 = vcvt_f32_f16(vld1_f16(x + i + 0 ));
+        x1 = vcvt_f32_f16(vld1_f16(x + i + 4 ));
+        x2 = vcvt_f32_f16(vld1_f16(x + i + 8 ));
+        x3 = vcvt_f32_f16(vld1_f16(x + i + 12));
+        x4 = vcvt_f32_f16(vld1_f16(x + i + 16));
+        x5 = vcvt_f32_f16(vld1_f16(x + i + 20));
+        x6 = vcvt_f32_f16(vld1_f16(x + i + 24));
+        x7 = vcvt_f32_f16(vld1_f16(x + i + 28));
+
+        y0 = vfmaq_f32(y0, x0, v40);
+        y1 = vfmaq_f32(y1, x1, v40);
+        y2 = vfmaq_f32(y2, x2, v40);
+        y3 = vfmaq_f32(y3, x3, v40);
+        y4 = vfmaq_f32(y4, x4, v41);
+        y5 = vfmaq_f32(y5, x5, v41);
+        y6 = vfmaq_f32(y6, x6, v41);
+        y7 = vfmaq_f32(y7, x7, v41);
+
+        vst1_f16(y + i + 0 , vcvt_f16_f32(y0));
+        vst1_f16(y + i + 4 , vcvt_f16_f32(y1));
+        vst1_f16(y + i + 8 , vcvt_f16_f32(y2));
+        vst1_f16(y + i + 12, vcvt_f16_f32(y3));
+        vst1_f16(y + i + 16, vcvt_f16_f32(y4));
+        vst1_f16(y + i + 20, vcvt_f16_f32(y5));
+        vst1_f16(y + i + 24, vcvt_f16_f32(y6));
+        vst1_f16(y + i + 28, vcvt_f16_f32(y7));
+    }
+#endif
+
+    // leftovers
+    for (int i = n32; i < n; ++i) {
+        GGML_ASSERT(false);
+        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
+    }
+#elif defined(__AVX512F__)
+    // AVX-512 512-bit
+    // v stays in fp32, so the result is rounded to fp16 only once
+    const int n64 = (n & ~63);
+
+    const __m512 v16 = _mm512_set1_ps(v);
+
+    int i = 0;
+
+    for (; i < n64; i += 64) {
+        for (int k = 0; k < 64; k += 16) {
+            const __m512 yk = _mm512_fmadd_ps(GGML_F16x16_LOAD(x + i + k), v16, GGML_F16x16_LOAD(y + i + k));
+            _mm256_storeu_si256((__m256i *)(y + i + k), _mm512_cvtps_ph(yk, 0));
+        }
+    }
+
+    for (; i + 16 <= n; i += 16) {
+        const __m512 yi = _mm512_fmadd_ps(GGML_F16x16_LOAD(x + i), v16, GGML_F16x16_LOAD(y + i));
+        _mm256_storeu_si256((__m256i *)(y + i), _mm512_cvtps_ph(yi, 0));
+    }
+
+    // leftovers
+    for (; i < n; ++i) {
+        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
+    }
+#elif defined(__AVX2__)
+    // AVX 256-bit
+    const int n32 = (n & ~31);
+
+    const __m256 v8 = _mm256_set1_ps(v);
+
+    __m256 x0, x1, x2, x3;
+    __m256 y0, y1, y2, y3;
+
+    for (int i = 0; i < n32; i += 32) {
+        y0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 0 )));
+        y1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 8 )));
+        y2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 16)));
+        y3 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 24)));
+
+        x0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 0 )));
+        x1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 8 )));
+        x2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 16)));
+        x3 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 24)));
+
+        y0 = _mm256_fmadd_ps(x0, v8, y0);
+        y1 = _mm256_fmadd_ps(x1, v8, y1);
+        y2 = _mm256_fmadd_ps(x2, v8, y2);
+        y3 = _mm256_fmadd_ps(x3, v8, y3);
+
+        _mm_storeu_si128((__m128i*)(y + i + 0 ), _mm256_cvtps_ph(y0, 0));
+        _mm_storeu_si128((__m128i*)(y + i + 8 ), _mm256_cvtps_ph(y1, 0));
+        _mm_storeu_si128((__m128i*)(y + i + 16), _mm256_cvtps_ph(y2, 0));
+        _mm_storeu_si128((__m128i*)(y + i + 24), _mm256_cvtps_ph(y3, 0));
+    }
+
+    // leftovers
+    for (int i = n32; i < n; ++i) {
+        GGML_ASSERT(false);
+        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
+    }
+#elif defined(__wasm_simd128__)
+    // WASM SIMD 128-bit
+    const int n16 = (n & ~15);
+
+    const v128_t v4 = wasm_f32x4_splat(v);
+
+    v128_t x0, x1, x2, x3;
+    v128_t y0, y1, y2, y3;
+
+    float tx[16];
+    float ty[16];
+
+    for (int i = 0; i < n16; i += 16) {
+        for (int k = 0; k < 16; ++k) {
+            tx[k] = ggml_fp16_to_fp32(x[i + k]);
+            ty[k] = ggml_fp16_to_fp32(y[i + k]);
+        }
+
+        x0 = wasm_v128_load(tx + 0);
+        x1 = wasm_v128_load(tx + 4);
+        x2 = wasm_v128_load(tx + 8);
+        x3 = wasm_v128_load(tx + 12);
+
+        y0 = wasm_v128_load(ty + 0);
+        y1 = wasm_v128_load(ty + 4);
+        y2 = wasm_v128_load(ty + 8);
+        y3 = wasm_v128_load(ty + 12);
+
+        y0 = wasm_f32x4_add(y0, wasm_f32x4_mul(x0, v4));
+        y1 = wasm_f32x4_add(y1, wasm_f32x4_mul(x1, v4));
+        y2 = wasm_f32x4_add(y2, wasm_f32x4_mul(x2, v4));
+        y3 = wasm_f32x4_add(y3, wasm_f32x4_mul(x3, v4));
+
+        wasm_v128_store(ty + 0, y0);
+        wasm_v128_store(ty + 4, y1);
+        wasm_v128_store(ty + 8, y2);
+        wasm_v128_store(ty + 12, y3);
+
+        for (int k = 0; k < 16; ++k) {
+            y[i + k] = ggml_fp32_to_fp16(ty[k]);
+        }
+    }
+
+    // leftovers
+    for (int i = n16; i < n; ++i) {
+        GGML_ASSERT(false);
+        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
+    }
+#else
+    for (int i = 0; i < n; ++i) {
+        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
+    }
+#endif
+}
+
+const struct ggml_vec_fns GGML_VEC_FNS(GGML_VEC_NAME) = {
+    .name = GGML_VEC_STR(GGML_VEC_NAME),
+
+    .dot_f32 = ggml_vec_dot_f32,
+    .dot_f16 = ggml_vec_dot_f16,
+    .mad_f32 = ggml_vec_mad_f32,
+    .mad_f16 = ggml_vec_mad_f16,
+
+    .gemm_pack_row_f16 = ggml_gemm_pack_row_f16,
+    .gemm_tile_f32     = ggml_gemm_tile_f32,
+
+    .adam_f32 = ggml_vec_adam_f32,
+
+    .quantize_fns = {
+        [GGML_TYPE_Q4_0] = {
+            .quantize_row   = quantize_row_q4_0,
+            .dequantize_row = dequantize_row_q4_0,
+            .vec_dot        = ggml_vec_dot_q4_0_q8_0,
+            .vec_dot_type   = GGML_TYPE_Q8_0,
+        },
+        [GGML_TYPE_Q8_0] = {
+            .quantize_row   = quantize_row_q8_0,
+            .dequantize_row = dequantize_row_q8_0,
+            .vec_dot        = ggml_vec_dot_q8_0_q8_0,
+            .vec_dot_type   = GGML_TYPE_Q8_0,
+        },
+    },
+};
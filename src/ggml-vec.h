@@ -0,0 +1,100 @@
+#pragma once
+
+// SIMD kernels of ggml
+//
+// ggml-vec.c is compiled once per instruction set and every build exports its kernels as one table
+// ggml_init selects the table that matches the host CPU, so a single binary runs on any x86 machine
+
+#include "ggml.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+// floating point type used to accumulate sums
+typedef double ggml_float;
+
+//
+// quantization
+//
+
+#define QK 32
+
+// 4-bit quantization: x = d*(q - 8)
+// element j of the block is stored in the low nibble of qs[j], element j + QK/2 in the high nibble
+typedef struct {
+    ggml_fp16_t d;      // scale
+    uint8_t qs[QK / 2]; // nibbles
+} block_q4_0;
+static_assert(sizeof(block_q4_0) == sizeof(ggml_fp16_t) + QK / 2, "wrong q4_0 block size/padding");
+
+// 8-bit quantization: x = d*q
+typedef struct {
+    ggml_fp16_t d;  // scale
+    int8_t qs[QK];  // quants
+} block_q8_0;
+static_assert(sizeof(block_q8_0) == sizeof(ggml_fp16_t) + QK, "wrong q8_0 block size/padding");
+
+typedef void (*quantize_row_t)  (const float * restrict x, void  * restrict y, int k);
+typedef void (*dequantize_row_t)(const void  * restrict x, float * restrict y, int k);
+typedef void (*vec_dot_q_t)     (const int n, float * restrict s, const void * restrict x, const void * restrict y);
+
+// per-type quantization kernels
+// the src1 rows of a mul_mat are quantized to vec_dot_type before the dot products with the src0 rows
+typedef struct {
+    quantize_row_t   quantize_row;
+    dequantize_row_t dequantize_row;
+    vec_dot_q_t      vec_dot;
+    enum ggml_type   vec_dot_type;
+} quantize_fns_t;
+
+//
+// gemm
+//
+// blocked f16 x f32 matrix multiplication, used by mul_mat when src1 has many columns
+//
+
+#define GGML_GEMM_MIN_COLS 16 // min src1 columns for the blocked path
+#define GGML_GEMM_MC       64 // src0 rows per band
+#define GGML_GEMM_MR       4  // tile rows    (src0 rows)
+#define GGML_GEMM_NR       3  // tile columns (src1 columns)
+
+//
+// kernel tables
+//
+
+struct ggml_vec_fns {
+    const char * name;
+
+    void (*dot_f32)(const int n, float * restrict s, const float * restrict x, const float * restrict y);
+    void (*dot_f16)(const int n, float * restrict s, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y);
+    void (*mad_f32)(const int n, float * restrict y, const float * restrict x, const float v);
+    void (*mad_f16)(const int n, ggml_fp16_t * restrict y, ggml_fp16_t * restrict x, const float v);
+
+    void (*gemm_pack_row_f16)(const int n, float * restrict y, const ggml_fp16_t * restrict x);
+    void (*gemm_tile_f32)(
+            const int n,
+            float * restrict s, const int lds,
+            const float * restrict x, const int ldx,
+            const float * restrict y, const int ldy);
+
+    // one Adam step of n parameters x with the gradient g and the moments m and v, see ggml_opt_adam_step()
+    void (*adam_f32)(
+            const int n,
+            float * restrict x, float * restrict m, float * restrict v,
+            const float * restrict g, const float * restrict hp);
+
+    quantize_fns_t quantize_fns[GGML_TYPE_COUNT];
+};
+
+// built without any instruction set flags - always available
+extern const struct ggml_vec_fns ggml_vec_fns_generic;
+
+#ifdef GGML_VEC_AVX2
+// x86 with AVX2, FMA and F16C
+extern const struct ggml_vec_fns ggml_vec_fns_avx2;
+#endif
+
+#ifdef GGML_VEC_AVX512
+// x86 with AVX-512F (and AVX2, FMA and F16C)
+extern const struct ggml_vec_fns ggml_vec_fns_avx512;
+#endif
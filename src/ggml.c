@@ -1,4 +1,9 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
 #include "ggml.h"
+#include "ggml-vec.h"
 
 #if defined(_MSC_VER) || defined(__MINGW32__)
 #include <malloc.h> // using malloc.h with MSC/MINGW
@@ -12,6 +17,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 
 #if defined _MSC_VER || defined(__MINGW32__)
@@ -32,6 +38,14 @@ static LONG atomic_fetch_add(atomic_int* ptr, LONG inc) {
 static LONG atomic_fetch_sub(atomic_int* ptr, LONG dec) {
     return atomic_fetch_add(ptr, -(dec));
 }
+static bool atomic_compare_exchange_strong(atomic_int* ptr, int* expected, int desired) {
+    const LONG old = InterlockedCompareExchange(ptr, desired, *expected);
+    if (old == *expected) {
+        return true;
+    }
+    *expected = old;
+    return false;
+}
 
 typedef HANDLE pthread_t;
 
@@ -55,6 +69,46 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef SRWLOCK pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t* mutex, void* unused) {
+    InitializeSRWLock(mutex);
+    return 0;
+}
+
+static int pthread_mutex_destroy(pthread_mutex_t* mutex) {
+    return 0;
+}
+
+static int pthread_mutex_lock(pthread_mutex_t* mutex) {
+    AcquireSRWLockExclusive(mutex);
+    return 0;
+}
+
+static int pthread_mutex_unlock(pthread_mutex_t* mutex) {
+    ReleaseSRWLockExclusive(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t* cond, void* unused) {
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_destroy(pthread_cond_t* cond) {
+    return 0;
+}
+
+static int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    return SleepConditionVariableSRW(cond, mutex, INFINITE, 0) ? 0 : EINVAL;
+}
+
+static int pthread_cond_broadcast(pthread_cond_t* cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -62,9 +116,21 @@ static int sched_yield (void) {
 typedef void* thread_ret_t;
 #endif
 
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #define GGML_DEBUG 0
 #define GGML_GELU_FP16
 
+// single-task nodes with at least this many elements are computed concurrently when they are independent
+#define GGML_GROUP_MIN_NELEMENTS 4096
+
+// maximum number of nodes per thread in a group of concurrently computed nodes
+#define GGML_GROUP_MAX_TASKS 4
+
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
 #else
@@ -91,9 +157,6 @@ typedef void* thread_ret_t;
 #include <cblas.h>
 #endif
 
-// floating point type used to accumulate sums
-typedef double ggml_float;
-
 // 16-bit float
 // on Arm, we use __fp16
 // on x86, we use uint16_t
@@ -221,6 +284,11 @@ int64_t ggml_time_us(void) {
     QueryPerformanceCounter(&t);
     return (t.QuadPart * 1000000) / timer_freq;
 }
+int64_t ggml_time_ns(void) {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (t.QuadPart / timer_freq)*1000000000 + ((t.QuadPart % timer_freq) * 1000000000) / timer_freq;
+}
 #else
 void ggml_time_init(void) {}
 int64_t ggml_time_ms(void) {
@@ -234,6 +302,12 @@ int64_t ggml_time_us(void) {
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return (int64_t)ts.tv_sec*1000000 + (int64_t)ts.tv_nsec/1000;
 }
+
+int64_t ggml_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + (int64_t)ts.tv_nsec;
+}
 #endif
 
 int64_t ggml_cycles(void) {
@@ -290,633 +364,128 @@ inline static void ggml_vec_neg_f32 (const int n, float * y, const float * x)
 inline static void ggml_vec_mul_f32 (const int n, float * z, const float * x, const float * y) { for (int i = 0; i < n; ++i) z[i]  = x[i]*y[i];   }
 inline static void ggml_vec_div_f32 (const int n, float * z, const float * x, const float * y) { for (int i = 0; i < n; ++i) z[i]  = x[i]/y[i];   }
 
-inline static void ggml_vec_dot_f32(const int n, float * restrict s, const float * restrict x, const float * restrict y) {
-    ggml_float sumf = 0.0;
-#ifdef __ARM_NEON
-    // NEON 128-bit
-    const int n16 = (n & ~15);
-
-    float32x4_t sum0 = vdupq_n_f32(0);
-    float32x4_t sum1 = vdupq_n_f32(0);
-    float32x4_t sum2 = vdupq_n_f32(0);
-    float32x4_t sum3 = vdupq_n_f32(0);
-
-    float32x4_t x0, x1, x2, x3;
-    float32x4_t y0, y1, y2, y3;
-
-    for (int i = 0; i < n16; i += 16) {
-        x0 = vld1q_f32(x + i + 0);
-        x1 = vld1q_f32(x + i + 4);
-        x2 = vld1q_f32(x + i + 8);
-        x3 = vld1q_f32(x + i + 12);
-
-        y0 = vld1q_f32(y + i + 0);
-        y1 = vld1q_f32(y + i + 4);
-        y2 = vld1q_f32(y + i + 8);
-        y3 = vld1q_f32(y + i + 12);
-
-        sum0 = vfmaq_f32(sum0, x0, y0);
-        sum1 = vfmaq_f32(sum1, x1, y1);
-        sum2 = vfmaq_f32(sum2, x2, y2);
-        sum3 = vfmaq_f32(sum3, x3, y3);
-    }
-
-    // reduce sum0..sum3 to sum0
-    sum0 = vaddq_f32(sum0, sum1);
-    sum2 = vaddq_f32(sum2, sum3);
-    sum0 = vaddq_f32(sum0, sum2);
-
-    float32x2_t sumf32 = vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0));
-    sumf = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
-
-    // leftovers
-    for (int i = n16; i < n; ++i) {
-        sumf += x[i]*y[i];
-    }
-#elif defined(__AVX2__)
-    // AVX 256-bit
-    const int n32 = (n & ~31);
-
-    __m256 sum0 = _mm256_setzero_ps();
-    __m256 sum1 = _mm256_setzero_ps();
-    __m256 sum2 = _mm256_setzero_ps();
-    __m256 sum3 = _mm256_setzero_ps();
-
-    __m256 x0, x1, x2, x3;
-    __m256 y0, y1, y2, y3;
-
-    for (int i = 0; i < n32; i += 32) {
-        x0 = _mm256_loadu_ps(x + i + 0);
-        x1 = _mm256_loadu_ps(x + i + 8);
-        x2 = _mm256_loadu_ps(x + i + 16);
-        x3 = _mm256_loadu_ps(x + i + 24);
-
-        y0 = _mm256_loadu_ps(y + i + 0);
-        y1 = _mm256_loadu_ps(y + i + 8);
-        y2 = _mm256_loadu_ps(y + i + 16);
-        y3 = _mm256_loadu_ps(y + i + 24);
-
-        sum0 = _mm256_fmadd_ps(x0, y0, sum0);
-        sum1 = _mm256_fmadd_ps(x1, y1, sum1);
-        sum2 = _mm256_fmadd_ps(x2, y2, sum2);
-        sum3 = _mm256_fmadd_ps(x3, y3, sum3);
-    }
-
-    sum0 = _mm256_add_ps(sum0, sum1);
-    sum2 = _mm256_add_ps(sum2, sum3);
-    sum0 = _mm256_add_ps(sum0, sum2);
-
-    const __m128 r4 = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
-    const __m128 r2 = _mm_add_ps(r4, _mm_movehl_ps(r4, r4));
-    const __m128 r1 = _mm_add_ss(r2, _mm_movehdup_ps(r2));
-
-    sumf = _mm_cvtss_f32(r1);
-
-    // leftovers
-    for (int i = n32; i < n; ++i) {
-        sumf += x[i]*y[i];
-    }
-#elif defined(__wasm_simd128__)
-    // WASM 128-bit
-    const int n16 = (n & ~15);
-
-    v128_t sum0 = wasm_f32x4_splat(0);
-    v128_t sum1 = wasm_f32x4_splat(0);
-    v128_t sum2 = wasm_f32x4_splat(0);
-    v128_t sum3 = wasm_f32x4_splat(0);
-
-    v128_t x0, x1, x2, x3;
-    v128_t y0, y1, y2, y3;
-
-    for (int i = 0; i < n16; i += 16) {
-        x0 = wasm_v128_load(x + i + 0);
-        x1 = wasm_v128_load(x + i + 4);
-        x2 = wasm_v128_load(x + i + 8);
-        x3 = wasm_v128_load(x + i + 12);
-
-        y0 = wasm_v128_load(y + i + 0);
-        y1 = wasm_v128_load(y + i + 4);
-        y2 = wasm_v128_load(y + i + 8);
-        y3 = wasm_v128_load(y + i + 12);
+//
+// cpu features
+//
 
-        sum0 = wasm_f32x4_add(sum0, wasm_f32x4_mul(x0, y0));
-        sum1 = wasm_f32x4_add(sum1, wasm_f32x4_mul(x1, y1));
-        sum2 = wasm_f32x4_add(sum2, wasm_f32x4_mul(x2, y2));
-        sum3 = wasm_f32x4_add(sum3, wasm_f32x4_mul(x3, y3));
-    }
+// x86 instruction set extensions of the host, usable only if the OS saves the wider registers
+struct ggml_cpu_features {
+    bool avx2; // together with FMA and F16C
+    bool avx512f;
+};
 
-    sum0 = wasm_f32x4_add(sum0, sum1);
-    sum2 = wasm_f32x4_add(sum2, sum3);
-    sum0 = wasm_f32x4_add(sum0, sum2);
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#if defined(_MSC_VER)
+#include <intrin.h>
 
-    sumf = wasm_f32x4_extract_lane(sum0, 0) + wasm_f32x4_extract_lane(sum0, 1) + wasm_f32x4_extract_lane(sum0, 2) + wasm_f32x4_extract_lane(sum0, 3);
+static void ggml_cpuid(uint32_t leaf, uint32_t r[4]) {
+    int t[4];
+    __cpuidex(t, leaf, 0);
+    memcpy(r, t, sizeof(t));
+}
 
-    // leftovers
-    for (int i = n16; i < n; ++i) {
-        sumf += x[i]*y[i];
-    }
+static uint64_t ggml_xgetbv(void) {
+    return _xgetbv(0);
+}
 #else
-    // scalar
-    for (int i = 0; i < n; ++i) {
-        sumf += x[i]*y[i];
-    }
-#endif
+#include <cpuid.h>
 
-    *s = sumf;
+static void ggml_cpuid(uint32_t leaf, uint32_t r[4]) {
+    __cpuid_count(leaf, 0, r[0], r[1], r[2], r[3]);
 }
 
-inline static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y) {
-    ggml_float sumf = 0.0;
-#ifdef __ARM_NEON
-    const int n32 = (n & ~31);
-
-#if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
-    float16x8_t sum0 = vdupq_n_f16(0);
-    float16x8_t sum1 = vdupq_n_f16(0);
-    float16x8_t sum2 = vdupq_n_f16(0);
-    float16x8_t sum3 = vdupq_n_f16(0);
-
-    float16x8_t x0, x1, x2, x3;
-    float16x8_t y0, y1, y2, y3;
-
-    for (int i = 0; i < n32; i += 32) {
-        x0 = vld1q_f16(x + i + 0 );
-        x1 = vld1q_f16(x + i + 8 );
-        x2 = vld1q_f16(x + i + 16);
-        x3 = vld1q_f16(x + i + 24);
-
-        y0 = vld1q_f16(y + i + 0 );
-        y1 = vld1q_f16(y + i + 8 );
-        y2 = vld1q_f16(y + i + 16);
-        y3 = vld1q_f16(y + i + 24);
-
-        sum0 = vfmaq_f16(sum0, x0, y0);
-        sum1 = vfmaq_f16(sum1, x1, y1);
-        sum2 = vfmaq_f16(sum2, x2, y2);
-        sum3 = vfmaq_f16(sum3, x3, y3);
-    }
-
-    // reduce sum0..sum3 to sum0
-    sum0 = vaddq_f16(sum0, sum1);
-    sum2 = vaddq_f16(sum2, sum3);
-    sum0 = vaddq_f16(sum0, sum2);
-
-    // load sum0 into 2 float32x4_t
-    float32x4_t sum0f32 = vcvt_f32_f16(vget_low_f16(sum0));
-    float32x4_t sum1f32 = vcvt_f32_f16(vget_high_f16(sum0));
-
-    // reduce sum0f32 and sum1f32 to sumf
-    sum0f32 = vaddq_f32(sum0f32, sum1f32);
-
-    float32x2_t sumf32 = vadd_f32(vget_low_f32(sum0f32), vget_high_f32(sum0f32));
-    sumf = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
-#else
-    float32x4_t sum0 = vdupq_n_f32(0);
-    float32x4_t sum1 = vdupq_n_f32(0);
-    float32x4_t sum2 = vdupq_n_f32(0);
-    float32x4_t sum3 = vdupq_n_f32(0);
-    float32x4_t sum4 = vdupq_n_f32(0);
-    float32x4_t sum5 = vdupq_n_f32(0);
-    float32x4_t sum6 = vdupq_n_f32(0);
-    float32x4_t sum7 = vdupq_n_f32(0);
-
-    float32x4_t x0, x1, x2, x3, x4, x5, x6, x7;
-    float32x4_t y0, y1, y2, y3, y4, y5, y6, y7;
-
-    for (int i = 0; i < n32; i += 32) {
-        x0 = vcvt_f32_f16(vld1_f16(x + i + 0 ));
-        x1 = vcvt_f32_f16(vld1_f16(x + i + 4 ));
-        x2 = vcvt_f32_f16(vld1_f16(x + i + 8 ));
-        x3 = vcvt_f32_f16(vld1_f16(x + i + 12));
-        x4 = vcvt_f32_f16(vld1_f16(x + i + 16));
-        x5 = vcvt_f32_f16(vld1_f16(x + i + 20));
-        x6 = vcvt_f32_f16(vld1_f16(x + i + 24));
-        x7 = vcvt_f32_f16(vld1_f16(x + i + 28));
-
-        y0 = vcvt_f32_f16(vld1_f16(y + i + 0 ));
-        y1 = vcvt_f32_f16(vld1_f16(y + i + 4 ));
-        y2 = vcvt_f32_f16(vld1_f16(y + i + 8 ));
-        y3 = vcvt_f32_f16(vld1_f16(y + i + 12));
-        y4 = vcvt_f32_f16(vld1_f16(y + i + 16));
-        y5 = vcvt_f32_f16(vld1_f16(y + i + 20));
-        y6 = vcvt_f32_f16(vld1_f16(y + i + 24));
-        y7 = vcvt_f32_f16(vld1_f16(y + i + 28));
-
-        sum0 = vfmaq_f32(sum0, x0, y0);
-        sum1 = vfmaq_f32(sum1, x1, y1);
-        sum2 = vfmaq_f32(sum2, x2, y2);
-        sum3 = vfmaq_f32(sum3, x3, y3);
-        sum4 = vfmaq_f32(sum4, x4, y4);
-        sum5 = vfmaq_f32(sum5, x5, y5);
-        sum6 = vfmaq_f32(sum6, x6, y6);
-        sum7 = vfmaq_f32(sum7, x7, y7);
-    }
-
-    // reduce sum0..sum7 to sum0
-    sum0 = vaddq_f32(sum0, sum1);
-    sum2 = vaddq_f32(sum2, sum3);
-    sum4 = vaddq_f32(sum4, sum5);
-    sum6 = vaddq_f32(sum6, sum7);
-    sum0 = vaddq_f32(sum0, sum2);
-    sum4 = vaddq_f32(sum4, sum6);
-    sum0 = vaddq_f32(sum0, sum4);
-
-    // reduce sum0 to sumf
-    float32x2_t sumf32 = vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0));
-    sumf = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
+static uint64_t ggml_xgetbv(void) {
+    uint32_t a, d;
+    __asm__ __volatile__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return ((uint64_t) d << 32) | a;
+}
 #endif
 
-    // leftovers
-    for (int i = n32; i < n; ++i) {
-        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
-    }
-#elif defined(__AVX2__)
-    // AVX 256-bit
-    const int n32 = (n & ~31);
+static struct ggml_cpu_features ggml_cpu_detect(void) {
+    struct ggml_cpu_features res = { false, false };
 
-    __m256 sum0 = _mm256_setzero_ps();
-    __m256 sum1 = _mm256_setzero_ps();
-    __m256 sum2 = _mm256_setzero_ps();
-    __m256 sum3 = _mm256_setzero_ps();
+    uint32_t r[4];
 
-    __m256 x0, x1, x2, x3;
-    __m256 y0, y1, y2, y3;
+    ggml_cpuid(0, r);
+    const uint32_t max_leaf = r[0];
 
-    for (int i = 0; i < n32; i += 32) {
-        x0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 0 )));
-        x1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 8 )));
-        x2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 16)));
-        x3 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 24)));
+    ggml_cpuid(1, r);
+    const bool fma     = r[2] & (1u << 12);
+    const bool osxsave = r[2] & (1u << 27);
+    const bool avx     = r[2] & (1u << 28);
+    const bool f16c    = r[2] & (1u << 29);
 
-        y0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 0 )));
-        y1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 8 )));
-        y2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 16)));
-        y3 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 24)));
+    // XCR0: bits 1-2 for the ymm state, bits 5-7 for the zmm and mask state
+    const uint64_t xcr0 = osxsave ? ggml_xgetbv() : 0;
+    const bool os_ymm = (xcr0 & 0x06) == 0x06;
+    const bool os_zmm = (xcr0 & 0xe6) == 0xe6;
 
-        sum0 = _mm256_fmadd_ps(x0, y0, sum0);
-        sum1 = _mm256_fmadd_ps(x1, y1, sum1);
-        sum2 = _mm256_fmadd_ps(x2, y2, sum2);
-        sum3 = _mm256_fmadd_ps(x3, y3, sum3);
+    if (max_leaf >= 7) {
+        ggml_cpuid(7, r);
+        res.avx2    = os_ymm && avx && fma && f16c && (r[1] & (1u << 5));
+        res.avx512f = os_zmm && (r[1] & (1u << 16));
     }
 
-    const __m256 sum01 = _mm256_add_ps(sum0, sum1);
-    const __m256 sum23 = _mm256_add_ps(sum2, sum3);
-    const __m256 sum0123 = _mm256_add_ps(sum01, sum23);
+    return res;
+}
+#else
+static struct ggml_cpu_features ggml_cpu_detect(void) {
+    struct ggml_cpu_features res = { false, false };
+    return res;
+}
+#endif
 
-    const __m128 r4 = _mm_add_ps(_mm256_castps256_ps128(sum0123), _mm256_extractf128_ps(sum0123, 1));
-    const __m128 r2 = _mm_add_ps(r4, _mm_movehl_ps(r4, r4));
-    const __m128 r1 = _mm_add_ss(r2, _mm_movehdup_ps(r2));
+// features of the host CPU, detected in ggml_init_once
+static struct ggml_cpu_features ggml_cpu = { false, false };
 
-    sumf = _mm_cvtss_f32(r1);
+// SIMD kernels for the host CPU, selected in ggml_init_once
+static const struct ggml_vec_fns * ggml_vec = &ggml_vec_fns_generic;
 
-    // leftovers
-    for (int i = n32; i < n; ++i) {
-        //GGML_ASSERT(false);
-        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
+// pick the best kernels that were compiled in and that the host supports
+// GGML_CPU_ISA=<name> in the environment restricts the choice to the given (lower) instruction set
+static const struct ggml_vec_fns * ggml_vec_select(const struct ggml_cpu_features cpu) {
+    const char * isa = getenv("GGML_CPU_ISA");
+    if (isa && isa[0] == '\0') {
+        isa = NULL;
     }
-#elif defined(__wasm_simd128__)
-    // WASM 128-bit
-    const int n16 = (n & ~15);
 
-    v128_t sum0 = wasm_f32x4_splat(0.0f);
-    v128_t sum1 = wasm_f32x4_splat(0.0f);
-    v128_t sum2 = wasm_f32x4_splat(0.0f);
-    v128_t sum3 = wasm_f32x4_splat(0.0f);
+    const struct ggml_vec_fns * candidates[] = {
+#ifdef GGML_VEC_AVX512
+        cpu.avx2 && cpu.avx512f ? &ggml_vec_fns_avx512 : NULL,
+#endif
+#ifdef GGML_VEC_AVX2
+        cpu.avx2 ? &ggml_vec_fns_avx2 : NULL,
+#endif
+        &ggml_vec_fns_generic,
+    };
 
-    v128_t x0, x1, x2, x3;
-    v128_t y0, y1, y2, y3;
+    UNUSED(cpu);
 
-    float tx[16];
-    float ty[16];
+    const int n = sizeof(candidates)/sizeof(candidates[0]);
 
-    for (int i = 0; i < n16; i += 16) {
-        for (int k = 0; k < 16; ++k) {
-            tx[k] = ggml_fp16_to_fp32(x[i + k]);
-            ty[k] = ggml_fp16_to_fp32(y[i + k]);
+    for (int i = 0; i < n; ++i) {
+        if (candidates[i] && (isa == NULL || strcmp(isa, candidates[i]->name) == 0)) {
+            return candidates[i];
         }
-
-        x0 = wasm_v128_load(tx + 0);
-        x1 = wasm_v128_load(tx + 4);
-        x2 = wasm_v128_load(tx + 8);
-        x3 = wasm_v128_load(tx + 12);
-
-        y0 = wasm_v128_load(ty + 0);
-        y1 = wasm_v128_load(ty + 4);
-        y2 = wasm_v128_load(ty + 8);
-        y3 = wasm_v128_load(ty + 12);
-
-        sum0 = wasm_f32x4_add(sum0, wasm_f32x4_mul(x0, y0));
-        sum1 = wasm_f32x4_add(sum1, wasm_f32x4_mul(x1, y1));
-        sum2 = wasm_f32x4_add(sum2, wasm_f32x4_mul(x2, y2));
-        sum3 = wasm_f32x4_add(sum3, wasm_f32x4_mul(x3, y3));
     }
 
-    sum0 = wasm_f32x4_add(sum0, sum1);
-    sum2 = wasm_f32x4_add(sum2, sum3);
-    sum0 = wasm_f32x4_add(sum0, sum2);
-
-    sumf = wasm_f32x4_extract_lane(sum0, 0) + wasm_f32x4_extract_lane(sum0, 1) + wasm_f32x4_extract_lane(sum0, 2) + wasm_f32x4_extract_lane(sum0, 3);
+    return &ggml_vec_fns_generic;
+}
 
-    // leftovers
-    for (int i = n16; i < n; ++i) {
-        //GGML_ASSERT(false);
-        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
-    }
-#else
-    for (int i = 0; i < n; ++i) {
-        sumf += ggml_fp16_to_fp32(x[i])*ggml_fp16_to_fp32(y[i]);
-    }
-#endif
+inline static void ggml_vec_dot_f32(const int n, float * restrict s, const float * restrict x, const float * restrict y) {
+    ggml_vec->dot_f32(n, s, x, y);
+}
 
-    *s = sumf;
+inline static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y) {
+    ggml_vec->dot_f16(n, s, x, y);
 }
 
 inline static void ggml_vec_mad_f32(const int n, float * restrict y, const float * restrict x, const float v) {
-#ifdef __ARM_NEON
-    // NEON 128-bit
-    const int n16 = (n & ~15);
-
-    const float32x4_t v4 = vdupq_n_f32(v);
-
-    float32x4_t x0, x1, x2, x3;
-    float32x4_t y0, y1, y2, y3;
-
-    for (int i = 0; i < n16; i += 16) {
-        x0 = vld1q_f32(x + i + 0);
-        x1 = vld1q_f32(x + i + 4);
-        x2 = vld1q_f32(x + i + 8);
-        x3 = vld1q_f32(x + i + 12);
-
-        y0 = vld1q_f32(y + i + 0);
-        y1 = vld1q_f32(y + i + 4);
-        y2 = vld1q_f32(y + i + 8);
-        y3 = vld1q_f32(y + i + 12);
-
-        y0 = vfmaq_f32(y0, x0, v4);
-        y1 = vfmaq_f32(y1, x1, v4);
-        y2 = vfmaq_f32(y2, x2, v4);
-        y3 = vfmaq_f32(y3, x3, v4);
-
-        vst1q_f32(y + i + 0, y0);
-        vst1q_f32(y + i + 4, y1);
-        vst1q_f32(y + i + 8, y2);
-        vst1q_f32(y + i + 12, y3);
-    }
-
-    // leftovers
-    for (int i = n16; i < n; ++i) {
-        y[i] += x[i]*v;
-    }
-#elif defined(__AVX2__)
-    // AVX 256-bit
-    const int n32 = (n & ~31);
-
-    const __m256 v4 = _mm256_set1_ps(v);
-
-    __m256 x0, x1, x2, x3;
-    __m256 y0, y1, y2, y3;
-
-    for (int i = 0; i < n32; i += 32) {
-        x0 = _mm256_loadu_ps(x + i + 0);
-        x1 = _mm256_loadu_ps(x + i + 8);
-        x2 = _mm256_loadu_ps(x + i + 16);
-        x3 = _mm256_loadu_ps(x + i + 24);
-
-        y0 = _mm256_loadu_ps(y + i + 0);
-        y1 = _mm256_loadu_ps(y + i + 8);
-        y2 = _mm256_loadu_ps(y + i + 16);
-        y3 = _mm256_loadu_ps(y + i + 24);
-
-        y0 = _mm256_fmadd_ps(x0, v4, y0);
-        y1 = _mm256_fmadd_ps(x1, v4, y1);
-        y2 = _mm256_fmadd_ps(x2, v4, y2);
-        y3 = _mm256_fmadd_ps(x3, v4, y3);
-
-        _mm256_storeu_ps(y + i + 0, y0);
-        _mm256_storeu_ps(y + i + 8, y1);
-        _mm256_storeu_ps(y + i + 16, y2);
-        _mm256_storeu_ps(y + i + 24, y3);
-    }
-
-    // leftovers
-    for (int i = n32; i < n; ++i) {
-        y[i] += x[i]*v;
-    }
-#elif defined(__wasm_simd128__)
-    // WASM SIMD 128-bit
-    const int n16 = (n & ~15);
-
-    const v128_t v4 = wasm_f32x4_splat(v);
-
-    v128_t x0, x1, x2, x3;
-    v128_t y0, y1, y2, y3;
-
-    for (int i = 0; i < n16; i += 16) {
-        x0 = wasm_v128_load(x + i + 0);
-        x1 = wasm_v128_load(x + i + 4);
-        x2 = wasm_v128_load(x + i + 8);
-        x3 = wasm_v128_load(x + i + 12);
-
-        y0 = wasm_v128_load(y + i + 0);
-        y1 = wasm_v128_load(y + i + 4);
-        y2 = wasm_v128_load(y + i + 8);
-        y3 = wasm_v128_load(y + i + 12);
-
-        y0 = wasm_f32x4_add(y0, wasm_f32x4_mul(x0, v4));
-        y1 = wasm_f32x4_add(y1, wasm_f32x4_mul(x1, v4));
-        y2 = wasm_f32x4_add(y2, wasm_f32x4_mul(x2, v4));
-        y3 = wasm_f32x4_add(y3, wasm_f32x4_mul(x3, v4));
-
-        wasm_v128_store(y + i + 0, y0);
-        wasm_v128_store(y + i + 4, y1);
-        wasm_v128_store(y + i + 8, y2);
-        wasm_v128_store(y + i + 12, y3);
-    }
-
-    // leftovers
-    for (int i = n16; i < n; ++i) {
-        y[i] += x[i]*v;
-    }
-#else
-    // scalar
-    for (int i = 0; i < n; ++i) {
-        y[i] += x[i]*v;
-    }
-#endif
+    ggml_vec->mad_f32(n, y, x, v);
 }
 
 inline static void ggml_vec_mad_f16(const int n, ggml_fp16_t * restrict y, ggml_fp16_t * restrict x, const float v) {
-#ifdef __ARM_NEON
-    // NEON 128-bit
-    const int n32 = (n & ~31);
-
-#if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
-    const float16x8_t v8 = vdupq_n_f16(v);
-
-    float16x8_t x0, x1, x2, x3;
-    float16x8_t y0, y1, y2, y3;
-
-    for (int i = 0; i < n32; i += 32) {
-        y0 = vld1q_f16(y + i + 0 );
-        y1 = vld1q_f16(y + i + 8 );
-        y2 = vld1q_f16(y + i + 16);
-        y3 = vld1q_f16(y + i + 24);
-
-        x0 = vld1q_f16(x + i + 0 );
-        x1 = vld1q_f16(x + i + 8 );
-        x2 = vld1q_f16(x + i + 16);
-        x3 = vld1q_f16(x + i + 24);
-
-        y0 = vfmaq_f16(y0, x0, v8);
-        y1 = vfmaq_f16(y1, x1, v8);
-        y2 = vfmaq_f16(y2, x2, v8);
-        y3 = vfmaq_f16(y3, x3, v8);
-
-        vst1q_f16(y + i + 0 , y0);
-        vst1q_f16(y + i + 8 , y1);
-        vst1q_f16(y + i + 16, y2);
-        vst1q_f16(y + i + 24, y3);
-    }
-#else
-    const float32x4_t v40 = vdupq_n_f32(v);
-    const float32x4_t v41 = vdupq_n_f32(v);
-
-    float32x4_t x0, x1, x2, x3, x4, x5, x6, x7;
-    float32x4_t y0, y1, y2, y3, y4, y5, y6, y7;
-
-    for (int i = 0; i < n32; i += 32) {
-        y0 = vcvt_f32_f16(vld1_f16(y + i + 0 ));
-        y1 = vcvt_f32_f16(vld1_f16(y + i + 4 ));
-        y2 = vcvt_f32_f16(vld1_f16(y + i + 8 ));
-        y3 = vcvt_f32_f16(vld1_f16(y + i + 12));
-        y4 = vcvt_f32_f16(vld1_f16(y + i + 16));
-        y5 = vcvt_f32_f16(vld1_f16(y + i + 20));
-        y6 = vcvt_f32_f16(vld1_f16(y + i + 24));
-        y7 = vcvt_f32_f16(vld1_f16(y + i + 28));
-
-        x0 = vcvt_f32_f16(vld1_f16(x + i + 0 ));
-        x1 = vcvt_f32_f16(vld1_f16(x + i + 4 ));
-        x2 = vcvt_f32_f16(vld1_f16(x + i + 8 ));
-        x3 = vcvt_f32_f16(vld1_f16(x + i + 12));
-        x4 = vcvt_f32_f16(vld1_f16(x + i + 16));
-        x5 = vcvt_f32_f16(vld1_f16(x + i + 20));
-        x6 = vcvt_f32_f16(vld1_f16(x + i + 24));
-        x7 = vcvt_f32_f16(vld1_f16(x + i + 28));
-
-        y0 = vfmaq_f32(y0, x0, v40);
-        y1 = vfmaq_f32(y1, x1, v40);
-        y2 = vfmaq_f32(y2, x2, v40);
-        y3 = vfmaq_f32(y3, x3, v40);
-        y4 = vfmaq_f32(y4, x4, v41);
-        y5 = vfmaq_f32(y5, x5, v41);
-        y6 = vfmaq_f32(y6, x6, v41);
-        y7 = vfmaq_f32(y7, x7, v41);
-
-        vst1_f16(y + i + 0 , vcvt_f16_f32(y0));
-        vst1_f16(y + i + 4 , vcvt_f16_f32(y1));
-        vst1_f16(y + i + 8 , vcvt_f16_f32(y2));
-        vst1_f16(y + i + 12, vcvt_f16_f32(y3));
-        vst1_f16(y + i + 16, vcvt_f16_f32(y4));
-        vst1_f16(y + i + 20, vcvt_f16_f32(y5));
-        vst1_f16(y + i + 24, vcvt_f16_f32(y6));
-        vst1_f16(y + i + 28, vcvt_f16_f32(y7));
-    }
-#endif
-
-    // leftovers
-    for (int i = n32; i < n; ++i) {
-        GGML_ASSERT(false);
-        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
-    }
-#elif defined(__AVX2__)
-    // AVX 256-bit
-    const int n32 = (n & ~31);
-
-    const __m256 v8 = _mm256_set1_ps(v);
-
-    __m256 x0, x1, x2, x3;
-    __m256 y0, y1, y2, y3;
-
-    for (int i = 0; i < n32; i += 32) {
-        y0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 0 )));
-        y1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 8 )));
-        y2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 16)));
-        y3 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(y + i + 24)));
-
-        x0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 0 )));
-        x1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 8 )));
-        x2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 16)));
-        x3 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(x + i + 24)));
-
-        y0 = _mm256_fmadd_ps(x0, v8, y0);
-        y1 = _mm256_fmadd_ps(x1, v8, y1);
-        y2 = _mm256_fmadd_ps(x2, v8, y2);
-        y3 = _mm256_fmadd_ps(x3, v8, y3);
-
-        _mm_storeu_si128((__m128i*)(y + i + 0 ), _mm256_cvtps_ph(y0, 0));
-        _mm_storeu_si128((__m128i*)(y + i + 8 ), _mm256_cvtps_ph(y1, 0));
-        _mm_storeu_si128((__m128i*)(y + i + 16), _mm256_cvtps_ph(y2, 0));
-        _mm_storeu_si128((__m128i*)(y + i + 24), _mm256_cvtps_ph(y3, 0));
-    }
-
-    // leftovers
-    for (int i = n32; i < n; ++i) {
-        GGML_ASSERT(false);
-        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
-    }
-#elif defined(__wasm_simd128__)
-    // WASM SIMD 128-bit
-    const int n16 = (n & ~15);
-
-    const v128_t v4 = wasm_f32x4_splat(v);
-
-    v128_t x0, x1, x2, x3;
-    v128_t y0, y1, y2, y3;
-
-    float tx[16];
-    float ty[16];
-
-    for (int i = 0; i < n16; i += 16) {
-        for (int k = 0; k < 16; ++k) {
-            tx[k] = ggml_fp16_to_fp32(x[i + k]);
-            ty[k] = ggml_fp16_to_fp32(y[i + k]);
-        }
-
-        x0 = wasm_v128_load(tx + 0);
-        x1 = wasm_v128_load(tx + 4);
-        x2 = wasm_v128_load(tx + 8);
-        x3 = wasm_v128_load(tx + 12);
-
-        y0 = wasm_v128_load(ty + 0);
-        y1 = wasm_v128_load(ty + 4);
-        y2 = wasm_v128_load(ty + 8);
-        y3 = wasm_v128_load(ty + 12);
-
-        y0 = wasm_f32x4_add(y0, wasm_f32x4_mul(x0, v4));
-        y1 = wasm_f32x4_add(y1, wasm_f32x4_mul(x1, v4));
-        y2 = wasm_f32x4_add(y2, wasm_f32x4_mul(x2, v4));
-        y3 = wasm_f32x4_add(y3, wasm_f32x4_mul(x3, v4));
-
-        wasm_v128_store(ty + 0, y0);
-        wasm_v128_store(ty + 4, y1);
-        wasm_v128_store(ty + 8, y2);
-        wasm_v128_store(ty + 12, y3);
-
-        for (int k = 0; k < 16; ++k) {
-            y[i + k] = ggml_fp32_to_fp16(ty[k]);
-        }
-    }
-
-    // leftovers
-    for (int i = n16; i < n; ++i) {
-        GGML_ASSERT(false);
-        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
-    }
-#else
-    for (int i = 0; i < n; ++i) {
-        y[i] = ggml_fp32_to_fp16(ggml_fp16_to_fp32(y[i]) + ggml_fp16_to_fp32(x[i])*v);
-    }
-#endif
+    ggml_vec->mad_f16(n, y, x, v);
 }
 
 inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) { for (int i = 0; i < n; ++i) y[i] *= v;          }
@@ -962,6 +531,33 @@ inline static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
 inline static void ggml_vec_sum_f32     (const int n, float * s, const float * x) { ggml_float sum = 0.0; for (int i = 0; i < n; ++i) sum += x[i]; *s += sum; }
 inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x) { ggml_vec_norm_f32(n, s, x); *s = 1./(*s); }
 
+// z = x + y and z = x*y, where the nr elements of y are repeated along x (nr divides n)
+inline static void ggml_vec_add_rep_f32(const int n, float * z, const float * x, const float * y, const int nr) {
+    if (nr == n) {
+        ggml_vec_add_f32(n, z, x, y);
+    } else if (nr == 1) {
+        ggml_vec_cpy_f32(n, z, x);
+        ggml_vec_acc1_f32(n, z, y[0]);
+    } else {
+        for (int i = 0; i < n; i += nr) {
+            ggml_vec_add_f32(nr, z + i, x + i, y);
+        }
+    }
+}
+
+inline static void ggml_vec_mul_rep_f32(const int n, float * z, const float * x, const float * y, const int nr) {
+    if (nr == n) {
+        ggml_vec_mul_f32(n, z, x, y);
+    } else if (nr == 1) {
+        ggml_vec_cpy_f32(n, z, x);
+        ggml_vec_scale_f32(n, z, y[0]);
+    } else {
+        for (int i = 0; i < n; i += nr) {
+            ggml_vec_mul_f32(nr, z + i, x + i, y);
+        }
+    }
+}
+
 //
 // logging
 //
@@ -990,12 +586,28 @@ inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x
 // data types
 //
 
+static_assert(GGML_TYPE_COUNT == 7, "GGML_TYPE_COUNT != 7");
+
+// number of elements per block
+static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
+    1,
+    1,
+    1,
+    1,
+    1,
+    QK,
+    QK,
+};
+
+// size in bytes of a block
 const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     sizeof(int8_t ),
     sizeof(int16_t),
     sizeof(int32_t),
     sizeof(ggml_fp16_t),
     sizeof(float  ),
+    sizeof(block_q4_0),
+    sizeof(block_q8_0),
 };
 
 const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
@@ -1031,11 +643,17 @@ const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "DIAG_MASK_INF",
     "SOFT_MAX",
     "ROPE",
-    "CONV_1D_1S",
-    "CONV_1D_2S",
+    "CONV_1D",
 
     "FLASH_ATTN",
     "FLASH_FF",
+    "FLASH_ATTN_KV",
+
+    "OPT_ADAM",
+
+    "NORM_MUL_ADD",
+    "ADD_GELU",
+    "SCALE_MASK_SOFT_MAX",
 };
 
 const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
@@ -1071,11 +689,17 @@ const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "diag_mask_inf(x)",
     "soft_max(x)",
     "rope(x)",
-    "conv_1d_1s(x)",
-    "conv_1d_2s(x)",
+    "conv_1d(x)",
 
     "flash_attn(x)",
     "flash_ff(x)",
+    "flash_attn_kv(x)",
+
+    "adam(x)",
+
+    "norm(x)*y+z",
+    "gelu(x+y)",
+    "soft_max(mask(x*v))",
 };
 
 //
@@ -1104,15 +728,19 @@ struct ggml_context {
     size_t mem_size;
     void * mem_buffer;
     bool   mem_buffer_owned;
+    bool   no_alloc;
 
     int n_objects;
 
     struct ggml_object * objects_begin;
     struct ggml_object * objects_end;
+
+    int slot; // index in g_state.contexts, -1 if the context was allocated on the heap
 };
 
 struct ggml_context_container {
-    bool used;
+    // 0 when the slot is free - a slot is claimed by the call of ggml_init() that swaps it from 0 to 1
+    atomic_int used;
 
     struct ggml_context context;
 };
@@ -1143,11 +771,17 @@ struct ggml_compute_params {
 
 struct ggml_state {
     struct ggml_context_container contexts[GGML_MAX_CONTEXTS];
+
+    // the slot where the next ggml_init() starts to look, so concurrent calls probe different slots
+    atomic_int next_slot;
+
+    // the first ggml_init() computes the tables and selects the kernels, the others wait for it
+    atomic_int init_started;
+    atomic_int init_done;
 };
 
 // global state
 struct ggml_state g_state;
-atomic_int g_state_barrier = 0;
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -1184,17 +818,29 @@ int ggml_nrows(const struct ggml_tensor * tensor) {
 size_t ggml_nbytes(const struct ggml_tensor * tensor) {
     static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
 
-    return ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type];
+    return (ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type])/GGML_BLCK_SIZE[tensor->type];
+}
+
+int ggml_blck_size(enum ggml_type type) {
+    return GGML_BLCK_SIZE[type];
 }
 
 size_t ggml_type_size(enum ggml_type type) {
     return GGML_TYPE_SIZE[type];
 }
 
+float ggml_type_sizef(enum ggml_type type) {
+    return ((float)(GGML_TYPE_SIZE[type]))/GGML_BLCK_SIZE[type];
+}
+
 size_t ggml_element_size(const struct ggml_tensor * tensor) {
     return GGML_TYPE_SIZE[tensor->type];
 }
 
+bool ggml_is_quantized(enum ggml_type type) {
+    return GGML_BLCK_SIZE[type] > 1;
+}
+
 bool ggml_is_scalar(const struct ggml_tensor * tensor) {
     static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
 
@@ -1227,7 +873,7 @@ bool ggml_is_contiguous(const struct ggml_tensor * tensor) {
 
     return
         tensor->nb[0] == GGML_TYPE_SIZE[tensor->type] &&
-        tensor->nb[1] == tensor->nb[0]*tensor->ne[0] &&
+        tensor->nb[1] == (tensor->nb[0]*tensor->ne[0])/GGML_BLCK_SIZE[tensor->type] &&
         tensor->nb[2] == tensor->nb[1]*tensor->ne[1] &&
         tensor->nb[3] == tensor->nb[2]*tensor->ne[2];
 }
@@ -1276,53 +922,60 @@ int ggml_up64(int n) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-struct ggml_context * ggml_init(struct ggml_init_params params) {
-    // make this function thread safe
-    {
-        int processing = atomic_fetch_add(&g_state_barrier, 1);
-        while (processing > 0) {
-            // wait for other threads to finish
-            atomic_fetch_sub(&g_state_barrier, 1);
+static void ggml_init_once(void) {
+    if (atomic_load(&g_state.init_done)) {
+        return;
+    }
+
+    if (atomic_fetch_add(&g_state.init_started, 1) > 0) {
+        // another thread is computing the tables
+        while (!atomic_load(&g_state.init_done)) {
             sched_yield();
-            processing = atomic_fetch_add(&g_state_barrier, 1);
         }
+        return;
     }
 
-    static bool is_first_call = true;
-    if (is_first_call) {
-        const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
+    const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
 
-        ggml_fp16_t ii;
-        for (int i = 0; i < (1 << 16); ++i) {
-            uint16_t ui = i;
-            memcpy(&ii, &ui, sizeof(ii));
-            const float f = ggml_fp16_to_fp32(ii);
-            table_gelu_f16[i] = ggml_fp32_to_fp16(ggml_gelu_f32(f));
-            table_exp_f16[i] = ggml_fp32_to_fp16(exp(f));
-        }
+    ggml_fp16_t ii;
+    for (int i = 0; i < (1 << 16); ++i) {
+        uint16_t ui = i;
+        memcpy(&ii, &ui, sizeof(ii));
+        const float f = ggml_fp16_to_fp32(ii);
+        table_gelu_f16[i] = ggml_fp32_to_fp16(ggml_gelu_f32(f));
+        table_exp_f16[i] = ggml_fp32_to_fp16(exp(f));
+    }
 
-        const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
+    const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
 
-        GGML_PRINT_DEBUG("%s: GELU and EXP tables initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
+    GGML_PRINT_DEBUG("%s: GELU and EXP tables initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
 
-        is_first_call = false;
-    }
+    ggml_cpu = ggml_cpu_detect();
+    ggml_vec = ggml_vec_select(ggml_cpu);
+
+    GGML_PRINT_DEBUG("%s: using the %s kernels\n", __func__, ggml_vec->name);
+
+    atomic_store(&g_state.init_done, 1);
+}
+
+// ggml_init() and ggml_free() do not lock: a context takes a free slot of g_state.contexts with a compare-and-swap,
+// and when all GGML_MAX_CONTEXTS slots are in use, it is allocated on the heap
+struct ggml_context * ggml_init(struct ggml_init_params params) {
+    ggml_init_once();
 
-    // find non-used context in g_state
     struct ggml_context * ctx = NULL;
 
-    static bool first_time = true;
-    if (first_time) {
-        for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
-            g_state.contexts[i].used = false;
-        }
-        first_time = false;
-    }
+    const unsigned int i0 = atomic_fetch_add(&g_state.next_slot, 1);
+
+    int slot = -1;
 
-    for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
-        if (!g_state.contexts[i].used) {
-            g_state.contexts[i].used = true;
-            ctx = &g_state.contexts[i].context;
+    for (int k = 0; k < GGML_MAX_CONTEXTS; k++) {
+        const int i = (i0 + k) % GGML_MAX_CONTEXTS;
+
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&g_state.contexts[i].used, &expected, 1)) {
+            ctx  = &g_state.contexts[i].context;
+            slot = i;
 
             GGML_PRINT_DEBUG("%s: found unused context %d\n", __func__, i);
             break;
@@ -1330,67 +983,67 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
     }
 
     if (ctx == NULL) {
-        GGML_PRINT_DEBUG("%s: no unused context found\n", __func__);
-
-        atomic_fetch_sub(&g_state_barrier, 1);
+        GGML_PRINT_DEBUG("%s: no unused context found, allocating one\n", __func__);
 
-        return NULL;
+        ctx = malloc(sizeof(struct ggml_context));
+        if (ctx == NULL) {
+            return NULL;
+        }
     }
 
     *ctx = (struct ggml_context) {
         .mem_size         = params.mem_size,
         .mem_buffer       = params.mem_buffer ? params.mem_buffer : malloc(params.mem_size),
         .mem_buffer_owned = params.mem_buffer ? false : true,
+        .no_alloc         = params.no_alloc,
         .n_objects        = 0,
         .objects_begin    = NULL,
         .objects_end      = NULL,
+        .slot             = slot,
     };
 
     ggml_assert_aligned(ctx->mem_buffer);
 
     GGML_PRINT_DEBUG("%s: context initialized\n", __func__);
 
-    atomic_fetch_sub(&g_state_barrier, 1);
-
     return ctx;
 }
 
 void ggml_free(struct ggml_context * ctx) {
-    // make this function thread safe
-    {
-        int processing = atomic_fetch_add(&g_state_barrier, 1);
-        while (processing > 0) {
-            // wait for other threads to finish
-            atomic_fetch_sub(&g_state_barrier, 1);
-            sched_yield();
-            processing = atomic_fetch_add(&g_state_barrier, 1);
-        }
+    if (ctx == NULL) {
+        return;
     }
 
-    for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
-        if (&g_state.contexts[i].context == ctx) {
-            g_state.contexts[i].used = false;
-
-            GGML_PRINT_DEBUG("%s: context %d with %d objects has been freed. memory used = %zu\n",
-                    __func__, i, ctx->n_objects, ctx->objects_end->offset + ctx->objects_end->size);
-
-            if (ctx->mem_buffer_owned) {
-                free(ctx->mem_buffer);
-            }
-
-            atomic_fetch_sub(&g_state_barrier, 1);
+    GGML_PRINT_DEBUG("%s: context %d with %d objects has been freed. memory used = %zu\n",
+            __func__, ctx->slot, ctx->n_objects, ggml_used_mem(ctx));
 
-            return;
-        }
+    if (ctx->mem_buffer_owned) {
+        free(ctx->mem_buffer);
     }
 
-    GGML_PRINT_DEBUG("%s: context not found\n", __func__);
+    if (ctx->slot >= 0) {
+        atomic_store(&g_state.contexts[ctx->slot].used, 0);
+    } else {
+        free(ctx);
+    }
+}
 
-    atomic_fetch_sub(&g_state_barrier, 1);
+void ggml_reset(struct ggml_context * ctx) {
+    ctx->n_objects     = 0;
+    ctx->objects_begin = NULL;
+    ctx->objects_end   = NULL;
 }
 
 size_t ggml_used_mem(const struct ggml_context * ctx) {
-    return ctx->objects_end->offset + ctx->objects_end->size;
+    return ctx->objects_end ? ctx->objects_end->offset + ctx->objects_end->size : 0;
+}
+
+void ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc) {
+    ctx->no_alloc = no_alloc;
+}
+
+size_t ggml_tensor_overhead(void) {
+    return GGML_OBJECT_SIZE + sizeof(struct ggml_tensor);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1410,9 +1063,11 @@ struct ggml_tensor * ggml_new_tensor_impl(
 
     size_t size_needed = 0;
 
-    if (data == NULL) {
-        size_needed += GGML_TYPE_SIZE[type];
-        for (int i = 0; i < n_dims; i++) {
+    GGML_ASSERT(ne[0] % GGML_BLCK_SIZE[type] == 0);
+
+    if (data == NULL && !ctx->no_alloc) {
+        size_needed += GGML_TYPE_SIZE[type]*(ne[0]/GGML_BLCK_SIZE[type]);
+        for (int i = 1; i < n_dims; i++) {
             size_needed *= ne[i];
         }
         // align to GGML_MEM_ALIGN
@@ -1459,6 +1114,7 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.nb           =*/ { 0, 0, 0, 0 },
         /*.op           =*/ GGML_OP_NONE,
         /*.is_param     =*/ false,
+        /*.is_output    =*/ false,
         /*.grad         =*/ NULL,
         /*.src0         =*/ NULL,
         /*.src1         =*/ NULL,
@@ -1467,7 +1123,9 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
-        /*.data         =*/ data == NULL ? (void *)(result + 1) : data,
+        /*.data         =*/ (data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
+        /*.view_src     =*/ NULL,
+        /*.view_offs    =*/ 0,
         /*.pad          =*/ { 0 },
     };
 
@@ -1478,7 +1136,8 @@ struct ggml_tensor * ggml_new_tensor_impl(
     }
 
     result->nb[0] = GGML_TYPE_SIZE[type];
-    for (int i = 1; i < GGML_MAX_DIMS; i++) {
+    result->nb[1] = result->nb[0]*(result->ne[0]/GGML_BLCK_SIZE[type]);
+    for (int i = 2; i < GGML_MAX_DIMS; i++) {
         result->nb[i] = result->nb[i - 1]*result->ne[i - 1];
     }
 
@@ -1532,17 +1191,42 @@ struct ggml_tensor * ggml_new_tensor_4d(
     return ggml_new_tensor(ctx, type, 4, ne);
 }
 
+// the parameters of some ops are stored in a small I32 tensor that is filled when the op is created,
+// so it is allocated even in a no_alloc context
+static struct ggml_tensor * ggml_new_i32_params(struct ggml_context * ctx, int n) {
+    const bool no_alloc = ctx->no_alloc;
+    ctx->no_alloc = false;
+
+    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n);
+
+    ctx->no_alloc = no_alloc;
+
+    return result;
+}
+
 struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
+    // the value is set right away, so the scalar is allocated even in a no_alloc context
+    const bool no_alloc = ctx->no_alloc;
+    ctx->no_alloc = false;
+
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
 
+    ctx->no_alloc = no_alloc;
+
     ggml_set_i32(result, value);
 
     return result;
 }
 
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
+    // the value is set right away, so the scalar is allocated even in a no_alloc context
+    const bool no_alloc = ctx->no_alloc;
+    ctx->no_alloc = false;
+
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
 
+    ctx->no_alloc = no_alloc;
+
     ggml_set_f32(result, value);
 
     return result;
@@ -1600,6 +1284,8 @@ struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -1652,6 +1338,8 @@ struct ggml_tensor * ggml_set_f32(struct ggml_tensor * tensor, float value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -1688,6 +1376,8 @@ int32_t ggml_get_i32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1724,6 +1414,8 @@ void ggml_set_i32_1d(const struct ggml_tensor * tensor, int i, int32_t value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1758,6 +1450,8 @@ float ggml_get_f32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1794,6 +1488,8 @@ void ggml_set_f32_1d(const struct ggml_tensor * tensor, int i, float value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1810,10 +1506,26 @@ float * ggml_get_data_f32(const struct ggml_tensor * tensor) {
     return (float *)(tensor->data);
 }
 
+// the tensor shares the memory of src, starting at offs bytes
+// the data of src can still be NULL, in which case ggml_graph_alloc() assigns the data of both
+static void ggml_set_view_src(struct ggml_tensor * tensor, struct ggml_tensor * src, size_t offs) {
+    tensor->view_src  = src;
+    tensor->view_offs = offs;
+}
+
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
-        const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+        struct ggml_tensor  * src) {
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+
+    ggml_set_view_src(result, src, 0);
+
+    // the view has the layout of src, which can be strided (e.g. the destination of a ggml_cpy())
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        result->nb[i] = src->nb[i];
+    }
+
+    return result;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1859,11 +1571,13 @@ struct ggml_tensor * ggml_add_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    assert(ggml_are_same_shape(a, b));
+    // b is broadcast to the shape of a
+    assert(ggml_can_repeat(b, a));
 
     bool is_node = false;
 
     if (!inplace && (a->grad || b->grad)) {
+        GGML_ASSERT(ggml_are_same_shape(a, b)); // TODO: implement backward with broadcasting
         is_node = true;
     }
 
@@ -1937,11 +1651,13 @@ struct ggml_tensor * ggml_mul_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    assert(ggml_are_same_shape(a, b));
+    // b is broadcast to the shape of a
+    assert(ggml_can_repeat(b, a));
 
     bool is_node = false;
 
     if (!inplace && (a->grad || b->grad)) {
+        GGML_ASSERT(ggml_are_same_shape(a, b)); // TODO: implement backward with broadcasting
         is_node = true;
     }
 
@@ -2524,6 +2240,8 @@ struct ggml_tensor * ggml_reshape(
 
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
 
+    ggml_set_view_src(result, a, 0);
+
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
@@ -2550,6 +2268,8 @@ struct ggml_tensor * ggml_reshape_2d(
     const int ne[2] = { ne0, ne1 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
 
+    ggml_set_view_src(result, a, 0);
+
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
@@ -2577,6 +2297,8 @@ struct ggml_tensor * ggml_reshape_3d(
     const int ne[3] = { ne0, ne1, ne2 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
 
+    ggml_set_view_src(result, a, 0);
+
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
@@ -2596,7 +2318,9 @@ struct ggml_tensor * ggml_view_1d(
         assert(false); // gradient propagation is not supported
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, a->data ? (char *) a->data + offset : NULL);
+
+    ggml_set_view_src(result, a, offset);
 
     result->op   = GGML_OP_VIEW;
     result->grad = NULL;
@@ -2621,7 +2345,9 @@ struct ggml_tensor * ggml_view_2d(
 
     const int ne[GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data ? (char *) a->data + offset : NULL);
+
+    ggml_set_view_src(result, a, offset);
 
     result->nb[1] = nb1;
     result->nb[2] = result->nb[1]*ne1;
@@ -2635,6 +2361,39 @@ struct ggml_tensor * ggml_view_2d(
     return result;
 }
 
+// ggml_view_3d
+
+struct ggml_tensor * ggml_view_3d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        size_t                nb1,
+        size_t                nb2,
+        size_t                offset) {
+    if (a->grad) {
+        assert(false); // gradient propagation is not supported
+    }
+
+    const int ne[GGML_MAX_DIMS] = { ne0, ne1, ne2, 1 };
+
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data ? (char *) a->data + offset : NULL);
+
+    ggml_set_view_src(result, a, offset);
+
+    result->nb[1] = nb1;
+    result->nb[2] = nb2;
+    result->nb[3] = result->nb[2]*ne2;
+
+    result->op   = GGML_OP_VIEW;
+    result->grad = NULL;
+    result->src0 = a;
+    result->src1 = NULL;
+
+    return result;
+}
+
 // ggml_permute
 
 struct ggml_tensor * ggml_permute(
@@ -2768,7 +2527,7 @@ struct ggml_tensor * ggml_diag_mask_inf(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
-    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+    struct ggml_tensor * b = ggml_new_i32_params(ctx, 1);
     ((int32_t *) b->data)[0] = n_past;
 
     result->op   = GGML_OP_DIAG_MASK_INF;
@@ -2823,7 +2582,7 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
-    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+    struct ggml_tensor * b = ggml_new_i32_params(ctx, 3);
     ((int32_t *) b->data)[0] = n_past;
     ((int32_t *) b->data)[1] = n_dims;
     ((int32_t *) b->data)[2] = mode;
@@ -2836,58 +2595,58 @@ struct ggml_tensor * ggml_rope(
     return result;
 }
 
-// ggml_conv_1d_1s
+// ggml_conv_1d
 
-struct ggml_tensor * ggml_conv_1d_1s(
+struct ggml_tensor * ggml_conv_1d(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
-        struct ggml_tensor  * b) {
-    assert(ggml_is_matrix(b));
-    assert(a->ne[1] == b->ne[1]);
-    assert(a->ne[3] == 1);
+        struct ggml_tensor  * b,
+        int                   s0,
+        int                   p0) {
+    GGML_ASSERT(ggml_is_matrix(b));
+    GGML_ASSERT(a->ne[1] == b->ne[1]);
+    GGML_ASSERT(a->ne[3] == 1);
+    GGML_ASSERT(s0 > 0 && p0 >= 0);
+    GGML_ASSERT(b->ne[0] + 2*p0 >= a->ne[0]);
     bool is_node = false;
 
     if (a->grad || b->grad) {
-        assert(false); // TODO: implement backward
+        GGML_ASSERT(false); // TODO: implement backward
         is_node = true;
     }
 
-    const int ne[4] = { b->ne[0], a->ne[2], 1, 1, };
+    const int ne[4] = { (b->ne[0] + 2*p0 - a->ne[0])/s0 + 1, a->ne[2], 1, 1, };
     struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 2, ne);
 
-    result->op   = GGML_OP_CONV_1D_1S;
-    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
-    result->src0 = a;
-    result->src1 = b;
+    struct ggml_tensor * c = ggml_new_i32_params(ctx, 2);
+    ((int32_t *) c->data)[0] = s0;
+    ((int32_t *) c->data)[1] = p0;
+
+    result->op     = GGML_OP_CONV_1D;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = a;
+    result->src1   = b;
+    result->opt[0] = c;
 
     return result;
 }
 
-// ggml_conv_1d_2s
+// ggml_conv_1d_1s
 
-struct ggml_tensor * ggml_conv_1d_2s(
+struct ggml_tensor * ggml_conv_1d_1s(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b) {
-    assert(ggml_is_matrix(b));
-    assert(a->ne[1] == b->ne[1]);
-    assert(a->ne[3] == 1);
-    bool is_node = false;
-
-    if (a->grad || b->grad) {
-        assert(false); // TODO: implement backward
-        is_node = true;
-    }
-
-    const int ne[4] = { b->ne[0]/2, a->ne[2], 1, 1, };
-    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 2, ne);
+    return ggml_conv_1d(ctx, a, b, 1, a->ne[0]/2);
+}
 
-    result->op   = GGML_OP_CONV_1D_2S;
-    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
-    result->src0 = a;
-    result->src1 = b;
+// ggml_conv_1d_2s
 
-    return result;
+struct ggml_tensor * ggml_conv_1d_2s(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    return ggml_conv_1d(ctx, a, b, 2, a->ne[0]/2);
 }
 
 // ggml_flash_attn
@@ -2921,6 +2680,43 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_kv
+
+struct ggml_tensor * ggml_flash_attn_kv(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        int                   n_past,
+        float                 scale) {
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(v->type == GGML_TYPE_F32 || v->type == GGML_TYPE_F16);
+    GGML_ASSERT(k->ne[0] == q->ne[0] && k->ne[2] == q->ne[2] && k->ne[3] == q->ne[3]);
+    GGML_ASSERT(v->ne[0] == k->ne[1] && v->ne[1] == q->ne[0] && v->ne[2] == q->ne[2] && v->ne[3] == q->ne[3]);
+    GGML_ASSERT(mask == NULL || (mask->type == GGML_TYPE_F32 && mask->ne[0] == k->ne[1] && mask->ne[1] == q->ne[1]));
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, q->ne);
+
+    struct ggml_tensor * b = ggml_new_i32_params(ctx, 1);
+    ((int32_t *) b->data)[0] = n_past;
+
+    result->op     = GGML_OP_FLASH_ATTN_KV;
+    result->grad   = NULL;
+    result->src0   = q;
+    result->src1   = k;
+    result->opt[0] = v;
+    result->opt[1] = b;
+    result->opt[2] = mask;
+    result->opt[3] = ggml_new_f32(ctx, scale);
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -2954,6 +2750,38 @@ struct ggml_tensor * ggml_flash_ff(
     return result;
 }
 
+// ggml_opt_adam_step
+
+struct ggml_tensor * ggml_opt_adam_step(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * m,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * hp) {
+    GGML_ASSERT(a->grad != NULL && a->grad->type == GGML_TYPE_F32);
+    GGML_ASSERT(a->type == GGML_TYPE_F32 ? w == NULL : a->type == GGML_TYPE_F16 && w != NULL);
+    GGML_ASSERT(ggml_is_contiguous(a) && ggml_is_contiguous(a->grad));
+    GGML_ASSERT(ggml_nelements(a->grad) == ggml_nelements(a));
+    GGML_ASSERT(m->type == GGML_TYPE_F32 && ggml_is_contiguous(m) && ggml_nelements(m) == ggml_nelements(a));
+    GGML_ASSERT(v->type == GGML_TYPE_F32 && ggml_is_contiguous(v) && ggml_nelements(v) == ggml_nelements(a));
+    GGML_ASSERT(w == NULL || (w->type == GGML_TYPE_F32 && ggml_is_contiguous(w) && ggml_nelements(w) == ggml_nelements(a)));
+    GGML_ASSERT(hp->type == GGML_TYPE_F32 && ggml_nelements(hp) == 5);
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op     = GGML_OP_OPT_ADAM;
+    result->grad   = NULL;
+    result->src0   = a;
+    result->src1   = a->grad;
+    result->opt[0] = m;
+    result->opt[1] = v;
+    result->opt[2] = w;
+    result->opt[3] = hp;
+
+    return result;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_set_param(
@@ -2962,7 +2790,7 @@ void ggml_set_param(
     tensor->is_param = true;
 
     assert(tensor->grad == NULL);
-    tensor->grad = ggml_dup_tensor(ctx, tensor);
+    tensor->grad = ggml_new_tensor(ctx, GGML_TYPE_F32, tensor->n_dims, tensor->ne);
 }
 
 // ggml_compute_forward_dup
@@ -2990,7 +2818,7 @@ void ggml_compute_forward_dup_f16(
     //const size_t nb03 = src0->nb[3];
 
     if (ggml_is_contiguous(src0) && src0->type == dst->type) {
-        memcpy(dst->data, src0->data, ggml_nelements(dst) * GGML_TYPE_SIZE[src0->type]);
+        memcpy(dst->data, src0->data, ggml_nbytes(dst));
         return;
     }
 
@@ -3002,7 +2830,6 @@ void ggml_compute_forward_dup_f32(
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
     GGML_ASSERT(params->ith == 0);
-    GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -3019,8 +2846,58 @@ void ggml_compute_forward_dup_f32(
     const size_t nb02 = src0->nb[2];
     const size_t nb03 = src0->nb[3];
 
-    if (ggml_is_contiguous(src0) && src0->type == dst->type) {
-        memcpy(dst->data, src0->data, ggml_nelements(dst) * GGML_TYPE_SIZE[src0->type]);
+    if (ggml_is_contiguous(src0) && ggml_is_contiguous(dst) && src0->type == dst->type) {
+        memcpy(dst->data, src0->data, ggml_nbytes(dst));
+        return;
+    }
+
+    // the rows of src0 go to the same rows of dst, which can be strided (e.g. a view of a cache) or quantized
+    if (!ggml_is_contiguous(dst) || ggml_is_quantized(dst->type)) {
+        GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
+        const size_t nb0 = dst->nb[0];
+        const size_t nb1 = dst->nb[1];
+        const size_t nb2 = dst->nb[2];
+        const size_t nb3 = dst->nb[3];
+
+        for (int i03 = 0; i03 < ne03; i03++) {
+            for (int i02 = 0; i02 < ne02; i02++) {
+                for (int i01 = 0; i01 < ne01; i01++) {
+                    const char * src0_row = (char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
+                          char * dst_row  = (char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3;
+
+                    switch (dst->type) {
+                        case GGML_TYPE_Q4_0:
+                        case GGML_TYPE_Q8_0:
+                            {
+                                // the blocks of a row are contiguous
+                                GGML_ASSERT(nb00 == sizeof(float));
+                                GGML_ASSERT(nb0  == GGML_TYPE_SIZE[dst->type]);
+                                GGML_ASSERT(ne00 % GGML_BLCK_SIZE[dst->type] == 0);
+
+                                ggml_vec->quantize_fns[dst->type].quantize_row((const float *) src0_row, dst_row, ne00);
+                            } break;
+                        case GGML_TYPE_F16:
+                            {
+                                for (int i00 = 0; i00 < ne00; i00++) {
+                                    *(ggml_fp16_t *) (dst_row + i00*nb0) = ggml_fp32_to_fp16(*(const float *) (src0_row + i00*nb00));
+                                }
+                            } break;
+                        case GGML_TYPE_F32:
+                            {
+                                for (int i00 = 0; i00 < ne00; i00++) {
+                                    *(float *) (dst_row + i00*nb0) = *(const float *) (src0_row + i00*nb00);
+                                }
+                            } break;
+                        default:
+                            {
+                                GGML_ASSERT(false); // TODO: implement
+                            } break;
+                    }
+                }
+            }
+        }
+
         return;
     }
 
@@ -3117,6 +2994,8 @@ void ggml_compute_forward_dup(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -3131,7 +3010,7 @@ void ggml_compute_forward_add_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -3140,40 +3019,62 @@ void ggml_compute_forward_add_f32(
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int n  = ggml_nrows(src0);
-    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
 
     const size_t nb00 = src0->nb[0];
     const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
 
     const size_t nb10 = src1->nb[0];
     const size_t nb11 = src1->nb[1];
+    const size_t nb12 = src1->nb[2];
+    const size_t nb13 = src1->nb[3];
 
     const size_t nb0 = dst->nb[0];
     const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
 
     GGML_ASSERT( nb0 == sizeof(float));
     GGML_ASSERT(nb00 == sizeof(float));
 
-    if (nb10 == sizeof(float)) {
-        const int j0 = (n/nth)*ith;
-        const int j1 = ith == nth - 1 ? n : (n/nth)*(ith + 1);
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-        for (int j = j0; j < j1; j++) {
-            ggml_vec_add_f32(nc,
-                    (float *) ((char *) dst->data  + j*nb1),
-                    (float *) ((char *) src0->data + j*nb01),
-                    (float *) ((char *) src1->data + j*nb11));
-        }
-    } else {
-        // src1 is not contiguous
-        for (int j = ith; j < n; j += nth) {
-            float * dst_ptr  = (float *) ((char *) dst->data  + j*nb1);
-            float * src0_ptr = (float *) ((char *) src0->data + j*nb01);
-            for (int i = 0; i < nc; i++) {
-                float * src1_ptr = (float *) ((char *) src1->data + j*nb11 + i*nb10);
-
-                dst_ptr[i] = src0_ptr[i] + *src1_ptr;
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        // src1 is broadcast along the dimensions where it is smaller
+        const int i13 = i03 % ne13;
+        const int i12 = i02 % ne12;
+        const int i11 = i01 % ne11;
+
+        float * dst_ptr  = (float *) ((char *) dst->data  + i03*nb3  + i02*nb2  + i01*nb1);
+        float * src0_ptr = (float *) ((char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01);
+        float * src1_ptr = (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11);
+
+        if (nb10 == sizeof(float)) {
+            ggml_vec_add_rep_f32(ne00, dst_ptr, src0_ptr, src1_ptr, ne10);
+        } else {
+            // src1 is not contiguous
+            for (int i0 = 0; i0 < ne00; i0++) {
+                dst_ptr[i0] = src0_ptr[i0] + *(float *) ((char *) src1_ptr + (i0 % ne10)*nb10);
             }
         }
     }
@@ -3193,6 +3094,8 @@ void ggml_compute_forward_add(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3243,6 +3146,8 @@ void ggml_compute_forward_sub(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3257,25 +3162,73 @@ void ggml_compute_forward_mul_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-    assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
-    const int nc = src0->ne[0];
+    const int ith = params->ith;
+    const int nth = params->nth;
 
-    assert( dst->nb[0] == sizeof(float));
-    assert(src0->nb[0] == sizeof(float));
-    assert(src1->nb[0] == sizeof(float));
+    const int nr = ggml_nrows(src0);
 
-    for (int i = 0; i < n; i++) {
-        ggml_vec_mul_f32(nc,
-                (float *) ((char *) dst->data  + i*( dst->nb[1])),
-                (float *) ((char *) src0->data + i*(src0->nb[1])),
-                (float *) ((char *) src1->data + i*(src1->nb[1])));
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
+    const size_t nb00 = src0->nb[0];
+    const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
+
+    const size_t nb10 = src1->nb[0];
+    const size_t nb11 = src1->nb[1];
+    const size_t nb12 = src1->nb[2];
+    const size_t nb13 = src1->nb[3];
+
+    const size_t nb0 = dst->nb[0];
+    const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
+
+    GGML_ASSERT( nb0 == sizeof(float));
+    GGML_ASSERT(nb00 == sizeof(float));
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        // src1 is broadcast along the dimensions where it is smaller
+        const int i13 = i03 % ne13;
+        const int i12 = i02 % ne12;
+        const int i11 = i01 % ne11;
+
+        float * dst_ptr  = (float *) ((char *) dst->data  + i03*nb3  + i02*nb2  + i01*nb1);
+        float * src0_ptr = (float *) ((char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01);
+        float * src1_ptr = (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11);
+
+        if (nb10 == sizeof(float)) {
+            ggml_vec_mul_rep_f32(ne00, dst_ptr, src0_ptr, src1_ptr, ne10);
+        } else {
+            // src1 is not contiguous
+            for (int i0 = 0; i0 < ne00; i0++) {
+                dst_ptr[i0] = src0_ptr[i0]*(*(float *) ((char *) src1_ptr + (i0 % ne10)*nb10));
+            }
+        }
     }
 }
 
@@ -3293,6 +3246,8 @@ void ggml_compute_forward_mul(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3343,6 +3298,8 @@ void ggml_compute_forward_div(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3389,6 +3346,8 @@ void ggml_compute_forward_sqr(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3435,6 +3394,8 @@ void ggml_compute_forward_sqrt(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3493,6 +3454,8 @@ void ggml_compute_forward_sum(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3570,6 +3533,8 @@ void ggml_compute_forward_mean(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3632,6 +3597,8 @@ void ggml_compute_forward_repeat(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3678,6 +3645,8 @@ void ggml_compute_forward_abs(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3724,6 +3693,8 @@ void ggml_compute_forward_sgn(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3770,6 +3741,8 @@ void ggml_compute_forward_neg(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3816,6 +3789,8 @@ void ggml_compute_forward_step(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3862,6 +3837,8 @@ void ggml_compute_forward_relu(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3925,6 +3902,8 @@ void ggml_compute_forward_gelu(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4007,6 +3986,8 @@ void ggml_compute_forward_norm(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4038,6 +4019,36 @@ bool ggml_compute_forward_mul_mat_use_blas(
     return false;
 }
 
+// floats per row of the f32 band of src0 rows in the gemm work data
+static size_t ggml_gemm_band_row_size(int ne00) {
+    return ((ne00 + CACHE_LINE_SIZE_F32 - 1)/CACHE_LINE_SIZE_F32)*CACHE_LINE_SIZE_F32;
+}
+
+// floats of gemm work data per thread: the band, a copy of the src1 columns of a tile
+// and room to align them to the cache line
+static size_t ggml_gemm_band_size(int ne00) {
+    return (GGML_GEMM_MC + GGML_GEMM_NR)*ggml_gemm_band_row_size(ne00) + CACHE_LINE_SIZE_F32;
+}
+
+static void * ggml_align_cache_line(void * p) {
+    return (void *) (((uintptr_t) p + CACHE_LINE_SIZE - 1) & ~((uintptr_t) CACHE_LINE_SIZE - 1));
+}
+
+// the blocked gemm needs f16 src0 with contiguous rows or columns (a transposed matrix) and enough contiguous
+// src1 columns
+static bool ggml_compute_forward_mul_mat_use_gemm(
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    UNUSED(dst);
+
+    return src0->type == GGML_TYPE_F16 && src1->type == GGML_TYPE_F32 &&
+           ((src0->nb[0] == sizeof(ggml_fp16_t) && src0->nb[1] >= src0->nb[0]) ||
+            (src0->nb[1] == sizeof(ggml_fp16_t) && src0->nb[0] >  src0->nb[1])) &&
+           src1->nb[0] == sizeof(float) && src1->nb[1] % sizeof(float) == 0 &&
+           src1->ne[1] >= GGML_GEMM_MIN_COLS;
+}
+
 void ggml_compute_forward_mul_mat_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -4347,7 +4358,7 @@ void ggml_compute_forward_mul_mat_f16_f32(
     //   compute by src0 rows
     //
     // nb00 <  nb01 - src0 is transposed
-    //   compute by src0 columns
+    //   compute by src0 columns, or by bands of src0 rows with the blocked gemm
 
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
     if (ggml_compute_forward_mul_mat_use_blas(src0, src1, dst)) {
@@ -4416,42 +4427,145 @@ void ggml_compute_forward_mul_mat_f16_f32(
     }
 #endif
 
-    if (params->type == GGML_TASK_INIT) {
-        if (nb01 >= nb00) {
-            ggml_fp16_t * const wdata = params->wdata;
-
-            int id = 0;
-            for (int i13 = 0; i13 < ne13; ++i13) {
-                for (int i12 = 0; i12 < ne12; ++i12) {
-                    for (int i11 = 0; i11 < ne11; ++i11) {
-                        for (int i10 = 0; i10 < ne10; ++i10) {
-                            wdata[id++] = ggml_fp32_to_fp16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
-                        }
-                    }
-                }
-            }
-
-            GGML_ASSERT(id*sizeof(ggml_fp16_t) <= params->wsize);
-
+    if (ggml_compute_forward_mul_mat_use_gemm(src0, src1, dst)) {
+        if (params->type == GGML_TASK_INIT) {
             return;
         }
 
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
-        return;
-    }
-
-    if (params->type == GGML_TASK_FINALIZE) {
-        if (nb01 >= nb00) {
+        if (params->type == GGML_TASK_FINALIZE) {
             return;
         }
 
-        // TODO: fix this memset (wsize is overestimated)
-        //assert(params->wsize == (ggml_nbytes(dst) + CACHE_LINE_SIZE)*nth);
+        // parallelize by src0 rows, in bands of up to GGML_GEMM_MC rows of the same src0 matrix
 
-        ggml_fp16_t * const wdata = params->wdata;
+        // total rows in src0
+        const int nr = ne01*ne02*ne03;
 
-        // cols per thread
+        // rows per thread
+        const int dr = (nr + nth - 1)/nth;
+
+        // row range for this thread
+        const int ir0 = dr*ith;
+        const int ir1 = MIN(ir0 + dr, nr);
+
+        // f32 copy of the current band and of the src1 columns of a tile, in the work data of the thread
+        // the rows start at cache line boundaries, so that the wide vector loads do not cross them
+        const int ldx = ggml_gemm_band_row_size(ne00);
+
+        float * const wdata = (float *) ggml_align_cache_line((float *) params->wdata + ggml_gemm_band_size(ne00)*ith);
+        float * const ydata = wdata + GGML_GEMM_MC*ldx;
+
+        const int ldy = nb11/sizeof(float);
+        const int lds = nb1/sizeof(float);
+
+        for (int ir = ir0; ir < ir1; ) {
+            // src0 indices
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+            // rows in the band
+            const int nrb = MIN(MIN(GGML_GEMM_MC, ir1 - ir), ne01 - i01);
+
+            if (nb00 == sizeof(ggml_fp16_t)) {
+                for (int i = 0; i < nrb; ++i) {
+                    ggml_vec->gemm_pack_row_f16(ne00, wdata + i*ldx,
+                            (ggml_fp16_t *) ((char *) src0->data + ((i01 + i)*nb01 + i02*nb02 + i03*nb03)));
+                }
+            } else {
+                // transposed src0: the band is nrb consecutive elements of each of the ne00 rows in memory
+                // it is transposed in blocks of 16 x 16, so that the few cache lines of a block stay in L1 although
+                // the rows of the band map to the same sets
+                float tmp[16];
+
+                for (int k0 = 0; k0 < ne00; k0 += 16) {
+                    const int k1 = MIN(k0 + 16, ne00);
+
+                    for (int i0 = 0; i0 < nrb; i0 += 16) {
+                        const int i1 = MIN(i0 + 16, nrb);
+
+                        for (int k = k0; k < k1; ++k) {
+                            ggml_vec->gemm_pack_row_f16(i1 - i0, tmp,
+                                    (ggml_fp16_t *) ((char *) src0->data + (k*nb00 + (i01 + i0)*nb01 + i02*nb02 + i03*nb03)));
+
+                            for (int i = i0; i < i1; ++i) {
+                                wdata[i*ldx + k] = tmp[i - i0];
+                            }
+                        }
+                    }
+                }
+            }
+
+            const float * y = (float *) ((char *) src1->data + i02*nb12 + i03*nb13);
+                  float * d = (float *) ((char *) dst->data  + i01*nb0 + i02*nb2 + i03*nb3);
+
+            for (int j = 0; j < ne11; j += GGML_GEMM_NR) {
+                const int nj = MIN(GGML_GEMM_NR, ne11 - j);
+
+                // aligned copy of the src1 columns of the tile
+                for (int jj = 0; jj < nj; ++jj) {
+                    memcpy(ydata + jj*ldx, y + (j + jj)*ldy, ne00*sizeof(float));
+                }
+
+                for (int i = 0; i < nrb; i += GGML_GEMM_MR) {
+                    const int ni = MIN(GGML_GEMM_MR, nrb - i);
+
+                    if (ni == GGML_GEMM_MR && nj == GGML_GEMM_NR) {
+                        ggml_vec->gemm_tile_f32(ne00, d + j*lds + i, lds, wdata + i*ldx, ldx, ydata, ldx);
+                        continue;
+                    }
+
+                    // partial tile at the edge of the band or of src1
+                    for (int jj = 0; jj < nj; ++jj) {
+                        for (int ii = i; ii < i + ni; ++ii) {
+                            ggml_vec_dot_f32(ne00, d + (j + jj)*lds + ii, wdata + ii*ldx, ydata + jj*ldx);
+                        }
+                    }
+                }
+            }
+
+            ir += nrb;
+        }
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_INIT) {
+        if (nb01 >= nb00) {
+            ggml_fp16_t * const wdata = params->wdata;
+
+            int id = 0;
+            for (int i13 = 0; i13 < ne13; ++i13) {
+                for (int i12 = 0; i12 < ne12; ++i12) {
+                    for (int i11 = 0; i11 < ne11; ++i11) {
+                        for (int i10 = 0; i10 < ne10; ++i10) {
+                            wdata[id++] = ggml_fp32_to_fp16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
+                        }
+                    }
+                }
+            }
+
+            GGML_ASSERT(id*sizeof(ggml_fp16_t) <= params->wsize);
+
+            return;
+        }
+
+        // TODO: fix this memset (wsize is overestimated)
+        memset(params->wdata, 0, params->wsize);
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        if (nb01 >= nb00) {
+            return;
+        }
+
+        // TODO: fix this memset (wsize is overestimated)
+        //assert(params->wsize == (ggml_nbytes(dst) + CACHE_LINE_SIZE)*nth);
+
+        ggml_fp16_t * const wdata = params->wdata;
+
+        // cols per thread
         const int dc = (ne + nth - 1)/nth;
 
         // col range for this thread
@@ -4577,6 +4691,139 @@ void ggml_compute_forward_mul_mat_f16_f32(
     //}
 }
 
+void ggml_compute_forward_mul_mat_q_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
+    const int ne0  = dst->ne[0];
+    const int ne1  = dst->ne[1];
+    const int ne2  = dst->ne[2];
+    const int ne3  = dst->ne[3];
+
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+    const int nb03 = src0->nb[3];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+    const int nb12 = src1->nb[2];
+    const int nb13 = src1->nb[3];
+
+    const int nb0  = dst->nb[0];
+    const int nb1  = dst->nb[1];
+    const int nb2  = dst->nb[2];
+    const int nb3  = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_ASSERT(ne02 == ne12);
+    GGML_ASSERT(ne03 == ne13);
+    GGML_ASSERT(ne2  == ne12);
+    GGML_ASSERT(ne3  == ne13);
+
+    const enum ggml_type type = src0->type;
+
+    const quantize_row_t quantize_row_vec_dot = ggml_vec->quantize_fns[ggml_vec->quantize_fns[type].vec_dot_type].quantize_row;
+    const vec_dot_q_t    vec_dot_q            = ggml_vec->quantize_fns[type].vec_dot;
+
+    // we don't support transposed or permuted src0
+    GGML_ASSERT(nb00 == (int) GGML_TYPE_SIZE[type]);
+    GGML_ASSERT(nb01 >= nb00);
+    GGML_ASSERT(ne00 % GGML_BLCK_SIZE[type] == 0);
+
+    // TODO: do not support transposed src1
+    GGML_ASSERT(nb10 == sizeof(float));
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    GGML_ASSERT(ne0 == ne01);
+    GGML_ASSERT(ne1 == ne11);
+    GGML_ASSERT(ne2 == ne02);
+    GGML_ASSERT(ne3 == ne03);
+
+    // size of a quantized src1 row
+    const enum ggml_type vec_dot_type = ggml_vec->quantize_fns[type].vec_dot_type;
+    const size_t row_size = ne10*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
+
+    if (params->type == GGML_TASK_INIT) {
+        char * wdata = params->wdata;
+
+        for (int i13 = 0; i13 < ne13; ++i13) {
+            for (int i12 = 0; i12 < ne12; ++i12) {
+                for (int i11 = 0; i11 < ne11; ++i11) {
+                    quantize_row_vec_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
+                    wdata += row_size;
+                }
+            }
+        }
+
+        GGML_ASSERT((size_t)(wdata - (char *) params->wdata) <= params->wsize);
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // parallelize by src0 rows using the quantized dot product
+
+    // total rows in src0
+    const int nr = ne01*ne02*ne03;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const char * wdata = params->wdata;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // src0 indices
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const int i13 = i03;
+        const int i12 = i02;
+
+        const int i0 = i01;
+        const int i2 = i02;
+        const int i3 = i03;
+
+        const void * src0_row = (const void *) ((const char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+        const char * src1_col = wdata + (i13*ne12*ne11 + i12*ne11)*row_size;
+
+        float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+
+        for (int ic = 0; ic < ne11; ++ic) {
+            vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (const void *) (src1_col + ic*row_size));
+        }
+    }
+}
+
 void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -4591,6 +4838,11 @@ void ggml_compute_forward_mul_mat(
             {
                 ggml_compute_forward_mul_mat_f32(params, src0, src1, dst);
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_mul_mat_q_f32(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -4652,6 +4904,8 @@ void ggml_compute_forward_scale(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4712,6 +4966,35 @@ void ggml_compute_forward_transpose(
 
 // ggml_compute_forward_get_rows
 
+void ggml_compute_forward_get_rows_q(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    assert(params->ith == 0);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nelements(src1);
+
+    const dequantize_row_t dequantize_row = ggml_vec->quantize_fns[src0->type].dequantize_row;
+
+    assert( dst->ne[0] == nc);
+    assert( dst->ne[1] == nr);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[src0->type]);
+
+    for (int i = 0; i < nr; ++i) {
+        const int r = ((int32_t *) src1->data)[i];
+
+        dequantize_row(
+                (const void *) ((char *) src0->data + r*src0->nb[1]),
+                     (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
+    }
+}
+
 void ggml_compute_forward_get_rows_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -4781,6 +5064,11 @@ void ggml_compute_forward_get_rows(
             {
                 ggml_compute_forward_get_rows_f32(params, src0, src1, dst);
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_get_rows_q(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -4843,6 +5131,8 @@ void ggml_compute_forward_diag_mask_inf(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4852,6 +5142,48 @@ void ggml_compute_forward_diag_mask_inf(
 
 // ggml_compute_forward_soft_max
 
+// normalize the row p with the soft max, the -INFINITY elements become 0
+static void ggml_soft_max_row_f32(const int nc, float * p) {
+#ifndef NDEBUG
+    for (int i = 0; i < nc; ++i) {
+        assert(!isnan(p[i]));
+    }
+#endif
+
+    float max = -INFINITY;
+    for (int i = 0; i < nc; i++) {
+        max = MAX(max, p[i]);
+    }
+
+    ggml_float sum = 0.0;
+
+    uint16_t ss;
+    for (int i = 0; i < nc; i++) {
+        if (p[i] == -INFINITY) {
+            p[i] = 0.0;
+        } else {
+            //const float val = (p[i] == -INFINITY) ? 0.0 : exp(p[i] - max);
+            ggml_fp16_t s = ggml_fp32_to_fp16(p[i] - max);
+            memcpy(&ss, &s, sizeof(ss));
+            const float val = ggml_fp16_to_fp32(table_exp_f16[ss]);
+            sum += val;
+            p[i] = val;
+        }
+    }
+
+    assert(sum > 0.0f);
+
+    sum = 1.0/sum;
+    ggml_vec_scale_f32(nc, p, sum);
+
+#ifndef NDEBUG
+    for (int i = 0; i < nc; ++i) {
+        assert(!isnan(p[i]));
+        assert(!isinf(p[i]));
+    }
+#endif
+}
+
 void ggml_compute_forward_soft_max_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -4880,46 +5212,7 @@ void ggml_compute_forward_soft_max_f32(
     const int ir1 = MIN(ir0 + dr, nr);
 
     for (int i1 = ir0; i1 < ir1; i1++) {
-        float *p = (float *)((char *) dst->data + i1*dst->nb[1]);
-
-#ifndef NDEBUG
-        for (int i = 0; i < nc; ++i) {
-            assert(!isnan(p[i]));
-        }
-#endif
-
-        float max = -INFINITY;
-        for (int i = 0; i < nc; i++) {
-            max = MAX(max, p[i]);
-        }
-
-        ggml_float sum = 0.0;
-
-        uint16_t ss;
-        for (int i = 0; i < nc; i++) {
-            if (p[i] == -INFINITY) {
-                p[i] = 0.0;
-            } else {
-                //const float val = (p[i] == -INFINITY) ? 0.0 : exp(p[i] - max);
-                ggml_fp16_t s = ggml_fp32_to_fp16(p[i] - max);
-                memcpy(&ss, &s, sizeof(ss));
-                const float val = ggml_fp16_to_fp32(table_exp_f16[ss]);
-                sum += val;
-                p[i] = val;
-            }
-        }
-
-        assert(sum > 0.0f);
-
-        sum = 1.0/sum;
-        ggml_vec_scale_f32(nc, p, sum);
-
-#ifndef NDEBUG
-        for (int i = 0; i < nc; ++i) {
-            assert(!isnan(p[i]));
-            assert(!isinf(p[i]));
-        }
-#endif
+        ggml_soft_max_row_f32(nc, (float *)((char *) dst->data + i1*dst->nb[1]));
     }
 }
 
@@ -4936,6 +5229,8 @@ void ggml_compute_forward_soft_max(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5016,6 +5311,8 @@ void ggml_compute_forward_rope(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5023,91 +5320,94 @@ void ggml_compute_forward_rope(
     }
 }
 
-// ggml_compute_forward_conv_1d_1s
+// ggml_compute_forward_conv_1d
+
+// the convolution is computed as a gemm of the kernels with the im2col matrix of the input:
+// row i of the im2col matrix holds the K x C_in input values under the kernel at output position i,
+// so dst[o, i] = dot(kernel o, im2col row i) and the tiles of dst are computed with gemm_tile_f32
+
+// floats per row of the im2col matrix and of the f32 kernel rows - aligned to the cache line
+static size_t ggml_conv_1d_row_size(const struct ggml_tensor * src0) {
+    return ggml_gemm_band_row_size(src0->ne[0]*src0->ne[1]);
+}
+
+// floats of work data: the im2col matrix and, per thread, the f32 kernel rows of a tile
+static size_t ggml_conv_1d_work_size(const struct ggml_tensor * src0, const struct ggml_tensor * dst, int n_tasks) {
+    const size_t ldx = ggml_conv_1d_row_size(src0);
+
+    return (dst->ne[0] + n_tasks*GGML_GEMM_NR)*ldx + (n_tasks + 1)*CACHE_LINE_SIZE_F32;
+}
 
-void ggml_compute_forward_conv_1d_1s_f16_f32(
+static void ggml_compute_forward_conv_1d(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
               struct ggml_tensor * dst) {
-    GGML_ASSERT(src0->type == GGML_TYPE_F16);
+    GGML_ASSERT(src0->type == GGML_TYPE_F16 || src0->type == GGML_TYPE_F32);
     GGML_ASSERT(src1->type == GGML_TYPE_F32);
     GGML_ASSERT( dst->type == GGML_TYPE_F32);
 
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
 
+    const int s0 = ((const int32_t *) opt0->data)[0];
+    const int p0 = ((const int32_t *) opt0->data)[1];
+
     const int ne00 = src0->ne[0];
     const int ne01 = src0->ne[1];
     const int ne02 = src0->ne[2];
-    //const int ne03 = src0->ne[3];
 
     const int ne10 = src1->ne[0];
-    const int ne11 = src1->ne[1];
-    //const int ne12 = src1->ne[2];
-    //const int ne13 = src1->ne[3];
 
-    //const int ne0  = dst->ne[0];
-    //const int ne1  = dst->ne[1];
-    //const int ne2  = dst->ne[2];
-    //const int ne3  = dst->ne[3];
-    //const int ne   = ne0*ne1*ne2*ne3;
+    const int ne0  = dst->ne[0];
 
     const int nb00 = src0->nb[0];
     const int nb01 = src0->nb[1];
     const int nb02 = src0->nb[2];
-    //const int nb03 = src0->nb[3];
 
     const int nb10 = src1->nb[0];
     const int nb11 = src1->nb[1];
-    //const int nb12 = src1->nb[2];
-    //const int nb13 = src1->nb[3];
 
-    //const int nb0  = dst->nb[0];
     const int nb1  = dst->nb[1];
-    //const int nb2  = dst->nb[2];
-    //const int nb3  = dst->nb[3];
 
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int nk = ne00;
-    const int nh = nk/2;
+    // the kernels are contiguous rows of K x C_in values
+    GGML_ASSERT(nb00 == (int) GGML_TYPE_SIZE[src0->type]);
+    GGML_ASSERT(nb01 == ne00*nb00);
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
 
-    const int ew0 = ggml_up32(ne01);
+    const int nk  = ne00*ne01;
+    const int ldx = ggml_conv_1d_row_size(src0);
 
-    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
-    GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nb10 == sizeof(float));
+    float * const xdata = (float *) ggml_align_cache_line(params->wdata);
 
     if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
+        return;
+    }
 
-        // prepare kernel data (src0)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + 0;
+    if (params->type == GGML_TASK_COMPUTE) {
+        // im2col, parallelized by output positions
+        const int dr = (ne0 + nth - 1)/nth;
 
-            for (int i02 = 0; i02 < ne02; i02++) {
-                for (int i01 = 0; i01 < ne01; i01++) {
-                    const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    ggml_fp16_t * dst_data = wdata + i02*ew0*ne00;
-                    for (int i00 = 0; i00 < ne00; i00++) {
-                        dst_data[i00*ew0 + i01] = src[i00];
-                    }
-                }
-            }
-        }
+        const int ir0 = dr*ith;
+        const int ir1 = MIN(ir0 + dr, ne0);
 
-        // prepare source data (src1)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
+        for (int i0 = ir0; i0 < ir1; ++i0) {
+            float * x = xdata + (size_t) i0*ldx;
+
+            // the first input position under the kernel - the padding is zero
+            const int j0 = i0*s0 - p0;
 
-            for (int i11 = 0; i11 < ne11; i11++) {
-                const float * const src = (float *)((char *) src1->data + i11*nb11);
-                ggml_fp16_t * dst_data = wdata;
-                for (int i10 = 0; i10 < ne10; i10++) {
-                    dst_data[(i10 + nh)*ew0 + i11] = ggml_fp32_to_fp16(src[i10]);
+            for (int i01 = 0; i01 < ne01; ++i01) {
+                const float * src = (float *) ((char *) src1->data + i01*nb11);
+
+                for (int i00 = 0; i00 < ne00; ++i00) {
+                    const int j = j0 + i00;
+                    x[i01*ne00 + i00] = (j >= 0 && j < ne10) ? src[j] : 0.0f;
                 }
             }
         }
@@ -5115,269 +5415,143 @@ void ggml_compute_forward_conv_1d_1s_f16_f32(
         return;
     }
 
-    if (params->type == GGML_TASK_FINALIZE) {
-        return;
-    }
-
-    // total rows in dst
-    const int nr = ne02;
+    // gemm in the FINALIZE phase, after all the im2col rows are ready
+    // parallelize by output positions, in bands of up to GGML_GEMM_MC rows of the im2col matrix
 
     // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    const int dr = (ne0 + nth - 1)/nth;
 
     // row range for this thread
     const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int i0 = 0; i0 < ne10; ++i0) {
-            dst_data[i0] = 0;
-            for (int k = -nh; k <= nh; k++) {
-                float v = 0.0f;
-                ggml_vec_dot_f16(ew0, &v,
-                        (ggml_fp16_t *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (ggml_fp16_t *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
-
-                dst_data[i0] += v;
-            }
-        }
-    }
-}
-
-void ggml_compute_forward_conv_1d_1s_f32(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
-    GGML_ASSERT(src0->type == GGML_TYPE_F32);
-    GGML_ASSERT(src1->type == GGML_TYPE_F32);
-    GGML_ASSERT( dst->type == GGML_TYPE_F32);
-
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
-
-    const int ne00 = src0->ne[0];
-    const int ne01 = src0->ne[1];
-    const int ne02 = src0->ne[2];
-    //const int ne03 = src0->ne[3];
-
-    const int ne10 = src1->ne[0];
-    const int ne11 = src1->ne[1];
-    //const int ne12 = src1->ne[2];
-    //const int ne13 = src1->ne[3];
-
-    //const int ne0  = dst->ne[0];
-    //const int ne1  = dst->ne[1];
-    //const int ne2  = dst->ne[2];
-    //const int ne3  = dst->ne[3];
-    //const int ne   = ne0*ne1*ne2*ne3;
+    const int ir1 = MIN(ir0 + dr, ne0);
 
-    const int nb00 = src0->nb[0];
-    const int nb01 = src0->nb[1];
-    const int nb02 = src0->nb[2];
-    //const int nb03 = src0->nb[3];
-
-    const int nb10 = src1->nb[0];
-    const int nb11 = src1->nb[1];
-    //const int nb12 = src1->nb[2];
-    //const int nb13 = src1->nb[3];
-
-    //const int nb0  = dst->nb[0];
-    const int nb1  = dst->nb[1];
-    //const int nb2  = dst->nb[2];
-    //const int nb3  = dst->nb[3];
+    // f32 copy of the kernels of a tile, in the work data of the thread
+    float * const ydata = (float *) ggml_align_cache_line(xdata + (size_t) ne0*ldx + (size_t) ith*(GGML_GEMM_NR*ldx + CACHE_LINE_SIZE_F32));
 
-    const int ith = params->ith;
-    const int nth = params->nth;
+    const int lds = nb1/sizeof(float);
 
-    const int nk = ne00;
-    const int nh = nk/2;
+    for (int ir = ir0; ir < ir1; ir += GGML_GEMM_MC) {
+        // rows in the band
+        const int nrb = MIN(GGML_GEMM_MC, ir1 - ir);
 
-    const int ew0 = ggml_up32(ne01);
-
-    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
-    GGML_ASSERT(nb00 == sizeof(float));
-    GGML_ASSERT(nb10 == sizeof(float));
+              float * x = xdata + (size_t) ir*ldx;
+              float * d = (float *) dst->data + ir;
 
-    if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
+        for (int j = 0; j < ne02; j += GGML_GEMM_NR) {
+            const int nj = MIN(GGML_GEMM_NR, ne02 - j);
 
-        // prepare kernel data (src0)
-        {
-            float * const wdata = (float *) params->wdata + 0;
+            for (int jj = 0; jj < nj; ++jj) {
+                const char * w = (const char *) src0->data + (j + jj)*nb02;
 
-            for (int i02 = 0; i02 < ne02; i02++) {
-                for (int i01 = 0; i01 < ne01; i01++) {
-                    const float * const src = (float *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    float * dst_data = wdata + i02*ew0*ne00;
-                    for (int i00 = 0; i00 < ne00; i00++) {
-                        dst_data[i00*ew0 + i01] = src[i00];
-                    }
+                if (src0->type == GGML_TYPE_F16) {
+                    ggml_vec->gemm_pack_row_f16(nk, ydata + jj*ldx, (const ggml_fp16_t *) w);
+                } else {
+                    memcpy(ydata + jj*ldx, w, nk*sizeof(float));
                 }
             }
-        }
 
-        // prepare source data (src1)
-        {
-            float * const wdata = (float *) params->wdata + ne02*ew0*ne00;
+            for (int i = 0; i < nrb; i += GGML_GEMM_MR) {
+                const int ni = MIN(GGML_GEMM_MR, nrb - i);
 
-            for (int i11 = 0; i11 < ne11; i11++) {
-                const float * const src = (float *)((char *) src1->data + i11*nb11);
-                float * dst_data = wdata;
-                for (int i10 = 0; i10 < ne10; i10++) {
-                    dst_data[(i10 + nh)*ew0 + i11] = src[i10];
+                if (ni == GGML_GEMM_MR && nj == GGML_GEMM_NR) {
+                    ggml_vec->gemm_tile_f32(nk, d + j*lds + i, lds, x + i*ldx, ldx, ydata, ldx);
+                    continue;
                 }
-            }
-        }
-
-        return;
-    }
-
-    if (params->type == GGML_TASK_FINALIZE) {
-        return;
-    }
 
-    // total rows in dst
-    const int nr = ne02;
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int i0 = 0; i0 < ne10; ++i0) {
-            dst_data[i0] = 0;
-            for (int k = -nh; k <= nh; k++) {
-                float v = 0.0f;
-                ggml_vec_dot_f32(ew0, &v,
-                        (float *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (float *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
-
-                dst_data[i0] += v;
+                // partial tile at the edge of the band or of the kernels
+                for (int jj = 0; jj < nj; ++jj) {
+                    for (int ii = i; ii < i + ni; ++ii) {
+                        ggml_vec_dot_f32(nk, d + (j + jj)*lds + ii, x + ii*ldx, ydata + jj*ldx);
+                    }
+                }
             }
         }
     }
 }
 
-void ggml_compute_forward_conv_1d_1s(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-        struct ggml_tensor * dst) {
-    switch (src0->type) {
-        case GGML_TYPE_F16:
-            {
-                ggml_compute_forward_conv_1d_1s_f16_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_conv_1d_1s_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_I8:
-        case GGML_TYPE_I16:
-        case GGML_TYPE_I32:
-        case GGML_TYPE_COUNT:
-            {
-                GGML_ASSERT(false);
-            } break;
-    }
-}
-
-// ggml_compute_forward_conv_1d_2s
+// ggml_compute_forward_flash_attn
 
-void ggml_compute_forward_conv_1d_2s_f16_f32(
+void ggml_compute_forward_flash_attn_f32(
         const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
-    GGML_ASSERT(src0->type == GGML_TYPE_F16);
-    GGML_ASSERT(src1->type == GGML_TYPE_F32);
-    GGML_ASSERT( dst->type == GGML_TYPE_F32);
-
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const bool masked,
+             struct ggml_tensor * dst) {
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
 
-    const int ne00 = src0->ne[0];
-    const int ne01 = src0->ne[1];
-    const int ne02 = src0->ne[2];
-    //const int ne03 = src0->ne[3];
+    const int neq0 = q->ne[0];
+    const int neq1 = q->ne[1];
+    const int neq2 = q->ne[2];
+    const int neq3 = q->ne[3];
 
-    const int ne10 = src1->ne[0];
-    const int ne11 = src1->ne[1];
-    //const int ne12 = src1->ne[2];
-    //const int ne13 = src1->ne[3];
+    const int nek0 = k->ne[0];
+    const int nek1 = k->ne[1];
+    //const int nek2 = k->ne[2];
+    //const int nek3 = k->ne[3];
+
+    //const int nev0 = v->ne[0];
+    const int nev1 = v->ne[1];
+    //const int nev2 = v->ne[2];
+    //const int nev3 = v->ne[3];
 
-    //const int ne0  = dst->ne[0];
-    //const int ne1  = dst->ne[1];
+    const int ne0  = dst->ne[0];
+    const int ne1  = dst->ne[1];
     //const int ne2  = dst->ne[2];
     //const int ne3  = dst->ne[3];
-    //const int ne   = ne0*ne1*ne2*ne3;
 
-    const int nb00 = src0->nb[0];
-    const int nb01 = src0->nb[1];
-    const int nb02 = src0->nb[2];
-    //const int nb03 = src0->nb[3];
+    const int nbk0 = k->nb[0];
+    const int nbk1 = k->nb[1];
+    const int nbk2 = k->nb[2];
+    const int nbk3 = k->nb[3];
 
-    const int nb10 = src1->nb[0];
-    const int nb11 = src1->nb[1];
-    //const int nb12 = src1->nb[2];
-    //const int nb13 = src1->nb[3];
+    const int nbq0 = q->nb[0];
+    const int nbq1 = q->nb[1];
+    const int nbq2 = q->nb[2];
+    const int nbq3 = q->nb[3];
+
+    const int nbv0 = v->nb[0];
+    const int nbv1 = v->nb[1];
+    const int nbv2 = v->nb[2];
+    const int nbv3 = v->nb[3];
 
-    //const int nb0  = dst->nb[0];
+    const int nb0  = dst->nb[0];
     const int nb1  = dst->nb[1];
-    //const int nb2  = dst->nb[2];
-    //const int nb3  = dst->nb[3];
+    const int nb2  = dst->nb[2];
+    const int nb3  = dst->nb[3];
 
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int nk = ne00;
-    const int nh = nk/2;
-
-    const int ew0 = ggml_up32(ne01);
-
-    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
-    GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nb10 == sizeof(float));
+    const int D = neq0;
+    const int N = neq1;
+    const int P = nek1 - N;
+    const int M = P + N;
 
-    if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
+    GGML_ASSERT(ne0 == D);
+    GGML_ASSERT(ne1 == N);
+    GGML_ASSERT(P >= 0);
 
-        // prepare kernel data (src0)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + 0;
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == sizeof(float));
+    GGML_ASSERT(nbv0 == sizeof(float));
 
-            for (int i02 = 0; i02 < ne02; i02++) {
-                for (int i01 = 0; i01 < ne01; i01++) {
-                    const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    ggml_fp16_t * dst_data = wdata + i02*ew0*ne00;
-                    for (int i00 = 0; i00 < ne00; i00++) {
-                        dst_data[i00*ew0 + i01] = src[i00];
-                    }
-                }
-            }
-        }
+    GGML_ASSERT(neq0 == D);
+    GGML_ASSERT(nek0 == D);
+    GGML_ASSERT(nev1 == D);
 
-        // prepare source data (src1)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
+    GGML_ASSERT(neq1 == N);
+    GGML_ASSERT(nek1 == N + P);
+    GGML_ASSERT(nev1 == D);
 
-            for (int i11 = 0; i11 < ne11; i11++) {
-                const float * const src = (float *)((char *) src1->data + i11*nb11);
-                ggml_fp16_t * dst_data = wdata;
-                for (int i10 = 0; i10 < ne10; i10++) {
-                    dst_data[(i10 + nh)*ew0 + i11] = ggml_fp32_to_fp16(src[i10]);
-                }
-            }
-        }
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
 
+    if (params->type == GGML_TASK_INIT) {
         return;
     }
 
@@ -5385,8 +5559,10 @@ void ggml_compute_forward_conv_1d_2s_f16_f32(
         return;
     }
 
-    // total rows in dst
-    const int nr = ne02;
+    // parallelize by q rows using ggml_vec_dot_f32
+
+    // total rows in q
+    const int nr = neq1*neq2*neq3;
 
     // rows per thread
     const int dr = (nr + nth - 1)/nth;
@@ -5395,294 +5571,32 @@ void ggml_compute_forward_conv_1d_2s_f16_f32(
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int i0 = 0; i0 < ne10; i0 += 2) {
-            dst_data[i0/2] = 0;
-            for (int k = -nh; k <= nh; k++) {
-                float v = 0.0f;
-                ggml_vec_dot_f16(ew0, &v,
-                        (ggml_fp16_t *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (ggml_fp16_t *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
-
-                dst_data[i0/2] += v;
-            }
-        }
-    }
-}
+    const float scale = 1.0/sqrt((double) D);
 
-void ggml_compute_forward_conv_1d_2s_f32(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
-    GGML_ASSERT(src0->type == GGML_TYPE_F32);
-    GGML_ASSERT(src1->type == GGML_TYPE_F32);
-    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
 
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // q indices
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-    const int ne00 = src0->ne[0];
-    const int ne01 = src0->ne[1];
-    const int ne02 = src0->ne[2];
-    //const int ne03 = src0->ne[3];
+        float * S = (float *) params->wdata + ith*(M + CACHE_LINE_SIZE_F32);
 
-    const int ne10 = src1->ne[0];
-    const int ne11 = src1->ne[1];
-    //const int ne12 = src1->ne[2];
-    //const int ne13 = src1->ne[3];
+        for (int ic = 0; ic < nek1; ++ic) {
+            // k indices
+            const int ik3 = iq3;
+            const int ik2 = iq2;
+            const int ik1 = ic;
 
-    //const int ne0  = dst->ne[0];
-    //const int ne1  = dst->ne[1];
-    //const int ne2  = dst->ne[2];
-    //const int ne3  = dst->ne[3];
-    //const int ne   = ne0*ne1*ne2*ne3;
+            // S indices
+            const int i1 = ik1;
 
-    const int nb00 = src0->nb[0];
-    const int nb01 = src0->nb[1];
-    const int nb02 = src0->nb[2];
-    //const int nb03 = src0->nb[3];
-
-    const int nb10 = src1->nb[0];
-    const int nb11 = src1->nb[1];
-    //const int nb12 = src1->nb[2];
-    //const int nb13 = src1->nb[3];
-
-    //const int nb0  = dst->nb[0];
-    const int nb1  = dst->nb[1];
-    //const int nb2  = dst->nb[2];
-    //const int nb3  = dst->nb[3];
-
-    const int ith = params->ith;
-    const int nth = params->nth;
-
-    const int nk = ne00;
-    const int nh = nk/2;
-
-    const int ew0 = ggml_up32(ne01);
-
-    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
-    GGML_ASSERT(nb00 == sizeof(float));
-    GGML_ASSERT(nb10 == sizeof(float));
-
-    if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
-
-        // prepare kernel data (src0)
-        {
-            float * const wdata = (float *) params->wdata + 0;
-
-            for (int i02 = 0; i02 < ne02; i02++) {
-                for (int i01 = 0; i01 < ne01; i01++) {
-                    const float * const src = (float *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    float * dst_data = wdata + i02*ew0*ne00;
-                    for (int i00 = 0; i00 < ne00; i00++) {
-                        dst_data[i00*ew0 + i01] = src[i00];
-                    }
-                }
-            }
-        }
-
-        // prepare source data (src1)
-        {
-            float * const wdata = (float *) params->wdata + ne02*ew0*ne00;
-
-            for (int i11 = 0; i11 < ne11; i11++) {
-                const float * const src = (float *)((char *) src1->data + i11*nb11);
-                float * dst_data = wdata;
-                for (int i10 = 0; i10 < ne10; i10++) {
-                    dst_data[(i10 + nh)*ew0 + i11] = src[i10];
-                }
-            }
-        }
-
-        return;
-    }
-
-    if (params->type == GGML_TASK_FINALIZE) {
-        return;
-    }
-
-    // total rows in dst
-    const int nr = ne02;
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int i0 = 0; i0 < ne10; i0 += 2) {
-            dst_data[i0/2] = 0;
-            for (int k = -nh; k <= nh; k++) {
-                float v = 0.0f;
-                ggml_vec_dot_f32(ew0, &v,
-                        (float *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (float *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
-
-                dst_data[i0/2] += v;
-            }
-        }
-    }
-}
-
-void ggml_compute_forward_conv_1d_2s(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-        struct ggml_tensor * dst) {
-    switch (src0->type) {
-        case GGML_TYPE_F16:
-            {
-                ggml_compute_forward_conv_1d_2s_f16_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_conv_1d_2s_f32(params, src0, src1, dst);
-            } break;
-        case GGML_TYPE_I8:
-        case GGML_TYPE_I16:
-        case GGML_TYPE_I32:
-        case GGML_TYPE_COUNT:
-            {
-                GGML_ASSERT(false);
-            } break;
-    }
-}
-
-// ggml_compute_forward_flash_attn
-
-void ggml_compute_forward_flash_attn_f32(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * q,
-        const struct ggml_tensor * k,
-        const struct ggml_tensor * v,
-        const bool masked,
-             struct ggml_tensor * dst) {
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
-
-    const int neq0 = q->ne[0];
-    const int neq1 = q->ne[1];
-    const int neq2 = q->ne[2];
-    const int neq3 = q->ne[3];
-
-    const int nek0 = k->ne[0];
-    const int nek1 = k->ne[1];
-    //const int nek2 = k->ne[2];
-    //const int nek3 = k->ne[3];
-
-    //const int nev0 = v->ne[0];
-    const int nev1 = v->ne[1];
-    //const int nev2 = v->ne[2];
-    //const int nev3 = v->ne[3];
-
-    const int ne0  = dst->ne[0];
-    const int ne1  = dst->ne[1];
-    //const int ne2  = dst->ne[2];
-    //const int ne3  = dst->ne[3];
-
-    const int nbk0 = k->nb[0];
-    const int nbk1 = k->nb[1];
-    const int nbk2 = k->nb[2];
-    const int nbk3 = k->nb[3];
-
-    const int nbq0 = q->nb[0];
-    const int nbq1 = q->nb[1];
-    const int nbq2 = q->nb[2];
-    const int nbq3 = q->nb[3];
-
-    const int nbv0 = v->nb[0];
-    const int nbv1 = v->nb[1];
-    const int nbv2 = v->nb[2];
-    const int nbv3 = v->nb[3];
-
-    const int nb0  = dst->nb[0];
-    const int nb1  = dst->nb[1];
-    const int nb2  = dst->nb[2];
-    const int nb3  = dst->nb[3];
-
-    const int ith = params->ith;
-    const int nth = params->nth;
-
-    const int D = neq0;
-    const int N = neq1;
-    const int P = nek1 - N;
-    const int M = P + N;
-
-    GGML_ASSERT(ne0 == D);
-    GGML_ASSERT(ne1 == N);
-    GGML_ASSERT(P >= 0);
-
-    GGML_ASSERT(nbq0 == sizeof(float));
-    GGML_ASSERT(nbk0 == sizeof(float));
-    GGML_ASSERT(nbv0 == sizeof(float));
-
-    GGML_ASSERT(neq0 == D);
-    GGML_ASSERT(nek0 == D);
-    GGML_ASSERT(nev1 == D);
-
-    GGML_ASSERT(neq1 == N);
-    GGML_ASSERT(nek1 == N + P);
-    GGML_ASSERT(nev1 == D);
-
-    // dst cannot be transposed or permuted
-    GGML_ASSERT(nb0 == sizeof(float));
-    GGML_ASSERT(nb0 <= nb1);
-    GGML_ASSERT(nb1 <= nb2);
-    GGML_ASSERT(nb2 <= nb3);
-
-    if (params->type == GGML_TASK_INIT) {
-        return;
-    }
-
-    if (params->type == GGML_TASK_FINALIZE) {
-        return;
-    }
-
-    // parallelize by q rows using ggml_vec_dot_f32
-
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
-    const float scale = 1.0/sqrt((double) D);
-
-    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
-
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
-
-        float * S = (float *) params->wdata + ith*(M + CACHE_LINE_SIZE_F32);
-
-        for (int ic = 0; ic < nek1; ++ic) {
-            // k indices
-            const int ik3 = iq3;
-            const int ik2 = iq2;
-            const int ik1 = ic;
-
-            // S indices
-            const int i1 = ik1;
-
-            ggml_vec_dot_f32(neq0,
-                    S + i1,
-                    (float *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                    (float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
-        }
+            ggml_vec_dot_f32(neq0,
+                    S + i1,
+                    (float *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
+                    (float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
+        }
 
         // scale
         ggml_vec_scale_f32(nek1, S, scale);
@@ -5944,6 +5858,8 @@ void ggml_compute_forward_flash_attn(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5951,55 +5867,316 @@ void ggml_compute_forward_flash_attn(
     }
 }
 
-// ggml_compute_forward_flash_ff
-
-void ggml_compute_forward_flash_ff_f16(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * a,  // F16
-        const struct ggml_tensor * b0, // F16 fc_w
-        const struct ggml_tensor * b1, // F32 fc_b
-        const struct ggml_tensor * c0, // F16 proj_w
-        const struct ggml_tensor * c1, // F32 proj_b
-        struct ggml_tensor * dst) {
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
+// ggml_compute_forward_flash_attn_kv
 
-    const int nea0 = a->ne[0];
-    const int nea1 = a->ne[1];
-    const int nea2 = a->ne[2];
-    const int nea3 = a->ne[3];
+// the keys / values are streamed through the row of scores in tiles of this many positions
+#define GGML_FLASH_ATTN_KV_TILE 256
 
-    const int neb00 = b0->ne[0];
-    const int neb01 = b0->ne[1];
-    //const int neb02 = b0->ne[2];
-    //const int neb03 = b0->ne[3];
+// the number of chunks the keys / values of each row are split into - when there are fewer rows (query tokens x
+// heads) than threads, as when decoding a single token, the threads also split the keys / values of a row and the
+// partial results are merged in the FINALIZE phase
+static int ggml_flash_attn_kv_n_chunks(int n_rows, int n_kv, int nth) {
+    if (n_rows >= nth) {
+        return 1;
+    }
 
-    const int neb10 = b1->ne[0];
-    const int neb11 = b1->ne[1];
-    //const int neb12 = b1->ne[2];
-    //const int neb13 = b1->ne[3];
+    const int n_tiles = (n_kv + GGML_FLASH_ATTN_KV_TILE - 1)/GGML_FLASH_ATTN_KV_TILE;
 
-    const int nec00 = c0->ne[0];
-    const int nec01 = c0->ne[1];
-    //const int nec02 = c0->ne[2];
-    //const int nec03 = c0->ne[3];
+    return MAX(1, MIN((nth + n_rows - 1)/n_rows, n_tiles));
+}
 
-    const int nec10 = c1->ne[0];
-    const int nec11 = c1->ne[1];
-    //const int nec12 = c1->ne[2];
-    //const int nec13 = c1->ne[3];
+// the scratch of a thread in floats: the scores of a tile in F32 and F16, the accumulator and the converted q row
+static size_t ggml_flash_attn_kv_scratch(int D) {
+    return GGML_FLASH_ATTN_KV_TILE + GGML_FLASH_ATTN_KV_TILE/2 + 2*D + CACHE_LINE_SIZE_F32;
+}
 
-    const int ne0 = dst->ne[0];
-    const int ne1 = dst->ne[1];
-    const int ne2 = dst->ne[2];
-    //const int ne3 = dst->ne[3];
+static void ggml_compute_forward_flash_attn_kv(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        const int n_past,
+        const float scale,
+        struct ggml_tensor * dst) {
+    const int neq1 = q->ne[1];
+    const int neq2 = q->ne[2];
+    const int neq3 = q->ne[3];
 
-    const int nba0 = a->nb[0];
-    const int nba1 = a->nb[1];
-    const int nba2 = a->nb[2];
-    const int nba3 = a->nb[3];
+    const int nbq1 = q->nb[1];
+    const int nbq2 = q->nb[2];
+    const int nbq3 = q->nb[3];
 
-    const int nbb00 = b0->nb[0];
+    const int nbk1 = k->nb[1];
+    const int nbk2 = k->nb[2];
+    const int nbk3 = k->nb[3];
+
+    const int nbv1 = v->nb[1];
+    const int nbv2 = v->nb[2];
+    const int nbv3 = v->nb[3];
+
+    const int nb1 = dst->nb[1];
+    const int nb2 = dst->nb[2];
+    const int nb3 = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int D    = q->ne[0];
+    const int n_kv = k->ne[1];
+
+    GGML_ASSERT(q->nb[0]   == sizeof(float));
+    GGML_ASSERT(k->nb[0]   == GGML_TYPE_SIZE[k->type]);
+    GGML_ASSERT(v->nb[0]   == GGML_TYPE_SIZE[v->type]);
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
+    GGML_ASSERT(mask == NULL || mask->nb[0] == sizeof(float));
+
+    // rows of the result: one for each query token of each head
+    const int nr = neq1*neq2*neq3;
+
+    const int n_chunks = ggml_flash_attn_kv_n_chunks(nr, n_kv, nth);
+    const int n_tiles  = (n_kv + GGML_FLASH_ATTN_KV_TILE - 1)/GGML_FLASH_ATTN_KV_TILE;
+    const int dc       = ((n_tiles + n_chunks - 1)/n_chunks)*GGML_FLASH_ATTN_KV_TILE;
+
+    // the partial results (max score, sum of the weights, weighted sum of the values) of each chunk of each row
+    float * partials = (float *) params->wdata + nth*ggml_flash_attn_kv_scratch(D);
+
+    if (params->type == GGML_TASK_INIT) {
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        if (n_chunks == 1) {
+            return;
+        }
+
+        // merge the chunks of each row
+        const int dr  = (nr + nth - 1)/nth;
+        const int ir0 = dr*ith;
+        const int ir1 = MIN(ir0 + dr, nr);
+
+        for (int ir = ir0; ir < ir1; ++ir) {
+            const int i3 = ir/(neq2*neq1);
+            const int i2 = (ir - i3*neq2*neq1)/neq1;
+            const int i1 = (ir - i3*neq2*neq1 - i2*neq1);
+
+            const float * p = partials + (size_t) ir*n_chunks*(D + 2);
+
+            float M = -INFINITY;
+            for (int ic = 0; ic < n_chunks; ++ic) {
+                M = MAX(M, p[ic*(D + 2)]);
+            }
+
+            float * y = (float *) ((char *) dst->data + i1*nb1 + i2*nb2 + i3*nb3);
+
+            ggml_vec_set_f32(D, y, 0.0f);
+
+            float S = 0.0f;
+            for (int ic = 0; ic < n_chunks; ++ic) {
+                const float * pc = p + ic*(D + 2);
+
+                if (pc[1] == 0.0f) {
+                    continue;
+                }
+
+                const float w = expf(pc[0] - M);
+
+                S += w*pc[1];
+                ggml_vec_mad_f32(D, y, pc + 2, w);
+            }
+
+            ggml_vec_scale_f32(D, y, S == 0.0f ? 0.0f : 1.0f/S);
+        }
+
+        return;
+    }
+
+    // parallelize by rows and, with few rows, by chunks of the keys / values of a row
+    const int nu  = nr*n_chunks;
+    const int du  = (nu + nth - 1)/nth;
+    const int iu0 = du*ith;
+    const int iu1 = MIN(iu0 + du, nu);
+
+    float       * S   = (float *) params->wdata + ith*ggml_flash_attn_kv_scratch(D);
+    ggml_fp16_t * S16 = (ggml_fp16_t *) (S + GGML_FLASH_ATTN_KV_TILE);
+    float       * acc = S + GGML_FLASH_ATTN_KV_TILE + GGML_FLASH_ATTN_KV_TILE/2;
+    void        * qc  = acc + D; // the q row converted to the type of the dot product with k
+
+    const enum ggml_type type_q = k->type == GGML_TYPE_F32 ? GGML_TYPE_F32 :
+                                  k->type == GGML_TYPE_F16 ? GGML_TYPE_F16 : ggml_vec->quantize_fns[k->type].vec_dot_type;
+
+    for (int iu = iu0; iu < iu1; ++iu) {
+        const int ir = iu/n_chunks;
+        const int ic = iu%n_chunks;
+
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+
+        // without a mask, the token iq1 sees the positions up to n_past + iq1 - the rest of the keys / values is skipped
+        const int n_vis = mask ? n_kv : MIN(n_kv, n_past + iq1 + 1);
+
+        const int j0 = MIN(ic*dc, n_vis);
+        const int j1 = MIN(j0 + dc, n_vis);
+
+        float       * qrow = (float *) ((char *) q->data + iq1*nbq1 + iq2*nbq2 + iq3*nbq3);
+        const float * mrow = mask ? (const float *) ((const char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+        void * qd = type_q == GGML_TYPE_F32 ? (void *) qrow : qc;
+
+        if (type_q == GGML_TYPE_F16) {
+            for (int i = 0; i < D; ++i) {
+                ((ggml_fp16_t *) qc)[i] = ggml_fp32_to_fp16(qrow[i]);
+            }
+        } else if (type_q != GGML_TYPE_F32) {
+            ggml_vec->quantize_fns[type_q].quantize_row(qrow, qc, D);
+        }
+
+        char * kd = (char *) k->data + iq2*nbk2 + iq3*nbk3;
+        char * vd = (char *) v->data + iq2*nbv2 + iq3*nbv3;
+
+        float M = -INFINITY; // the max score so far
+        float L = 0.0f;      // the sum of the weights so far, relative to M
+
+        ggml_vec_set_f32(D, acc, 0.0f);
+
+        for (int t0 = j0; t0 < j1; t0 += GGML_FLASH_ATTN_KV_TILE) {
+            const int nt = MIN(GGML_FLASH_ATTN_KV_TILE, j1 - t0);
+
+            float Mt = -INFINITY;
+
+            for (int j = 0; j < nt; ++j) {
+                if (mrow && mrow[t0 + j] == -INFINITY) {
+                    S[j] = -INFINITY;
+                    continue;
+                }
+
+                char * krow = kd + (t0 + j)*nbk1;
+
+                float s;
+                switch (k->type) {
+                    case GGML_TYPE_F32: ggml_vec_dot_f32(D, &s, (float *) krow, (float *) qd); break;
+                    case GGML_TYPE_F16: ggml_vec_dot_f16(D, &s, (ggml_fp16_t *) krow, (ggml_fp16_t *) qd); break;
+                    default:            ggml_vec->quantize_fns[k->type].vec_dot(D, &s, krow, qd); break;
+                }
+
+                s = s*scale + (mrow ? mrow[t0 + j] : 0.0f);
+
+                S[j] = s;
+                Mt   = MAX(Mt, s);
+            }
+
+            if (Mt == -INFINITY) {
+                continue;
+            }
+
+            // rescale what was accumulated so far to the new max
+            if (Mt > M) {
+                const float r = expf(M - Mt);
+
+                L *= r;
+                ggml_vec_scale_f32(D, acc, r);
+
+                M = Mt;
+            }
+
+            uint16_t ss;
+            for (int j = 0; j < nt; ++j) {
+                if (S[j] == -INFINITY) {
+                    S[j] = 0.0f;
+                } else {
+                    ggml_fp16_t s = ggml_fp32_to_fp16(S[j] - M);
+                    memcpy(&ss, &s, sizeof(ss));
+                    S[j] = ggml_fp16_to_fp32(table_exp_f16[ss]);
+                    L += S[j];
+                }
+            }
+
+            // acc += V[:, t0:t0 + nt]*S
+            if (v->type == GGML_TYPE_F16) {
+                for (int j = 0; j < nt; ++j) {
+                    S16[j] = ggml_fp32_to_fp16(S[j]);
+                }
+
+                for (int d = 0; d < D; ++d) {
+                    float s;
+                    ggml_vec_dot_f16(nt, &s, (ggml_fp16_t *) (vd + d*nbv1) + t0, S16);
+                    acc[d] += s;
+                }
+            } else {
+                for (int d = 0; d < D; ++d) {
+                    float s;
+                    ggml_vec_dot_f32(nt, &s, (float *) (vd + d*nbv1) + t0, S);
+                    acc[d] += s;
+                }
+            }
+        }
+
+        if (n_chunks == 1) {
+            float * y = (float *) ((char *) dst->data + iq1*nb1 + iq2*nb2 + iq3*nb3);
+
+            // a row that sees no position (everything masked) is zero
+            ggml_vec_scale_f32(D, acc, L == 0.0f ? 0.0f : 1.0f/L);
+            memcpy(y, acc, D*sizeof(float));
+        } else {
+            float * p = partials + (size_t) iu*(D + 2);
+
+            p[0] = M;
+            p[1] = L;
+            memcpy(p + 2, acc, D*sizeof(float));
+        }
+    }
+}
+
+// ggml_compute_forward_flash_ff
+
+void ggml_compute_forward_flash_ff_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * a,  // F16
+        const struct ggml_tensor * b0, // F16 fc_w
+        const struct ggml_tensor * b1, // F32 fc_b
+        const struct ggml_tensor * c0, // F16 proj_w
+        const struct ggml_tensor * c1, // F32 proj_b
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int nea0 = a->ne[0];
+    const int nea1 = a->ne[1];
+    const int nea2 = a->ne[2];
+    const int nea3 = a->ne[3];
+
+    const int neb00 = b0->ne[0];
+    const int neb01 = b0->ne[1];
+    //const int neb02 = b0->ne[2];
+    //const int neb03 = b0->ne[3];
+
+    const int neb10 = b1->ne[0];
+    const int neb11 = b1->ne[1];
+    //const int neb12 = b1->ne[2];
+    //const int neb13 = b1->ne[3];
+
+    const int nec00 = c0->ne[0];
+    const int nec01 = c0->ne[1];
+    //const int nec02 = c0->ne[2];
+    //const int nec03 = c0->ne[3];
+
+    const int nec10 = c1->ne[0];
+    const int nec11 = c1->ne[1];
+    //const int nec12 = c1->ne[2];
+    //const int nec13 = c1->ne[3];
+
+    const int ne0 = dst->ne[0];
+    const int ne1 = dst->ne[1];
+    const int ne2 = dst->ne[2];
+    //const int ne3 = dst->ne[3];
+
+    const int nba0 = a->nb[0];
+    const int nba1 = a->nb[1];
+    const int nba2 = a->nb[2];
+    const int nba3 = a->nb[3];
+
+    const int nbb00 = b0->nb[0];
     const int nbb01 = b0->nb[1];
     const int nbb02 = b0->nb[2];
     const int nbb03 = b0->nb[3];
@@ -6153,6 +6330,8 @@ void ggml_compute_forward_flash_ff(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -6160,158 +6339,516 @@ void ggml_compute_forward_flash_ff(
     }
 }
 
-/////////////////////////////////
+// ggml_compute_forward_opt_adam
 
-void ggml_compute_forward(struct ggml_compute_params * params, struct ggml_tensor * tensor) {
-    assert(params);
+static void ggml_compute_forward_opt_adam(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * m,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * w,
+        const struct ggml_tensor * hp,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(dst->data == src0->data);
 
-    switch (tensor->op) {
-        case GGML_OP_DUP:
-            {
-                ggml_compute_forward_dup(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_ADD:
-            {
-                ggml_compute_forward_add(params, tensor->src0, tensor->src1, tensor);
-            } break;
-        case GGML_OP_SUB:
-            {
-                ggml_compute_forward_sub(params, tensor->src0, tensor->src1, tensor);
-            } break;
-        case GGML_OP_MUL:
-            {
-                ggml_compute_forward_mul(params, tensor->src0, tensor->src1, tensor);
-            } break;
-        case GGML_OP_DIV:
-            {
-                ggml_compute_forward_div(params, tensor->src0, tensor->src1, tensor);
-            } break;
-        case GGML_OP_SQR:
-            {
-                ggml_compute_forward_sqr(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_SQRT:
-            {
-                ggml_compute_forward_sqrt(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_SUM:
-            {
-                ggml_compute_forward_sum(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_MEAN:
-            {
-                ggml_compute_forward_mean(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_REPEAT:
-            {
-                ggml_compute_forward_repeat(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_ABS:
-            {
-                ggml_compute_forward_abs(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_SGN:
-            {
-                ggml_compute_forward_sgn(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_NEG:
-            {
-                ggml_compute_forward_neg(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_STEP:
-            {
-                ggml_compute_forward_step(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_RELU:
-            {
-                ggml_compute_forward_relu(params, tensor->src0, tensor);
-            } break;
-        case GGML_OP_GELU:
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int n = ggml_nelements(src0);
+
+    // elements per thread, in whole cache lines of the moments
+    const int dn = (((n + nth - 1)/nth + CACHE_LINE_SIZE_F32 - 1)/CACHE_LINE_SIZE_F32)*CACHE_LINE_SIZE_F32;
+
+    // element range for this thread
+    const int i0 = MIN(dn*ith, n);
+    const int i1 = MIN(i0 + dn, n);
+
+    if (i0 == i1) {
+        return;
+    }
+
+    const float * g = (float *) src1->data + i0;
+
+    float * pm = (float *) m->data + i0;
+    float * pv = (float *) v->data + i0;
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
             {
-                ggml_compute_forward_gelu(params, tensor->src0, tensor);
+                ggml_vec->adam_f32(i1 - i0, (float *) src0->data + i0, pm, pv, g, (float *) hp->data);
             } break;
-        case GGML_OP_NORM:
+        case GGML_TYPE_F16:
             {
-                ggml_compute_forward_norm(params, tensor->src0, tensor);
+                // the step is applied to the f32 master copy, the parameter is its rounding
+                float * x = (float *) w->data + i0;
+
+                ggml_vec->adam_f32(i1 - i0, x, pm, pv, g, (float *) hp->data);
+
+                ggml_fp16_t * y = (ggml_fp16_t *) src0->data + i0;
+                for (int i = 0; i < i1 - i0; ++i) {
+                    y[i] = ggml_fp32_to_fp16(x[i]);
+                }
             } break;
-        case GGML_OP_MUL_MAT:
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_COUNT:
             {
-                ggml_compute_forward_mul_mat(params, tensor->src0, tensor->src1, tensor);
+                GGML_ASSERT(false);
             } break;
-        case GGML_OP_SCALE:
+    }
+}
+
+// ggml_compute_forward_norm_mul_add
+
+void ggml_compute_forward_norm_mul_add_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_can_repeat(src2, src0));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+    GGML_ASSERT(src2->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
+
+    const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
+
+    const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
+
+    const ggml_float eps = 1e-5f; // same as ggml_compute_forward_norm_f32()
+
+    for (int i03 = 0; i03 < ne03; i03++) {
+        for (int i02 = 0; i02 < ne02; i02++) {
+            for (int i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+                // the rows of the weight and the bias, broadcast to the rows of x
+                const float * w = (float *) ((char *) src1->data +
+                        (i01 % src1->ne[1])*src1->nb[1] + (i02 % src1->ne[2])*src1->nb[2] + (i03 % src1->ne[3])*src1->nb[3]);
+                const float * b = (float *) ((char *) src2->data +
+                        (i01 % src2->ne[1])*src2->nb[1] + (i02 % src2->ne[2])*src2->nb[2] + (i03 % src2->ne[3])*src2->nb[3]);
+
+                ggml_float mean = 0.0;
+                for (int i00 = 0; i00 < ne00; i00++) {
+                    mean += x[i00];
+                }
+
+                mean /= ne00;
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                ggml_float sum2 = 0.0;
+                for (int i00 = 0; i00 < ne00; i00++) {
+                    ggml_float v = x[i00] - mean;
+                    y[i00] = v;
+                    sum2 += v*v;
+                }
+
+                const float scale = 1.0/sqrt(sum2/ne00 + eps);
+
+                // the row is still in the cache
+                ggml_vec_scale_f32  (ne00, y, scale);
+                ggml_vec_mul_rep_f32(ne00, y, y, w, src1->ne[0]);
+                ggml_vec_add_rep_f32(ne00, y, y, b, src2->ne[0]);
+            }
+        }
+    }
+}
+
+void ggml_compute_forward_norm_mul_add(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
             {
-                ggml_compute_forward_scale(params, tensor->src0, tensor->src1, tensor);
+                ggml_compute_forward_norm_mul_add_f32(params, src0, src1, src2, dst);
             } break;
-        case GGML_OP_CPY:
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_COUNT:
             {
-                ggml_compute_forward_cpy(params, tensor->src0, tensor);
+                assert(false);
             } break;
-        case GGML_OP_RESHAPE:
+    }
+}
+
+// ggml_compute_forward_add_gelu
+
+void ggml_compute_forward_add_gelu_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nr = ggml_nrows(src0);
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        float * dst_ptr  = (float *) ((char *) dst->data  + i03*dst->nb[3]  + i02*dst->nb[2]  + i01*dst->nb[1]);
+        float * src0_ptr = (float *) ((char *) src0->data + i03*src0->nb[3] + i02*src0->nb[2] + i01*src0->nb[1]);
+        float * src1_ptr = (float *) ((char *) src1->data +
+                (i03 % ne13)*src1->nb[3] + (i02 % ne12)*src1->nb[2] + (i01 % ne11)*src1->nb[1]);
+
+        ggml_vec_add_rep_f32(ne00, dst_ptr, src0_ptr, src1_ptr, ne10);
+        ggml_vec_gelu_f32   (ne00, dst_ptr, dst_ptr);
+    }
+}
+
+void ggml_compute_forward_add_gelu(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
             {
-                ggml_compute_forward_reshape(params, tensor->src0, tensor);
+                ggml_compute_forward_add_gelu_f32(params, src0, src1, dst);
             } break;
-        case GGML_OP_VIEW:
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_COUNT:
             {
-                ggml_compute_forward_view(params, tensor->src0);
+                assert(false);
             } break;
-        case GGML_OP_PERMUTE:
+    }
+}
+
+// ggml_compute_forward_scale_mask_soft_max
+
+void ggml_compute_forward_scale_mask_soft_max_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_is_contiguous(src0));
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_is_scalar(src1));
+
+    // the mask is either the n_past of ggml_diag_mask_inf() or a tensor that is added to the rows (see ggml_graph_fuse)
+    const bool mask_n_past = src2 != NULL && src2->type == GGML_TYPE_I32;
+
+    GGML_ASSERT(src2 == NULL || (mask_n_past && ggml_nelements(src2) == 1) ||
+                (src2->type == GGML_TYPE_F32 && src2->nb[0] == sizeof(float) && ggml_can_repeat(src2, src0)));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // scale factor
+    const float v = *(float *) src1->data;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // without the mask, all positions are kept
+    const int n_past = mask_n_past ? ((int32_t *) src2->data)[0] : nc;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        float * p = (float *)((char *) dst->data + i1*dst->nb[1]);
+
+        // the node is usually computed in place
+        if (dst->data != src0->data) {
+            ggml_vec_cpy_f32(nc, p, (float *)((char *) src0->data + i1*src0->nb[1]));
+        }
+
+        ggml_vec_scale_f32(nc, p, v);
+
+        if (src2 != NULL && !mask_n_past) {
+            // the rows of the mask are broadcast to the rows of src0
+            const int i3 = i1/(src0->ne[2]*src0->ne[1]);
+            const int i2 = (i1 - i3*src0->ne[2]*src0->ne[1])/src0->ne[1];
+            const int j  = i1 - i3*src0->ne[2]*src0->ne[1] - i2*src0->ne[1];
+
+            const float * m = (const float *) ((char *) src2->data +
+                    (j % src2->ne[1])*src2->nb[1] + (i2 % src2->ne[2])*src2->nb[2] + (i3 % src2->ne[3])*src2->nb[3]);
+
+            ggml_vec_acc_f32(nc, p, m);
+        } else {
+            // same as ggml_compute_forward_diag_mask_inf_f32()
+            const int j = i1 % src0->ne[1];
+            for (int i = MAX(n_past + j + 1, 0); i < nc; i++) {
+                p[i] = -INFINITY;
+            }
+        }
+
+        ggml_soft_max_row_f32(nc, p);
+    }
+}
+
+void ggml_compute_forward_scale_mask_soft_max(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
             {
-                ggml_compute_forward_permute(params, tensor->src0);
+                ggml_compute_forward_scale_mask_soft_max_f32(params, src0, src1, src2, dst);
             } break;
-        case GGML_OP_TRANSPOSE:
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_COUNT:
             {
-                ggml_compute_forward_transpose(params, tensor->src0);
+                assert(false);
             } break;
-        case GGML_OP_GET_ROWS:
+    }
+}
+
+/////////////////////////////////
+
+void ggml_compute_forward(struct ggml_compute_params * params, struct ggml_tensor * tensor) {
+    assert(params);
+
+    switch (tensor->op) {
+        case GGML_OP_DUP:
             {
-                ggml_compute_forward_get_rows(params, tensor->src0, tensor->src1, tensor);
+                ggml_compute_forward_dup(params, tensor->src0, tensor);
             } break;
-        case GGML_OP_DIAG_MASK_INF:
+        case GGML_OP_ADD:
             {
-                ggml_compute_forward_diag_mask_inf(params, tensor->src0, tensor->src1, tensor);
+                ggml_compute_forward_add(params, tensor->src0, tensor->src1, tensor);
             } break;
-        case GGML_OP_SOFT_MAX:
+        case GGML_OP_SUB:
             {
-                ggml_compute_forward_soft_max(params, tensor->src0, tensor);
+                ggml_compute_forward_sub(params, tensor->src0, tensor->src1, tensor);
             } break;
-        case GGML_OP_ROPE:
+        case GGML_OP_MUL:
             {
-                ggml_compute_forward_rope(params, tensor->src0, tensor->src1, tensor);
+                ggml_compute_forward_mul(params, tensor->src0, tensor->src1, tensor);
             } break;
-        case GGML_OP_CONV_1D_1S:
+        case GGML_OP_DIV:
             {
-                ggml_compute_forward_conv_1d_1s(params, tensor->src0, tensor->src1, tensor);
+                ggml_compute_forward_div(params, tensor->src0, tensor->src1, tensor);
             } break;
-        case GGML_OP_CONV_1D_2S:
+        case GGML_OP_SQR:
             {
-                ggml_compute_forward_conv_1d_2s(params, tensor->src0, tensor->src1, tensor);
+                ggml_compute_forward_sqr(params, tensor->src0, tensor);
             } break;
-        case GGML_OP_FLASH_ATTN:
+        case GGML_OP_SQRT:
             {
-                int32_t t = ggml_get_i32_1d(tensor->opt[1], 0);
-                GGML_ASSERT(t == 0 || t == 1);
-                bool masked = t != 0;
-                ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], masked, tensor);
+                ggml_compute_forward_sqrt(params, tensor->src0, tensor);
             } break;
-        case GGML_OP_FLASH_FF:
+        case GGML_OP_SUM:
             {
-                ggml_compute_forward_flash_ff(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
+                ggml_compute_forward_sum(params, tensor->src0, tensor);
             } break;
-        case GGML_OP_NONE:
+        case GGML_OP_MEAN:
             {
-                // nop
+                ggml_compute_forward_mean(params, tensor->src0, tensor);
             } break;
-        case GGML_OP_COUNT:
+        case GGML_OP_REPEAT:
             {
-                GGML_ASSERT(false);
+                ggml_compute_forward_repeat(params, tensor->src0, tensor);
             } break;
-    };
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor * tensor, bool inplace) {
-    struct ggml_tensor * src0 = tensor->src0;
+        case GGML_OP_ABS:
+            {
+                ggml_compute_forward_abs(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_SGN:
+            {
+                ggml_compute_forward_sgn(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_NEG:
+            {
+                ggml_compute_forward_neg(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_STEP:
+            {
+                ggml_compute_forward_step(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_RELU:
+            {
+                ggml_compute_forward_relu(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_GELU:
+            {
+                ggml_compute_forward_gelu(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_NORM:
+            {
+                ggml_compute_forward_norm(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                ggml_compute_forward_mul_mat(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_SCALE:
+            {
+                ggml_compute_forward_scale(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_CPY:
+            {
+                ggml_compute_forward_cpy(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_RESHAPE:
+            {
+                ggml_compute_forward_reshape(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_VIEW:
+            {
+                ggml_compute_forward_view(params, tensor->src0);
+            } break;
+        case GGML_OP_PERMUTE:
+            {
+                ggml_compute_forward_permute(params, tensor->src0);
+            } break;
+        case GGML_OP_TRANSPOSE:
+            {
+                ggml_compute_forward_transpose(params, tensor->src0);
+            } break;
+        case GGML_OP_GET_ROWS:
+            {
+                ggml_compute_forward_get_rows(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_DIAG_MASK_INF:
+            {
+                ggml_compute_forward_diag_mask_inf(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_SOFT_MAX:
+            {
+                ggml_compute_forward_soft_max(params, tensor->src0, tensor);
+            } break;
+        case GGML_OP_ROPE:
+            {
+                ggml_compute_forward_rope(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_CONV_1D:
+            {
+                ggml_compute_forward_conv_1d(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
+            } break;
+        case GGML_OP_FLASH_ATTN:
+            {
+                int32_t t = ggml_get_i32_1d(tensor->opt[1], 0);
+                GGML_ASSERT(t == 0 || t == 1);
+                bool masked = t != 0;
+                ggml_compute_forward_flash_attn(params, tensor->src0, tensor->src1, tensor->opt[0], masked, tensor);
+            } break;
+        case GGML_OP_FLASH_ATTN_KV:
+            {
+                const int32_t n_past = ggml_get_i32_1d(tensor->opt[1], 0);
+                const float   scale  = ggml_get_f32_1d(tensor->opt[3], 0);
+                ggml_compute_forward_flash_attn_kv(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[2], n_past, scale, tensor);
+            } break;
+        case GGML_OP_FLASH_FF:
+            {
+                ggml_compute_forward_flash_ff(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
+            } break;
+        case GGML_OP_OPT_ADAM:
+            {
+                ggml_compute_forward_opt_adam(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor->opt[3], tensor);
+            } break;
+        case GGML_OP_NORM_MUL_ADD:
+            {
+                ggml_compute_forward_norm_mul_add(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
+            } break;
+        case GGML_OP_ADD_GELU:
+            {
+                ggml_compute_forward_add_gelu(params, tensor->src0, tensor->src1, tensor);
+            } break;
+        case GGML_OP_SCALE_MASK_SOFT_MAX:
+            {
+                ggml_compute_forward_scale_mask_soft_max(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
+            } break;
+        case GGML_OP_NONE:
+            {
+                // nop
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    };
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor * tensor, bool inplace) {
+    struct ggml_tensor * src0 = tensor->src0;
     struct ggml_tensor * src1 = tensor->src1;
 
     switch (tensor->op) {
@@ -6527,11 +7064,7 @@ void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor * tenso
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
-        case GGML_OP_CONV_1D_1S:
-            {
-                GGML_ASSERT(false); // TODO: not implemented
-            } break;
-        case GGML_OP_CONV_1D_2S:
+        case GGML_OP_CONV_1D:
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
@@ -6543,6 +7076,20 @@ void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor * tenso
             {
                 GGML_ASSERT(false); // not supported
             } break;
+        case GGML_OP_FLASH_ATTN_KV:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
+        case GGML_OP_OPT_ADAM:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
+        case GGML_OP_NORM_MUL_ADD:
+        case GGML_OP_ADD_GELU:
+        case GGML_OP_SCALE_MASK_SOFT_MAX:
+            {
+                GGML_ASSERT(false); // the nodes with gradients are not fused
+            } break;
         case GGML_OP_NONE:
             {
                 // nop
@@ -6554,6 +7101,105 @@ void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor * tenso
     };
 }
 
+// the visited set has at least twice as many slots as the graph has room for nodes and leafs
+static int ggml_graph_visited_size(int size) {
+    int n = 1;
+    while (n < 4*size) {
+        n *= 2;
+    }
+    return n;
+}
+
+static size_t ggml_graph_visited_hash(const struct ggml_tensor * node, int n) {
+    // mix the bits of the address, the tensors are evenly spaced in the context
+    uint64_t h = (uint64_t) (uintptr_t) node;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (size_t) (h & (uint64_t) (n - 1));
+}
+
+// inserts node in the visited set of the graph, returns false if it was already there
+static bool ggml_graph_visit(struct ggml_cgraph * cgraph, struct ggml_tensor * node) {
+    size_t i = ggml_graph_visited_hash(node, cgraph->visited_size);
+
+    while (cgraph->visited[i] != NULL) {
+        if (cgraph->visited[i] == node) {
+            return false;
+        }
+        i = (i + 1) & (size_t) (cgraph->visited_size - 1);
+    }
+
+    cgraph->visited[i] = node;
+
+    return true;
+}
+
+// rebuilds the visited set from the nodes and leafs, after they were changed in place
+static void ggml_graph_rehash(struct ggml_cgraph * cgraph) {
+    memset(cgraph->visited, 0, cgraph->visited_size*sizeof(struct ggml_tensor *));
+
+    for (int i = 0; i < cgraph->n_leafs; i++) {
+        ggml_graph_visit(cgraph, cgraph->leafs[i]);
+    }
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        ggml_graph_visit(cgraph, cgraph->nodes[i]);
+    }
+}
+
+size_t ggml_graph_overhead(int size, bool grads) {
+    const size_t n_ptrs = (size_t) (grads ? 3 : 2)*size + ggml_graph_visited_size(size);
+
+    return ggml_tensor_overhead() + GGML_MEM_ALIGN + sizeof(struct ggml_cgraph) + n_ptrs*sizeof(struct ggml_tensor *);
+}
+
+struct ggml_cgraph * ggml_new_graph_custom(struct ggml_context * ctx, int size, bool grads) {
+    GGML_ASSERT(size > 0);
+
+    const int    visited_size = ggml_graph_visited_size(size);
+    const size_t n_ptrs       = (size_t) (grads ? 3 : 2)*size + visited_size;
+
+    // the graph and its arrays are stored in an I8 tensor, like the work buffer, so they are allocated even in a
+    // no_alloc context
+    const bool no_alloc = ctx->no_alloc;
+    ctx->no_alloc = false;
+
+    struct ggml_tensor * buf = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, GGML_MEM_ALIGN + sizeof(struct ggml_cgraph) + n_ptrs*sizeof(struct ggml_tensor *));
+
+    ctx->no_alloc = no_alloc;
+
+    struct ggml_cgraph  * result = (struct ggml_cgraph *) buf->data;
+    struct ggml_tensor ** ptrs   = (struct ggml_tensor **) ((char *) buf->data + ((sizeof(struct ggml_cgraph) + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN);
+
+    memset(ptrs, 0, n_ptrs*sizeof(struct ggml_tensor *));
+
+    *result = (struct ggml_cgraph) {
+        /*.n_nodes        =*/ 0,
+        /*.n_leafs        =*/ 0,
+        /*.n_threads      =*/ 0,
+        /*.work_size      =*/ 0,
+        /*.work           =*/ NULL,
+        /*.n_threads_plan =*/ 0,
+        /*.size           =*/ size,
+        /*.nodes          =*/ ptrs,
+        /*.grads          =*/ grads ? ptrs + 2*size : NULL,
+        /*.leafs          =*/ ptrs + size,
+        /*.visited_size   =*/ visited_size,
+        /*.visited        =*/ ptrs + (grads ? 3 : 2)*size,
+        /*.perf_runs      =*/ 0,
+        /*.perf_cycles    =*/ 0,
+        /*.perf_time_us   =*/ 0,
+    };
+
+    return result;
+}
+
+struct ggml_cgraph * ggml_new_graph(struct ggml_context * ctx) {
+    return ggml_new_graph_custom(ctx, GGML_DEFAULT_GRAPH_SIZE, false);
+}
+
 void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor * node) {
     if (node->grad == NULL) {
         // this usually happens when we generate intermediate nodes from constants in the backward pass
@@ -6563,666 +7209,2072 @@ void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor * node)
         }
     }
 
-    // check if already visited
+    // check if already visited
+    if (!ggml_graph_visit(cgraph, node)) {
+        return;
+    }
+
+    if (node->src0) {
+        ggml_visit_parents(cgraph, node->src0);
+    }
+
+    if (node->src1) {
+        ggml_visit_parents(cgraph, node->src1);
+    }
+
+    for (int i = 0; i < GGML_MAX_OPT; ++i) {
+        if (node->opt[i]) {
+            ggml_visit_parents(cgraph, node->opt[i]);
+        }
+    }
+
+    if (node->op == GGML_OP_NONE && node->grad == NULL) {
+        // reached a leaf node, not part of the gradient graph (e.g. a constant)
+        GGML_ASSERT(cgraph->n_leafs < cgraph->size && "the graph is full - create it with ggml_new_graph_custom()");
+
+        cgraph->leafs[cgraph->n_leafs] = node;
+        cgraph->n_leafs++;
+    } else {
+        GGML_ASSERT(cgraph->n_nodes < cgraph->size && "the graph is full - create it with ggml_new_graph_custom()");
+
+        cgraph->nodes[cgraph->n_nodes] = node;
+        if (cgraph->grads) {
+            cgraph->grads[cgraph->n_nodes] = node->grad;
+        }
+        cgraph->n_nodes++;
+    }
+}
+
+void ggml_build_forward_impl(struct ggml_cgraph * cgraph, struct ggml_tensor * tensor, bool expand) {
+    if (!expand) {
+        cgraph->n_nodes = 0;
+        cgraph->n_leafs = 0;
+
+        memset(cgraph->visited, 0, cgraph->visited_size*sizeof(struct ggml_tensor *));
+    }
+
+    const int n0 = cgraph->n_nodes;
+    UNUSED(n0);
+
+    ggml_visit_parents(cgraph, tensor);
+
+    const int n_new = cgraph->n_nodes - n0;
+    GGML_PRINT_DEBUG("%s: visited %d new nodes\n", __func__, n_new);
+
+    if (n_new > 0) {
+        // the last added node should always be starting point
+        assert(cgraph->nodes[cgraph->n_nodes - 1] == tensor);
+
+        // the new nodes have to be planned
+        cgraph->n_threads_plan = 0;
+    }
+}
+
+void ggml_build_forward_expand(struct ggml_cgraph * cgraph, struct ggml_tensor * tensor) {
+    ggml_build_forward_impl(cgraph, tensor, true);
+}
+
+struct ggml_cgraph ggml_build_forward(struct ggml_context * ctx, struct ggml_tensor * tensor) {
+    struct ggml_cgraph * result = ggml_new_graph_custom(ctx, GGML_DEFAULT_GRAPH_SIZE, true);
+
+    ggml_build_forward_impl(result, tensor, false);
+
+    return *result;
+}
+
+struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep) {
+    assert(gf->n_nodes > 0);
+
+    // the backward graph starts as a copy of the forward graph, in its own arrays
+    struct ggml_cgraph result = *ggml_new_graph_custom(ctx, gf->size, true);
+
+    result.n_nodes   = gf->n_nodes;
+    result.n_leafs   = gf->n_leafs;
+    result.n_threads = gf->n_threads;
+
+    for (int i = 0; i < gf->n_nodes; i++) {
+        result.nodes[i] = gf->nodes[i];
+        result.grads[i] = gf->grads ? gf->grads[i] : gf->nodes[i]->grad;
+    }
+
+    for (int i = 0; i < gf->n_leafs; i++) {
+        result.leafs[i] = gf->leafs[i];
+    }
+
+    ggml_graph_rehash(&result);
+
+    // if we are keeping the gradient graph, we have to detach the gradient nodes from the original graph
+    if (keep) {
+        for (int i = 0; i < gf->n_nodes; i++) {
+            struct ggml_tensor * node = gf->nodes[i];
+
+            if (node->grad) {
+                node->grad = ggml_dup_tensor(ctx, node);
+                if (gf->grads) {
+                    gf->grads[i] = node->grad;
+                }
+            }
+        }
+    }
+
+    for (int i = gf->n_nodes - 1; i >= 0; i--) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        // because we detached the grad nodes from the original graph, we can afford inplace operations
+        if (node->grad) {
+            ggml_compute_backward(ctx, node, keep);
+        }
+    }
+
+    for (int i = gf->n_nodes - 1; i >= 0; i--) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        if (node->is_param) {
+            GGML_PRINT_DEBUG("%s: found root node %p\n", __func__, (void *) node);
+            ggml_build_forward_impl(&result, node->grad, true);
+        }
+    }
+
+    return result;
+}
+
+//
+// thread data
+//
+// synchronization is done via busy loops that fall back to sleeping on a condition variable
+// after n_spin iterations, so that idle threads do not keep the cores busy
+// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
+//
+
+#ifdef __APPLE__
+
+//#include <os/lock.h>
+
+//typedef os_unfair_lock ggml_lock_t;
+//
+//#define ggml_lock_init(x)    UNUSED(x)
+//#define ggml_lock_destroy(x) UNUSED(x)
+//#define ggml_lock_lock       os_unfair_lock_lock
+//#define ggml_lock_unlock     os_unfair_lock_unlock
+//
+//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
+
+typedef int ggml_lock_t;
+
+#define ggml_lock_init(x)    UNUSED(x)
+#define ggml_lock_destroy(x) UNUSED(x)
+#define ggml_lock_lock(x)    UNUSED(x)
+#define ggml_lock_unlock(x)  UNUSED(x)
+
+#define GGML_LOCK_INITIALIZER 0
+
+#else
+
+//typedef pthread_spinlock_t ggml_lock_t;
+
+//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
+//#define ggml_lock_destroy pthread_spin_destroy
+//#define ggml_lock_lock    pthread_spin_lock
+//#define ggml_lock_unlock  pthread_spin_unlock
+
+typedef int ggml_lock_t;
+
+#define ggml_lock_init(x)    UNUSED(x)
+#define ggml_lock_destroy(x) UNUSED(x)
+#define ggml_lock_lock(x)    UNUSED(x)
+#define ggml_lock_unlock(x)  UNUSED(x)
+
+#define GGML_LOCK_INITIALIZER 0
+
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ggml_cpu_relax() _mm_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define ggml_cpu_relax() __asm__ __volatile__("yield")
+#else
+#define ggml_cpu_relax()
+#endif
+
+// the wait statistics of a thread are counted by the thread itself and read by the thread that owns the pool, so the
+// counters are atomic - relaxed, as they do not order anything
+#if defined _MSC_VER || defined(__MINGW32__)
+typedef volatile LONG64 ggml_counter_t;
+
+#define ggml_counter_inc(x)   InterlockedIncrement64(x)
+#define ggml_counter_get(x)   InterlockedCompareExchange64((ggml_counter_t *) (x), 0, 0)
+#define ggml_counter_reset(x) InterlockedExchange64(x, 0)
+#else
+typedef atomic_llong ggml_counter_t;
+
+#define ggml_counter_inc(x)   atomic_fetch_add_explicit(x, 1, memory_order_relaxed)
+#define ggml_counter_get(x)   atomic_load_explicit(x, memory_order_relaxed)
+#define ggml_counter_reset(x) atomic_store_explicit(x, 0, memory_order_relaxed)
+#endif
+
+struct ggml_compute_wait_stats {
+    ggml_counter_t n_spin;
+    ggml_counter_t n_sleep;
+};
+
+static void ggml_compute_wait_stats_reset(struct ggml_compute_wait_stats * stats) {
+    ggml_counter_reset(&stats->n_spin);
+    ggml_counter_reset(&stats->n_sleep);
+}
+
+struct ggml_compute_state_shared {
+    ggml_lock_t spin;
+
+    int n_threads;
+
+    // synchronization primitives
+    atomic_int  n_ready;
+    atomic_bool has_work;
+    atomic_bool stop; // stop all threads
+
+    // number of busy loop iterations before a waiting thread goes to sleep
+    atomic_int n_spin;
+
+    // number of threads sleeping on the condition variable
+    atomic_int      n_sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+};
+
+//
+// profiler
+//
+// while a profiler is active, the graph computation records the wall time of each node and the time each thread spent
+// in the compute phase of the node. the events are reserved for the whole graph before it is computed, so the threads
+// record into their own buffers without synchronization
+//
+
+struct ggml_profiler_node_event {
+    enum ggml_op op;
+    int     n_tasks;
+    int     ne[GGML_MAX_DIMS];
+    int64_t t_start;
+    int64_t t_end; // 0 for the nodes that are not computed (no-ops)
+    int64_t flops;
+    int64_t bytes;
+};
+
+struct ggml_profiler_thread_event {
+    int     node; // index of the node event
+    int64_t t_start;
+    int64_t t_end;
+};
+
+struct ggml_profiler_thread {
+    int n_events;
+    int n_alloc;
+    struct ggml_profiler_thread_event * events;
+};
+
+struct ggml_profiler {
+    int64_t t_origin; // the times in the trace are relative to the creation of the profiler
+
+    int n_nodes;
+    int n_nodes_alloc;
+    struct ggml_profiler_node_event * nodes;
+
+    int n_threads;
+    struct ggml_profiler_thread * threads;
+};
+
+// the profiler that records the graph computations, see ggml_profiler_set_active()
+static struct ggml_profiler * g_profiler = NULL;
+
+// reserve the events of a graph with n_nodes nodes computed by n_threads threads and return the index of its first node
+static int ggml_profiler_reserve(struct ggml_profiler * prof, int n_nodes, int n_threads) {
+    if (prof->n_nodes + n_nodes > prof->n_nodes_alloc) {
+        prof->n_nodes_alloc = MAX(2*prof->n_nodes_alloc, prof->n_nodes + n_nodes);
+        prof->nodes = realloc(prof->nodes, prof->n_nodes_alloc*sizeof(struct ggml_profiler_node_event));
+        GGML_ASSERT(prof->nodes != NULL);
+    }
+
+    if (n_threads > prof->n_threads) {
+        prof->threads = realloc(prof->threads, n_threads*sizeof(struct ggml_profiler_thread));
+        GGML_ASSERT(prof->threads != NULL);
+        memset(prof->threads + prof->n_threads, 0, (n_threads - prof->n_threads)*sizeof(struct ggml_profiler_thread));
+        prof->n_threads = n_threads;
+    }
+
+    // at most one event per node and thread
+    for (int ith = 0; ith < n_threads; ith++) {
+        struct ggml_profiler_thread * thread = &prof->threads[ith];
+
+        if (thread->n_events + n_nodes > thread->n_alloc) {
+            thread->n_alloc = MAX(2*thread->n_alloc, thread->n_events + n_nodes);
+            thread->events  = realloc(thread->events, thread->n_alloc*sizeof(struct ggml_profiler_thread_event));
+            GGML_ASSERT(thread->events != NULL);
+        }
+    }
+
+    const int i0 = prof->n_nodes;
+
+    memset(prof->nodes + i0, 0, n_nodes*sizeof(struct ggml_profiler_node_event));
+    prof->n_nodes += n_nodes;
+
+    return i0;
+}
+
+// estimated number of floating point operations of the node
+static int64_t ggml_profiler_node_flops(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+            {
+                // a dot product of length ne00 for each element of the result
+                return 2*(int64_t) node->src0->ne[0]*ggml_nelements(node);
+            }
+        case GGML_OP_CONV_1D:
+            {
+                // kernel size x input channels for each element of the result
+                return 2*(int64_t) node->src0->ne[0]*node->src0->ne[1]*ggml_nelements(node);
+            }
+        case GGML_OP_FLASH_ATTN:
+            {
+                // K*Q and V*softmax(K*Q) for each head
+                return 4*(int64_t) node->src1->ne[0]*node->src1->ne[1]*node->src0->ne[1]*node->src0->ne[2]*node->src0->ne[3];
+            }
+        case GGML_OP_FLASH_ATTN_KV:
+            {
+                // K*Q and V*softmax(K*Q) for each head, over all the keys / values even if the causal mask skips some
+                return 4*(int64_t) node->src0->ne[0]*node->src1->ne[1]*node->src0->ne[1]*node->src0->ne[2]*node->src0->ne[3];
+            }
+        case GGML_OP_FLASH_FF:
+            {
+                // two matrix multiplications through the hidden layer
+                return 4*(int64_t) node->src1->ne[0]*node->src1->ne[1]*node->src0->ne[1]*node->src0->ne[2];
+            }
+        case GGML_OP_NONE:
+        case GGML_OP_DUP:
+        case GGML_OP_REPEAT:
+        case GGML_OP_CPY:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+        case GGML_OP_GET_ROWS:
+            {
+                return 0;
+            }
+        default:
+            {
+                // element-wise
+                return ggml_nelements(node);
+            }
+    }
+}
+
+// estimated number of bytes that the node reads and writes
+static int64_t ggml_profiler_node_bytes(const struct ggml_tensor * node) {
+    int64_t bytes = ggml_nbytes(node);
+
+    // only the selected rows of the table are read
+    if (node->op == GGML_OP_GET_ROWS) {
+        return bytes + ggml_nbytes(node->src1) + ggml_nelements(node->src1)*ggml_type_size(node->src0->type)*node->src0->ne[0]/ggml_blck_size(node->src0->type);
+    }
+
+    struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+    for (int j = 0; j < GGML_MAX_OPT; j++) {
+        srcs[2 + j] = node->opt[j];
+    }
+
+    for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+        if (srcs[j]) {
+            bytes += ggml_nbytes(srcs[j]);
+        }
+    }
+
+    return bytes;
+}
+
+static void ggml_profiler_record_node(
+        struct ggml_profiler * prof,
+        int i,
+        const struct ggml_tensor * node,
+        int64_t t_start,
+        int64_t t_end) {
+    struct ggml_profiler_node_event * event = &prof->nodes[i];
+
+    event->op      = node->op;
+    event->n_tasks = node->n_tasks;
+    for (int j = 0; j < GGML_MAX_DIMS; j++) {
+        event->ne[j] = node->ne[j];
+    }
+    event->t_start = t_start;
+    event->t_end   = t_end;
+    event->flops   = ggml_profiler_node_flops(node);
+    event->bytes   = ggml_profiler_node_bytes(node);
+}
+
+static inline void ggml_profiler_record_thread(struct ggml_profiler * prof, int ith, int node, int64_t t_start, int64_t t_end) {
+    struct ggml_profiler_thread * thread = &prof->threads[ith];
+
+    thread->events[thread->n_events++] = (struct ggml_profiler_thread_event) { node, t_start, t_end };
+}
+
+struct ggml_compute_state {
+    pthread_t thrd;
+
+    struct ggml_compute_params params;
+    struct ggml_tensor * node;
+
+    // group of independent single-task nodes (see ggml_graph_get_group)
+    struct ggml_tensor ** group;
+    int n_group;
+
+    // the active profiler and the index of the event of the node (of the first node of the group)
+    struct ggml_profiler * prof;
+    int prof_node;
+
+    struct ggml_compute_state_shared * shared;
+
+    struct ggml_compute_wait_stats stats;
+};
+
+// function used by each compute thread
+void * ggml_graph_compute_one(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+
+    ggml_compute_forward(&state->params, state->node);
+
+    return NULL;
+}
+
+struct ggml_threadpool {
+    struct ggml_compute_state_shared shared;
+
+    // the thread that computes the graph acts as thread 0, so there are n_threads - 1 workers
+    struct ggml_compute_state * workers;
+
+    // wait statistics of thread 0
+    struct ggml_compute_wait_stats stats;
+
+    // the NUMA node of each thread, NULL if the threads are not pinned (see ggml_threadpool_set_affinity())
+    int * node;
+};
+
+enum ggml_compute_wait_cond {
+    GGML_COMPUTE_WAIT_WORK,    // has_work == true
+    GGML_COMPUTE_WAIT_NO_WORK, // has_work == false
+    GGML_COMPUTE_WAIT_DONE,    // n_ready  == 0
+};
+
+static inline bool ggml_compute_cond(struct ggml_compute_state_shared * shared, enum ggml_compute_wait_cond cond) {
+    if (atomic_load(&shared->stop)) {
+        return true;
+    }
+
+    switch (cond) {
+        case GGML_COMPUTE_WAIT_WORK:    return  atomic_load(&shared->has_work);
+        case GGML_COMPUTE_WAIT_NO_WORK: return !atomic_load(&shared->has_work);
+        case GGML_COMPUTE_WAIT_DONE:    return  atomic_load(&shared->n_ready) == 0;
+    }
+
+    return true;
+}
+
+// busy wait for n_spin iterations and then sleep until the condition is satisfied or the pool is stopped
+// the budget is read at each iteration, so that a lower one set by ggml_threadpool_set_n_spin() applies right away
+static void ggml_compute_wait(
+        struct ggml_compute_state_shared * shared,
+        enum ggml_compute_wait_cond cond,
+        struct ggml_compute_wait_stats * stats) {
+    for (int i = 0; ; ++i) {
+        const int n_spin = atomic_load(&shared->n_spin);
+        if (n_spin >= 0 && i >= n_spin) {
+            break;
+        }
+
+        if (ggml_compute_cond(shared, cond)) {
+            ggml_counter_inc(&stats->n_spin);
+            return;
+        }
+        ggml_lock_lock  (&shared->spin);
+        ggml_lock_unlock(&shared->spin);
+        ggml_cpu_relax();
+    }
+
+    // the counter is incremented before the condition is checked under the mutex, so a thread that changes
+    // the state either sees the sleeper and wakes it up, or the sleeper sees the new state
+    atomic_fetch_add(&shared->n_sleeping, 1);
+
+    pthread_mutex_lock(&shared->mutex);
+    while (!ggml_compute_cond(shared, cond)) {
+        pthread_cond_wait(&shared->cond, &shared->mutex);
+    }
+    pthread_mutex_unlock(&shared->mutex);
+
+    atomic_fetch_sub(&shared->n_sleeping, 1);
+
+    ggml_counter_inc(&stats->n_sleep);
+}
+
+// must be called after every change of has_work, n_ready or stop that another thread may be waiting for
+static inline void ggml_compute_notify(struct ggml_compute_state_shared * shared) {
+    if (atomic_load(&shared->n_sleeping) > 0) {
+        pthread_mutex_lock(&shared->mutex);
+        pthread_cond_broadcast(&shared->cond);
+        pthread_mutex_unlock(&shared->mutex);
+    }
+}
+
+// the forward pass of these ops does not compute anything
+static inline bool ggml_is_nop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// memory range [begin, end) spanned by the elements of the tensor - empty if the tensor has no elements
+static void ggml_tensor_extent(const struct ggml_tensor * tensor, const char ** begin, const char ** end) {
+    size_t size = 0;
+
+    if (ggml_nelements(tensor) > 0) {
+        size = GGML_TYPE_SIZE[tensor->type];
+        for (int i = 0; i < GGML_MAX_DIMS; i++) {
+            const int n = i == 0 ? tensor->ne[0]/GGML_BLCK_SIZE[tensor->type] : tensor->ne[i];
+            size += (n - 1)*tensor->nb[i];
+        }
+    }
+
+    *begin = (const char *) tensor->data;
+    *end   = *begin + size;
+}
+
+bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a == NULL || b == NULL) {
+        return false;
+    }
+
+    const char * a0; const char * a1;
+    const char * b0; const char * b1;
+
+    ggml_tensor_extent(a, &a0, &a1);
+    ggml_tensor_extent(b, &b0, &b1);
+
+    // an empty range that starts inside the other one does not overlap it
+    return a0 < a1 && b0 < b1 && a0 < b1 && b0 < a1;
+}
+
+// check if the node reads memory that overlaps with the tensor
+static bool ggml_node_reads(const struct ggml_tensor * node, const struct ggml_tensor * tensor) {
+    if (ggml_tensors_overlap(node->src0, tensor) || ggml_tensors_overlap(node->src1, tensor)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_OPT; i++) {
+        if (ggml_tensors_overlap(node->opt[i], tensor)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// two nodes can be computed concurrently if neither of them writes memory that the other one reads or writes
+// the check is done on the memory and not on the graph edges, because writes into views (e.g. the KV cache)
+// are not visible as edges between the writer and the reader
+static bool ggml_nodes_independent(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    return !ggml_tensors_overlap(a, b) && !ggml_node_reads(a, b) && !ggml_node_reads(b, a);
+}
+
+// number of consecutive nodes starting at i0 that form a group of independent single-task nodes
+// no-op nodes in between are included in the group
+static int ggml_graph_get_group(const struct ggml_cgraph * cgraph, int i0, int n_max) {
+    int n_group = 1;
+    int n_real  = 1;
+
+    for (int i = i0 + 1; i < cgraph->n_nodes && n_real < n_max; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_is_nop(node)) {
+            continue;
+        }
+
+        if (node->n_tasks != 1 || ggml_nelements(node) < GGML_GROUP_MIN_NELEMENTS) {
+            break;
+        }
+
+        bool independent = true;
+        for (int j = i0; j < i && independent; j++) {
+            if (!ggml_is_nop(cgraph->nodes[j])) {
+                independent = ggml_nodes_independent(cgraph->nodes[j], node);
+            }
+        }
+
+        if (!independent) {
+            break;
+        }
+
+        n_group = i - i0 + 1;
+        n_real++;
+    }
+
+    return n_group;
+}
+
+// thread ith computes every nth node of the group
+// with a profiler, the events of the nodes of the group start at index prof_node
+static void ggml_graph_compute_group(
+        struct ggml_tensor ** group,
+        int n_group,
+        int ith,
+        int nth,
+        struct ggml_profiler * prof,
+        int prof_node) {
+    int k = 0;
+
+    for (int i = 0; i < n_group; i++) {
+        struct ggml_tensor * node = group[i];
+
+        if (ggml_is_nop(node)) {
+            if (ith == 0) {
+                node->perf_runs++;
+            }
+            continue;
+        }
+
+        if ((k++)%nth != ith) {
+            continue;
+        }
+
+        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
+        const int64_t perf_node_start_time_us = ggml_perf_time_us();
+
+        const int64_t t_start = prof ? ggml_time_ns() : 0;
+
+        struct ggml_compute_params params = {
+            /*.type  =*/ GGML_TASK_INIT,
+            /*.ith   =*/ 0,
+            /*.nth   =*/ 1,
+            /*.wsize =*/ 0,
+            /*.wdata =*/ NULL,
+        };
+
+        ggml_compute_forward(&params, node);
+
+        params.type = GGML_TASK_COMPUTE;
+        ggml_compute_forward(&params, node);
+
+        params.type = GGML_TASK_FINALIZE;
+        ggml_compute_forward(&params, node);
+
+        node->perf_runs++;
+        node->perf_cycles  += ggml_perf_cycles()  - perf_node_start_cycles;
+        node->perf_time_us += ggml_perf_time_us() - perf_node_start_time_us;
+
+        // the node is computed by a single thread, so its wall time is the time of that thread
+        if (prof) {
+            const int64_t t_end = ggml_time_ns();
+
+            ggml_profiler_record_node  (prof, prof_node + i, node, t_start, t_end);
+            ggml_profiler_record_thread(prof, ith, prof_node + i, t_start, t_end);
+        }
+    }
+}
+
+thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+
+    const int n_threads = state->shared->n_threads;
+
+    while (true) {
+        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
+            atomic_store(&state->shared->has_work, false);
+            ggml_compute_notify(state->shared);
+        } else {
+            ggml_compute_wait(state->shared, GGML_COMPUTE_WAIT_NO_WORK, &state->stats);
+            if (atomic_load(&state->shared->stop)) {
+                return 0;
+            }
+        }
+
+        atomic_fetch_sub(&state->shared->n_ready, 1);
+        ggml_compute_notify(state->shared);
+
+        // wait for work
+        ggml_compute_wait(state->shared, GGML_COMPUTE_WAIT_WORK, &state->stats);
+
+        // check if we should stop
+        if (atomic_load(&state->shared->stop)) {
+            break;
+        }
+
+        if (state->node) {
+            if (state->prof && state->params.type == GGML_TASK_COMPUTE) {
+                const int64_t t_start = ggml_time_ns();
+
+                ggml_compute_forward(&state->params, state->node);
+
+                ggml_profiler_record_thread(state->prof, state->params.ith, state->prof_node, t_start, ggml_time_ns());
+            } else {
+                ggml_compute_forward(&state->params, state->node);
+            }
+            state->node = NULL;
+        } else if (state->n_group > 0) {
+            ggml_graph_compute_group(state->group, state->n_group, state->params.ith, state->params.nth, state->prof, state->prof_node);
+            state->group   = NULL;
+            state->n_group = 0;
+        } else {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    GGML_ASSERT(n_threads > 0);
+
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    GGML_ASSERT(pool != NULL);
+
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    shared->spin      = GGML_LOCK_INITIALIZER;
+    shared->n_threads = n_threads;
+
+    atomic_store(&shared->n_ready,  0);
+    atomic_store(&shared->has_work, false);
+    atomic_store(&shared->stop,     false);
+
+    atomic_store(&shared->n_spin,     GGML_DEFAULT_N_SPIN);
+    atomic_store(&shared->n_sleeping, 0);
+
+    pool->workers = NULL;
+    pool->node    = NULL;
+
+    ggml_compute_wait_stats_reset(&pool->stats);
+
+    if (n_threads > 1) {
+        ggml_lock_init(&shared->spin);
+
+        pthread_mutex_init(&shared->mutex, NULL);
+        pthread_cond_init (&shared->cond,  NULL);
+
+        atomic_store(&shared->has_work, true);
+
+        pool->workers = malloc(sizeof(struct ggml_compute_state)*(n_threads - 1));
+        GGML_ASSERT(pool->workers != NULL);
+
+        for (int j = 0; j < n_threads - 1; j++) {
+            pool->workers[j] = (struct ggml_compute_state) {
+                .thrd   = 0,
+                .params = {
+                    .type  = GGML_TASK_COMPUTE,
+                    .ith   = j + 1,
+                    .nth   = n_threads,
+                    .wsize = 0,
+                    .wdata = NULL,
+                },
+                .node      = NULL,
+                .group     = NULL,
+                .n_group   = 0,
+                .prof      = NULL,
+                .prof_node = 0,
+                .shared    = shared,
+            };
+            ggml_compute_wait_stats_reset(&pool->workers[j].stats);
+
+            int rc = pthread_create(&pool->workers[j].thrd, NULL, ggml_graph_compute_thread, &pool->workers[j]);
+            assert(rc == 0);
+            UNUSED(rc);
+        }
+    }
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    if (shared->n_threads > 1) {
+        atomic_store(&shared->stop, true);
+        atomic_store(&shared->has_work, true);
+        ggml_compute_notify(shared);
+
+        for (int j = 0; j < shared->n_threads - 1; j++) {
+            int rc = pthread_join(pool->workers[j].thrd, NULL);
+            assert(rc == 0);
+            UNUSED(rc);
+        }
+
+        pthread_cond_destroy (&shared->cond);
+        pthread_mutex_destroy(&shared->mutex);
+
+        ggml_lock_destroy(&shared->spin);
+    }
+
+    free(pool->workers);
+    free(pool->node);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->shared.n_threads;
+}
+
+// between graph computations, the workers wait for work - with a spin budget, wait until they all went to sleep, so
+// that none of them is still in a wait that started with the previous budget or before the statistics were reset
+static void ggml_threadpool_park(struct ggml_threadpool * pool) {
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    if (atomic_load(&shared->n_spin) < 0) {
+        return;
+    }
+
+    while (atomic_load(&shared->n_sleeping) < shared->n_threads - 1) {
+        sched_yield();
+    }
+}
+
+void ggml_threadpool_set_n_spin(struct ggml_threadpool * pool, int n_spin) {
+    atomic_store(&pool->shared.n_spin, n_spin);
+
+    ggml_threadpool_park(pool);
+}
+
+struct ggml_threadpool_stats ggml_threadpool_get_stats(const struct ggml_threadpool * pool) {
+    struct ggml_threadpool_stats result = {
+        .n_spin  = ggml_counter_get(&pool->stats.n_spin),
+        .n_sleep = ggml_counter_get(&pool->stats.n_sleep),
+    };
+
+    for (int j = 0; j < pool->shared.n_threads - 1; j++) {
+        result.n_spin  += ggml_counter_get(&pool->workers[j].stats.n_spin);
+        result.n_sleep += ggml_counter_get(&pool->workers[j].stats.n_sleep);
+    }
+
+    return result;
+}
+
+void ggml_threadpool_reset_stats(struct ggml_threadpool * pool) {
+    ggml_threadpool_park(pool);
+
+    ggml_compute_wait_stats_reset(&pool->stats);
+
+    for (int j = 0; j < pool->shared.n_threads - 1; j++) {
+        ggml_compute_wait_stats_reset(&pool->workers[j].stats);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// NUMA
+
+#define GGML_NUMA_MAX_NODES 64
+#define GGML_NUMA_MAX_CPUS  1024
+
+// the nodes that have cpus - the cpus of node i are cpus[cpu0[i] .. cpu0[i + 1])
+struct ggml_numa_topology {
+    int n_nodes;
+    int node[GGML_NUMA_MAX_NODES];
+    int cpu0[GGML_NUMA_MAX_NODES + 1];
+    int cpus[GGML_NUMA_MAX_CPUS];
+};
+
+// read the nodes and their cpus from /sys/devices/system/node - a system without NUMA information is a single node
+// with the cpus of the process
+static void ggml_numa_get_topology(struct ggml_numa_topology * topo) {
+    topo->n_nodes = 0;
+    topo->cpu0[0] = 0;
+
+#if defined(__linux__)
+    for (int id = 0; id < GGML_NUMA_MAX_NODES; id++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+
+        FILE * f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+
+        // a list of ranges, e.g. "0-7,16-23"
+        int n = topo->cpu0[topo->n_nodes];
+
+        int c0 = 0;
+        int c1 = 0;
+        while (fscanf(f, "%d", &c0) == 1) {
+            c1 = c0;
+
+            int c = fgetc(f);
+            if (c == '-') {
+                if (fscanf(f, "%d", &c1) != 1) {
+                    break;
+                }
+                c = fgetc(f);
+            }
+
+            for (int cpu = c0; cpu <= c1 && n < GGML_NUMA_MAX_CPUS; cpu++) {
+                topo->cpus[n++] = cpu;
+            }
+
+            if (c != ',') {
+                break;
+            }
+        }
+
+        fclose(f);
+
+        if (n > topo->cpu0[topo->n_nodes]) {
+            topo->node[topo->n_nodes] = id;
+            topo->n_nodes++;
+            topo->cpu0[topo->n_nodes] = n;
+        }
+    }
+
+    if (topo->n_nodes == 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        int n = 0;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE && n < GGML_NUMA_MAX_CPUS; cpu++) {
+                if (CPU_ISSET(cpu, &set)) {
+                    topo->cpus[n++] = cpu;
+                }
+            }
+        }
+
+        if (n > 0) {
+            topo->node[0] = 0;
+            topo->n_nodes = 1;
+            topo->cpu0[1] = n;
+        }
+    }
+#endif
+}
+
+int ggml_numa_n_nodes(void) {
+    struct ggml_numa_topology topo;
+    ggml_numa_get_topology(&topo);
+
+    return MAX(1, topo.n_nodes);
+}
+
+bool ggml_threadpool_set_affinity(struct ggml_threadpool * pool) {
+#if defined(__linux__)
+    struct ggml_numa_topology topo;
+    ggml_numa_get_topology(&topo);
+
+    if (topo.n_nodes == 0) {
+        return false;
+    }
+
+    const int n_threads = pool->shared.n_threads;
+    const int n_nodes   = topo.n_nodes;
+
+    int * node = malloc(sizeof(int)*n_threads);
+    GGML_ASSERT(node != NULL);
+
+    bool ok = true;
+
+    for (int ith = 0; ith < n_threads; ith++) {
+        // the threads [i*n_threads/n_nodes, (i + 1)*n_threads/n_nodes) go to node i
+        const int in = (int) ((int64_t) ith*n_nodes/n_threads);
+        const int i0 = (int) (((int64_t) in*n_threads + n_nodes - 1)/n_nodes); // first thread of the node
+
+        const int n_cpus = topo.cpu0[in + 1] - topo.cpu0[in];
+        const int cpu    = topo.cpus[topo.cpu0[in] + (ith - i0)%n_cpus];
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        const pthread_t thrd = ith == 0 ? pthread_self() : pool->workers[ith - 1].thrd;
+
+        ok = pthread_setaffinity_np(thrd, sizeof(set), &set) == 0 && ok;
+
+        node[ith] = topo.node[in];
+    }
+
+    free(pool->node);
+    pool->node = node;
+
+    return ok;
+#else
+    UNUSED(pool);
+    return false;
+#endif
+}
+
+#if defined(__linux__)
+#define GGML_MPOL_BIND       2
+#define GGML_MPOL_INTERLEAVE 3
+#define GGML_MPOL_MF_MOVE    (1 << 1)
+
+// check that the pages in [p0, p1) that are in memory are on the nodes of the mask, on a sample of up to 64 pages
+// mbind() with MPOL_MF_MOVE skips the pages it cannot move without an error (e.g. the pages of a shared file mapping)
+static bool ggml_numa_check(uintptr_t p0, uintptr_t p1, uintptr_t page, unsigned long nodemask) {
+    enum { n_max = 64 };
+
+    void * pages[n_max];
+    int status[n_max];
+
+    const uintptr_t n_pages = (p1 - p0)/page;
+    const int n = (int) MIN(n_pages, (uintptr_t) n_max);
+
+    for (int i = 0; i < n; i++) {
+        pages[i] = (void *) (p0 + (i*n_pages/n)*page);
+    }
+
+    // without target nodes, move_pages() only returns the node of each page
+    if (syscall(SYS_move_pages, 0, (unsigned long) n, pages, NULL, status, 0) != 0) {
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        // a negative status is an error, e.g. -ENOENT for a page that is not in memory yet - it will be allocated
+        // according to the policy
+        if (status[i] >= GGML_NUMA_MAX_NODES || (status[i] >= 0 && !(nodemask & (1ul << status[i])))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// set the memory policy of the pages in [begin, end), rounded inwards to whole pages, and move the pages that are
+// already there - false if the pages are not on the nodes afterwards
+static bool ggml_numa_mbind(const char * begin, const char * end, int mode, unsigned long nodemask) {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+
+    const uintptr_t p0 = ((uintptr_t) begin + page - 1) & ~(page - 1);
+    const uintptr_t p1 = ((uintptr_t) end) & ~(page - 1);
+
+    if (p0 >= p1) {
+        return true;
+    }
+
+    // the kernel reads maxnode - 1 bits of the mask
+    if (syscall(SYS_mbind, (void *) p0, p1 - p0, mode, &nodemask, GGML_NUMA_MAX_NODES + 1, GGML_MPOL_MF_MOVE) != 0) {
+        return false;
+    }
+
+    return ggml_numa_check(p0, p1, page, nodemask);
+}
+#endif
+
+bool ggml_numa_place(const struct ggml_threadpool * pool, struct ggml_tensor * tensor, enum ggml_numa_placement placement) {
+#if defined(__linux__)
+    const char * data = (const char *) tensor->data;
+
+    if (data == NULL) {
+        return false;
+    }
+
+    if (placement == GGML_NUMA_INTERLEAVE || pool->node == NULL) {
+        struct ggml_numa_topology topo;
+        ggml_numa_get_topology(&topo);
+
+        if (topo.n_nodes < 2) {
+            return true;
+        }
+
+        unsigned long nodemask = 0;
+        for (int i = 0; i < topo.n_nodes; i++) {
+            nodemask |= 1ul << topo.node[i];
+        }
+
+        return ggml_numa_mbind(data, data + ggml_nbytes(tensor), GGML_MPOL_INTERLEAVE, nodemask);
+    }
+
+    // the rows that a thread computes in a mul_mat (see ggml_compute_forward_mul_mat_f32), placed on its node
+    const int n_threads = pool->shared.n_threads;
+
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+
+    const int nr = ggml_nrows(tensor);
+    const int dr = (nr + n_threads - 1)/n_threads;
+
+    bool ok = true;
+
+    for (int ith = 0; ith < n_threads; ) {
+        // the consecutive threads on the same node
+        int ith1 = ith + 1;
+        while (ith1 < n_threads && pool->node[ith1] == pool->node[ith]) {
+            ith1++;
+        }
+
+        const int ir0 = MIN(dr*ith,  nr);
+        const int ir1 = MIN(dr*ith1, nr);
+
+        // the page on the boundary between two nodes goes to the first one
+        const char * begin = data + ir0*tensor->nb[1];
+        const char * end   = data + ir1*tensor->nb[1];
+
+        if (ith1 < n_threads) {
+            end = (const char *) (((uintptr_t) end + page - 1) & ~(page - 1));
+        }
+
+        if (begin < end) {
+            ok = ggml_numa_mbind(begin, end, GGML_MPOL_BIND, 1ul << pool->node[ith]) && ok;
+        }
+
+        ith = ith1;
+    }
+
+    return ok;
+#else
+    UNUSED(pool);
+    UNUSED(tensor);
+    UNUSED(placement);
+    return false;
+#endif
+}
+
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    if (cgraph->n_threads <= 0) {
+        cgraph->n_threads = 8;
+    }
+
+    struct ggml_threadpool * pool = ggml_threadpool_new(cgraph->n_threads);
+
+    ggml_graph_compute_with_pool(ctx, cgraph, pool);
+
+    ggml_threadpool_free(pool);
+}
+
+// wait until all threads of the pool have reached the barrier
+static void ggml_graph_compute_barrier_enter(struct ggml_threadpool * pool) {
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    if (atomic_fetch_add(&shared->n_ready, 1) == shared->n_threads - 1) {
+        atomic_store(&shared->has_work, false);
+        ggml_compute_notify(shared);
+    }
+
+    ggml_compute_wait(shared, GGML_COMPUTE_WAIT_NO_WORK, &pool->stats);
+}
+
+// wait until all threads of the pool have left the barrier
+static void ggml_graph_compute_barrier_leave(struct ggml_threadpool * pool) {
+    struct ggml_compute_state_shared * shared = &pool->shared;
+
+    atomic_fetch_sub(&shared->n_ready, 1);
+    ggml_compute_notify(shared);
+
+    ggml_compute_wait(shared, GGML_COMPUTE_WAIT_DONE, &pool->stats);
+}
+
+// start the workers after their tasks have been set between barrier_enter and barrier_leave
+static void ggml_graph_compute_launch(struct ggml_threadpool * pool) {
+    atomic_store(&pool->shared.has_work, true);
+    ggml_compute_notify(&pool->shared);
+}
+
+// set the number of tasks of each node and return the size of the work buffer that the nodes need
+static size_t ggml_graph_plan_tasks(struct ggml_cgraph * cgraph, const int n_threads) {
+    size_t work_size = 0;
+
+    // thread scheduling for the different operations
     for (int i = 0; i < cgraph->n_nodes; i++) {
-        if (cgraph->nodes[i] == node) {
-            return;
-        }
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        switch (node->op) {
+            case GGML_OP_DUP:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_ADD:
+            case GGML_OP_MUL:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_SUM:
+            case GGML_OP_MEAN:
+            case GGML_OP_REPEAT:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_RELU:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_GELU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NORM:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    // TODO: use different scheduling for different matrix sizes
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    // TODO: better way to determine if the matrix is transposed
+                    if (node->src0->nb[1] < node->src0->nb[0]) {
+                        cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
+
+                        // the blocked gemm also takes an f16 src0 that is transposed
+                        if (ggml_compute_forward_mul_mat_use_gemm(node->src0, node->src1, node)) {
+                            cur = MAX(cur, sizeof(float)*ggml_gemm_band_size(node->src0->ne[0])*node->n_tasks);
+                        }
+                    } else {
+                        if (node->src0->type == GGML_TYPE_F16 &&
+                            node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
+                            } else if (ggml_compute_forward_mul_mat_use_gemm(node->src0, node->src1, node)) {
+                                cur = sizeof(float)*ggml_gemm_band_size(node->src0->ne[0])*node->n_tasks;
+                            } else {
+                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
+                            }
+#else
+                            if (ggml_compute_forward_mul_mat_use_gemm(node->src0, node->src1, node)) {
+                                cur = sizeof(float)*ggml_gemm_band_size(node->src0->ne[0])*node->n_tasks;
+                            } else {
+                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
+                            }
+#endif
+                        } else if (node->src0->type == GGML_TYPE_F32 &&
+                                   node->src1->type == GGML_TYPE_F32) {
+                            cur = 0;
+                        } else if (ggml_is_quantized(node->src0->type) &&
+                                   node->src1->type == GGML_TYPE_F32) {
+                            const enum ggml_type type_q = ggml_vec->quantize_fns[node->src0->type].vec_dot_type;
+                            cur = (GGML_TYPE_SIZE[type_q]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[type_q];
+                        } else {
+                            GGML_ASSERT(false);
+                        }
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_CPY:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_DIAG_MASK_INF:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_SOFT_MAX:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ROPE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_CONV_1D:
+                {
+                    node->n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    const size_t cur = sizeof(float)*ggml_conv_1d_work_size(node->src0, node, node->n_tasks);
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN_KV:
+                {
+                    node->n_tasks = n_threads;
+
+                    const int D  = node->src0->ne[0];
+                    const int nr = node->src0->ne[1]*node->src0->ne[2]*node->src0->ne[3];
+
+                    const int n_chunks = ggml_flash_attn_kv_n_chunks(nr, node->src1->ne[1], node->n_tasks);
+
+                    size_t cur = sizeof(float)*ggml_flash_attn_kv_scratch(D)*node->n_tasks;
+
+                    if (n_chunks > 1) {
+                        cur += sizeof(float)*(size_t) nr*n_chunks*(D + 2);
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_OPT_ADAM:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NORM_MUL_ADD:
+            case GGML_OP_ADD_GELU:
+            case GGML_OP_SCALE_MASK_SOFT_MAX:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    assert(false);
+                } break;
+        };
     }
 
-    for (int i = 0; i < cgraph->n_leafs; i++) {
-        if (cgraph->leafs[i] == node) {
-            return;
+    return work_size;
+}
+
+// size of the work buffer that is allocated for the graph, including the per-thread cache line padding
+static size_t ggml_graph_work_size(size_t work_size, const int n_threads) {
+    return work_size > 0 ? work_size + CACHE_LINE_SIZE*(n_threads - 1) : 0;
+}
+
+void ggml_graph_compute_with_pool(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool) {
+    GGML_ASSERT(pool != NULL);
+
+    cgraph->n_threads = pool->shared.n_threads;
+
+    const int n_threads = cgraph->n_threads;
+
+    struct ggml_compute_state * workers = pool->workers;
+
+    // initialize tasks + work buffer
+    // a graph that is computed again with the same number of threads keeps its plan
+    if (cgraph->n_threads_plan != n_threads) {
+        const size_t work_size = ggml_graph_work_size(ggml_graph_plan_tasks(cgraph, n_threads), n_threads);
+
+        // a graph that was planned for fewer threads (or placed by ggml_graph_alloc) may need a larger work buffer
+        // the old one is left where it is
+        if (work_size > cgraph->work_size) {
+            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, work_size);
+
+            // the work buffer is allocated in the context even if the tensors of the graph are not
+            const bool no_alloc = ctx->no_alloc;
+            ctx->no_alloc = false;
+            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, work_size);
+            ctx->no_alloc = no_alloc;
+
+            GGML_ASSERT(cgraph->work != NULL);
+
+            cgraph->work_size = work_size;
         }
-    }
 
-    if (node->src0) {
-        ggml_visit_parents(cgraph, node->src0);
+        cgraph->n_threads_plan = n_threads;
     }
 
-    if (node->src1) {
-        ggml_visit_parents(cgraph, node->src1);
+    // the events of the graph are reserved before the workers are started, so they don't move while being written
+    struct ggml_profiler * prof = g_profiler;
+
+    const int prof_base = prof ? ggml_profiler_reserve(prof, cgraph->n_nodes, n_threads) : 0;
+
+    for (int j = 0; j < n_threads - 1; j++) {
+        workers[j].prof = prof;
     }
 
-    for (int i = 0; i < GGML_MAX_OPT; ++i) {
-        if (node->opt[i]) {
-            ggml_visit_parents(cgraph, node->opt[i]);
+    const int64_t perf_start_cycles  = ggml_perf_cycles();
+    const int64_t perf_start_time_us = ggml_perf_time_us();
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
+
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        // TODO: this could be used to avoid unnecessary computations, but it needs to be improved
+        //if (node->grad == NULL && node->perf_runs > 0) {
+        //    continue;
+        //}
+
+        if (ggml_is_nop(node)) {
+            node->perf_runs++;
+            continue;
         }
-    }
 
-    if (node->op == GGML_OP_NONE && node->grad == NULL) {
-        // reached a leaf node, not part of the gradient graph (e.g. a constant)
-        assert(cgraph->n_leafs < GGML_MAX_NODES);
+        // compute independent single-task nodes concurrently, instead of one after another on the main thread
+        if (n_threads > 1 && node->n_tasks == 1 && ggml_nelements(node) >= GGML_GROUP_MIN_NELEMENTS) {
+            const int n_group = ggml_graph_get_group(cgraph, i, GGML_GROUP_MAX_TASKS*n_threads);
+
+            if (n_group > 1) {
+                ggml_graph_compute_barrier_enter(pool);
+
+                for (int j = 0; j < n_threads - 1; j++) {
+                    workers[j].params = (struct ggml_compute_params) {
+                        .type  = GGML_TASK_COMPUTE,
+                        .ith   = j + 1,
+                        .nth   = n_threads,
+                        .wsize = 0,
+                        .wdata = NULL,
+                    };
+                    workers[j].group     = &cgraph->nodes[i];
+                    workers[j].n_group   = n_group;
+                    workers[j].prof_node = prof_base + i;
+                }
 
-        cgraph->leafs[cgraph->n_leafs] = node;
-        cgraph->n_leafs++;
-    } else {
-        assert(cgraph->n_nodes < GGML_MAX_NODES);
+                ggml_graph_compute_barrier_leave(pool);
+                ggml_graph_compute_launch(pool);
 
-        cgraph->nodes[cgraph->n_nodes] = node;
-        cgraph->grads[cgraph->n_nodes] = node->grad;
-        cgraph->n_nodes++;
-    }
-}
+                ggml_graph_compute_group(&cgraph->nodes[i], n_group, 0, n_threads, prof, prof_base + i);
 
-void ggml_build_forward_impl(struct ggml_cgraph * cgraph, struct ggml_tensor * tensor, bool expand) {
-    if (!expand) {
-        cgraph->n_nodes = 0;
-        cgraph->n_leafs = 0;
-    }
+                // wait for thread pool
+                ggml_graph_compute_barrier_enter(pool);
+                ggml_graph_compute_barrier_leave(pool);
 
-    const int n0 = cgraph->n_nodes;
-    UNUSED(n0);
+                i += n_group - 1;
+                continue;
+            }
+        }
 
-    ggml_visit_parents(cgraph, tensor);
+        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
+        const int64_t perf_node_start_time_us = ggml_perf_time_us();
 
-    const int n_new = cgraph->n_nodes - n0;
-    GGML_PRINT_DEBUG("%s: visited %d new nodes\n", __func__, n_new);
+        const int64_t t_node_start = prof ? ggml_time_ns() : 0;
 
-    if (n_new > 0) {
-        // the last added node should always be starting point
-        assert(cgraph->nodes[cgraph->n_nodes - 1] == tensor);
-    }
-}
+        // INIT
+        struct ggml_compute_params params = {
+            /*.type  =*/ GGML_TASK_INIT,
+            /*.ith   =*/ 0,
+            /*.nth   =*/ node->n_tasks,
+            /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+            /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
+        };
 
-void ggml_build_forward_expand(struct ggml_cgraph * cgraph, struct ggml_tensor * tensor) {
-    ggml_build_forward_impl(cgraph, tensor, true);
-}
+        ggml_compute_forward(&params, node);
 
-struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
-    struct ggml_cgraph result = {
-        /*.n_nodes      =*/ 0,
-        /*.n_leafs      =*/ 0,
-        /*.n_threads    =*/ 0,
-        /*.work_size    =*/ 0,
-        /*.work         =*/ NULL,
-        /*.nodes        =*/ { NULL },
-        /*.grads        =*/ { NULL },
-        /*.leafs        =*/ { NULL },
-        /*.perf_runs    =*/ 0,
-        /*.perf_cycles  =*/ 0,
-        /*.perf_time_us =*/ 0,
-    };
+        // COMPUTE
+        if (node->n_tasks > 1) {
+            ggml_graph_compute_barrier_enter(pool);
 
-    ggml_build_forward_impl(&result, tensor, false);
+            // launch thread pool
+            for (int j = 0; j < n_threads - 1; j++) {
+                workers[j].params = (struct ggml_compute_params) {
+                    .type  = GGML_TASK_COMPUTE,
+                    .ith   = j + 1,
+                    .nth   = n_threads,
+                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+                    .wdata = cgraph->work ? cgraph->work->data : NULL,
+                };
+                workers[j].node      = node;
+                workers[j].prof_node = prof_base + i;
+            }
 
-    return result;
-}
+            ggml_graph_compute_barrier_leave(pool);
 
-struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep) {
-    struct ggml_cgraph result = *gf;
+            ggml_graph_compute_launch(pool);
+        }
 
-    assert(gf->n_nodes > 0);
+        params.type = GGML_TASK_COMPUTE;
 
-    // if we are keeping the gradient graph, we have to detach the gradient nodes from the original graph
-    if (keep) {
-        for (int i = 0; i < gf->n_nodes; i++) {
-            struct ggml_tensor * node = gf->nodes[i];
+        if (prof) {
+            const int64_t t_start = ggml_time_ns();
 
-            if (node->grad) {
-                node->grad = ggml_dup_tensor(ctx, node);
-                gf->grads[i] = node->grad;
+            ggml_compute_forward(&params, node);
+
+            ggml_profiler_record_thread(prof, 0, prof_base + i, t_start, ggml_time_ns());
+        } else {
+            ggml_compute_forward(&params, node);
+        }
+
+        // wait for thread pool
+        if (node->n_tasks > 1) {
+            ggml_graph_compute_barrier_enter(pool);
+            ggml_graph_compute_barrier_leave(pool);
+        }
+
+        // FINALIZE
+        if (node->n_tasks > 1) {
+            ggml_graph_compute_barrier_enter(pool);
+
+            // launch thread pool
+            for (int j = 0; j < n_threads - 1; j++) {
+                workers[j].params = (struct ggml_compute_params) {
+                    .type  = GGML_TASK_FINALIZE,
+                    .ith   = j + 1,
+                    .nth   = n_threads,
+                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+                    .wdata = cgraph->work ? cgraph->work->data : NULL,
+                };
+                workers[j].node = node;
             }
+
+            ggml_graph_compute_barrier_leave(pool);
+
+            ggml_graph_compute_launch(pool);
         }
-    }
 
-    for (int i = gf->n_nodes - 1; i >= 0; i--) {
-        struct ggml_tensor * node = gf->nodes[i];
+        params.type = GGML_TASK_FINALIZE;
+        ggml_compute_forward(&params, node);
 
-        // because we detached the grad nodes from the original graph, we can afford inplace operations
-        if (node->grad) {
-            ggml_compute_backward(ctx, node, keep);
+        // wait for thread pool
+        if (node->n_tasks > 1) {
+            ggml_graph_compute_barrier_enter(pool);
+            ggml_graph_compute_barrier_leave(pool);
+        }
+
+        // performance stats (node)
+        {
+            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
+            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
+
+            node->perf_runs++;
+            node->perf_cycles  += perf_cycles_cur;
+            node->perf_time_us += perf_time_us_cur;
+        }
+
+        if (prof) {
+            ggml_profiler_record_node(prof, prof_base + i, node, t_node_start, ggml_time_ns());
         }
     }
 
-    for (int i = gf->n_nodes - 1; i >= 0; i--) {
-        struct ggml_tensor * node = gf->nodes[i];
+    // performance stats (graph)
+    {
+        int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
+        int64_t perf_time_us_cur = ggml_perf_time_us() - perf_start_time_us;
 
-        if (node->is_param) {
-            GGML_PRINT_DEBUG("%s: found root node %p\n", __func__, (void *) node);
-            ggml_build_forward_impl(&result, node->grad, true);
+        cgraph->perf_runs++;
+        cgraph->perf_cycles  += perf_cycles_cur;
+        cgraph->perf_time_us += perf_time_us_cur;
+
+        GGML_PRINT_DEBUG("%s: perf (%d) - cpu = %.3f / %.3f ms, wall = %.3f / %.3f ms\n",
+                __func__, cgraph->perf_runs,
+                (double) perf_cycles_cur      / (double) ggml_cycles_per_ms(),
+                (double) cgraph->perf_cycles  / (double) ggml_cycles_per_ms() / (double) cgraph->perf_runs,
+                (double) perf_time_us_cur     / 1000.0,
+                (double) cgraph->perf_time_us / 1000.0 / cgraph->perf_runs);
+    }
+}
+
+void ggml_graph_reset(struct ggml_cgraph * cgraph) {
+    if (cgraph->grads == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * grad = cgraph->grads[i];
+
+        if (grad) {
+            ggml_set_zero(grad);
         }
     }
-
-    return result;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+// graph memory planner
 //
-// thread data
-//
-// synchronization is done via busy loops
-// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
+// the memory of the planned tensors is handed out from a virtual buffer with a best-fit free list, so the offsets
+// can be computed without a real buffer. a tensor is released after the last node that reads it and after the last
+// of its views, and the memory of a node is taken before its sources are released, so no node overlaps its inputs
 //
 
-#ifdef __APPLE__
+#define GGML_GRAPH_ALLOC_MAX_FREE 256
 
-//#include <os/lock.h>
+struct ggml_graph_alloc_block {
+    size_t offset;
+    size_t size;
+};
 
-//typedef os_unfair_lock ggml_lock_t;
-//
-//#define ggml_lock_init(x)    UNUSED(x)
-//#define ggml_lock_destroy(x) UNUSED(x)
-//#define ggml_lock_lock       os_unfair_lock_lock
-//#define ggml_lock_unlock     os_unfair_lock_unlock
-//
-//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
+struct ggml_graph_allocr {
+    size_t max_size; // high-water mark of the used memory
 
-typedef int ggml_lock_t;
+    // the free blocks are sorted by offset and the last one extends to infinity
+    int n_free;
+    struct ggml_graph_alloc_block free[GGML_GRAPH_ALLOC_MAX_FREE];
+};
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+static size_t ggml_graph_allocr_alloc(struct ggml_graph_allocr * alloc, size_t size) {
+    size = ((size + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
 
-#define GGML_LOCK_INITIALIZER 0
+    // best fit among the bounded blocks, otherwise from the start of the unbounded one
+    int best = alloc->n_free - 1;
+    for (int i = 0; i < alloc->n_free - 1; i++) {
+        if (alloc->free[i].size >= size && (best == alloc->n_free - 1 || alloc->free[i].size < alloc->free[best].size)) {
+            best = i;
+        }
+    }
 
-#else
+    struct ggml_graph_alloc_block * block = &alloc->free[best];
 
-//typedef pthread_spinlock_t ggml_lock_t;
+    const size_t offset = block->offset;
 
-//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
-//#define ggml_lock_destroy pthread_spin_destroy
-//#define ggml_lock_lock    pthread_spin_lock
-//#define ggml_lock_unlock  pthread_spin_unlock
+    block->offset += size;
 
-typedef int ggml_lock_t;
+    if (best < alloc->n_free - 1) {
+        block->size -= size;
+        if (block->size == 0) {
+            for (int i = best; i < alloc->n_free - 1; i++) {
+                alloc->free[i] = alloc->free[i + 1];
+            }
+            alloc->n_free--;
+        }
+    }
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+    alloc->max_size = MAX(alloc->max_size, offset + size);
 
-#define GGML_LOCK_INITIALIZER 0
+    return offset;
+}
 
-#endif
+static void ggml_graph_allocr_free(struct ggml_graph_allocr * alloc, size_t offset, size_t size) {
+    size = ((size + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
 
-struct ggml_compute_state_shared {
-    ggml_lock_t spin;
+    if (size == 0) {
+        return;
+    }
 
-    int n_threads;
+    // the block is always below the unbounded block, so it is inserted before it at the latest
+    int i = 0;
+    while (alloc->free[i].offset < offset) {
+        i++;
+    }
 
-    // synchronization primitives
-    atomic_int  n_ready;
-    atomic_bool has_work;
-    atomic_bool stop; // stop all threads
-};
+    const bool last = i == alloc->n_free - 1;
 
-struct ggml_compute_state {
-    pthread_t thrd;
+    const bool merge_prev = i > 0 && alloc->free[i - 1].offset + alloc->free[i - 1].size == offset;
+    const bool merge_next = alloc->free[i].offset == offset + size;
 
-    struct ggml_compute_params params;
-    struct ggml_tensor * node;
+    if (merge_prev && merge_next) {
+        alloc->free[i - 1].size += size + alloc->free[i].size;
+        for (int j = i; j < alloc->n_free - 1; j++) {
+            alloc->free[j] = alloc->free[j + 1];
+        }
+        alloc->n_free--;
+    } else if (merge_prev) {
+        alloc->free[i - 1].size += size;
+    } else if (merge_next) {
+        alloc->free[i].offset = offset;
+        if (!last) {
+            alloc->free[i].size += size;
+        }
+    } else {
+        GGML_ASSERT(alloc->n_free < GGML_GRAPH_ALLOC_MAX_FREE);
+        for (int j = alloc->n_free; j > i; j--) {
+            alloc->free[j] = alloc->free[j - 1];
+        }
+        alloc->free[i] = (struct ggml_graph_alloc_block) { offset, size };
+        alloc->n_free++;
+    }
+}
 
-    struct ggml_compute_state_shared * shared;
-};
+struct ggml_graph_alloc_info {
+    const struct ggml_tensor * tensor;
 
-// function used by each compute thread
-void * ggml_graph_compute_one(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    int n_children; // nodes that still have to read the tensor
+    int n_views;    // views of the tensor that are still in use
 
-    ggml_compute_forward(&state->params, state->node);
+    bool   planned;  // the planner assigns the data of the tensor
+    bool   assigned; // the offset has been assigned
+    size_t offset;   // offset of the data in the buffer
+};
 
-    return NULL;
-}
+// open addressing hash table with the tensors of the graph as keys
+static struct ggml_graph_alloc_info * ggml_graph_alloc_info_get(
+        struct ggml_graph_alloc_info * infos,
+        size_t n_infos,
+        const struct ggml_tensor * tensor) {
+    size_t i = ((uintptr_t) tensor/sizeof(struct ggml_tensor)) & (n_infos - 1);
 
-thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    while (infos[i].tensor != NULL && infos[i].tensor != tensor) {
+        i = (i + 1) & (n_infos - 1);
+    }
 
-    const int n_threads = state->shared->n_threads;
+    infos[i].tensor = tensor;
 
-    while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
-        } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
-            }
-        }
+    return &infos[i];
+}
 
-        atomic_fetch_sub(&state->shared->n_ready, 1);
+static void ggml_graph_alloc_release(
+        struct ggml_graph_allocr * alloc,
+        struct ggml_graph_alloc_info * infos,
+        size_t n_infos,
+        struct ggml_graph_alloc_info * info) {
+    // the memory of the outputs (and of the tensors they view) is never reused
+    if (!info->planned || info->tensor->is_output) {
+        return;
+    }
 
-        // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
-            }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
-        }
+    const struct ggml_tensor * tensor = info->tensor;
 
-        // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
-            break;
-        }
+    if (tensor->view_src != NULL) {
+        struct ggml_graph_alloc_info * src_info = ggml_graph_alloc_info_get(infos, n_infos, tensor->view_src);
 
-        if (state->node) {
-            ggml_compute_forward(&state->params, state->node);
-            state->node = NULL;
-        } else {
-            break;
+        src_info->n_views--;
+        if (src_info->n_children == 0 && src_info->n_views == 0) {
+            ggml_graph_alloc_release(alloc, infos, n_infos, src_info);
         }
+    } else {
+        ggml_graph_allocr_free(alloc, info->offset, ggml_nbytes(tensor));
     }
-
-    return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    if (cgraph->n_threads <= 0) {
-        cgraph->n_threads = 8;
+static void ggml_graph_alloc_assign(
+        struct ggml_graph_allocr * alloc,
+        struct ggml_graph_alloc_info * infos,
+        size_t n_infos,
+        struct ggml_graph_alloc_info * info) {
+    if (info->assigned) {
+        return;
     }
 
-    const int n_threads = cgraph->n_threads;
-
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+    const struct ggml_tensor * tensor = info->tensor;
 
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
+    if (tensor->view_src != NULL) {
+        // the destination of a copy is a leaf that gets its memory together with the first view of it
+        struct ggml_graph_alloc_info * src_info = ggml_graph_alloc_info_get(infos, n_infos, tensor->view_src);
 
-        atomic_store(&state_shared.has_work, true);
+        ggml_graph_alloc_assign(alloc, infos, n_infos, src_info);
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
-            };
-            int rc = pthread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            assert(rc == 0);
-            UNUSED(rc);
-        }
+        info->offset = src_info->offset + tensor->view_offs;
+    } else {
+        info->offset = ggml_graph_allocr_alloc(alloc, ggml_nbytes(tensor));
     }
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
-
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
-
-            switch (node->op) {
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_ADD:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_MUL:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_SUM:
-                case GGML_OP_MEAN:
-                case GGML_OP_REPEAT:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_GELU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_NORM:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        // TODO: use different scheduling for different matrix sizes
-                        node->n_tasks = n_threads;
-
-                        size_t cur = 0;
-
-                        // TODO: better way to determine if the matrix is transposed
-                        if (node->src0->nb[1] < node->src0->nb[0]) {
-                            cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
-                        } else {
-                            if (node->src0->type == GGML_TYPE_F16 &&
-                                node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                                if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                    cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
-                                } else {
-                                    cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
-                                }
-#else
-                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
-#endif
-                            } else if (node->src0->type == GGML_TYPE_F32 &&
-                                       node->src1->type == GGML_TYPE_F32) {
-                                cur = 0;
-                            } else {
-                                GGML_ASSERT(false);
-                            }
-                        }
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_CPY:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_DIAG_MASK_INF:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ROPE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CONV_1D_1S:
-                case GGML_OP_CONV_1D_2S:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
+    info->assigned = true;
+}
 
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+void ggml_set_output(struct ggml_tensor * tensor) {
+    tensor->is_output = true;
+}
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+size_t ggml_graph_alloc(struct ggml_context * ctx, struct ggml_cgraph * cgraph, void * buf, size_t buf_size) {
+    const int n_threads = cgraph->n_threads > 0 ? cgraph->n_threads : 8; // same default as ggml_graph_compute()
 
-                        size_t cur = 0;
+    size_t n_infos = 1;
+    while (n_infos < 2*(size_t) (cgraph->n_nodes + cgraph->n_leafs)) {
+        n_infos *= 2;
+    }
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+    struct ggml_graph_alloc_info * infos = calloc(n_infos, sizeof(struct ggml_graph_alloc_info));
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+    struct ggml_graph_allocr alloc = {
+        .max_size = 0,
+        .n_free   = 1,
+        .free     = { { 0, 0 } },
+    };
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+    // the work buffer is used by all nodes
+    const size_t work_size = ggml_graph_work_size(ggml_graph_plan_tasks(cgraph, n_threads), n_threads);
+    const size_t work_offs = ggml_graph_allocr_alloc(&alloc, work_size);
 
-                        size_t cur = 0;
+    // tensors without data are planned, views are planned together with the tensor they view
+    // the sources of a node always come before it, so the same holds for the tensor a node views
+    for (int i = 0; i < cgraph->n_leafs + cgraph->n_nodes; i++) {
+        struct ggml_tensor * tensor = i < cgraph->n_leafs ? cgraph->leafs[i] : cgraph->nodes[i - cgraph->n_leafs];
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+        struct ggml_graph_alloc_info * info = ggml_graph_alloc_info_get(infos, n_infos, tensor);
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+        if (tensor->view_src != NULL) {
+            struct ggml_graph_alloc_info * src_info = ggml_graph_alloc_info_get(infos, n_infos, tensor->view_src);
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        assert(false);
-                    } break;
-            };
+            info->planned = src_info->planned;
+            src_info->n_views++;
+        } else {
+            info->planned = tensor->data == NULL;
         }
 
-        if (cgraph->work != NULL && work_size > cgraph->work_size) {
-            assert(false); // TODO: better handling
+        if (i >= cgraph->n_leafs) {
+            struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { tensor->src0, tensor->src1 };
+            for (int j = 0; j < GGML_MAX_OPT; j++) {
+                srcs[2 + j] = tensor->opt[j];
+            }
+
+            for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+                if (srcs[j]) {
+                    ggml_graph_alloc_info_get(infos, n_infos, srcs[j])->n_children++;
+                }
+            }
         }
+    }
 
-        if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+    // the inputs are placed before the first node is computed
+    // the leafs that are viewed by a node (e.g. the destination of ggml_cpy()) are written by the graph, so they
+    // are placed when the first view of them is computed instead
+    for (int i = 0; i < cgraph->n_leafs; i++) {
+        struct ggml_graph_alloc_info * info = ggml_graph_alloc_info_get(infos, n_infos, cgraph->leafs[i]);
 
-            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
-            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+        if (info->planned && info->n_views == 0) {
+            ggml_graph_alloc_assign(&alloc, infos, n_infos, info);
         }
     }
 
-    const int64_t perf_start_cycles  = ggml_perf_cycles();
-    const int64_t perf_start_time_us = ggml_perf_time_us();
-
     for (int i = 0; i < cgraph->n_nodes; i++) {
-        GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
-
         struct ggml_tensor * node = cgraph->nodes[i];
 
-        // TODO: this could be used to avoid unnecessary computations, but it needs to be improved
-        //if (node->grad == NULL && node->perf_runs > 0) {
-        //    continue;
-        //}
-
-        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
-        const int64_t perf_node_start_time_us = ggml_perf_time_us();
+        struct ggml_graph_alloc_info * info = ggml_graph_alloc_info_get(infos, n_infos, node);
 
-        // INIT
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_INIT,
-            /*.ith   =*/ 0,
-            /*.nth   =*/ node->n_tasks,
-            /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-            /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
-        };
+        if (info->planned) {
+            ggml_graph_alloc_assign(&alloc, infos, n_infos, info);
+        }
 
-        ggml_compute_forward(&params, node);
+        struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { node->src0, node->src1 };
+        for (int j = 0; j < GGML_MAX_OPT; j++) {
+            srcs[2 + j] = node->opt[j];
+        }
 
-        // COMPUTE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
+        for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+            if (srcs[j] == NULL) {
+                continue;
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            struct ggml_graph_alloc_info * src_info = ggml_graph_alloc_info_get(infos, n_infos, srcs[j]);
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
+            src_info->n_children--;
+            if (src_info->n_children == 0 && src_info->n_views == 0) {
+                ggml_graph_alloc_release(&alloc, infos, n_infos, src_info);
             }
+        }
+    }
+
+    const size_t size = alloc.max_size;
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    if (buf != NULL) {
+        if (size > buf_size) {
+            GGML_PRINT("%s: not enough space in the buffer (needed %zu, available %zu)\n", __func__, size, buf_size);
+            assert(false);
+            free(infos);
+            return 0;
+        }
+
+        for (int i = 0; i < cgraph->n_leafs + cgraph->n_nodes; i++) {
+            struct ggml_tensor * tensor = i < cgraph->n_leafs ? cgraph->leafs[i] : cgraph->nodes[i - cgraph->n_leafs];
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+            struct ggml_graph_alloc_info * info = ggml_graph_alloc_info_get(infos, n_infos, tensor);
+
+            if (info->planned) {
+                tensor->data = (char *) buf + info->offset;
             }
+        }
 
-            atomic_store(&state_shared.has_work, true);
+        cgraph->work      = NULL;
+        cgraph->work_size = 0;
+
+        if (work_size > 0) {
+            const int ne = work_size;
+            cgraph->work      = ggml_new_tensor_impl(ctx, GGML_TYPE_I8, 1, &ne, (char *) buf + work_offs);
+            cgraph->work_size = work_size;
         }
 
-        params.type = GGML_TASK_COMPUTE;
-        ggml_compute_forward(&params, node);
+        cgraph->n_threads_plan = n_threads;
+    }
 
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+    free(infos);
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    return size;
+}
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+void ggml_graph_update_views(struct ggml_cgraph * cgraph) {
+    // the tensor a node views always comes before it, so the views of views are updated in the same pass
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+        if (node->view_src != NULL && node->view_src->data != NULL) {
+            node->data = (char *) node->view_src->data + node->view_offs;
         }
+    }
+}
 
-        // FINALIZE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+////////////////////////////////////////////////////////////////////////////////
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+// graph fusion
+//
+// a chain of element-wise nodes is merged into its last node, which takes the sources of the whole chain, and the
+// other nodes of the chain are removed from the graph. a node is merged only into the node right after it and only
+// if that node is its single user, so its own result is never needed
+//
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_FINALIZE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
+static bool ggml_graph_fuse_can_merge(
+        struct ggml_graph_alloc_info * infos,
+        size_t n_infos,
+        const struct ggml_tensor * node,
+        int n_views) {
+    const struct ggml_graph_alloc_info * info = ggml_graph_alloc_info_get(infos, n_infos, node);
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    // n_views is 1 for the nodes of a chain that is computed in place
+    return !node->is_output && node->grad == NULL && info->n_children == 1 && info->n_views == n_views;
+}
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+// the fused kernels broadcast the rows of b to a
+static bool ggml_graph_fuse_can_repeat(const struct ggml_tensor * b, const struct ggml_tensor * a) {
+    return a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float) && ggml_can_repeat(b, a);
+}
 
-            atomic_store(&state_shared.has_work, true);
-        }
+void ggml_graph_fuse(struct ggml_cgraph * cgraph) {
+    size_t n_infos = 1;
+    while (n_infos < 2*(size_t) (cgraph->n_nodes + cgraph->n_leafs)) {
+        n_infos *= 2;
+    }
 
-        params.type = GGML_TASK_FINALIZE;
-        ggml_compute_forward(&params, node);
+    struct ggml_graph_alloc_info * infos = calloc(n_infos, sizeof(struct ggml_graph_alloc_info));
 
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+    // count the users of each tensor
+    for (int i = 0; i < cgraph->n_leafs + cgraph->n_nodes; i++) {
+        struct ggml_tensor * tensor = i < cgraph->n_leafs ? cgraph->leafs[i] : cgraph->nodes[i - cgraph->n_leafs];
+
+        if (tensor->view_src != NULL) {
+            ggml_graph_alloc_info_get(infos, n_infos, tensor->view_src)->n_views++;
+        }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+        if (i >= cgraph->n_leafs) {
+            struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { tensor->src0, tensor->src1 };
+            for (int j = 0; j < GGML_MAX_OPT; j++) {
+                srcs[2 + j] = tensor->opt[j];
             }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+            for (int j = 0; j < 2 + GGML_MAX_OPT; j++) {
+                if (srcs[j]) {
+                    ggml_graph_alloc_info_get(infos, n_infos, srcs[j])->n_children++;
+                }
             }
         }
+    }
 
-        // performance stats (node)
-        {
-            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
-            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
+    // number of nodes kept so far - the last kept nodes are the candidates for merging into the current one
+    int n = 0;
 
-            node->perf_runs++;
-            node->perf_cycles  += perf_cycles_cur;
-            node->perf_time_us += perf_time_us_cur;
-        }
-    }
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-    // join thread pool
-    if (n_threads > 1) {
-        atomic_store(&state_shared.stop, true);
-        atomic_store(&state_shared.has_work, true);
+        struct ggml_tensor * prev0 = n > 0 ? cgraph->nodes[n - 1] : NULL;
+        struct ggml_tensor * prev1 = n > 1 ? cgraph->nodes[n - 2] : NULL;
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = pthread_join(workers[j].thrd, NULL);
-            assert(rc == 0);
-            UNUSED(rc);
+        switch (node->grad == NULL ? node->op : GGML_OP_NONE) {
+            case GGML_OP_ADD:
+                {
+                    // norm(x)*w + b
+                    struct ggml_tensor * mul  = node->src0;
+                    struct ggml_tensor * norm = mul->src0;
+
+                    if (mul == prev0 && mul->op == GGML_OP_MUL && norm == prev1 && norm->op == GGML_OP_NORM &&
+                        node->view_src == NULL && mul->view_src == NULL && norm->view_src == NULL &&
+                        ggml_graph_fuse_can_merge(infos, n_infos, mul,  0) &&
+                        ggml_graph_fuse_can_merge(infos, n_infos, norm, 0) &&
+                        ggml_graph_fuse_can_repeat(mul->src1,  norm) &&
+                        ggml_graph_fuse_can_repeat(node->src1, norm)) {
+                        node->op     = GGML_OP_NORM_MUL_ADD;
+                        node->opt[0] = node->src1;
+                        node->src0   = norm->src0;
+                        node->src1   = mul->src1;
+
+                        n -= 2;
+                    }
+                } break;
+            case GGML_OP_GELU:
+                {
+                    // gelu(x + b), usually with x the result of a matrix multiplication
+                    struct ggml_tensor * add = node->src0;
+
+                    if (add == prev0 && add->op == GGML_OP_ADD &&
+                        node->view_src == NULL && add->view_src == NULL &&
+                        ggml_graph_fuse_can_merge(infos, n_infos, add, 0) &&
+                        ggml_graph_fuse_can_repeat(add->src1, add->src0)) {
+                        node->op   = GGML_OP_ADD_GELU;
+                        node->src0 = add->src0;
+                        node->src1 = add->src1;
+
+                        n -= 1;
+                    }
+                } break;
+            case GGML_OP_SOFT_MAX:
+                {
+                    // soft_max(diag_mask_inf(x*v)), soft_max(x*v + mask) or soft_max(x*v) - the whole chain is computed in place
+                    struct ggml_tensor * mask  = node->src0->op == GGML_OP_DIAG_MASK_INF || node->src0->op == GGML_OP_ADD ? node->src0 : NULL;
+                    struct ggml_tensor * scale = mask ? mask->src0 : node->src0;
+
+                    // the added mask is a new tensor, the other nodes of the chain are views of their input
+                    const bool mask_add = mask != NULL && mask->op == GGML_OP_ADD;
+
+                    if (scale->op == GGML_OP_SCALE && scale == (mask ? prev1 : prev0) && (mask == NULL || mask == prev0) &&
+                        node->view_src == node->src0 && (mask == NULL || mask->view_src == (mask_add ? NULL : scale)) &&
+                        scale->view_src == scale->src0 && ggml_is_contiguous(scale->src0) &&
+                        ggml_graph_fuse_can_merge(infos, n_infos, scale, mask_add ? 0 : 1) &&
+                        (mask == NULL || ggml_graph_fuse_can_merge(infos, n_infos, mask, 1)) &&
+                        (!mask_add || (mask->src1 != scale && ggml_graph_fuse_can_repeat(mask->src1, scale)))) {
+                        node->op        = GGML_OP_SCALE_MASK_SOFT_MAX;
+                        node->src0      = scale->src0;
+                        node->src1      = scale->src1;
+                        node->opt[0]    = mask ? mask->src1 : NULL;
+                        node->view_src  = scale->view_src;
+                        node->view_offs = scale->view_offs;
+
+                        n -= mask ? 2 : 1;
+                    }
+                } break;
+            default:
+                break;
         }
 
-        ggml_lock_destroy(&state_shared.spin);
+        cgraph->nodes[n] = node;
+        if (cgraph->grads) {
+            cgraph->grads[n] = cgraph->grads[i];
+        }
+        n++;
     }
 
-    // performance stats (graph)
-    {
-        int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
-        int64_t perf_time_us_cur = ggml_perf_time_us() - perf_start_time_us;
+    for (int i = n; i < cgraph->n_nodes; i++) {
+        cgraph->nodes[i] = NULL;
+        if (cgraph->grads) {
+            cgraph->grads[i] = NULL;
+        }
+    }
 
-        cgraph->perf_runs++;
-        cgraph->perf_cycles  += perf_cycles_cur;
-        cgraph->perf_time_us += perf_time_us_cur;
+    cgraph->n_nodes = n;
 
-        GGML_PRINT_DEBUG("%s: perf (%d) - cpu = %.3f / %.3f ms, wall = %.3f / %.3f ms\n",
-                __func__, cgraph->perf_runs,
-                (double) perf_cycles_cur      / (double) ggml_cycles_per_ms(),
-                (double) cgraph->perf_cycles  / (double) ggml_cycles_per_ms() / (double) cgraph->perf_runs,
-                (double) perf_time_us_cur     / 1000.0,
-                (double) cgraph->perf_time_us / 1000.0 / cgraph->perf_runs);
-    }
-}
+    // the merged nodes are no longer part of the graph
+    ggml_graph_rehash(cgraph);
 
-void ggml_graph_reset(struct ggml_cgraph * cgraph) {
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        struct ggml_tensor * grad = cgraph->grads[i];
+    // the tasks have to be planned again
+    cgraph->n_threads_plan = 0;
 
-        if (grad) {
-            ggml_set_zero(grad);
-        }
-    }
+    free(infos);
 }
 
 void ggml_graph_print(const struct ggml_cgraph * cgraph) {
@@ -7266,6 +9318,251 @@ void ggml_graph_print(const struct ggml_cgraph * cgraph) {
     GGML_PRINT("========================================\n");
 }
 
+struct ggml_profiler * ggml_profiler_new(void) {
+    struct ggml_profiler * prof = malloc(sizeof(struct ggml_profiler));
+    GGML_ASSERT(prof != NULL);
+
+    *prof = (struct ggml_profiler) {
+        /*.t_origin      =*/ ggml_time_ns(),
+        /*.n_nodes       =*/ 0,
+        /*.n_nodes_alloc =*/ 0,
+        /*.nodes         =*/ NULL,
+        /*.n_threads     =*/ 0,
+        /*.threads       =*/ NULL,
+    };
+
+    return prof;
+}
+
+void ggml_profiler_free(struct ggml_profiler * prof) {
+    if (g_profiler == prof) {
+        g_profiler = NULL;
+    }
+
+    for (int ith = 0; ith < prof->n_threads; ith++) {
+        free(prof->threads[ith].events);
+    }
+
+    free(prof->threads);
+    free(prof->nodes);
+    free(prof);
+}
+
+void ggml_profiler_set_active(struct ggml_profiler * prof) {
+    g_profiler = prof;
+}
+
+void ggml_profiler_reset(struct ggml_profiler * prof) {
+    prof->t_origin = ggml_time_ns();
+    prof->n_nodes  = 0;
+
+    for (int ith = 0; ith < prof->n_threads; ith++) {
+        prof->threads[ith].n_events = 0;
+    }
+}
+
+// sum the events of the profiler per op
+// for each node, max is the busy time of its slowest thread and mean the average busy time of the threads that had
+// work in the node - the node time that is not spent by its slowest thread is spent in the INIT/FINALIZE phases and
+// in the synchronization of the threads
+static void ggml_profiler_compute_op_stats(const struct ggml_profiler * prof, struct ggml_profiler_op_stats * stats) {
+    memset(stats, 0, GGML_OP_COUNT*sizeof(struct ggml_profiler_op_stats));
+
+    int64_t * node_max = calloc(prof->n_nodes + 1, sizeof(int64_t));
+    int64_t * node_sum = calloc(prof->n_nodes + 1, sizeof(int64_t));
+    int     * node_cnt = calloc(prof->n_nodes + 1, sizeof(int));
+    GGML_ASSERT(node_max && node_sum && node_cnt);
+
+    for (int ith = 0; ith < prof->n_threads; ith++) {
+        const struct ggml_profiler_thread * thread = &prof->threads[ith];
+
+        for (int k = 0; k < thread->n_events; k++) {
+            const struct ggml_profiler_thread_event * event = &thread->events[k];
+            const int64_t t = event->t_end - event->t_start;
+
+            node_max[event->node]  = MAX(node_max[event->node], t);
+            node_sum[event->node] += t;
+            node_cnt[event->node] += 1;
+        }
+    }
+
+    for (int i = 0; i < prof->n_nodes; i++) {
+        const struct ggml_profiler_node_event * event = &prof->nodes[i];
+
+        if (event->t_end == 0) {
+            continue;
+        }
+
+        struct ggml_profiler_op_stats * s = &stats[event->op];
+
+        s->n_nodes += 1;
+        s->time_ns += event->t_end - event->t_start;
+        s->max_ns  += node_max[i];
+        s->mean_ns += node_cnt[i] > 0 ? node_sum[i]/node_cnt[i] : 0;
+        s->flops   += event->flops;
+        s->bytes   += event->bytes;
+    }
+
+    free(node_cnt);
+    free(node_sum);
+    free(node_max);
+}
+
+struct ggml_profiler_op_stats ggml_profiler_get_op_stats(const struct ggml_profiler * prof, enum ggml_op op) {
+    struct ggml_profiler_op_stats stats[GGML_OP_COUNT];
+
+    ggml_profiler_compute_op_stats(prof, stats);
+
+    return stats[op];
+}
+
+void ggml_profiler_print(const struct ggml_profiler * prof) {
+    struct ggml_profiler_op_stats stats[GGML_OP_COUNT];
+
+    ggml_profiler_compute_op_stats(prof, stats);
+
+    int64_t t_total = 0;
+    for (int i = 0; i < GGML_OP_COUNT; i++) {
+        t_total += stats[i].time_ns;
+    }
+
+    GGML_PRINT("=== PROFILE ===\n");
+    GGML_PRINT("%20s %7s %10s %6s %9s %8s %9s %9s\n",
+            "op", "nodes", "time (ms)", "%", "GFLOP/s", "GB/s", "imbalance", "sync (ms)");
+
+    for (int i = 0; i < GGML_OP_COUNT; i++) {
+        const struct ggml_profiler_op_stats * s = &stats[i];
+
+        if (s->n_nodes == 0) {
+            continue;
+        }
+
+        const double t = (double) MAX(s->time_ns, 1);
+
+        GGML_PRINT("%20s %7d %10.3f %6.2f %9.2f %8.2f %9.2f %9.3f\n",
+                GGML_OP_LABEL[i], s->n_nodes,
+                1e-6*s->time_ns,
+                100.0*s->time_ns/MAX(t_total, 1),
+                s->flops/t,
+                s->bytes/t,
+                s->mean_ns > 0 ? (double) s->max_ns/s->mean_ns : 1.0,
+                1e-6*(s->time_ns - s->max_ns));
+    }
+
+    GGML_PRINT("%20s %7s %10.3f\n", "total", "", 1e-6*t_total);
+
+    for (int ith = 0; ith < prof->n_threads; ith++) {
+        const struct ggml_profiler_thread * thread = &prof->threads[ith];
+
+        int64_t t_busy = 0;
+        for (int k = 0; k < thread->n_events; k++) {
+            t_busy += thread->events[k].t_end - thread->events[k].t_start;
+        }
+
+        GGML_PRINT("thread %3d: busy = %10.3f ms (%6.2f%%), %d events\n",
+                ith, 1e-6*t_busy, 100.0*t_busy/MAX(t_total, 1), thread->n_events);
+    }
+
+    GGML_PRINT("========================================\n");
+}
+
+bool ggml_profiler_write_trace(const struct ggml_profiler * prof, const char * fname) {
+    FILE * fout = fopen(fname, "w");
+    if (!fout) {
+        GGML_PRINT("%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    const double t0 = (double) prof->t_origin;
+
+    fprintf(fout, "{\"traceEvents\": [\n");
+    fprintf(fout, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, \"args\": {\"name\": \"nodes\"}},\n");
+    fprintf(fout, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"threads\"}}");
+
+    for (int i = 0; i < prof->n_nodes; i++) {
+        const struct ggml_profiler_node_event * event = &prof->nodes[i];
+
+        if (event->t_end == 0) {
+            continue;
+        }
+
+        fprintf(fout, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f, "
+                "\"args\": {\"node\": %d, \"ne\": [%d, %d, %d, %d], \"n_tasks\": %d, \"flops\": %" PRId64 ", \"bytes\": %" PRId64 "}}",
+                GGML_OP_LABEL[event->op], 1e-3*(event->t_start - t0), 1e-3*(event->t_end - event->t_start),
+                i, event->ne[0], event->ne[1], event->ne[2], event->ne[3], event->n_tasks, event->flops, event->bytes);
+    }
+
+    for (int ith = 0; ith < prof->n_threads; ith++) {
+        const struct ggml_profiler_thread * thread = &prof->threads[ith];
+
+        for (int k = 0; k < thread->n_events; k++) {
+            const struct ggml_profiler_thread_event * event = &thread->events[k];
+
+            fprintf(fout, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"args\": {\"node\": %d}}",
+                    GGML_OP_LABEL[prof->nodes[event->node].op], ith,
+                    1e-3*(event->t_start - t0), 1e-3*(event->t_end - event->t_start), event->node);
+        }
+    }
+
+    fprintf(fout, "\n], \"displayTimeUnit\": \"ms\"}\n");
+
+    const bool ok = ferror(fout) == 0;
+    fclose(fout);
+
+    return ok;
+}
+
+bool ggml_profiler_write_summary(const struct ggml_profiler * prof, const char * fname) {
+    FILE * fout = fopen(fname, "w");
+    if (!fout) {
+        GGML_PRINT("%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    struct ggml_profiler_op_stats stats[GGML_OP_COUNT];
+
+    ggml_profiler_compute_op_stats(prof, stats);
+
+    fprintf(fout, "{\n  \"ops\": [");
+
+    bool first = true;
+    for (int i = 0; i < GGML_OP_COUNT; i++) {
+        const struct ggml_profiler_op_stats * s = &stats[i];
+
+        if (s->n_nodes == 0) {
+            continue;
+        }
+
+        fprintf(fout, "%s\n    {\"op\": \"%s\", \"n_nodes\": %d, \"time_ns\": %" PRId64 ", \"max_ns\": %" PRId64 ", "
+                "\"mean_ns\": %" PRId64 ", \"flops\": %" PRId64 ", \"bytes\": %" PRId64 "}",
+                first ? "" : ",", GGML_OP_LABEL[i], s->n_nodes, s->time_ns, s->max_ns, s->mean_ns, s->flops, s->bytes);
+
+        first = false;
+    }
+
+    fprintf(fout, "\n  ],\n  \"threads\": [");
+
+    for (int ith = 0; ith < prof->n_threads; ith++) {
+        const struct ggml_profiler_thread * thread = &prof->threads[ith];
+
+        int64_t t_busy = 0;
+        for (int k = 0; k < thread->n_events; k++) {
+            t_busy += thread->events[k].t_end - thread->events[k].t_start;
+        }
+
+        fprintf(fout, "%s\n    {\"ith\": %d, \"n_events\": %d, \"busy_ns\": %" PRId64 "}",
+                ith == 0 ? "" : ",", ith, thread->n_events, t_busy);
+    }
+
+    fprintf(fout, "\n  ]\n}\n");
+
+    const bool ok = ferror(fout) == 0;
+    fclose(fout);
+
+    return ok;
+}
+
 // check if node is part of the graph
 bool ggml_graph_find(const struct ggml_cgraph * cgraph, const struct ggml_tensor * node) {
     if (cgraph == NULL) {
@@ -7410,36 +9707,74 @@ label=\"<x>CONST %d [%d, %d]\"; ]\n",
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// copy the elements of a parameter or gradient to / from an f32 array
+static void ggml_opt_get_f32(const struct ggml_tensor * tensor, float * x) {
+    const int ne = ggml_nelements(tensor);
+
+    switch (tensor->type) {
+        case GGML_TYPE_F32:
+            {
+                memcpy(x, tensor->data, ne*sizeof(float));
+            } break;
+        case GGML_TYPE_F16:
+            {
+                for (int j = 0; j < ne; ++j) {
+                    x[j] = ggml_fp16_to_fp32(((ggml_fp16_t *) tensor->data)[j]);
+                }
+            } break;
+        default:
+            {
+                for (int j = 0; j < ne; ++j) {
+                    x[j] = ggml_get_f32_1d(tensor, j);
+                }
+            } break;
+    }
+}
+
+static void ggml_opt_set_f32(struct ggml_tensor * tensor, const float * x) {
+    const int ne = ggml_nelements(tensor);
+
+    switch (tensor->type) {
+        case GGML_TYPE_F32:
+            {
+                memcpy(tensor->data, x, ne*sizeof(float));
+            } break;
+        case GGML_TYPE_F16:
+            {
+                for (int j = 0; j < ne; ++j) {
+                    ((ggml_fp16_t *) tensor->data)[j] = ggml_fp32_to_fp16(x[j]);
+                }
+            } break;
+        default:
+            {
+                for (int j = 0; j < ne; ++j) {
+                    ggml_set_f32_1d(tensor, j, x[j]);
+                }
+            } break;
+    }
+}
+
 void ggml_opt_set_params(int np, struct ggml_tensor * const ps[], const float * x) {
     int i = 0;
     for (int p = 0; p < np; ++p) {
-        const int ne = ggml_nelements(ps[p]) ;
-        // TODO: add function to set tensor from array
-        for (int j = 0; j < ne; ++j) {
-            ggml_set_f32_1d(ps[p], j, x[i++]);
-        }
+        ggml_opt_set_f32(ps[p], x + i);
+        i += ggml_nelements(ps[p]);
     }
 }
 
 void ggml_opt_get_params(int np, struct ggml_tensor * const ps[], float * x) {
     int i = 0;
     for (int p = 0; p < np; ++p) {
-        const int ne = ggml_nelements(ps[p]) ;
-        // TODO: add function to get all elements at once
-        for (int j = 0; j < ne; ++j) {
-            x[i++] = ggml_get_f32_1d(ps[p], j);
-        }
+        ggml_opt_get_f32(ps[p], x + i);
+        i += ggml_nelements(ps[p]);
     }
 }
 
 void ggml_opt_get_grad(int np, struct ggml_tensor * const ps[], float * g) {
     int i = 0;
     for (int p = 0; p < np; ++p) {
-        const int ne = ggml_nelements(ps[p]) ;
-        // TODO: add function to get all elements at once
-        for (int j = 0; j < ne; ++j) {
-            g[i++] = ggml_get_f32_1d(ps[p]->grad, j);
-        }
+        ggml_opt_get_f32(ps[p]->grad, g + i);
+        i += ggml_nelements(ps[p]);
     }
 }
 
@@ -7448,6 +9783,9 @@ void ggml_opt_get_grad(int np, struct ggml_tensor * const ps[], float * g) {
 //
 //   ref: https://arxiv.org/pdf/1412.6980.pdf
 //
+// the step is a graph with one ggml_opt_adam_step() node per parameter, so the parameters and their moments are
+// updated in place by the worker threads, without copies to flat arrays
+//
 
 enum ggml_opt_result ggml_opt_adam(
         struct ggml_context * ctx,
@@ -7460,19 +9798,10 @@ enum ggml_opt_result ggml_opt_adam(
     gf->n_threads = params.n_threads;
     gb->n_threads = params.n_threads;
 
-    // these will store the parameters we want to optimize
-    struct ggml_tensor * ps[GGML_MAX_PARAMS];
-
     int np = 0;
-    int nx = 0;
     for (int i = 0; i < gf->n_nodes; ++i) {
         if (gf->nodes[i]->is_param) {
-            GGML_PRINT_DEBUG("found param %d: grad->op = %d\n", np, gf->nodes[i]->grad->op);
-
-            assert(np < GGML_MAX_PARAMS);
-
-            ps[np++] = gf->nodes[i];
-            nx += ggml_nelements(gf->nodes[i]);
+            np++;
         }
     }
 
@@ -7482,22 +9811,52 @@ enum ggml_opt_result ggml_opt_adam(
     const float beta2 = params.adam.beta2;
     const float eps   = params.adam.eps;
 
-    float * x  = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, nx)->data; // view of the parameters
-    float * g1 = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, nx)->data; // gradient
-    float * g2 = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, nx)->data; // gradient squared
-    float * m  = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, nx)->data; // first moment
-    float * v  = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, nx)->data; // second moment
-    float * mh = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, nx)->data; // first moment hat
-    float * vh = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, nx)->data; // second moment hat
+    // [alpha_t, beta1, beta2, eps, vh_scale], alpha_t and vh_scale are set for each iteration
+    struct ggml_tensor * hp = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 5);
 
-    float * pf = params.past > 0 ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, params.past)->data : NULL; // past function values
+    ggml_set_f32_1d(hp, 1, beta1);
+    ggml_set_f32_1d(hp, 2, beta2);
+    ggml_set_f32_1d(hp, 3, eps);
 
-    // initialize
-    ggml_vec_set_f32(nx, m, 0.0f);
-    ggml_vec_set_f32(nx, v, 0.0f);
+    // the nodes and leafs of gb are marked as visited, so only the steps and their moments are added to the graph
+    struct ggml_cgraph * gu = ggml_new_graph_custom(ctx, gb->n_nodes + gb->n_leafs + 4*np + 1, false);
 
-    // update view
-    ggml_opt_get_params(np, ps, x);
+    for (int i = 0; i < gb->n_leafs; ++i) {
+        ggml_graph_visit(gu, gb->leafs[i]);
+    }
+
+    for (int i = 0; i < gb->n_nodes; ++i) {
+        ggml_graph_visit(gu, gb->nodes[i]);
+    }
+
+    gu->n_threads = params.n_threads;
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        struct ggml_tensor * p = gf->nodes[i];
+
+        if (!p->is_param) {
+            continue;
+        }
+
+        GGML_PRINT_DEBUG("found param %d: grad->op = %d\n", gu->n_nodes, p->grad->op);
+
+        struct ggml_tensor * m = ggml_set_zero(ggml_new_tensor(ctx, GGML_TYPE_F32, p->n_dims, p->ne)); // first moment
+        struct ggml_tensor * v = ggml_set_zero(ggml_new_tensor(ctx, GGML_TYPE_F32, p->n_dims, p->ne)); // second moment
+
+        // f32 master copy of an f16 parameter
+        struct ggml_tensor * w = NULL;
+
+        if (p->type != GGML_TYPE_F32) {
+            w = ggml_new_tensor(ctx, GGML_TYPE_F32, p->n_dims, p->ne);
+            ggml_opt_get_f32(p, w->data);
+        }
+
+        ggml_build_forward_expand(gu, ggml_opt_adam_step(ctx, p, m, v, w, hp));
+    }
+
+    GGML_ASSERT(gu->n_nodes == np);
+
+    float * pf = params.past > 0 ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, params.past)->data : NULL; // past function values
 
     // compute the function value
     ggml_graph_reset  (gf);
@@ -7517,12 +9876,10 @@ enum ggml_opt_result ggml_opt_adam(
         GGML_PRINT_DEBUG  ("=== iter %d ===\n", t);
 
         GGML_PRINT_DEBUG  ("f      = %10.6f\n", ggml_get_f32_1d(f, 0));
-        GGML_PRINT_DEBUG_5("df/dx0 = %10.6f\n", ggml_get_f32_1d(ps[0]->grad, 0));
-        GGML_PRINT_DEBUG_5("df/dx1 = %10.6f\n", ggml_get_f32_1d(ps[1]->grad, 0));
 
         for (int i = 0; i < np; ++i) {
             GGML_PRINT_DEBUG("param %d: %10.6f, g = %10.6f\n", i,
-                    ggml_get_f32_1d(ps[i], 0), ggml_get_f32_1d(ps[i]->grad, 0));
+                    ggml_get_f32_1d(gu->nodes[i]->src0, 0), ggml_get_f32_1d(gu->nodes[i]->src1, 0));
         }
 
         const int64_t t_start_wall = ggml_time_us();
@@ -7531,37 +9888,13 @@ enum ggml_opt_result ggml_opt_adam(
         UNUSED(t_start_cpu);
 
         {
-            // update the gradient
-            ggml_opt_get_grad(np, ps, g1);
-
-            // m_t = beta1*m_t-1 + (1 - beta1)*g_t
-            ggml_vec_scale_f32(nx, m, beta1);
-            ggml_vec_mad_f32  (nx, m, g1, 1.0f - beta1);
-
-            // g2 = g1^2
-            ggml_vec_sqr_f32  (nx, g2, g1);
-
-            // v_t = beta2*v_t-1 + (1 - beta2)*g_t^2
-            ggml_vec_scale_f32(nx, v, beta2);
-            ggml_vec_mad_f32  (nx, v, g2, 1.0f - beta2);
-
             // m^hat = m_t / (1 - beta1^t)
             // v^hat = v_t / (1 - beta2^t)
-            // x_t = x_t-1 - alpha*m^hat/(sqrt(v^hat) + eps)
-            ggml_vec_cpy_f32  (nx, mh, m);
-            ggml_vec_cpy_f32  (nx, vh, v);
-
-            ggml_vec_scale_f32(nx, mh, alpha/(1.0f - powf(beta1, t + 1)));
-            ggml_vec_scale_f32(nx, vh,  1.0f/(1.0f - powf(beta2, t + 1)));
-
-            ggml_vec_sqrt_f32 (nx, vh, vh);
-            ggml_vec_acc1_f32 (nx, vh, eps);
-
-            ggml_vec_div_f32  (nx, mh, mh, vh);
-            ggml_vec_sub_f32  (nx, x,  x,  mh);
+            ggml_set_f32_1d(hp, 0, alpha/(1.0f - powf(beta1, t + 1)));
+            ggml_set_f32_1d(hp, 4,  1.0f/(1.0f - powf(beta2, t + 1)));
 
             // update the parameters
-            ggml_opt_set_params(np, ps, x);
+            ggml_graph_compute(ctx, gu);
         }
 
         ggml_graph_reset  (gf);
@@ -7760,19 +10093,24 @@ enum ggml_opt_result ggml_opt_lbfgs(
 
     const int m = params.lbfgs.m;
 
-    // these will store the parameters we want to optimize
-    struct ggml_tensor * ps[GGML_MAX_PARAMS];
-
     int np = 0;
     int nx = 0;
     for (int i = 0; i < gf->n_nodes; ++i) {
         if (gf->nodes[i]->is_param) {
-            GGML_PRINT_DEBUG("found param %d: grad->op = %d\n", np, gf->nodes[i]->grad->op);
+            np++;
+            nx += ggml_nelements(gf->nodes[i]);
+        }
+    }
 
-            assert(np < GGML_MAX_PARAMS);
+    // these will store the parameters we want to optimize
+    struct ggml_tensor ** ps = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, MAX(np, 1)*sizeof(struct ggml_tensor *))->data;
+
+    np = 0;
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        if (gf->nodes[i]->is_param) {
+            GGML_PRINT_DEBUG("found param %d: grad->op = %d\n", np, gf->nodes[i]->grad->op);
 
             ps[np++] = gf->nodes[i];
-            nx += ggml_nelements(gf->nodes[i]);
         }
     }
 
@@ -8048,7 +10386,7 @@ enum ggml_opt_result ggml_opt(
     enum ggml_opt_result result = GGML_OPT_OK;
 
     // build forward + backward compute graphs
-    struct ggml_cgraph gf = ggml_build_forward (f);
+    struct ggml_cgraph gf = ggml_build_forward (ctx, f);
     struct ggml_cgraph gb = ggml_build_backward(ctx, &gf, false);
 
     switch (params.type) {
@@ -8081,20 +10419,34 @@ enum ggml_opt_result ggml_opt(
 
 ////////////////////////////////////////////////////////////////////////////////
 
+size_t ggml_quantize(enum ggml_type type, const float * src, void * dst, int n) {
+    GGML_ASSERT(ggml_is_quantized(type));
+    GGML_ASSERT(n % GGML_BLCK_SIZE[type] == 0);
+
+    ggml_vec->quantize_fns[type].quantize_row(src, dst, n);
+
+    return (n/GGML_BLCK_SIZE[type])*GGML_TYPE_SIZE[type];
+}
+
+void ggml_dequantize(enum ggml_type type, const void * src, float * dst, int n) {
+    GGML_ASSERT(ggml_is_quantized(type));
+    GGML_ASSERT(n % GGML_BLCK_SIZE[type] == 0);
+
+    ggml_vec->quantize_fns[type].dequantize_row(src, dst, n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 int ggml_cpu_has_avx2(void) {
-#if defined(__AVX2__)
-    return 1;
-#else
-    return 0;
-#endif
+    ggml_init_once();
+
+    return ggml_cpu.avx2;
 }
 
 int ggml_cpu_has_avx512(void) {
-#if defined(__AVX512F__)
-    return 1;
-#else
-    return 0;
-#endif
+    ggml_init_once();
+
+    return ggml_cpu.avx512f;
 }
 
 int ggml_cpu_has_neon(void) {
@@ -8129,4 +10481,10 @@ int ggml_cpu_has_blas(void) {
 #endif
 }
 
+const char * ggml_cpu_isa(void) {
+    ggml_init_once();
+
+    return ggml_vec->name;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,152 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+void set_random(struct ggml_tensor * t) {
+    for (int i = 0; i < ggml_nelements(t); i++) {
+        ((float *)t->data)[i] = 2.0f*frand() - 1.0f;
+    }
+}
+
+// a few layers of a transformer-like block with views and copies
+// the output of the first layer is returned in y0
+struct ggml_tensor * build(struct ggml_context * ctx0, struct ggml_tensor * w, struct ggml_tensor * x, int n_layer, struct ggml_tensor ** y0) {
+    const int N = x->ne[1];
+
+    struct ggml_tensor * cur = x;
+
+    for (int il = 0; il < n_layer; ++il) {
+        struct ggml_tensor * inp = cur;
+
+        cur = ggml_norm(ctx0, cur);
+        cur = ggml_mul_mat(ctx0, w, cur);
+        cur = ggml_gelu(ctx0, cur);
+
+        // split into 4 heads of 16 and merge them back
+        cur = ggml_permute(ctx0, ggml_reshape_3d(ctx0, cur, 16, 4, N), 0, 2, 1, 3);
+        cur = ggml_cpy(ctx0, cur, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 16, N, 4));
+        cur = ggml_soft_max(ctx0, ggml_diag_mask_inf(ctx0, ggml_scale(ctx0, cur, ggml_new_f32(ctx0, 0.5f)), 2));
+        cur = ggml_reshape_2d(ctx0, ggml_cpy(ctx0, ggml_permute(ctx0, cur, 0, 2, 1, 3),
+                                             ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 16, 4, N)), 64, N);
+
+        cur = ggml_add(ctx0, cur, inp);
+
+        if (il == 0) {
+            *y0 = cur;
+        }
+    }
+
+    return cur;
+}
+
+int main(int argc, const char ** argv) {
+    const int n_embd  = 64;
+    const int n_layer = 8;
+    const int N       = 8;
+
+    struct ggml_init_params params = {
+        .mem_size   = 16*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_embd);
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+
+    set_random(w);
+    set_random(x);
+
+    // reference with all tensors allocated in the context
+    struct ggml_tensor * y0_ref = NULL;
+    struct ggml_tensor * y_ref  = build(ctx0, w, x, n_layer, &y0_ref);
+
+    struct ggml_cgraph gf_ref = ggml_build_forward(ctx0, y_ref);
+    gf_ref.n_threads = 2;
+
+    ggml_graph_compute(ctx0, &gf_ref);
+
+    size_t size_ref = 0;
+    for (int i = 0; i < gf_ref.n_nodes; i++) {
+        if (gf_ref.nodes[i]->view_src == NULL) {
+            size_ref += ggml_nbytes(gf_ref.nodes[i]);
+        }
+    }
+
+    // the same graph in a context that only holds the tensor objects, with planned memory
+    struct ggml_init_params params_na = {
+        .mem_size   = 2*GGML_DEFAULT_GRAPH_SIZE*ggml_tensor_overhead() + ggml_graph_overhead(GGML_DEFAULT_GRAPH_SIZE, true),
+        .mem_buffer = NULL,
+        .no_alloc   = true,
+    };
+
+    struct ggml_context * ctx_na = ggml_init(params_na);
+
+    struct ggml_tensor * x_na = ggml_new_tensor_2d(ctx_na, GGML_TYPE_F32, n_embd, N);
+    struct ggml_tensor * y0   = NULL;
+    struct ggml_tensor * y    = build(ctx_na, w, x_na, n_layer, &y0);
+
+    // the intermediate result can be read after the computation
+    ggml_set_output(y0);
+
+    struct ggml_cgraph gf = ggml_build_forward(ctx_na, y);
+    gf.n_threads = 2;
+
+    const size_t size = ggml_graph_alloc(ctx_na, &gf, NULL, 0);
+
+    printf("%s: planned size = %zu bytes, sum of the node sizes = %zu bytes\n", __func__, size, size_ref);
+
+    // with 8 layers, the memory of the early layers must have been reused
+    if (size == 0 || size*4 > size_ref) {
+        assert(false);
+        return 1;
+    }
+
+    void * buf = malloc(size);
+
+    if (ggml_graph_alloc(ctx_na, &gf, buf, size) != size || x_na->data == NULL || y->data == NULL) {
+        assert(false);
+        return 1;
+    }
+
+    // the input can be set after planning
+    for (int i = 0; i < ggml_nelements(x); ++i) {
+        ggml_set_f32_1d(x_na, i, ggml_get_f32_1d(x, i));
+    }
+
+    ggml_graph_compute(ctx_na, &gf);
+
+    for (int i = 0; i < ggml_nelements(y); ++i) {
+        const float v   = ggml_get_f32_1d(y,     i);
+        const float ref = ggml_get_f32_1d(y_ref, i);
+        if (fabsf(v - ref) > 1e-5f) {
+            printf("error: i = %d, v = %f, ref = %f\n", i, v, ref);
+            assert(false);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < ggml_nelements(y0); ++i) {
+        const float v   = ggml_get_f32_1d(y0,     i);
+        const float ref = ggml_get_f32_1d(y0_ref, i);
+        if (fabsf(v - ref) > 1e-5f) {
+            printf("error: layer 0, i = %d, v = %f, ref = %f\n", i, v, ref);
+            assert(false);
+            return 1;
+        }
+    }
+
+    free(buf);
+
+    ggml_free(ctx_na);
+    ggml_free(ctx0);
+
+    return 0;
+}
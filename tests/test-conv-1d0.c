@@ -0,0 +1,94 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+// compares ggml_conv_1d() to the direct convolution
+int test(struct ggml_context * ctx0, enum ggml_type type, int L, int c_in, int c_out, int K, int s0, int p0, int n_threads) {
+    struct ggml_tensor * w = ggml_new_tensor_3d(ctx0, type, K, c_in, c_out);
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, L, c_in);
+
+    // the reference uses the rounded f16 kernel values
+    float * w_ref = malloc(K*c_in*c_out*sizeof(float));
+    for (int i = 0; i < K*c_in*c_out; i++) {
+        const float v = 2.0f*frand() - 1.0f;
+        if (type == GGML_TYPE_F16) {
+            ((ggml_fp16_t *) w->data)[i] = ggml_fp32_to_fp16(v);
+            w_ref[i] = ggml_fp16_to_fp32(((ggml_fp16_t *) w->data)[i]);
+        } else {
+            ((float *) w->data)[i] = v;
+            w_ref[i] = v;
+        }
+    }
+
+    for (int i = 0; i < L*c_in; i++) {
+        ((float *) x->data)[i] = 2.0f*frand() - 1.0f;
+    }
+
+    struct ggml_tensor * y = ggml_conv_1d(ctx0, w, x, s0, p0);
+
+    const int L_out = (L + 2*p0 - K)/s0 + 1;
+    assert(y->ne[0] == L_out && y->ne[1] == c_out);
+
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
+    gf.n_threads = n_threads;
+
+    ggml_graph_compute(ctx0, &gf);
+
+    float max_err = 0.0f;
+    for (int o = 0; o < c_out; o++) {
+        for (int i = 0; i < L_out; i++) {
+            double sum = 0.0;
+            for (int c = 0; c < c_in; c++) {
+                for (int k = 0; k < K; k++) {
+                    const int j = i*s0 + k - p0;
+                    if (j >= 0 && j < L) {
+                        sum += (double) w_ref[(o*c_in + c)*K + k]*((float *) x->data)[c*L + j];
+                    }
+                }
+            }
+            max_err = fmaxf(max_err, fabsf(ggml_get_f32_1d(y, o*L_out + i) - (float) sum));
+        }
+    }
+
+    free(w_ref);
+
+    printf("%s: type = %d, L = %d, c_in = %d, c_out = %d, K = %d, s0 = %d, p0 = %d, n_threads = %d, max_err = %g\n", __func__,
+            type, L, c_in, c_out, K, s0, p0, n_threads, max_err);
+
+    return max_err < 1e-4f;
+}
+
+int main(int argc, const char ** argv) {
+    struct ggml_init_params params = {
+        .mem_size   = 64*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    for (int n_threads = 1; n_threads <= 4; n_threads += 3) {
+        for (int it = 0; it < 2; ++it) {
+            const enum ggml_type type = it == 0 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
+            struct ggml_context * ctx0 = ggml_init(params);
+
+            // the two convolutions of the whisper encoder, and odd shapes that leave partial tiles
+            if (!test(ctx0, type, 300, 80, 64, 3, 1, 1, n_threads) ||
+                !test(ctx0, type, 300, 64, 64, 3, 2, 1, n_threads) ||
+                !test(ctx0, type, 101, 7,  13, 5, 3, 2, n_threads) ||
+                !test(ctx0, type, 9,   3,  5,  4, 1, 0, n_threads)) {
+                assert(false);
+                return 1;
+            }
+
+            ggml_free(ctx0);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+void set_random(struct ggml_tensor * t) {
+    float * tmp = malloc(ggml_nelements(t)*sizeof(float));
+    for (int i = 0; i < ggml_nelements(t); i++) {
+        tmp[i] = 2.0f*frand() - 1.0f;
+    }
+    switch (t->type) {
+        case GGML_TYPE_F32:
+            for (int i = 0; i < ggml_nelements(t); i++) {
+                ((float *)t->data)[i] = tmp[i];
+            }
+            break;
+        case GGML_TYPE_F16:
+            for (int i = 0; i < ggml_nelements(t); i++) {
+                ((ggml_fp16_t *)t->data)[i] = ggml_fp32_to_fp16(tmp[i]);
+            }
+            break;
+        default:
+            ggml_quantize(t->type, tmp, t->data, ggml_nelements(t));
+            break;
+    }
+    free(tmp);
+}
+
+// compares ggml_flash_attn_kv() to the unfused graph of the gpt-2 attention
+int test(struct ggml_context * ctx0, enum ggml_type type_k, enum ggml_type type_v, int N, int n_kv, int n_past, bool use_mask, int n_threads) {
+    const int D = 64;
+    const int H = 4;
+
+    const float scale = 1.0f/sqrtf(D);
+
+    struct ggml_tensor * q = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, D, N, H);
+    struct ggml_tensor * k = ggml_new_tensor_3d(ctx0, type_k, D, n_kv, H);
+    struct ggml_tensor * v = ggml_new_tensor_3d(ctx0, type_v, n_kv, D, H);
+
+    set_random(q);
+    set_random(k);
+    set_random(v);
+
+    // each token sees a different part of the memory, as with several sequences in a batch
+    struct ggml_tensor * mask = NULL;
+    if (use_mask) {
+        mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, N);
+        for (int j = 0; j < N; j++) {
+            for (int i = 0; i < n_kv; i++) {
+                ggml_set_f32_1d(mask, j*n_kv + i, (i % (j + 2) == 1 || i > n_past + 7*j) ? -INFINITY : 0.0f);
+            }
+        }
+    }
+
+    // reference
+    struct ggml_tensor * kq = ggml_scale(ctx0, ggml_mul_mat(ctx0, k, q), ggml_new_f32(ctx0, scale));
+    kq = use_mask ? ggml_add(ctx0, kq, mask) : ggml_diag_mask_inf(ctx0, kq, n_past);
+    struct ggml_tensor * y_ref = ggml_mul_mat(ctx0, v, ggml_soft_max(ctx0, kq));
+
+    struct ggml_cgraph gf_ref = ggml_build_forward(ctx0, y_ref);
+    gf_ref.n_threads = n_threads;
+
+    ggml_graph_compute(ctx0, &gf_ref);
+
+    // flash attention, with n_past changed after the node is created
+    struct ggml_tensor * y = ggml_flash_attn_kv(ctx0, q, k, v, mask, 0, scale);
+    ggml_set_i32_1d(y->opt[1], 0, n_past);
+
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
+    gf.n_threads = n_threads;
+
+    ggml_graph_compute(ctx0, &gf);
+
+    float max_err = 0.0f;
+    for (int i = 0; i < ggml_nelements(y); ++i) {
+        max_err = fmaxf(max_err, fabsf(ggml_get_f32_1d(y, i) - ggml_get_f32_1d(y_ref, i)));
+    }
+
+    printf("%s: k = %d, v = %d, N = %d, n_kv = %d, n_past = %d, mask = %d, n_threads = %d, max_err = %g\n", __func__,
+            type_k, type_v, N, n_kv, n_past, use_mask, n_threads, max_err);
+
+    return max_err < 1e-3f;
+}
+
+int main(int argc, const char ** argv) {
+    struct ggml_init_params params = {
+        .mem_size   = 128*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    const enum ggml_type types[][2] = {
+        { GGML_TYPE_F32,  GGML_TYPE_F32 },
+        { GGML_TYPE_F16,  GGML_TYPE_F16 },
+        { GGML_TYPE_Q8_0, GGML_TYPE_F16 },
+    };
+
+    for (int it = 0; it < 3; ++it) {
+        for (int use_mask = 0; use_mask <= 1; ++use_mask) {
+            for (int n_threads = 1; n_threads <= 16; n_threads *= 4) {
+                struct ggml_context * ctx0 = ggml_init(params);
+
+                // decoding a single token splits the memory across the threads, a prompt splits the rows
+                if (!test(ctx0, types[it][0], types[it][1], 1, 640, 600, use_mask, n_threads) ||
+                    !test(ctx0, types[it][0], types[it][1], 7, 640, 500, use_mask, n_threads) ||
+                    !test(ctx0, types[it][0], types[it][1], 5, 32,  0,   use_mask, n_threads)) {
+                    assert(false);
+                    return 1;
+                }
+
+                ggml_free(ctx0);
+            }
+        }
+    }
+
+    return 0;
+}
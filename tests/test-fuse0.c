@@ -0,0 +1,173 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+void set_random(struct ggml_tensor * t) {
+    for (int i = 0; i < ggml_nelements(t); i++) {
+        ((float *)t->data)[i] = 2.0f*frand() - 1.0f;
+    }
+}
+
+struct params {
+    struct ggml_tensor * ln_g;
+    struct ggml_tensor * ln_b;
+    struct ggml_tensor * w;
+    struct ggml_tensor * w_b;
+    struct ggml_tensor * ch_b; // one bias per row, broadcast along the row
+    struct ggml_tensor * mask; // 0 or -INFINITY, broadcast to the heads
+};
+
+// a few layers with all the chains that ggml_graph_fuse() merges
+struct ggml_tensor * build(struct ggml_context * ctx0, const struct params * p, struct ggml_tensor * x, int n_layer) {
+    const int N = x->ne[1];
+
+    struct ggml_tensor * cur = x;
+
+    for (int il = 0; il < n_layer; ++il) {
+        struct ggml_tensor * inp = cur;
+
+        // norm(x)*w + b
+        cur = ggml_norm(ctx0, cur);
+        cur = ggml_add(ctx0, ggml_mul(ctx0, cur, p->ln_g), p->ln_b);
+
+        // gelu(x + b) with a bias per column and with a bias per row
+        cur = ggml_gelu(ctx0, ggml_add(ctx0, ggml_mul_mat(ctx0, p->w, cur), p->w_b));
+        cur = ggml_gelu(ctx0, ggml_add(ctx0, cur, p->ch_b));
+
+        // soft_max(diag_mask_inf(x*v)) on 4 heads of 16
+        cur = ggml_permute(ctx0, ggml_reshape_3d(ctx0, cur, 16, 4, N), 0, 2, 1, 3);
+        cur = ggml_cpy(ctx0, cur, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 16, N, 4));
+        cur = ggml_soft_max(ctx0, ggml_diag_mask_inf(ctx0, ggml_scale(ctx0, cur, ggml_new_f32(ctx0, 0.5f)), 2 + il));
+
+        // soft_max(x*v + mask)
+        cur = ggml_soft_max(ctx0, ggml_add(ctx0, ggml_scale(ctx0, cur, ggml_new_f32(ctx0, 0.25f)), p->mask));
+
+        // soft_max(x*v)
+        cur = ggml_soft_max(ctx0, ggml_scale(ctx0, cur, ggml_new_f32(ctx0, 2.0f)));
+
+        cur = ggml_reshape_2d(ctx0, ggml_cpy(ctx0, ggml_permute(ctx0, cur, 0, 2, 1, 3),
+                                             ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 16, 4, N)), 64, N);
+
+        cur = ggml_add(ctx0, cur, inp);
+    }
+
+    return cur;
+}
+
+int count_op(const struct ggml_cgraph * gf, enum ggml_op op) {
+    int n = 0;
+    for (int i = 0; i < gf->n_nodes; i++) {
+        n += gf->nodes[i]->op == op;
+    }
+    return n;
+}
+
+int main(int argc, const char ** argv) {
+    const int n_embd  = 64;
+    const int n_layer = 4;
+    const int N       = 8;
+
+    struct ggml_init_params params = {
+        .mem_size   = 16*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct params p = {
+        .ln_g = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_embd),
+        .ln_b = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_embd),
+        .w    = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_embd),
+        .w_b  = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_embd),
+        .ch_b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 1, N),
+        .mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 16, N),
+    };
+
+    set_random(p.ln_g);
+    set_random(p.ln_b);
+    set_random(p.w);
+    set_random(p.w_b);
+    set_random(p.ch_b);
+
+    // each row keeps a different number of positions
+    for (int j = 0; j < N; j++) {
+        for (int i = 0; i < 16; i++) {
+            ggml_set_f32_1d(p.mask, j*16 + i, i > 2*j + 1 ? -INFINITY : 0.0f);
+        }
+    }
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+    set_random(x);
+
+    // reference without fusion
+    struct ggml_tensor * y_ref = build(ctx0, &p, x, n_layer);
+
+    struct ggml_cgraph gf_ref = ggml_build_forward(ctx0, y_ref);
+    gf_ref.n_threads = 2;
+
+    ggml_graph_compute(ctx0, &gf_ref);
+
+    // the same graph with the fused nodes - the chains are computed in place, so the input is a copy
+    struct ggml_tensor * x_fused = ggml_dup_tensor(ctx0, x);
+    for (int i = 0; i < ggml_nelements(x); ++i) {
+        ggml_set_f32_1d(x_fused, i, ggml_get_f32_1d(x, i));
+    }
+
+    struct ggml_tensor * y = build(ctx0, &p, x_fused, n_layer);
+
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
+    gf.n_threads = 2;
+
+    ggml_graph_fuse(&gf);
+
+    printf("%s: nodes = %d, fused nodes = %d\n", __func__, gf_ref.n_nodes, gf.n_nodes);
+
+    if (count_op(&gf, GGML_OP_NORM_MUL_ADD)        != n_layer   ||
+        count_op(&gf, GGML_OP_ADD_GELU)            != 2*n_layer ||
+        count_op(&gf, GGML_OP_SCALE_MASK_SOFT_MAX) != 3*n_layer ||
+        count_op(&gf, GGML_OP_NORM) != 0 || count_op(&gf, GGML_OP_GELU) != 0 || count_op(&gf, GGML_OP_SOFT_MAX) != 0 ||
+        gf.n_nodes != gf_ref.n_nodes - 9*n_layer) {
+        assert(false);
+        return 1;
+    }
+
+    ggml_graph_compute(ctx0, &gf);
+
+    for (int i = 0; i < ggml_nelements(y); ++i) {
+        const float v   = ggml_get_f32_1d(y,     i);
+        const float ref = ggml_get_f32_1d(y_ref, i);
+        if (fabsf(v - ref) > 1e-6f) {
+            printf("error: i = %d, v = %f, ref = %f\n", i, v, ref);
+            assert(false);
+            return 1;
+        }
+    }
+
+    // nodes with gradients are not fused
+    struct ggml_tensor * a = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_embd);
+    struct ggml_tensor * b = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_embd);
+    set_random(a);
+    set_random(b);
+    ggml_set_param(ctx0, a);
+
+    struct ggml_cgraph gf_grad = ggml_build_forward(ctx0, ggml_gelu(ctx0, ggml_add(ctx0, a, b)));
+    const int n_nodes_grad = gf_grad.n_nodes;
+
+    ggml_graph_fuse(&gf_grad);
+
+    if (count_op(&gf_grad, GGML_OP_ADD_GELU) != 0 || gf_grad.n_nodes != n_nodes_grad) {
+        assert(false);
+        return 1;
+    }
+
+    ggml_free(ctx0);
+
+    return 0;
+}
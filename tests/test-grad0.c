@@ -90,7 +90,7 @@ bool check_gradient(
         float max_error_abs,
         float max_error_rel) {
 
-    struct ggml_cgraph gf = ggml_build_forward (f);
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, f);
     struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
     ggml_graph_compute(ctx0, &gf);
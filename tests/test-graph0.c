@@ -0,0 +1,98 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+int main(int argc, const char ** argv) {
+    // a graph larger than the default size
+    const int n_chain = 3*GGML_DEFAULT_GRAPH_SIZE;
+
+    struct ggml_init_params params = {
+        .mem_size   = (size_t) 2*n_chain*(ggml_tensor_overhead() + 16) + ggml_graph_overhead(2*n_chain, false) + 16*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, 2*n_chain, false);
+
+    if (gf->size != 2*n_chain || gf->grads != NULL || gf->n_nodes != 0 || gf->n_leafs != 0) {
+        assert(false);
+        return 1;
+    }
+
+    // each node is used twice, so every one of them is reached again after it was visited
+    struct ggml_tensor * x = ggml_new_f32(ctx0, 1.0f);
+    struct ggml_tensor * y = x;
+
+    const float eps = 1.0f/n_chain;
+
+    float ref = 1.0f;
+    for (int i = 0; i < n_chain; i++) {
+        y = ggml_add(ctx0, y, ggml_mul(ctx0, y, ggml_new_f32(ctx0, eps)));
+        ref += ref*eps;
+    }
+
+    ggml_build_forward_expand(gf, y);
+
+    printf("%s: nodes = %d, leafs = %d\n", __func__, gf->n_nodes, gf->n_leafs);
+
+    if (gf->n_nodes != 2*n_chain || gf->n_leafs != n_chain + 1) {
+        assert(false);
+        return 1;
+    }
+
+    // expanding with a tensor that is already in the graph adds nothing
+    ggml_build_forward_expand(gf, gf->nodes[n_chain]);
+
+    if (gf->n_nodes != 2*n_chain || gf->n_leafs != n_chain + 1) {
+        assert(false);
+        return 1;
+    }
+
+    gf->n_threads = 2;
+
+    ggml_graph_compute(ctx0, gf);
+
+    // y = (1 + 1/n_chain)^n_chain ~ e
+    const float v = ggml_get_f32_1d(y, 0);
+
+    printf("%s: y = %f, ref = %f\n", __func__, v, ref);
+
+    if (fabsf(v - ref) > 1e-5f) {
+        assert(false);
+        return 1;
+    }
+
+    // the forward graph for the backward pass keeps the gradients
+    struct ggml_tensor * a = ggml_new_f32(ctx0, 3.0f);
+    ggml_set_param(ctx0, a);
+
+    struct ggml_tensor * f = ggml_mul(ctx0, a, ggml_mul(ctx0, a, a));
+
+    struct ggml_cgraph gfa = ggml_build_forward (ctx0, f);
+    struct ggml_cgraph gba = ggml_build_backward(ctx0, &gfa, false);
+
+    if (gfa.grads == NULL || gba.grads == NULL || gba.nodes == gfa.nodes || gba.n_nodes <= gfa.n_nodes) {
+        assert(false);
+        return 1;
+    }
+
+    ggml_graph_reset(&gfa);
+    ggml_set_f32(f->grad, 1.0f);
+
+    ggml_graph_compute(ctx0, &gba);
+
+    printf("%s: f = %f, df/da = %f\n", __func__, ggml_get_f32_1d(f, 0), ggml_get_f32_1d(a->grad, 0));
+
+    if (ggml_get_f32_1d(f, 0) != 27.0f || ggml_get_f32_1d(a->grad, 0) != 27.0f) {
+        assert(false);
+        return 1;
+    }
+
+    ggml_free(ctx0);
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define N_THREADS 4
+#define N_ITER    200
+
+// y = sum((x + x)*x) for x = [0, 1, ..., n - 1]
+static int compute(struct ggml_context * ctx0, int n) {
+    struct ggml_tensor * x = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n);
+    for (int i = 0; i < n; i++) {
+        ggml_set_f32_1d(x, i, (float) i);
+    }
+
+    struct ggml_tensor * y = ggml_sum(ctx0, ggml_mul(ctx0, ggml_add(ctx0, x, x), x));
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, 16, false);
+    ggml_build_forward_expand(gf, y);
+    gf->n_threads = 1;
+
+    ggml_graph_compute(ctx0, gf);
+
+    const float ref = (float) (n - 1)*n*(2*n - 1)/3;
+
+    return fabsf(ggml_get_f32_1d(y, 0) - ref) < 1e-3f*ref;
+}
+
+// each thread creates and frees its own contexts while the other threads do the same
+static void * worker(void * arg) {
+    const int ith = *(int *) arg;
+
+    struct ggml_init_params params = {
+        .mem_size   = 1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    for (int i = 0; i < N_ITER; i++) {
+        struct ggml_context * ctx0 = ggml_init(params);
+        if (ctx0 == NULL || !compute(ctx0, 16 + (ith + i)%16)) {
+            return (void *) 1;
+        }
+        ggml_free(ctx0);
+    }
+
+    return NULL;
+}
+
+int main(int argc, const char ** argv) {
+    struct ggml_init_params params = {
+        .mem_size   = 64*1024,
+        .mem_buffer = NULL,
+    };
+
+    // more live contexts than there are preallocated slots
+    const int n_ctx = GGML_MAX_CONTEXTS + 36;
+
+    struct ggml_context * ctxs[GGML_MAX_CONTEXTS + 36];
+    for (int i = 0; i < n_ctx; i++) {
+        ctxs[i] = ggml_init(params);
+        if (ctxs[i] == NULL || !compute(ctxs[i], 8)) {
+            assert(false);
+            return 1;
+        }
+    }
+
+    // free every other context, so the workers get both slots and heap contexts
+    for (int i = 0; i < n_ctx; i += 2) {
+        ggml_free(ctxs[i]);
+    }
+
+    pthread_t threads[N_THREADS];
+    int       ith[N_THREADS];
+
+    for (int i = 0; i < N_THREADS; i++) {
+        ith[i] = i;
+        pthread_create(&threads[i], NULL, worker, &ith[i]);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < N_THREADS; i++) {
+        void * res = NULL;
+        pthread_join(threads[i], &res);
+        failed |= res != NULL;
+    }
+
+    for (int i = 1; i < n_ctx; i += 2) {
+        ggml_free(ctxs[i]);
+    }
+
+    printf("%s: %d threads x %d contexts, failed = %d\n", __func__, N_THREADS, N_ITER, failed);
+
+    if (failed) {
+        assert(false);
+        return 1;
+    }
+
+    // a reset context builds the same graph in the same memory
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    size_t used = 0;
+    for (int i = 0; i < 10; i++) {
+        if (!compute(ctx0, 32)) {
+            assert(false);
+            return 1;
+        }
+
+        if (i > 0 && ggml_used_mem(ctx0) != used) {
+            assert(false);
+            return 1;
+        }
+        used = ggml_used_mem(ctx0);
+
+        ggml_reset(ctx0);
+
+        if (ggml_used_mem(ctx0) != 0) {
+            assert(false);
+            return 1;
+        }
+    }
+
+    printf("%s: reset, used mem = %zu\n", __func__, used);
+
+    ggml_free(ctx0);
+
+    return 0;
+}
@@ -90,7 +90,7 @@ bool check_gradient(
         float max_error_abs,
         float max_error_rel) {
 
-    struct ggml_cgraph gf = ggml_build_forward (f);
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, f);
     struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
     ggml_graph_compute(ctx0, &gf);
@@ -266,7 +266,7 @@ int main(int argc, const char ** argv) {
                 if (ndims <= 2) {
                     check_gradient("mul_mat", ctx0, x, f, ndims, nargs, 1e-3f, 1e-3f, INFINITY);
                 } else {
-                    struct ggml_cgraph gf = ggml_build_forward(m);
+                    struct ggml_cgraph gf = ggml_build_forward(ctx0, m);
                     ggml_graph_compute(ctx0, &gf);
                 }
 
@@ -302,7 +302,7 @@ int main(int argc, const char ** argv) {
                 if (ndims <= 2) {
                     check_gradient("mul_mat", ctx0, x, f, ndims, nargs, 1e-3f, 1e-3f, INFINITY);
                 } else {
-                    struct ggml_cgraph gf = ggml_build_forward(m);
+                    struct ggml_cgraph gf = ggml_build_forward(ctx0, m);
                     ggml_graph_compute(ctx0, &gf);
                 }
 
@@ -0,0 +1,149 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+struct ggml_tensor * get_random_tensor(struct ggml_context * ctx0, enum ggml_type type, int ne0, int ne1, int ne2) {
+    struct ggml_tensor * result = ggml_new_tensor_3d(ctx0, type, ne0, ne1, ne2);
+
+    for (int i = 0; i < ne0*ne1*ne2; i++) {
+        ggml_set_f32_1d(result, i, 2.0f*frand() - 1.0f);
+    }
+
+    return result;
+}
+
+// y = w*x for f16 w of K x M x L and f32 x of K x N x L, compared with a naive reference
+// with N >= 16 the blocked gemm path is used, which keeps src1 in f32
+// if trans is true, w is the transpose of an M x K x L tensor, as the gpt-2 weights in the model file
+bool test_mul_mat(struct ggml_context * ctx0, int K, int M, int N, int L, bool trans, float eps) {
+    struct ggml_tensor * w = trans ? get_random_tensor(ctx0, GGML_TYPE_F16, M, K, L)
+                                   : get_random_tensor(ctx0, GGML_TYPE_F16, K, M, L);
+    struct ggml_tensor * x = get_random_tensor(ctx0, GGML_TYPE_F32, K, N, L);
+
+    struct ggml_tensor * y = ggml_mul_mat(ctx0, trans ? ggml_transpose(ctx0, w) : w, x);
+
+    assert(y->ne[0] == M && y->ne[1] == N && y->ne[2] == L);
+
+    float * y_ref = malloc(M*N*L*sizeof(float));
+
+    for (int l = 0; l < L; ++l) {
+        for (int j = 0; j < N; ++j) {
+            for (int i = 0; i < M; ++i) {
+                double sum = 0.0;
+                for (int k = 0; k < K; ++k) {
+                    const float wik = trans ? ggml_get_f32_1d(w, (l*K + k)*M + i) : ggml_get_f32_1d(w, (l*M + i)*K + k);
+
+                    sum += (double) wik*ggml_get_f32_1d(x, (l*N + j)*K + k);
+                }
+                y_ref[(l*N + j)*M + i] = sum;
+            }
+        }
+    }
+
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
+
+    bool ok = true;
+
+    for (int n_threads = 1; n_threads <= 4 && ok; ++n_threads) {
+        gf.n_threads = n_threads;
+
+        ggml_set_zero(y);
+        ggml_graph_compute(ctx0, &gf);
+
+        float err = 0.0f;
+        for (int i = 0; i < M*N*L; ++i) {
+            err = fmaxf(err, fabsf(ggml_get_f32_1d(y, i) - y_ref[i]));
+        }
+
+        printf("%s: K = %d, M = %d, N = %d, L = %d, trans = %d, n_threads = %d, error = %f\n", __func__, K, M, N, L, trans, n_threads, err);
+
+        ok = err <= eps;
+    }
+
+    free(y_ref);
+
+    return ok;
+}
+
+// every product of w and x is 90000, more than the largest f16 (65504), so the dot products must be summed in f32
+bool test_mul_mat_large(struct ggml_context * ctx0, int K, int M, int N) {
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, K, M);
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, K, N);
+
+    for (int i = 0; i < K*M; i++) {
+        ggml_set_f32_1d(w, i, 300.0f);
+    }
+    for (int i = 0; i < K*N; i++) {
+        ggml_set_f32_1d(x, i, 300.0f);
+    }
+
+    struct ggml_tensor * y = ggml_mul_mat(ctx0, w, x);
+
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
+    gf.n_threads = 1;
+
+    ggml_graph_compute(ctx0, &gf);
+
+    const float ref = 90000.0f*K;
+
+    float err = 0.0f;
+    for (int i = 0; i < M*N; ++i) {
+        err = fmaxf(err, fabsf(ggml_get_f32_1d(y, i) - ref)/ref);
+    }
+
+    printf("%s: K = %d, M = %d, N = %d, y = %f, ref = %f, rel error = %g\n", __func__, K, M, N, ggml_get_f32_1d(y, 0), ref, err);
+
+    return err <= 1e-6f;
+}
+
+int main(int argc, const char ** argv) {
+    struct ggml_init_params params = {
+        .mem_size   = 64*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    // src1 is rounded to f16 for few columns
+    if (!test_mul_mat(ctx0, 256, 70, 5, 1, false, 1e-2f)) {
+        assert(false);
+        return 1;
+    }
+
+    // partial tiles, bands over the matrix boundary and lengths that are not a multiple of the vector size
+    const int shapes[][4] = {
+        {  64,  64,  16, 1 },
+        {  67,  70,  37, 2 },
+        { 256, 131,  50, 1 },
+        {   5,   3,  17, 3 },
+    };
+
+    // with src0 as stored and transposed
+    for (int trans = 0; trans <= 1; ++trans) {
+        for (int i = 0; i < (int) (sizeof(shapes)/sizeof(shapes[0])); ++i) {
+            if (!test_mul_mat(ctx0, shapes[i][0], shapes[i][1], shapes[i][2], shapes[i][3], trans, 1e-4f)) {
+                assert(false);
+                return 1;
+            }
+        }
+    }
+
+    // the f16 dot product path (N < 16) and the gemm path
+    if (!test_mul_mat_large(ctx0, 300,  3,  2) ||
+        !test_mul_mat_large(ctx0, 4096, 2,  1) ||
+        !test_mul_mat_large(ctx0, 300,  5, 17)) {
+        assert(false);
+        return 1;
+    }
+
+    ggml_free(ctx0);
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+// compares ggml_opt_adam_step() to the scalar update, for a few steps
+int test_step(struct ggml_context * ctx0, enum ggml_type type, int n, int n_threads) {
+    const float alpha = 0.01f;
+    const float beta1 = 0.9f;
+    const float beta2 = 0.999f;
+    const float eps   = 1e-8f;
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, type, n, 3);
+    ggml_set_param(ctx0, a);
+
+    const int ne = ggml_nelements(a);
+
+    struct ggml_tensor * m  = ggml_set_zero(ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n, 3));
+    struct ggml_tensor * v  = ggml_set_zero(ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n, 3));
+    struct ggml_tensor * w  = type == GGML_TYPE_F32 ? NULL : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n, 3);
+    struct ggml_tensor * hp = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 5);
+
+    float * x_ref = malloc(ne*sizeof(float));
+    float * m_ref = malloc(ne*sizeof(float));
+    float * v_ref = malloc(ne*sizeof(float));
+
+    for (int i = 0; i < ne; i++) {
+        ggml_set_f32_1d(a, i, 2.0f*frand() - 1.0f);
+
+        x_ref[i] = ggml_get_f32_1d(a, i);
+        m_ref[i] = 0.0f;
+        v_ref[i] = 0.0f;
+
+        if (w) {
+            ggml_set_f32_1d(w, i, x_ref[i]);
+        }
+    }
+
+    ggml_set_f32_1d(hp, 1, beta1);
+    ggml_set_f32_1d(hp, 2, beta2);
+    ggml_set_f32_1d(hp, 3, eps);
+
+    struct ggml_cgraph * gu = ggml_new_graph(ctx0);
+    ggml_build_forward_expand(gu, ggml_opt_adam_step(ctx0, a, m, v, w, hp));
+    gu->n_threads = n_threads;
+
+    for (int t = 0; t < 3; t++) {
+        const float alpha_t = alpha/(1.0f - powf(beta1, t + 1));
+        const float scale   =  1.0f/(1.0f - powf(beta2, t + 1));
+
+        ggml_set_f32_1d(hp, 0, alpha_t);
+        ggml_set_f32_1d(hp, 4, scale);
+
+        for (int i = 0; i < ne; i++) {
+            const float g = 2.0f*frand() - 1.0f;
+            ggml_set_f32_1d(a->grad, i, g);
+
+            m_ref[i] = m_ref[i]*beta1 + g*(1.0f - beta1);
+            v_ref[i] = v_ref[i]*beta2 + g*g*(1.0f - beta2);
+            x_ref[i] -= m_ref[i]*alpha_t/(sqrtf(v_ref[i]*scale) + eps);
+        }
+
+        ggml_graph_compute(ctx0, gu);
+    }
+
+    // an f16 parameter is the rounding of its master copy, which follows the f32 update
+    float err_x = 0.0f;
+    float err_a = 0.0f;
+    for (int i = 0; i < ne; i++) {
+        err_x = fmaxf(err_x, fabsf((w ? ggml_get_f32_1d(w, i) : ggml_get_f32_1d(a, i)) - x_ref[i]));
+        err_x = fmaxf(err_x, fabsf(ggml_get_f32_1d(m, i) - m_ref[i]));
+        err_x = fmaxf(err_x, fabsf(ggml_get_f32_1d(v, i) - v_ref[i]));
+        err_a = fmaxf(err_a, fabsf(ggml_get_f32_1d(a, i) - x_ref[i]));
+    }
+
+    free(x_ref);
+    free(m_ref);
+    free(v_ref);
+
+    printf("%s: type = %d, n = %d, n_threads = %d, err = %g, err_a = %g\n", __func__, type, n, n_threads, err_x, err_a);
+
+    return err_x < 1e-6f && err_a < (type == GGML_TYPE_F32 ? 1e-6f : 1e-3f);
+}
+
+// minimizes f = sum_i sum((p_i - c_i)^2) over more parameters than the optimizer used to allow
+int test_opt(enum ggml_opt_type type, int n_params, int n_threads) {
+    struct ggml_init_params params = {
+        .mem_size   = 64*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct ggml_tensor * ps[64];
+    struct ggml_tensor * cs[64];
+
+    assert(n_params <= 64);
+
+    struct ggml_tensor * f = NULL;
+
+    for (int i = 0; i < n_params; i++) {
+        ps[i] = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1 + i%7);
+        cs[i] = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1 + i%7);
+
+        for (int j = 0; j < ggml_nelements(ps[i]); j++) {
+            ggml_set_f32_1d(ps[i], j, 0.0f);
+            ggml_set_f32_1d(cs[i], j, 2.0f*frand() - 1.0f);
+        }
+
+        ggml_set_param(ctx0, ps[i]);
+
+        struct ggml_tensor * fi = ggml_sum(ctx0, ggml_sqr(ctx0, ggml_sub(ctx0, ps[i], cs[i])));
+
+        f = f ? ggml_add(ctx0, f, fi) : fi;
+    }
+
+    struct ggml_opt_params opt_params = ggml_opt_default_params(type);
+
+    opt_params.n_threads            = n_threads;
+    opt_params.print_forward_graph  = false;
+    opt_params.print_backward_graph = false;
+
+    if (type == GGML_OPT_ADAM) {
+        opt_params.adam.alpha  = 0.05f;
+        opt_params.adam.n_iter = 300;
+        opt_params.adam.eps_f  = 0.0f;
+        opt_params.max_no_improvement = 0;
+    }
+
+    ggml_opt(ctx0, opt_params, f);
+
+    float max_err = 0.0f;
+    for (int i = 0; i < n_params; i++) {
+        for (int j = 0; j < ggml_nelements(ps[i]); j++) {
+            max_err = fmaxf(max_err, fabsf(ggml_get_f32_1d(ps[i], j) - ggml_get_f32_1d(cs[i], j)));
+        }
+    }
+
+    printf("%s: type = %d, n_params = %d, n_threads = %d, f = %g, max_err = %g\n", __func__,
+            type, n_params, n_threads, ggml_get_f32_1d(f, 0), max_err);
+
+    ggml_free(ctx0);
+
+    return max_err < 1e-2f;
+}
+
+int main(int argc, const char ** argv) {
+    struct ggml_init_params params = {
+        .mem_size   = 16*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    for (int n_threads = 1; n_threads <= 4; n_threads += 3) {
+        struct ggml_context * ctx0 = ggml_init(params);
+
+        // sizes that split into whole and partial vectors per thread
+        if (!test_step(ctx0, GGML_TYPE_F32, 1000, n_threads) ||
+            !test_step(ctx0, GGML_TYPE_F32, 7,    n_threads) ||
+            !test_step(ctx0, GGML_TYPE_F16, 1000, n_threads) ||
+            !test_step(ctx0, GGML_TYPE_F16, 13,   n_threads)) {
+            assert(false);
+            return 1;
+        }
+
+        ggml_free(ctx0);
+
+        if (!test_opt(GGML_OPT_ADAM,  20, n_threads) ||
+            !test_opt(GGML_OPT_LBFGS, 20, n_threads)) {
+            assert(false);
+            return 1;
+        }
+    }
+
+    return 0;
+}
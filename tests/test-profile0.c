@@ -0,0 +1,97 @@
+#include "ggml/ggml.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+void set_random(struct ggml_tensor * t) {
+    for (int i = 0; i < ggml_nelements(t); i++) {
+        ((float *)t->data)[i] = 2.0f*frand() - 1.0f;
+    }
+}
+
+int main(int argc, const char ** argv) {
+    const int n_embd = 64;
+    const int N      = 8;
+
+    struct ggml_init_params params = {
+        .mem_size   = 16*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_embd);
+    struct ggml_tensor * b = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_embd);
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+
+    set_random(w);
+    set_random(b);
+    set_random(x);
+
+    // mul_mat, add, soft_max and a view that is not computed
+    struct ggml_tensor * y = ggml_soft_max(ctx0, ggml_add(ctx0, ggml_mul_mat(ctx0, w, x), b));
+    y = ggml_transpose(ctx0, y);
+
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
+    gf.n_threads = 2;
+
+    // nothing is recorded without an active profiler
+    struct ggml_profiler * prof = ggml_profiler_new();
+
+    ggml_graph_compute(ctx0, &gf);
+
+    if (ggml_profiler_get_op_stats(prof, GGML_OP_MUL_MAT).n_nodes != 0) {
+        assert(false);
+        return 1;
+    }
+
+    const int n_runs = 3;
+
+    ggml_profiler_set_active(prof);
+    for (int i = 0; i < n_runs; i++) {
+        ggml_graph_compute(ctx0, &gf);
+    }
+    ggml_profiler_set_active(NULL);
+
+    ggml_profiler_print(prof);
+
+    const struct ggml_profiler_op_stats mm = ggml_profiler_get_op_stats(prof, GGML_OP_MUL_MAT);
+
+    if (mm.n_nodes != n_runs ||
+        mm.flops   != (int64_t) n_runs*2*n_embd*n_embd*N ||
+        mm.time_ns <= 0 || mm.max_ns > mm.time_ns || mm.mean_ns > mm.max_ns ||
+        ggml_profiler_get_op_stats(prof, GGML_OP_ADD).n_nodes       != n_runs ||
+        ggml_profiler_get_op_stats(prof, GGML_OP_SOFT_MAX).n_nodes  != n_runs ||
+        ggml_profiler_get_op_stats(prof, GGML_OP_TRANSPOSE).n_nodes != 0) {
+        assert(false);
+        return 1;
+    }
+
+    if (!ggml_profiler_write_trace(prof, "test-profile0-trace.json") ||
+        !ggml_profiler_write_summary(prof, "test-profile0-summary.json")) {
+        assert(false);
+        return 1;
+    }
+
+    remove("test-profile0-trace.json");
+    remove("test-profile0-summary.json");
+
+    // the events are dropped on reset
+    ggml_profiler_reset(prof);
+
+    if (ggml_profiler_get_op_stats(prof, GGML_OP_MUL_MAT).n_nodes != 0) {
+        assert(false);
+        return 1;
+    }
+
+    ggml_profiler_free(prof);
+
+    ggml_free(ctx0);
+
+    return 0;
+}
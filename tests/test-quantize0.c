@@ -0,0 +1,148 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+struct ggml_tensor * get_random_tensor(struct ggml_context * ctx0, int ne0, int ne1) {
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, ne0, ne1);
+
+    for (int i = 0; i < ne0*ne1; i++) {
+        ((float *)result->data)[i] = 2.0f*frand() - 1.0f;
+    }
+
+    return result;
+}
+
+// quantize the f32 tensor src into a new tensor of the given type
+struct ggml_tensor * quantize_tensor(struct ggml_context * ctx0, struct ggml_tensor * src, enum ggml_type type) {
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx0, type, src->ne[0], src->ne[1]);
+
+    const size_t size = ggml_quantize(type, src->data, result->data, ggml_nelements(src));
+    assert(size == ggml_nbytes(result));
+
+    return result;
+}
+
+// dequantize the tensor src into a new f32 tensor
+struct ggml_tensor * dequantize_tensor(struct ggml_context * ctx0, struct ggml_tensor * src) {
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, src->ne[0], src->ne[1]);
+
+    ggml_dequantize(src->type, src->data, result->data, ggml_nelements(src));
+
+    return result;
+}
+
+float max_abs_diff(struct ggml_tensor * a, struct ggml_tensor * b) {
+    float res = 0.0f;
+    for (int i = 0; i < ggml_nelements(a); i++) {
+        res = fmaxf(res, fabsf(((float *) a->data)[i] - ((float *) b->data)[i]));
+    }
+
+    return res;
+}
+
+bool test_type(struct ggml_context * ctx0, enum ggml_type type, float eps) {
+    const int K = 256;
+    const int M = 48;
+    const int N = 8;
+
+    assert(ggml_is_quantized(type));
+    assert(ggml_blck_size(type) == 32);
+
+    struct ggml_tensor * w  = get_random_tensor(ctx0, K, M);
+    struct ggml_tensor * x  = get_random_tensor(ctx0, K, N);
+
+    struct ggml_tensor * wq = quantize_tensor(ctx0, w, type);
+    struct ggml_tensor * wd = dequantize_tensor(ctx0, wq);
+
+    assert(ggml_nbytes(wq) == (size_t) (ggml_nelements(w)*ggml_type_sizef(type)));
+    assert(ggml_nbytes(wq) < ggml_nbytes(w));
+
+    // round-trip error is bounded by the step size of the quantization
+    {
+        const float err = max_abs_diff(w, wd);
+        printf("%s: type = %d, round-trip error = %f\n", __func__, type, err);
+        if (err > eps) {
+            return false;
+        }
+    }
+
+    // mul_mat with the quantized weights vs the dequantized weights
+    // src1 is quantized to 8 bits before the dot products, so the reference uses the same rounding
+    {
+        struct ggml_tensor * xd = dequantize_tensor(ctx0, quantize_tensor(ctx0, x, GGML_TYPE_Q8_0));
+
+        struct ggml_tensor * y_ref = ggml_mul_mat(ctx0, wd, xd);
+        struct ggml_tensor * y     = ggml_mul_mat(ctx0, wq, x);
+
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, y_ref);
+        ggml_build_forward_expand(&gf, y);
+
+        for (int n_threads = 1; n_threads <= 4; ++n_threads) {
+            gf.n_threads = n_threads;
+
+            ggml_graph_compute(ctx0, &gf);
+
+            const float err = max_abs_diff(y, y_ref);
+            printf("%s: type = %d, n_threads = %d, mul_mat error = %f\n", __func__, type, n_threads, err);
+            if (err > 1e-4f) {
+                return false;
+            }
+        }
+    }
+
+    // get_rows of the quantized weights is exact w.r.t. the dequantized weights
+    {
+        struct ggml_tensor * rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, 3);
+        ggml_set_i32_1d(rows, 0, 5);
+        ggml_set_i32_1d(rows, 1, 0);
+        ggml_set_i32_1d(rows, 2, M - 1);
+
+        struct ggml_tensor * r = ggml_get_rows(ctx0, wq, rows);
+
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, r);
+        ggml_graph_compute(ctx0, &gf);
+
+        for (int i = 0; i < 3; ++i) {
+            const int ir = ggml_get_i32_1d(rows, i);
+            for (int j = 0; j < K; ++j) {
+                if (ggml_get_f32_1d(r, i*K + j) != ggml_get_f32_1d(wd, ir*K + j)) {
+                    printf("%s: type = %d, get_rows mismatch at (%d, %d)\n", __func__, type, i, j);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, const char ** argv) {
+    struct ggml_init_params params = {
+        .mem_size   = 16*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    // values are in [-1, 1]: the round-trip error is at most about one quantization step
+    if (!test_type(ctx0, GGML_TYPE_Q4_0, 1.0f/7.0f)) {
+        assert(false);
+        return 1;
+    }
+
+    if (!test_type(ctx0, GGML_TYPE_Q8_0, 1.0f/127.0f)) {
+        assert(false);
+        return 1;
+    }
+
+    ggml_free(ctx0);
+
+    return 0;
+}
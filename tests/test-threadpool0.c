@@ -0,0 +1,215 @@
+#include "ggml/ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+float frand() {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+struct ggml_tensor * get_random_tensor(struct ggml_context * ctx0, int ne0, int ne1) {
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, ne0, ne1);
+
+    for (int i = 0; i < ne0*ne1; i++) {
+        ((float *)result->data)[i] = 2.0f*frand() - 1.0f;
+    }
+
+    return result;
+}
+
+// compute the graph n_iter times with the given pool and compare the output with the reference
+bool check_pool(
+        struct ggml_context * ctx0,
+        struct ggml_cgraph * gf,
+        struct ggml_tensor * y,
+        const float * y_ref,
+        struct ggml_threadpool * pool,
+        int n_iter) {
+    for (int iter = 0; iter < n_iter; ++iter) {
+        ggml_graph_compute_with_pool(ctx0, gf, pool);
+
+        for (int i = 0; i < ggml_nelements(y); ++i) {
+            const float v = ggml_get_f32_1d(y, i);
+            if (fabsf(v - y_ref[i]) > 1e-5f) {
+                printf("error: n_threads=%d, iter=%d, i=%d, v=%f, ref=%f\n",
+                        ggml_threadpool_n_threads(pool), iter, i, v, y_ref[i]);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// the memory ranges that decide if two nodes are computed concurrently, including tensors without elements
+bool check_overlap(struct ggml_context * ctx0) {
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 64, 16);
+
+    struct ggml_tensor * row1 = ggml_view_2d(ctx0, a, 64, 1, a->nb[1], 1*a->nb[1]);
+    struct ggml_tensor * row2 = ggml_view_2d(ctx0, a, 64, 1, a->nb[1], 2*a->nb[1]);
+
+    // no columns, no rows, and a view without elements that starts inside a
+    struct ggml_tensor * empty0 = ggml_view_2d(ctx0, a,  0, 16, a->nb[1], 0);
+    struct ggml_tensor * empty1 = ggml_view_2d(ctx0, a, 64,  0, a->nb[1], 0);
+    struct ggml_tensor * empty2 = ggml_view_2d(ctx0, a,  0,  1, a->nb[1], 8*a->nb[1]);
+
+    struct {
+        const struct ggml_tensor * a;
+        const struct ggml_tensor * b;
+        bool overlap;
+    } cases[] = {
+        { a,      row1,   true  },
+        { row1,   row2,   false },
+        { row2,   a,      true  },
+        { empty0, a,      false },
+        { a,      empty1, false },
+        { empty2, a,      false },
+        { empty0, empty0, false },
+    };
+
+    for (size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i) {
+        if (ggml_tensors_overlap(cases[i].a, cases[i].b) != cases[i].overlap) {
+            printf("error: case %zu: expected overlap = %d\n", i, cases[i].overlap);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, const char ** argv) {
+    struct ggml_init_params params = {
+        .mem_size   = 128*1024*1024,
+        .mem_buffer = NULL,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    if (!check_overlap(ctx0)) {
+        assert(false);
+        return 1;
+    }
+
+    struct ggml_tensor * w = get_random_tensor(ctx0, 64, 48);
+    struct ggml_tensor * x = get_random_tensor(ctx0, 64, 8);
+
+    struct ggml_tensor * y = ggml_soft_max(ctx0, ggml_gelu(ctx0, ggml_mul_mat(ctx0, w, ggml_norm(ctx0, x))));
+
+    // reference result with a single thread
+    struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
+    gf.n_threads = 1;
+
+    ggml_graph_compute(ctx0, &gf);
+
+    float * y_ref = malloc(ggml_nbytes(y));
+    for (int i = 0; i < ggml_nelements(y); ++i) {
+        y_ref[i] = ggml_get_f32_1d(y, i);
+    }
+
+    // independent single-task nodes that write into views of the same buffer, followed by a node that reads it
+    const int n_kv = 4;
+    const int ne_kv = 64*128;
+
+    struct ggml_tensor * kv = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_kv*ne_kv);
+
+    struct ggml_cgraph gkv = *ggml_new_graph(ctx0);
+    gkv.n_threads = 1;
+
+    for (int k = 0; k < n_kv; ++k) {
+        struct ggml_tensor * t = ggml_sqr(ctx0, get_random_tensor(ctx0, 64, 128));
+        ggml_build_forward_expand(&gkv, ggml_cpy(ctx0, t, ggml_view_1d(ctx0, kv, ne_kv, k*ne_kv*sizeof(float))));
+    }
+
+    struct ggml_tensor * kv_sum = ggml_sum(ctx0, kv);
+    ggml_build_forward_expand(&gkv, kv_sum);
+
+    ggml_graph_compute(ctx0, &gkv);
+
+    float kv_sum_ref = ggml_get_f32_1d(kv_sum, 0);
+
+    // the gemm of f16 weights uses a part of the work buffer per thread, so the buffer of the graph planned for one
+    // thread is too small for the next pools - the tensor allocated after it must not be overwritten
+    struct ggml_tensor * w16 = ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, 256, 96);
+    for (int i = 0; i < ggml_nelements(w16); ++i) {
+        ggml_set_f32_1d(w16, i, 2.0f*frand() - 1.0f);
+    }
+
+    struct ggml_tensor * y16 = ggml_mul_mat(ctx0, w16, get_random_tensor(ctx0, 256, 32));
+
+    struct ggml_cgraph g16 = ggml_build_forward(ctx0, y16);
+    g16.n_threads = 1;
+
+    ggml_graph_compute(ctx0, &g16);
+
+    float * y16_ref = malloc(ggml_nbytes(y16));
+    for (int i = 0; i < ggml_nelements(y16); ++i) {
+        y16_ref[i] = ggml_get_f32_1d(y16, i);
+    }
+
+    const int n_guard = 64*1024;
+
+    float * guard = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_guard)->data;
+    for (int i = 0; i < n_guard; ++i) {
+        guard[i] = 1.0f;
+    }
+
+    for (int n_threads = 1; n_threads <= 4; ++n_threads) {
+        struct ggml_threadpool * pool = ggml_threadpool_new(n_threads);
+
+        if (!check_pool(ctx0, &g16, y16, y16_ref, pool, 2)) {
+            assert(false);
+            return 1;
+        }
+
+        for (int i = 0; i < n_guard; ++i) {
+            if (guard[i] != 1.0f) {
+                printf("error: n_threads=%d, the work buffer overran into the next tensor at %d\n", n_threads, i);
+                assert(false);
+                return 1;
+            }
+        }
+
+        ggml_set_zero(kv);
+
+        if (!check_pool(ctx0, &gkv, kv_sum, &kv_sum_ref, pool, 10)) {
+            assert(false);
+            return 1;
+        }
+
+        // default spin budget
+        if (!check_pool(ctx0, &gf, y, y_ref, pool, 10)) {
+            assert(false);
+            return 1;
+        }
+
+        // always sleep
+        ggml_threadpool_set_n_spin(pool, 0);
+        ggml_threadpool_reset_stats(pool);
+
+        if (!check_pool(ctx0, &gf, y, y_ref, pool, 10)) {
+            assert(false);
+            return 1;
+        }
+
+        const struct ggml_threadpool_stats stats = ggml_threadpool_get_stats(pool);
+
+        printf("n_threads = %d, n_spin = %lld, n_sleep = %lld\n",
+                n_threads, (long long) stats.n_spin, (long long) stats.n_sleep);
+
+        if (stats.n_spin != 0 || (n_threads > 1 && stats.n_sleep == 0)) {
+            assert(false);
+            return 1;
+        }
+
+        ggml_threadpool_free(pool);
+    }
+
+    free(y_ref);
+    free(y16_ref);
+
+    ggml_free(ctx0);
+
+    return 0;
+}
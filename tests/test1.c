@@ -26,7 +26,7 @@ int main(int argc, const char ** argv) {
 
         ggml_print_objects(ctx0);
 
-        struct ggml_cgraph gf = ggml_build_forward(f);
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, f);
         struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
         ggml_set_f32(x, 2.0f);
@@ -76,7 +76,7 @@ int main(int argc, const char ** argv) {
 
         struct ggml_tensor * y = ggml_add(ctx0, ggml_mul(ctx0, x1, x1), ggml_mul(ctx0, x1, x2));
 
-        struct ggml_cgraph gf = ggml_build_forward(y);
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
         struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
         ggml_graph_reset(&gf);
@@ -123,7 +123,7 @@ int main(int argc, const char ** argv) {
 
         struct ggml_tensor * y = ggml_mul(ctx0, ggml_add(ctx0, ggml_mul(ctx0, x1, x1), ggml_mul(ctx0, x1, x2)), x1);
 
-        struct ggml_cgraph gf = ggml_build_forward(y);
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
         struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
         ggml_set_f32(x1, 3.0f);
@@ -159,7 +159,7 @@ int main(int argc, const char ** argv) {
 
         struct ggml_tensor * y = ggml_mul(ctx0, ggml_mul(ctx0, ggml_mul(ctx0, x1, x1), ggml_mul(ctx0, x2, x2)), x3);
 
-        struct ggml_cgraph gf = ggml_build_forward(y);
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
         struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
         ggml_set_f32(x1, 1.0f);
@@ -218,7 +218,7 @@ int main(int argc, const char ** argv) {
 
         struct ggml_tensor * y = ggml_sum(ctx0, ggml_mul(ctx0, x1, x2));
 
-        struct ggml_cgraph gf = ggml_build_forward(y);
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
         struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
         ggml_set_f32(x1, 3.0f);
@@ -271,7 +271,7 @@ int main(int argc, const char ** argv) {
                         )
                     );
 
-        struct ggml_cgraph gf = ggml_build_forward(y);
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
         struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
         ggml_set_f32(x1, 3.0f);
@@ -324,7 +324,7 @@ int main(int argc, const char ** argv) {
                         )
                     );
 
-        struct ggml_cgraph gf = ggml_build_forward(y);
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
         struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
         ggml_set_f32(x1, 3.0f);
@@ -371,7 +371,7 @@ int main(int argc, const char ** argv) {
                     ggml_sub(ctx0, x1, x2)
                     );
 
-        struct ggml_cgraph gf = ggml_build_forward(y);
+        struct ggml_cgraph gf = ggml_build_forward(ctx0, y);
         struct ggml_cgraph gb = ggml_build_backward(ctx0, &gf, false);
 
         ggml_set_f32(x1, 3.0f);